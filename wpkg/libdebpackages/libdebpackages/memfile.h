@@ -103,6 +103,7 @@ public:
             field_name_dev_minor,
             field_name_raw_md5sum,
             field_name_original_compression,
+            field_name_data_offset,
             field_name_max
         };
 
@@ -150,6 +151,7 @@ public:
         int get_dev_minor() const;
         const md5::raw_md5sum& get_raw_md5sum() const;
         wpkgar::wpkgar_block_t::wpkgar_compression_t get_original_compression() const;
+        int64_t get_data_offset() const;
 
         void set_uri(const wpkg_filename::uri_filename& uri);
         void set_package_name(const std::string& package_name);
@@ -182,6 +184,7 @@ public:
         void set_dev_minor(const char *d, int max_size, int base);
         void set_raw_md5sum(md5::raw_md5sum& raw);
         void set_original_compression(wpkgar::wpkgar_block_t::wpkgar_compression_t original_compression);
+        void set_data_offset(int64_t offset);
 
         static int strnlen(const char *s, int n);
         static int str_to_int(const char *s, int n, int base);
@@ -208,6 +211,7 @@ public:
         int                     f_dev_minor;
         md5::raw_md5sum         f_raw_md5sum;
         wpkgar::wpkgar_block_t::wpkgar_compression_t f_original_compression;
+        int64_t                 f_data_offset;
     };
 
     enum file_format_t
@@ -252,6 +256,9 @@ public:
         int64_t read(char *buffer, int64_t offset, int64_t size) const;
         int64_t write(const char *buffer, int64_t offset, int64_t size);
         int compare(const block_manager& rhs) const;
+#if !defined(MO_WINDOWS)
+        int64_t write_fd(int fd) const;
+#endif
 
         file_format_t data_to_format(int64_t offset, int64_t size) const;
 
@@ -286,7 +293,12 @@ public:
 
     // read from and write to disk
     void read_file(const wpkg_filename::uri_filename& filename, file_info *info = NULL, int block_limit = -1);
+    bool read_file_if_modified(const wpkg_filename::uri_filename& filename, std::string& etag, std::string& last_modified);
+    void read_ar_file(const wpkg_filename::uri_filename& filename, const std::string& stop_prefix);
     void write_file(const wpkg_filename::uri_filename& filename, bool create_folders = false, bool force = false) const;
+#if !defined(MO_WINDOWS)
+    void write_fd(int fd, const wpkg_filename::uri_filename& filename) const;
+#endif
     void copy(memory_file& destination) const;
     int compare(const memory_file& rhs) const;
 
@@ -294,6 +306,9 @@ public:
     bool is_compressed() const;
     void compress(memory_file& result, file_format_t format, int zlevel = 9) const;
     void decompress(memory_file& result) const;
+    void compress_seekable(memory_file& result, int zlevel = 9) const;
+    bool is_seekable() const;
+    void decompress_range(memory_file& result, int64_t offset, int64_t size) const;
 
     // access the raw data
     void reset();
@@ -315,10 +330,18 @@ public:
     void set_package_path(const wpkg_filename::uri_filename& path);
     static void disk_file_to_info(const wpkg_filename::uri_filename& filename, file_info& info);
     static void info_to_disk_file(const wpkg_filename::uri_filename& filename, const file_info& info, int& err);
+#if !defined(MO_WINDOWS)
+    static void info_to_disk_fd(int fd, const wpkg_filename::uri_filename& filename, const file_info& info, int& err);
+#endif
 
     // compute md5sum of the entire file
     void raw_md5sum(md5::raw_md5sum& raw) const;
     std::string md5sum() const;
+    static std::string file_md5sum(const wpkg_filename::uri_filename& filename);
+
+    // I/O statistics (bytes read and written by read_file()/write_file())
+    static int64_t get_bytes_read();
+    static int64_t get_bytes_written();
 
 private:
     typedef controlled_vars::limited_auto_enum_init<file_format_t, file_format_undefined, file_format_other, file_format_undefined>  safe_file_format_t;
@@ -331,6 +354,7 @@ private:
     void decompress_from_gz(memory_file& result) const;
     void decompress_from_bz2(memory_file& result) const;
     void decompress_from_zst(memory_file& result) const;
+    bool read_http_file(const wpkg_filename::uri_filename& filename, file_info *info, std::string *etag, std::string *last_modified);
     bool dir_next_dir(file_info& info) const;
     void dir_next_ar(file_info& info) const;
     bool dir_next_tar(file_info& info) const;
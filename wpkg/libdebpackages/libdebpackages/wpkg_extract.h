@@ -0,0 +1,81 @@
+/*    wpkg_extract.h -- write the files of a package to the target
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+#ifndef WPKG_EXTRACT_H
+#define WPKG_EXTRACT_H
+
+/** \file
+ * \brief Extraction declarations.
+ *
+ * The wpkg library libdebpackages extracts the files of a package using
+ * an extractor object. The extractor knows how to write files and create
+ * directories on the target as efficiently as the operating system allows.
+ */
+#include "libdebpackages/memfile.h"
+
+namespace wpkg_extract
+{
+
+class DEBIAN_PACKAGE_EXPORT extractor
+{
+public:
+    enum share_mode_t
+    {
+        share_mode_none,        // always write the files
+        share_mode_hardlink,    // hard link identical files
+        share_mode_reflink      // clone identical files (copy-on-write)
+    };
+
+    extractor();
+    ~extractor();
+
+    static void set_share_mode(share_mode_t mode);
+    static share_mode_t get_share_mode();
+    static void set_payload_store(const wpkg_filename::uri_filename& store);
+    static const wpkg_filename::uri_filename& get_payload_store();
+    static void write_stored_file(const wpkg_filename::uri_filename& destination, const memfile::memory_file& data);
+    static void collect_payload_store(const wpkg_filename::uri_filename& store, int64_t& count, int64_t& size);
+
+    void write_file(const wpkg_filename::uri_filename& destination, const memfile::memory_file& data, const memfile::memory_file::file_info& info, int& err, bool shareable = false);
+    void make_directory(const wpkg_filename::uri_filename& destination, const memfile::memory_file::file_info& info, int& err);
+    void close();
+
+private:
+    // disallow copying (we own file descriptors)
+    extractor(const extractor& rhs);
+    extractor& operator = (const extractor& rhs);
+
+#if defined(MO_LINUX)
+    // directory file descriptors indexed by the directory path
+    typedef std::map<std::string, int>  dir_fds_t;
+
+    int dir_fd(const std::string& path);
+    bool share_file(const wpkg_filename::uri_filename& destination, int dfd, const std::string& basename, const std::string& key, const memfile::memory_file::file_info& info, int& err);
+    static bool link_file(const wpkg_filename::uri_filename& destination, int dfd, const std::string& basename, const std::string& source, const memfile::memory_file::file_info *info, int& err);
+    static void add_to_store(const std::string& path, const std::string& object);
+
+    dir_fds_t                   f_dir_fds;
+#endif
+};
+
+} // wpkg_extract namespace
+#endif
+//#ifndef WPKG_EXTRACT_H
+// vim: ts=4 sw=4 et
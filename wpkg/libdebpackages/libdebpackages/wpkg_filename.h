@@ -308,10 +308,31 @@ public:
 
     static const std::string&   get_tmpdir();
     static void                 set_tmpdir(const std::string& tmpdir);
+    static void                 detach_tmpdir();
     static void                 keep_files(bool keep = true);
 };
 
 
+class DEBIAN_PACKAGE_EXPORT os_stat_cache
+{
+public:
+                                os_stat_cache();
+                                ~os_stat_cache();
+
+    static bool                 is_active();
+    static bool                 find(const std::string& os_path, uri_filename::file_stat& s);
+    static void                 save(const std::string& os_path, const uri_filename::file_stat& s);
+    static void                 invalidate(const uri_filename& filename, bool recursive = false);
+    static void                 clear();
+    static void                 prefetch(const std::vector<uri_filename>& filenames);
+
+private:
+    // the cache is global, the objects only define its scope
+                                os_stat_cache(const os_stat_cache& rhs);
+    os_stat_cache&              operator = (const os_stat_cache& rhs);
+};
+
+
 class DEBIAN_PACKAGE_EXPORT os_dir_impl;
 class DEBIAN_PACKAGE_EXPORT os_dir
 {
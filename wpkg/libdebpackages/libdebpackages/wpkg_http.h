@@ -0,0 +1,238 @@
+/*    wpkg_http.h -- declaration of the HTTP/1.1 client
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief HTTP/1.1 client and server declarations.
+ *
+ * The HTTP client sits on top of the tcp_client class. It reads the
+ * replies through a buffer, understands the Content-Length and chunked
+ * transfer encodings, keeps the connections alive in a pool shared by
+ * all the requests sent to the same server, can pipeline requests, and
+ * can stream the body of a reply to a body_output object instead of
+ * keeping it in memory.
+ *
+ * The HTTP server sits on top of the tcp_server class. It serves the
+ * files of one directory (i.e. a repository) to such clients.
+ */
+#ifndef WPKG_HTTP_H
+#define WPKG_HTTP_H
+
+#include    "libdebpackages/tcp_client_server.h"
+#include    "libdebpackages/wpkg_filename.h"
+#include    "controlled_vars/controlled_vars_auto_init.h"
+#include    "controlled_vars/controlled_vars_auto_enum_init.h"
+#include    "controlled_vars/controlled_vars_ptr_auto_init.h"
+#include    <condition_variable>
+#include    <deque>
+#include    <map>
+#include    <memory>
+#include    <mutex>
+#include    <set>
+#include    <vector>
+
+
+namespace wpkg_http
+{
+
+// generic HTTP exception
+class wpkg_http_exception : public std::runtime_error
+{
+public:
+    wpkg_http_exception(const std::string& msg) : runtime_error(msg) {}
+};
+
+// problem with I/O
+class wpkg_http_exception_io : public wpkg_http_exception
+{
+public:
+    wpkg_http_exception_io(const std::string& msg) : wpkg_http_exception(msg) {}
+};
+
+// the server closed the connection before sending a reply
+class wpkg_http_exception_closed : public wpkg_http_exception_io
+{
+public:
+    wpkg_http_exception_closed(const std::string& msg) : wpkg_http_exception_io(msg) {}
+};
+
+// the reply is not valid HTTP
+class wpkg_http_exception_invalid : public wpkg_http_exception
+{
+public:
+    wpkg_http_exception_invalid(const std::string& msg) : wpkg_http_exception(msg) {}
+};
+
+
+class DEBIAN_PACKAGE_EXPORT request
+{
+public:
+                                request(const std::string& path = "/", const std::string& method = "GET");
+
+    std::string                 get_method() const;
+    std::string                 get_path() const;
+    void                        set_field(const std::string& name, const std::string& value);
+    std::string                 to_string(const std::string& host, int port) const;
+
+private:
+    std::string                             f_method;
+    std::string                             f_path;
+    std::vector<std::pair<std::string, std::string> >   f_fields;
+};
+
+
+class DEBIAN_PACKAGE_EXPORT body_output
+{
+public:
+    virtual                     ~body_output() {}
+
+    virtual void                write(const char *data, size_t size) = 0;
+};
+
+
+class DEBIAN_PACKAGE_EXPORT response
+{
+public:
+    friend class connection;
+
+    int                         get_status() const;
+    std::string                 get_status_line() const;
+    bool                        field_is_defined(const std::string& name) const;
+    std::string                 get_field(const std::string& name) const;
+    const std::string&          get_body() const;
+    int64_t                     get_body_size() const;
+    void                        set_body_output(body_output *output);
+
+private:
+    typedef std::map<std::string, std::string>  field_map_t;
+
+    void                        reset();
+    void                        append_body(const char *data, size_t size);
+
+    controlled_vars::zint32_t   f_status;
+    std::string                 f_status_line;
+    field_map_t                 f_fields;
+    std::string                 f_body;
+    controlled_vars::zint64_t   f_body_size;
+    controlled_vars::ptr_auto_init<body_output> f_body_output;
+};
+
+
+class DEBIAN_PACKAGE_EXPORT connection
+{
+public:
+                                connection(const std::string& host, int port);
+
+    std::string                 get_host() const;
+    int                         get_port() const;
+    bool                        is_reusable() const;
+    uint32_t                    get_responses() const;
+    time_t                      get_last_used() const;
+
+    void                        send(const request& r);
+    void                        receive(response& r, bool head = false);
+
+private:
+    // disallow copying
+                                connection(const connection& rhs);
+    connection&                 operator = (const connection& rhs);
+
+    bool                        fill();
+    std::string                 read_line();
+    void                        read_body(response& r, int64_t size);
+    void                        read_chunked_body(response& r);
+    void                        read_body_until_close(response& r);
+
+    std::string                                     f_host;
+    controlled_vars::zint32_t                       f_port;
+    std::shared_ptr<tcp_client_server::tcp_client>  f_client;
+    std::vector<char>                               f_buffer;
+    size_t                                          f_pos;
+    size_t                                          f_end;
+    controlled_vars::fbool_t                        f_reusable;
+    controlled_vars::zuint32_t                      f_responses;
+    time_t                                          f_last_used;
+};
+
+
+class DEBIAN_PACKAGE_EXPORT client
+{
+public:
+    static const int            MAX_IDLE_CONNECTIONS = 4;   // per server
+    static const int            MAX_IDLE_SECONDS = 15;
+    static const int            MAX_PIPELINE = 8;
+
+    static void                 get(const std::string& host, int port, const request& r, response& result);
+    static void                 pipeline(const std::string& host, int port, const std::vector<request>& requests, std::vector<response>& results);
+    static void                 close_idle_connections();
+
+private:
+    static std::shared_ptr<connection>  get_connection(const std::string& host, int port);
+    static void                 release_connection(const std::shared_ptr<connection>& c);
+};
+
+
+class DEBIAN_PACKAGE_EXPORT server
+{
+public:
+    static const int            DEFAULT_THREADS = 16;
+    static const int            IDLE_SECONDS = 5;
+
+                                server(const wpkg_filename::uri_filename& root, const std::string& addr, int port);
+    virtual                     ~server();
+
+    void                        set_threads(int threads);
+    std::string                 get_addr() const;
+    int                         get_port() const;
+
+    void                        run();
+    void                        stop();
+
+protected:
+    virtual void                prepare_file(const wpkg_filename::uri_filename& filename);
+    virtual void                log_request(const std::string& request_line, int status, int64_t size);
+
+private:
+    typedef std::deque<tcp_client_server::socket_t>    socket_queue_t;
+    typedef std::set<tcp_client_server::socket_t>      socket_set_t;
+
+    // disallow copying
+                                server(const server& rhs);
+    server&                     operator = (const server& rhs);
+
+    void                        worker();
+    void                        serve(tcp_client_server::socket_t s);
+    bool                        reply(tcp_client_server::socket_t s, const std::string& header, std::string& input, bool& keep_alive);
+
+    wpkg_filename::uri_filename                     f_root;
+    std::shared_ptr<tcp_client_server::tcp_server>  f_server;
+    controlled_vars::zint32_t                       f_threads;
+    std::mutex                                      f_mutex;
+    std::condition_variable                         f_condition;
+    socket_queue_t                                  f_queue;
+    socket_set_t                                    f_active;
+    controlled_vars::fbool_t                        f_stop;
+};
+
+
+} // namespace wpkg_http
+#endif
+//#ifndef WPKG_HTTP_H
+// vim: ts=4 sw=4 et
@@ -68,6 +68,7 @@ public:
 
     size_type                   read(void *buffer, size_type size) const;
     size_type                   write(const void *buffer, size_type size) const;
+    bool                        flush();
 
 private:
     wpkg_filename::uri_filename             f_filename;
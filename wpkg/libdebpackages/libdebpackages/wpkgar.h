@@ -39,6 +39,9 @@
 namespace wpkgar
 {
 
+// compression level (1 to 9) of the data.tar files saved in the database
+const int WPKGAR_DATABASE_COMPRESSION_LEVEL = 3;
+
 class wpkgar_exception : public std::runtime_error
 {
 public:
@@ -118,6 +121,7 @@ public:
     virtual         ~wpkgar_tracker_interface();
 
     virtual void    track(const std::string& command, const std::string& package_name);
+    virtual void    sync();
 };
 
 
@@ -186,6 +190,7 @@ public:
 
     typedef std::vector<std::string>        package_list_t;
     typedef std::vector<std::string>        script_parameters_t;
+    typedef std::vector<std::string>        script_commands_t;
     typedef std::vector<std::string>        hooks_t;
     typedef std::vector<std::string>        conffiles_t;
 
@@ -202,8 +207,11 @@ public:
 
     bool                                    has_package(const wpkg_filename::uri_filename& package_name) const;
     void                                    load_package(const wpkg_filename::uri_filename& name, bool force_reload = false, bool skip_data = false);
+    static void                             share_data_tar(bool share);
+    void                                    prefetch_packages(const wpkg_filename::filename_list_t& filenames);
     wpkg_filename::uri_filename             get_package_path(const wpkg_filename::uri_filename& package_name) const;
     void                                    get_wpkgar_file(const wpkg_filename::uri_filename& package_name, memfile::memory_file *& wpkgar_file);
+    bool                                    md5sums_verified(const wpkg_filename::uri_filename& package_name) const;
     package_status_t                        package_status(const wpkg_filename::uri_filename& package_name);
     package_status_t                        safe_package_status(const wpkg_filename::uri_filename& name);
     void                                    add_self(const std::string& package);
@@ -212,6 +220,7 @@ public:
     bool                                    is_self() const;
 
     void                                    list_installed_packages(package_list_t& list);
+    bool                                    compact_package(const std::string& package_name);
     void                                    add_repository( const source& source_repo );
     void                                    add_repository( const wpkg_filename::uri_filename& repository );
     void                                    set_repositories(const wpkg_filename::filename_list_t& repositories);
@@ -221,6 +230,7 @@ public:
     void                                    set_tracker(std::shared_ptr<wpkgar_tracker_interface> tracker);
     std::shared_ptr<wpkgar_tracker_interface> get_tracker() const;
     void                                    track(const std::string& command, const std::string& package_name = "");
+    void                                    sync_tracker();
 
     void                                    add_global_hook(const wpkg_filename::uri_filename& script_name);
     bool                                    remove_global_hook(const wpkg_filename::uri_filename& script_name);
@@ -228,6 +238,8 @@ public:
     void                                    install_hooks(const std::string& package_name);
     void                                    remove_hooks(const std::string& package_name);
     bool                                    run_script(const wpkg_filename::uri_filename& package_name, script_t script, script_parameters_t params);
+    void                                    get_script_commands(const wpkg_filename::uri_filename& package_name, script_t script, const script_parameters_t& params, script_commands_t& commands);
+    static int                              run_script_command(const std::string& command, const wpkg_filename::uri_filename& output);
 
     void                                    lock(const std::string& status);
     void                                    unlock();
@@ -242,10 +254,13 @@ public:
     void                                    set_package_selection_to_reject(const std::string& package_name);
     bool                                    has_control_file(const wpkg_filename::uri_filename& package_name, const std::string& control_filename) const;
     void                                    get_control_file(memfile::memory_file& p, const wpkg_filename::uri_filename& package_name, std::string& control_filename, bool compress = true);
+    void                                    get_data_file(memfile::memory_file& p, const wpkg_filename::uri_filename& package_name, const std::string& filename);
     bool                                    validate_fields(const wpkg_filename::uri_filename& package_name, const std::string& expression);
     void                                    conffiles(const wpkg_filename::uri_filename& package_name, conffiles_t& conf_files) const;
     bool                                    is_conffile(const wpkg_filename::uri_filename& package_name, const std::string& filename) const;
     bool                                    field_is_defined(const wpkg_filename::uri_filename& package_name, const std::string& name) const;
+    void                                    begin_status_transaction();
+    void                                    commit_status_transaction();
     void                                    set_field(const wpkg_filename::uri_filename& package_name, const std::string& name, const std::string& value, bool save = false);
     void                                    set_field(const wpkg_filename::uri_filename& package_name, const std::string& name, long value, bool save = false);
     std::string                             get_field(const wpkg_filename::uri_filename& package_name, const std::string& name) const;
@@ -270,12 +285,20 @@ private:
 
     const std::shared_ptr<wpkgar_package>   get_package(const wpkg_filename::uri_filename& package_name) const;
     void                                    load_temporary_package(const wpkg_filename::uri_filename& filename, bool skip_data = false);
+    typedef std::map<std::string, std::string>                              script_environment_t;
+
+    void                                    find_scripts(const wpkg_filename::uri_filename& package_name, script_t script, wpkg_filename::filename_list_t& scripts, std::string& interpreter);
+    static std::string                      script_parameters(const script_parameters_t& params);
+    std::string                             script_command(const std::string& interpreter, const wpkg_filename::uri_filename& script_name, const std::string& parameters) const;
+    void                                    script_environment(const wpkg_filename::uri_filename& package_name, script_environment_t& env) const;
     bool                                    run_one_script(const wpkg_filename::uri_filename& package_name, const std::string& interpreter, const wpkg_filename::uri_filename& script_name, const std::string& parameters);
+    void                                    save_status_file(const std::shared_ptr<wpkgar_package>& p);
 
     typedef std::map<std::string, std::shared_ptr<wpkgar_package> >         packages_t;
     typedef std::map<std::string, std::string>                              field_variables_t;
     typedef std::map<std::string, int>                                      self_packages_t;
     typedef controlled_vars::auto_init<int, -1>                             lock_fd_t;
+    typedef std::map<std::string, std::shared_ptr<wpkgar_package> >         status_transaction_t;
 
     std::shared_ptr<wpkg_control::control_file::control_file_state_t> f_control_file_state;
     controlled_vars::fbool_t                            f_root_path_is_defined;
@@ -292,6 +315,8 @@ private:
     self_packages_t                                     f_selves;
     controlled_vars::fbool_t                            f_include_selves;
     std::shared_ptr<wpkgar_tracker_interface>           f_tracker;
+    controlled_vars::zint32_t                           f_status_transaction_count;
+    status_transaction_t                                f_status_transaction;
 };
 
 
@@ -307,6 +332,18 @@ private:
 };
 
 
+class DEBIAN_PACKAGE_EXPORT wpkgar_status_transaction
+{
+public:
+    wpkgar_status_transaction(wpkgar_manager *manager);
+    ~wpkgar_status_transaction();
+    void commit();
+
+private:
+    wpkgar_manager *            f_manager;
+};
+
+
 class DEBIAN_PACKAGE_EXPORT wpkgar_rollback
 {
 public:
@@ -0,0 +1,110 @@
+/*    wpkgar_binary_index.h -- declaration of the binary repository index
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief Binary repository index declaration.
+ *
+ * The binary repository index is an alternative to the index.tar.gz
+ * file of a repository. It can be memory mapped and its packages are
+ * sorted by name so a package can be found without reading all the
+ * control files.
+ */
+#ifndef WPKGAR_BINARY_INDEX_H
+#define WPKGAR_BINARY_INDEX_H
+#include    "libdebpackages/wpkgar_repository.h"
+
+
+namespace wpkgar
+{
+
+
+class DEBIAN_PACKAGE_EXPORT wpkgar_binary_index
+{
+public:
+    typedef uint32_t                entry_t;
+
+    enum index_field_t
+    {
+        index_field_depends,
+        index_field_pre_depends,
+        index_field_provides,
+        index_field_conflicts,
+        index_field_breaks,
+        index_field_replaces,
+
+        index_field_max
+    };
+
+                                    wpkgar_binary_index();
+                                    ~wpkgar_binary_index();
+
+    static void                     create(const wpkgar_repository::entry_vector_t& entries, memfile::memory_file& output, bool compress, const wpkg_filename::uri_filename& tar_index = wpkg_filename::uri_filename());
+    static bool                     is_binary_index(const memfile::memory_file& file);
+    static wpkg_filename::uri_filename  index_filename(const wpkg_filename::uri_filename& tar_index);
+
+    void                            open(const wpkg_filename::uri_filename& filename);
+    void                            load(const memfile::memory_file& file);
+    void                            close();
+
+    entry_t                         size() const;
+    bool                            is_current(const wpkg_filename::uri_filename& tar_index) const;
+    bool                            find(const std::string& name, entry_t& first, entry_t& last) const;
+    std::string                     get_name(entry_t idx) const;
+    std::string                     get_version(entry_t idx) const;
+    std::string                     get_architecture(entry_t idx) const;
+    std::string                     get_filename(entry_t idx) const;
+    time_t                          get_mtime(entry_t idx) const;
+    static bool                     is_index_field(const std::string& name, index_field_t& field);
+    bool                            field_is_defined(entry_t idx, index_field_t field) const;
+    std::string                     get_field(entry_t idx, index_field_t field) const;
+    void                            get_control(entry_t idx, memfile::memory_file& ctrl) const;
+    void                            get_entries(wpkgar_repository::entry_vector_t& entries) const;
+
+private:
+    // disallow copying
+                                    wpkgar_binary_index(const wpkgar_binary_index& rhs);
+    wpkgar_binary_index&            operator = (const wpkgar_binary_index& rhs);
+
+    void                            validate();
+    const char *                    package_record(entry_t idx) const;
+    std::string                     string_at(uint32_t offset) const;
+
+    const char *                    f_data;
+    controlled_vars::zuint64_t      f_size;
+    std::vector<char>               f_buffer;
+    void *                          f_mapped;
+    controlled_vars::zuint32_t      f_count;
+    controlled_vars::zuint32_t      f_frame_count;
+    controlled_vars::zuint64_t      f_strings_offset;
+    controlled_vars::zuint64_t      f_strings_size;
+    controlled_vars::zuint64_t      f_packages_offset;
+    controlled_vars::zuint64_t      f_frames_offset;
+    controlled_vars::auto_init<uint32_t, 0xFFFFFFFF>    f_index_validator;
+    controlled_vars::fbool_t        f_compressed;
+    mutable controlled_vars::mint64_t   f_frame_idx;
+    mutable std::vector<char>       f_frame;
+};
+
+
+}   // namespace wpkgar
+#endif
+//#ifndef WPKGAR_BINARY_INDEX_H
+// vim: ts=4 sw=4 et
@@ -0,0 +1,73 @@
+/*    wpkgar_contents_index.h -- declaration of the repository contents index
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief Repository contents index declaration.
+ *
+ * The contents index lists all the files of all the packages of a
+ * repository. It is used to find which package, installed or not,
+ * includes a given file without downloading the packages.
+ */
+#ifndef WPKGAR_CONTENTS_INDEX_H
+#define WPKGAR_CONTENTS_INDEX_H
+#include    "libdebpackages/wpkgar_repository.h"
+
+
+namespace wpkgar
+{
+
+
+class DEBIAN_PACKAGE_EXPORT wpkgar_contents_index
+{
+public:
+    class DEBIAN_PACKAGE_EXPORT match_t
+    {
+    public:
+                                    match_t(const std::string& path, const std::string& package);
+
+        const std::string&          get_path() const;
+        const std::string&          get_package() const;
+
+    private:
+        std::string                 f_path;
+        std::string                 f_package;
+    };
+    typedef std::vector<match_t>    match_list_t;
+
+    static void                     create(const wpkgar_repository::entry_vector_t& entries, const wpkg_filename::filename_list_t& repositories, memfile::memory_file& output);
+    static wpkg_filename::uri_filename  index_filename(const wpkg_filename::uri_filename& tar_index);
+
+    void                            load(const memfile::memory_file& file);
+    size_t                          size() const;
+    void                            find(const std::string& pattern, match_list_t& matches) const;
+
+private:
+    std::string                     get_line(size_t idx) const;
+
+    std::string                     f_data;
+    std::vector<size_t>             f_lines;
+};
+
+
+}   // namespace wpkgar
+#endif
+//#ifndef WPKGAR_CONTENTS_INDEX_H
+// vim: ts=4 sw=4 et
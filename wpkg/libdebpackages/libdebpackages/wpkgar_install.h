@@ -39,9 +39,16 @@ namespace wpkg_backup
 class DEBIAN_PACKAGE_EXPORT wpkgar_backup;
 }
 
+namespace wpkg_extract
+{
+class DEBIAN_PACKAGE_EXPORT extractor;
+}
+
 namespace wpkgar
 {
 
+class DEBIAN_PACKAGE_EXPORT wpkgar_binary_index;
+
 namespace details
 {
 class DEBIAN_PACKAGE_EXPORT disk_list_t;
@@ -73,7 +80,8 @@ public:
         wpkgar_install_force_vendor,            // allow installing of incompatible vendor names
         wpkgar_install_quiet_file_info,         // do not print chmod/chown warnings
         wpkgar_install_recursive,               // read sub-directories of repositories
-        wpkgar_install_skip_same_version        // do not re-install over itself
+        wpkgar_install_skip_same_version,       // do not re-install over itself
+        wpkgar_install_skip_unchanged_files     // do not rewrite files with the same md5sum on upgrades
     };
 
     class DEBIAN_PACKAGE_EXPORT install_info_t
@@ -92,17 +100,20 @@ public:
 
         std::string    get_name()         const;
         std::string    get_version()      const;
+        std::string    get_filename()     const;
         install_type_t get_install_type() const;
         bool           is_upgrade()       const;
 
     private:
         std::string                 f_name;
         std::string                 f_version;
+        std::string                 f_filename;
         install_type_t              f_install_type;
         controlled_vars::fbool_t    f_is_upgrade;
     };
 
     wpkgar_install(wpkgar_manager *manager);
+    ~wpkgar_install();
 
     typedef std::vector<install_info_t> install_info_list_t;
     install_info_list_t get_install_list();
@@ -114,8 +125,12 @@ public:
     void set_configuring();
     void set_reconfiguring();
     void set_unpacking();
+    void set_configure_jobs(int jobs);
+    void set_fetch_jobs(int jobs);
+    void set_package_cache_size(int64_t size);
     void add_field_validation(const std::string& expression);
     void add_package( const std::string& package, const bool force_reinstall = false );
+    void add_implicit_package( const std::string& package );
     const std::string& get_package_name( const int idx ) const;
     int count() const;
 
@@ -123,6 +138,7 @@ public:
     bool pre_configure();
     int unpack();
     bool configure(int idx);
+    bool finish_configure();
     int reconfigure();
 
     // functions used internally
@@ -158,11 +174,16 @@ private:
             package_type_older,             // removed because the version is smaller (package is older)
             package_type_directory          // this is a directory, read it once when check dependencies and then ignore
         };
+        typedef std::vector<memfile::memory_file::file_info> file_info_list_t;
 
         package_item_t(wpkgar_manager *manager, const wpkg_filename::uri_filename& filename, package_type_t type = package_type_explicit);
         package_item_t(wpkgar_manager *manager, const wpkg_filename::uri_filename& filename, package_type_t type, const memfile::memory_file& ctrl);
+        package_item_t(wpkgar_manager *manager, const wpkg_filename::uri_filename& filename, package_type_t type, const std::shared_ptr<wpkgar_binary_index>& index, uint32_t entry);
 
         const wpkg_filename::uri_filename& get_filename() const;
+        void set_cached_filename(const wpkg_filename::uri_filename& filename);
+        bool has_index_control() const;
+        bool is_fully_loaded() const;
         const std::string& get_name() const;
         const std::string& get_architecture() const;
         const std::string& get_version() const;
@@ -179,18 +200,23 @@ private:
         void mark_unpacked();
         bool is_unpacked() const;
         bool is_marked_for_install() const;
+        void add_bytes_read(int64_t size);
+        int64_t get_bytes_read() const;
         void copy_package_in_database();
+        void get_data_files(file_info_list_t& files) const;
+        bool is_data_files_complete(const file_info_list_t& files, const std::map<std::string, std::string>& regular_files) const;
 
-        void load(bool ctrl);
+        void load(bool ctrl, bool ctrl_archive = false);
 
     private:
         enum loaded_state_t
         {
             load_state_not_loaded,
             load_state_control_file,
+            load_state_control_archive,
             load_state_full
         };
-        typedef controlled_vars::limited_auto_enum_init<loaded_state_t, load_state_not_loaded, load_state_control_file, load_state_not_loaded>  safe_loaded_state_t;
+        typedef controlled_vars::limited_auto_enum_init<loaded_state_t, load_state_not_loaded, load_state_full, load_state_not_loaded>  safe_loaded_state_t;
 
         wpkgar_manager *                            f_manager;
         wpkg_filename::uri_filename                 f_filename;
@@ -205,6 +231,9 @@ private:
         std::string                                 f_version;
         wpkgar_manager::package_status_t            f_original_status;
         controlled_vars::mint32_t                   f_upgrade;
+        controlled_vars::zint64_t                   f_bytes_read;
+        std::shared_ptr<wpkgar_binary_index>        f_index;
+        controlled_vars::zuint32_t                  f_index_entry;
     };
 
     typedef std::map<parameter_t, int>                                    wpkgar_flags_t;
@@ -215,6 +244,7 @@ private:
     typedef std::vector<wpkg_dependencies::dependencies::dependency_t>    wpkgar_dependency_list_t;
     typedef std::map<std::string, bool>                                   wpkgar_package_listed_t;
     typedef std::vector<std::string>                                      wpkgar_list_of_strings_t;
+    typedef std::map<std::string, std::pair<std::string, int64_t> >       wpkgar_package_checksums_t;
 
     enum validation_return_t
     {
@@ -263,7 +293,12 @@ private:
     void validate_predependencies();
     validation_return_t find_explicit_dependency(wpkgar_package_list_t::size_type index, const wpkg_filename::uri_filename& package_name, const wpkg_dependencies::dependencies::dependency_t& d, const std::string& field_name);
     validation_return_t find_installed_dependency(wpkgar_package_list_t::size_type index, const wpkg_filename::uri_filename& package_name, const wpkg_dependencies::dependencies::dependency_t& d, const std::string& field_name);
+    struct repository_job_t;
     void read_repositories();
+    void read_repository(repository_job_t& job) const;
+    void read_repository_index(repository_job_t& job, memfile::memory_file& index_file) const;
+    bool binary_index_is_current(const wpkgar_binary_index& index, const wpkg_filename::uri_filename& tar_index) const;
+    void read_binary_index(repository_job_t& job, const std::shared_ptr<wpkgar_binary_index>& index) const;
     void trim_conflicts(wpkgar_package_list_t& tree, wpkgar_package_list_t::size_type idx, bool only_explicit);
     bool trim_dependency
         ( package_item_t& item
@@ -284,6 +319,7 @@ private:
     void output_tree(int count, const wpkgar_package_list_t& tree, const std::string& sub_title);
     void validate_dependencies();
     void validate_packager_version();
+    void download_packages(bool evict);
     void validate_installed_size_and_overwrite();
     void validate_fields();
     void validate_scripts();
@@ -301,10 +337,12 @@ private:
     void cancel_install_scripts(package_item_t *item, package_item_t *conf_install, wpkg_backup::wpkgar_backup& backup);
     void set_status(package_item_t *item, package_item_t *upgrade, package_item_t *conf_install, const std::string& status);
     bool do_unpack(package_item_t *item, package_item_t *upgrade);
-    void unpack_file(package_item_t *item, const wpkg_filename::uri_filename& destination, const memfile::memory_file::file_info& info);
+    void unpack_file(package_item_t *item, wpkg_extract::extractor& extract, const wpkg_filename::uri_filename& destination, const memfile::memory_file::file_info& info, const memfile::memory_file *data, bool shareable = false);
 
     // configuration sub-functions
     bool configure_package(package_item_t *item);
+    int configure_files(package_item_t *item);
+    bool configure_result(package_item_t *item, int err, bool postinst, bool hooks);
 
     wpkgar_manager *                    f_manager;
     wpkgar_manager::package_list_t      f_list_installed_packages;
@@ -324,6 +362,14 @@ private:
     wpkgar_list_of_strings_t            f_field_names;
     controlled_vars::fbool_t            f_read_essentials;
     controlled_vars::fbool_t            f_install_source;
+    wpkg_filename::os_stat_cache        f_os_stat_cache;
+    controlled_vars::fbool_t            f_prefetching_packages;
+    controlled_vars::zint32_t           f_configure_jobs;
+    wpkgar_package_idxs_t               f_configure_queue;
+    controlled_vars::zint32_t           f_fetch_jobs;
+    controlled_vars::zint64_t           f_package_cache_size;
+    wpkgar_package_checksums_t          f_package_checksums;
+    wpkg_filename::filename_list_t      f_cached_packages;
 };
 
 }   // namespace wpkgar
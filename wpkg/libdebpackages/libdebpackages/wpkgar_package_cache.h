@@ -0,0 +1,111 @@
+/*    wpkgar_package_cache.h -- declaration of the local package cache
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief Local package cache declaration.
+ *
+ * The package cache keeps the .deb files downloaded from remote
+ * repositories in the administration directory so they do not get
+ * downloaded again on the next installation. The packages are
+ * downloaded in parallel and verified against the Package-Size and
+ * Package-md5sum fields found in the repository index.
+ */
+#ifndef WPKGAR_PACKAGE_CACHE_H
+#define WPKGAR_PACKAGE_CACHE_H
+#include    "libdebpackages/wpkg_filename.h"
+#include    "controlled_vars/controlled_vars_auto_init.h"
+#include    "controlled_vars/controlled_vars_auto_enum_init.h"
+#include    <vector>
+
+
+namespace wpkgar
+{
+
+
+class DEBIAN_PACKAGE_EXPORT wpkgar_package_cache
+{
+public:
+    static const int64_t            DEFAULT_MAXIMUM_SIZE = 1024LL * 1024LL * 1024LL;
+    static const int64_t            RANGE_SIZE = 4LL * 1024LL * 1024LL;
+
+    class DEBIAN_PACKAGE_EXPORT download_t
+    {
+    public:
+        friend class wpkgar_package_cache;
+
+        enum status_t
+        {
+            status_unknown,         // not fetched yet
+            status_cached,          // the cache already had a valid copy
+            status_downloaded,      // downloaded from scratch
+            status_resumed,         // the end of a partial download was downloaded
+            status_failed           // could not be downloaded or is invalid
+        };
+        typedef controlled_vars::limited_auto_enum_init<status_t, status_unknown, status_failed, status_unknown> safe_status_t;
+
+                                    download_t(const wpkg_filename::uri_filename& uri, const std::string& md5sum, int64_t size);
+
+        const wpkg_filename::uri_filename& get_uri() const;
+        const wpkg_filename::uri_filename& get_filename() const;
+        status_t                    get_status() const;
+        int64_t                     get_resumed_at() const;
+        int64_t                     get_downloaded() const;
+        int64_t                     get_elapsed() const;
+        std::string                 get_error() const;
+
+    private:
+        wpkg_filename::uri_filename f_uri;
+        std::string                 f_md5sum;
+        controlled_vars::zint64_t   f_size;
+        wpkg_filename::uri_filename f_filename;
+        safe_status_t               f_status;
+        controlled_vars::zint64_t   f_resumed_at;
+        controlled_vars::zint64_t   f_downloaded;
+        controlled_vars::zint64_t   f_elapsed;
+        std::string                 f_error;
+    };
+    typedef std::vector<download_t> download_list_t;
+
+                                    wpkgar_package_cache(const wpkg_filename::uri_filename& directory);
+
+    void                            set_maximum_size(int64_t size);
+    void                            set_jobs(int jobs);
+    wpkg_filename::uri_filename     get_filename(const wpkg_filename::uri_filename& uri) const;
+
+    void                            fetch(download_list_t& downloads) const;
+    int                             evict(const wpkg_filename::filename_list_t& keep) const;
+
+private:
+    void                            fetch_package(download_t& download) const;
+    void                            fetch_pipelined(download_list_t& downloads, const std::vector<size_t>& batch) const;
+    bool                            verify(const wpkg_filename::uri_filename& filename, const download_t& download) const;
+    void                            download_package(const wpkg_filename::uri_filename& part, download_t& download) const;
+
+    wpkg_filename::uri_filename     f_directory;
+    controlled_vars::zint64_t       f_maximum_size;
+    controlled_vars::zint32_t       f_jobs;
+};
+
+
+}   // namespace wpkgar
+#endif
+//#ifndef WPKGAR_PACKAGE_CACHE_H
+// vim: ts=4 sw=4 et
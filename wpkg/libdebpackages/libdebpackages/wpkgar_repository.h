@@ -42,7 +42,10 @@ public:
     enum parameter_t
     {
         wpkgar_repository_recursive,             // read sub-directories of repositories
-        wpkgar_repository_recursive_depth
+        wpkgar_repository_recursive_depth,
+        wpkgar_repository_jobs,                  // number of threads used by create_index()
+        wpkgar_repository_incremental,           // reuse unchanged packages in create_index()
+        wpkgar_repository_fetch_jobs             // number of sources retrieved at once by update()
     };
 
     class DEBIAN_PACKAGE_EXPORT index_entry
@@ -77,14 +80,27 @@ public:
         update_entry_status_t get_status() const;
         std::string get_uri() const;
         time_t get_time(update_entry_time_t t) const;
+        int64_t get_size() const;
+        std::string get_md5sum() const;
+        std::string get_repository_md5sum() const;
+        std::string get_etag() const;
+        std::string get_last_modified() const;
 
         void set_index(int index);
         void set_status(update_entry_status_t status);
         void set_uri(const std::string& uri);
         void update_time(time_t t);
+        void set_size(int64_t size);
+        void set_md5sum(const std::string& md5sum);
+        void set_repository_md5sum(const std::string& md5sum);
+        void set_etag(const std::string& etag);
+        void set_last_modified(const std::string& last_modified);
 
         void from_string(const std::string& line);
         std::string to_string() const;
+        static int32_t validators_index(const std::string& line);
+        void validators_from_string(const std::string& line);
+        std::string validators_to_string() const;
 
     private:
         typedef controlled_vars::auto_init<time_t> ztime_t;
@@ -94,6 +110,11 @@ public:
         zstatus_t                       f_status;
         std::string                     f_uri;
         ztime_t                         f_times[time_max];
+        controlled_vars::zint64_t       f_size;
+        std::string                     f_md5sum;
+        std::string                     f_repository_md5sum;
+        std::string                     f_etag;
+        std::string                     f_last_modified;
     };
     typedef std::vector<update_entry_t>      update_entry_vector_t;
 
@@ -139,7 +160,11 @@ public:
     int get_parameter(parameter_t flag, int default_value) const;
 
     void create_index(memfile::memory_file& index_file, const std::string* archive = NULL);
+    void save_index_fingerprints(const std::string& archive) const;
     static void load_index(const memfile::memory_file& file, entry_vector_t& entries);
+    static wpkg_filename::uri_filename index_diff_filename(const wpkg_filename::uri_filename& tar_index);
+    static wpkg_filename::uri_filename index_md5sum_filename(const wpkg_filename::uri_filename& tar_index);
+    static void create_index_diff(const memfile::memory_file& previous, const memfile::memory_file& current, memfile::memory_file& diff);
 
     void read_sources(const memfile::memory_file& filename, source_vector_t& sources);
     void write_sources(memfile::memory_file& file, const source_vector_t& sources);
@@ -156,7 +181,7 @@ private:
     wpkgar_repository& operator = (const wpkgar_repository& rhs);
 
     bool next_source(source& src) const;
-    void update_index(const wpkg_filename::uri_filename& uri);
+    size_t update_entry(const wpkg_filename::uri_filename& uri);
     void save_index_list() const;
     void upgrade_index(size_t i, memfile::memory_file& index_file);
     bool is_installed_package(const std::string& name) const;
@@ -167,6 +192,7 @@ private:
     controlled_vars::fbool_t            f_repository_packages_loaded;
     update_entry_vector_t               f_update_index;
     wpkgar_manager::package_list_t      f_installed_packages;
+    memfile::memory_file                f_index_fingerprints;
 };
 
 }   // namespace wpkgar
@@ -34,6 +34,8 @@
 #ifndef WPKGAR_TRACKER_H
 #define WPKGAR_TRACKER_H
 #include    "wpkgar.h"
+#include    "wpkg_stream.h"
+#include    <mutex>
 
 
 namespace wpkgar
@@ -54,12 +56,16 @@ public:
     wpkg_filename::uri_filename     get_filename() const;
 
     virtual void                    track(const std::string& command, const std::string& package_name = "");
+    virtual void                    sync();
 
 private:
     wpkgar_manager *                    f_manager;
     controlled_vars::fbool_t            f_keep_file;
     controlled_vars::fbool_t            f_committed;
     const wpkg_filename::uri_filename   f_filename;
+    wpkg_stream::fstream                f_file;
+    std::string                         f_pending;
+    std::mutex                          f_mutex;
 };
 
 
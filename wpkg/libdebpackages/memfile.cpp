@@ -37,10 +37,11 @@
  * large files extremely quickly.
  */
 
-// WARNING: The tcp_client_server.h MUST be first to avoid tons of errors
+// WARNING: The wpkg_http.h (which includes tcp_client_server.h) MUST be
+//          first to avoid tons of errors
 //          under MS-Windows (which apparently has quite a few problems
 //          with their headers and backward compatibility.)
-#include    "libdebpackages/tcp_client_server.h"
+#include    "libdebpackages/wpkg_http.h"
 
 #include    "libdebpackages/memfile.h"
 #include    "libdebpackages/wpkg_stream.h"
@@ -67,7 +68,9 @@
 #include    <utime.h>
 #include    <ctime>
 #include    <algorithm>
+#include    <atomic>
 #include    <iostream>
+#include    <sstream>
 #if defined(MO_WINDOWS)
 #include    "libdebpackages/comptr.h"
 #include    <objidl.h>
@@ -82,6 +85,8 @@
 #include    <pwd.h>
 #include    <grp.h>
 #include    <unistd.h>
+#include    <sys/stat.h>
+#include    <sys/uio.h>
 #endif
 
 
@@ -109,6 +114,50 @@ const int                               memory_file::file_info_owner_error; // i
 CONTROLLED_VARS_STATIC_ASSERT(memory_file::block_manager::BLOCK_MANAGER_BUFFER_BITS >= 10);
 
 
+namespace
+{
+
+/** \brief Total number of bytes read from files.
+ *
+ * This counter is incremented each time read_file() loads data from
+ * disk or over the network.
+ */
+std::atomic<int64_t>        g_bytes_read(0);
+
+/** \brief Total number of bytes written to files.
+ *
+ * This counter is incremented each time write_file() or write_fd() save
+ * data to disk.
+ */
+std::atomic<int64_t>        g_bytes_written(0);
+
+
+/** \brief Save the body of an HTTP response in a block manager.
+ *
+ * read_http_file() uses this object so the file is written in the
+ * memory file buffer as it gets received instead of being copied
+ * from the body of the response once complete.
+ */
+class block_manager_output : public wpkg_http::body_output
+{
+public:
+    block_manager_output(memory_file::block_manager& buffer)
+        : f_buffer(buffer)
+    {
+    }
+
+    virtual void write(const char *data, size_t size)
+    {
+        f_buffer.write(data, f_buffer.size(), static_cast<int64_t>(size));
+    }
+
+private:
+    memory_file::block_manager&     f_buffer;
+};
+
+} // no name namespace
+
+
 /** \class memory_file
  * \brief Handle a file in memory.
  *
@@ -394,6 +443,62 @@ int memory_file::block_manager::compare(const block_manager& rhs) const
     return 1;
 }
 
+#if !defined(MO_WINDOWS)
+/** \brief Write all the blocks to a file descriptor.
+ *
+ * This function sends the content of the buffers directly to the
+ * specified file descriptor. Contrary to read(), the data is not
+ * copied to an intermediate buffer: the blocks are handed to writev()
+ * as is, which also means many blocks get written with a single
+ * system call.
+ *
+ * The data is written at the current position of the file descriptor.
+ *
+ * \param[in] fd  The file descriptor where the data gets written.
+ *
+ * \return The number of bytes written or -1 if an error occurred, in
+ *         which case errno is set by the failing writev() call.
+ */
+int64_t memory_file::block_manager::write_fd(int fd) const
+{
+    // 64 x 64Kb = 4Mb per system call
+    const int max_iov(64);
+
+    int64_t page(0);
+    int64_t pos(0);
+    int64_t size_left(f_size);
+    while(size_left > 0)
+    {
+        struct iovec iov[max_iov];
+        int count(0);
+        int64_t left(size_left);
+        for(int64_t p(page); left > 0 && count < max_iov; ++p, ++count)
+        {
+            const int64_t offset(count == 0 ? pos : 0);
+            const int64_t sz(std::min(left, BLOCK_MANAGER_BUFFER_SIZE - offset));
+            iov[count].iov_base = const_cast<char *>(&f_buffers[p][offset]);
+            iov[count].iov_len = static_cast<size_t>(sz);
+            left -= sz;
+        }
+        const ssize_t r(writev(fd, iov, count));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        // move forward by what was written (may be a partial write)
+        size_left -= r;
+        pos += r;
+        page += pos >> BLOCK_MANAGER_BUFFER_BITS;
+        pos &= BLOCK_MANAGER_BUFFER_SIZE - 1;
+    }
+    return f_size;
+}
+#endif
+
 memory_file::file_format_t memory_file::block_manager::data_to_format(int64_t offset, int64_t /*bufsize*/ ) const
 {
     char buf[1024];
@@ -929,6 +1034,272 @@ public:
 };
 
 
+/** \brief Magic number of the skippable frame holding the seek table.
+ *
+ * The seek table of a seekable zstd file is saved in a skippable frame
+ * so any zstd decompressor simply ignores it.
+ */
+const uint32_t ZST_SEEK_TABLE_FRAME_MAGIC = 0x184D2A5E;
+
+/** \brief Magic number found at the very end of a seekable zstd file.
+ *
+ * The footer of the seek table ends with this magic number. It is used
+ * to determine whether a zstd file is seekable.
+ */
+const uint32_t ZST_SEEKABLE_MAGIC = 0x8F92EAB1;
+
+/** \brief Size of the seek table footer.
+ *
+ * The footer includes the number of frames (4 bytes), the descriptor
+ * (1 byte), and the seekable magic number (4 bytes.)
+ */
+const int64_t ZST_SEEK_TABLE_FOOTER_SIZE = 9;
+
+/** \brief Size of the uncompressed data saved in each frame.
+ *
+ * Each frame of a seekable zstd file is compressed independently. To
+ * read data at a given offset we only have to decompress the frames
+ * that include that data. Smaller frames make random access faster
+ * but the compression less efficient.
+ */
+const int64_t ZST_SEEKABLE_FRAME_SIZE = memory_file::block_manager::BLOCK_MANAGER_BUFFER_SIZE * 16;
+
+
+/** \brief Save a 32 bit number in little endian.
+ *
+ * \param[in] buf  The buffer where the number is saved (4 bytes.)
+ * \param[in] value  The value to save.
+ */
+void zst_set_le32(char *buf, uint32_t value)
+{
+    buf[0] = static_cast<char>(value);
+    buf[1] = static_cast<char>(value >> 8);
+    buf[2] = static_cast<char>(value >> 16);
+    buf[3] = static_cast<char>(value >> 24);
+}
+
+
+/** \brief Read a 32 bit number saved in little endian.
+ *
+ * \param[in] buf  The buffer where the number is read (4 bytes.)
+ *
+ * \return The number read from the buffer.
+ */
+uint32_t zst_get_le32(const char *buf)
+{
+    return static_cast<uint32_t>(static_cast<unsigned char>(buf[0]))
+        | (static_cast<uint32_t>(static_cast<unsigned char>(buf[1])) << 8)
+        | (static_cast<uint32_t>(static_cast<unsigned char>(buf[2])) << 16)
+        | (static_cast<uint32_t>(static_cast<unsigned char>(buf[3])) << 24);
+}
+
+
+/** \brief Compress a buffer in a seekable zstd file.
+ *
+ * This class compresses the input in independent zstd frames of
+ * ZST_SEEKABLE_FRAME_SIZE bytes and appends a seek table in a skippable
+ * frame. The result is a standard zstd file (any zstd decompressor can
+ * decompress it) which can also be read at any offset by only
+ * decompressing the frames that include that offset.
+ */
+class zst_seekable_deflate : private zst_lib
+{
+public:
+    zst_seekable_deflate(int zstlevel)
+    {
+        zstlevel = zstlevel * ZSTD_maxCLevel() / 9;
+
+        f_cctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(f_cctx, ZSTD_c_compressionLevel, zstlevel);
+        ZSTD_CCtx_setParameter(f_cctx, ZSTD_c_checksumFlag, 1);
+    }
+
+    ~zst_seekable_deflate()
+    {
+        check_error(ZSTD_freeCCtx(f_cctx));
+    }
+
+    void compress(memory_file& result, const memory_file::block_manager& block)
+    {
+        result.create(memory_file::file_format_zst);
+        std::vector<char> in(ZST_SEEKABLE_FRAME_SIZE);
+        std::vector<char> out(ZSTD_compressBound(ZST_SEEKABLE_FRAME_SIZE));
+        std::vector<char> table;
+        int64_t out_offset(0);
+        int64_t in_offset(0);
+        const int64_t sz(block.size());
+        do
+        {
+            // always create at least one frame so the file is recognized
+            // as a zstd file even when empty
+            const int64_t frame_size(std::min(sz - in_offset, ZST_SEEKABLE_FRAME_SIZE));
+            block.read(&in[0], in_offset, frame_size);
+            in_offset += frame_size;
+
+            const size_t r(ZSTD_compress2(f_cctx, &out[0], out.size(), &in[0], frame_size));
+            if(ZSTD_isError(r))
+            {
+                check_error(static_cast<int>(r));
+            }
+            result.write(&out[0], out_offset, r);
+            out_offset += r;
+
+            char entry[8];
+            zst_set_le32(entry, static_cast<uint32_t>(r));
+            zst_set_le32(entry + 4, static_cast<uint32_t>(frame_size));
+            table.insert(table.end(), entry, entry + sizeof(entry));
+        }
+        while(in_offset < sz);
+
+        // skippable frame header
+        char header[8];
+        zst_set_le32(header, ZST_SEEK_TABLE_FRAME_MAGIC);
+        zst_set_le32(header + 4, static_cast<uint32_t>(table.size() + ZST_SEEK_TABLE_FOOTER_SIZE));
+        result.write(header, out_offset, sizeof(header));
+        out_offset += sizeof(header);
+
+        // the entries
+        result.write(&table[0], out_offset, table.size());
+        out_offset += table.size();
+
+        // footer: number of frames, descriptor (no checksums), magic
+        char footer[ZST_SEEK_TABLE_FOOTER_SIZE];
+        zst_set_le32(footer, static_cast<uint32_t>(table.size() / 8));
+        footer[4] = 0;
+        zst_set_le32(footer + 5, ZST_SEEKABLE_MAGIC);
+        result.write(footer, out_offset, sizeof(footer));
+
+        result.guess_format_from_data();
+    }
+};
+
+
+/** \brief Read a seekable zstd file.
+ *
+ * This class loads the seek table of a seekable zstd file and then
+ * decompresses the frames necessary to retrieve the requested data.
+ */
+class zst_seekable_inflate : private zst_lib
+{
+public:
+    zst_seekable_inflate(const memory_file::block_manager& block)
+        : f_block(block)
+    {
+        f_dctx = ZSTD_createDCtx();
+    }
+
+    ~zst_seekable_inflate()
+    {
+        check_error(ZSTD_freeDCtx(f_dctx));
+    }
+
+    bool load_seek_table()
+    {
+        f_frames.clear();
+
+        const int64_t sz(f_block.size());
+        if(sz < 8 + ZST_SEEK_TABLE_FOOTER_SIZE)
+        {
+            return false;
+        }
+        char footer[ZST_SEEK_TABLE_FOOTER_SIZE];
+        f_block.read(footer, sz - ZST_SEEK_TABLE_FOOTER_SIZE, ZST_SEEK_TABLE_FOOTER_SIZE);
+        if(zst_get_le32(footer + 5) != ZST_SEEKABLE_MAGIC
+        || (footer[4] & 0x7C) != 0) // reserved bits must be zero
+        {
+            return false;
+        }
+        const int64_t entry_size((footer[4] & 0x80) != 0 ? 12 : 8);
+        const int64_t count(zst_get_le32(footer));
+        const int64_t table_size(count * entry_size);
+        const int64_t table_offset(sz - ZST_SEEK_TABLE_FOOTER_SIZE - table_size);
+        if(table_offset < 8)
+        {
+            return false;
+        }
+        char header[8];
+        f_block.read(header, table_offset - 8, sizeof(header));
+        if(zst_get_le32(header) != ZST_SEEK_TABLE_FRAME_MAGIC
+        || zst_get_le32(header + 4) != table_size + ZST_SEEK_TABLE_FOOTER_SIZE)
+        {
+            return false;
+        }
+        std::vector<char> table(table_size);
+        if(table_size > 0)
+        {
+            f_block.read(&table[0], table_offset, table_size);
+        }
+        int64_t compressed_offset(0);
+        int64_t decompressed_offset(0);
+        for(int64_t i(0); i < count; ++i)
+        {
+            frame_t frame;
+            frame.f_compressed_offset = compressed_offset;
+            frame.f_compressed_size = zst_get_le32(&table[i * entry_size]);
+            frame.f_decompressed_offset = decompressed_offset;
+            frame.f_decompressed_size = zst_get_le32(&table[i * entry_size + 4]);
+            compressed_offset += frame.f_compressed_size;
+            decompressed_offset += frame.f_decompressed_size;
+            f_frames.push_back(frame);
+        }
+        if(compressed_offset != table_offset - 8)
+        {
+            // the frames do not match the file size
+            f_frames.clear();
+            return false;
+        }
+        return true;
+    }
+
+    void decompress_range(memory_file& result, int64_t offset, int64_t size)
+    {
+        result.create(memory_file::file_format_other);
+        std::vector<char> in;
+        std::vector<char> out;
+        int64_t out_offset(0);
+        const int64_t end(offset + size);
+        for(frames_t::const_iterator it(f_frames.begin()); it != f_frames.end(); ++it)
+        {
+            const int64_t frame_end(it->f_decompressed_offset + it->f_decompressed_size);
+            if(frame_end <= offset)
+            {
+                continue;
+            }
+            if(it->f_decompressed_offset >= end)
+            {
+                break;
+            }
+            in.resize(it->f_compressed_size);
+            out.resize(it->f_decompressed_size);
+            f_block.read(&in[0], it->f_compressed_offset, it->f_compressed_size);
+            const size_t r(ZSTD_decompressDCtx(f_dctx, &out[0], out.size(), &in[0], in.size()));
+            if(ZSTD_isError(r) || static_cast<int64_t>(r) != it->f_decompressed_size)
+            {
+                throw memfile_exception_io("zstd decompression of a seekable frame failed");
+            }
+            const int64_t start(std::max(offset, it->f_decompressed_offset));
+            const int64_t stop(std::min(end, frame_end));
+            result.write(&out[start - it->f_decompressed_offset], out_offset, stop - start);
+            out_offset += stop - start;
+        }
+        result.guess_format_from_data();
+    }
+
+private:
+    struct frame_t
+    {
+        int64_t     f_compressed_offset;
+        int64_t     f_compressed_size;
+        int64_t     f_decompressed_offset;
+        int64_t     f_decompressed_size;
+    };
+    typedef std::vector<frame_t>    frames_t;
+
+    const memory_file::block_manager&   f_block;
+    frames_t                            f_frames;
+};
+
+
 } // no name namespace
 
 
@@ -1176,8 +1547,35 @@ void memory_file::disk_file_to_info(const wpkg_filename::uri_filename& filename,
  * \param[in] info  The information to assign to \p filename.
  * \param[in,out] err  A set of flags representing errors that happened.
  */
+#if !defined(MO_WINDOWS)
+namespace
+{
+
+/** \brief Determine the owner and group a file should be assigned.
+ *
+ * The user and group names have priority over the identifiers saved in
+ * the info structure because the identifiers are not expected to match
+ * between computers.
+ *
+ * \param[in] info  The information with the user and group names.
+ * \param[out] uid  The resulting user identifier.
+ * \param[out] gid  The resulting group identifier.
+ */
+void info_to_owner(const memory_file::file_info& info, uid_t& uid, gid_t& gid)
+{
+    struct passwd *pw(getpwnam(info.get_user().c_str()));
+    uid = pw == NULL ? (info.get_user() == "Administrator" ? 0 : info.get_uid()) : pw->pw_uid;
+    struct group *gr(getgrnam(info.get_group().c_str()));
+    gid = gr == NULL ? (info.get_user() == "Administrators" ? 0 : info.get_gid()) : gr->gr_gid;
+}
+
+} // no name namespace
+#endif
+
+
 void memory_file::info_to_disk_file(const wpkg_filename::uri_filename& filename, const file_info& info, int& err)
 {
+    wpkg_filename::os_stat_cache::invalidate(filename);
     wpkg_filename::uri_filename::os_filename_t os_name(filename.os_filename());
 
 #ifdef MO_WINDOWS
@@ -1223,10 +1621,9 @@ void memory_file::info_to_disk_file(const wpkg_filename::uri_filename& filename,
     //info.get_user("Administrator");
     //info.get_group("Administrators");
 #else
-    struct passwd *pw(getpwnam(info.get_user().c_str()));
-    uid_t uid(pw == NULL ? (info.get_user() == "Administrator" ? 0 : info.get_uid()) : pw->pw_uid);
-    struct group *gr(getgrnam(info.get_group().c_str()));
-    gid_t gid(gr == NULL ? (info.get_user() == "Administrators" ? 0 : info.get_gid()) : gr->gr_gid);
+    uid_t uid;
+    gid_t gid;
+    info_to_owner(info, uid, gid);
     if(chown(os_name.get_utf8().c_str(), uid, gid) != 0)
     {
         if(err & file_info_return_errors)
@@ -1258,6 +1655,77 @@ void memory_file::info_to_disk_file(const wpkg_filename::uri_filename& filename,
 }
 
 
+#if !defined(MO_WINDOWS)
+/** \brief Assign info to an open file.
+ *
+ * This function is the same as info_to_disk_file() except that it works
+ * on a file descriptor. The file (or directory) is therefore not searched
+ * again by the operating system for each one of the chmod(), chown(),
+ * and utime() calls.
+ *
+ * The \p filename parameter is only used in error messages.
+ *
+ * \exception memfile_exception_io
+ * If the function fails, it raises this exception unless the \p err
+ * parameter has the file_info_return_errors flag set.
+ *
+ * \param[in] fd  The file descriptor of the file to modify.
+ * \param[in] filename  The name of the file referenced by \p fd.
+ * \param[in] info  The information to assign to \p fd.
+ * \param[in,out] err  A set of flags representing errors that happened.
+ *
+ * \sa info_to_disk_file()
+ */
+void memory_file::info_to_disk_fd(int fd, const wpkg_filename::uri_filename& filename, const file_info& info, int& err)
+{
+    wpkg_filename::os_stat_cache::invalidate(filename);
+    if(fchmod(fd, info.get_mode()) != 0)
+    {
+        if(err & file_info_return_errors)
+        {
+            err |= file_info_permissions_error;
+        }
+        else
+        {
+            throw memfile_exception_io("cannot chmod permissions of \"" + filename.original_filename() + "\" as expected (not running as root?)");
+        }
+    }
+
+    uid_t uid;
+    gid_t gid;
+    info_to_owner(info, uid, gid);
+    if(fchown(fd, uid, gid) != 0)
+    {
+        if(err & file_info_return_errors)
+        {
+            err |= file_info_owner_error;
+        }
+        else
+        {
+            throw memfile_exception_io("cannot chown owner/group of \"" + filename.original_filename() + "\" as expected (not running as Administrator/root?)");
+        }
+    }
+
+    struct timespec times[2];
+    times[0].tv_sec = info.get_atime();
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = info.get_mtime();
+    times[1].tv_nsec = 0;
+    if(futimens(fd, times) != 0)
+    {
+        if(err & file_info_return_errors)
+        {
+            err |= file_info_time_error;
+        }
+        else
+        {
+            throw memfile_exception_io("cannot change access and modification times of \"" + filename.original_filename() + "\" as expected (not running as Administrator/root?)");
+        }
+    }
+}
+#endif
+
+
 
 
 memory_file::memory_file()
@@ -1665,258 +2133,381 @@ void memory_file::read_file(const wpkg_filename::uri_filename& filename, file_in
                 pos += read_size;
                 sz -= read_size;
             }
+            g_bytes_read += file_size;
         }
     }
     else if(scheme == "http" /*|| scheme == "https"*/)
     {
-        // make a copy of filename so we can handle redirects and not
-        // lose the original filename
-        wpkg_filename::uri_filename uri(filename);
+        read_http_file(filename, info, NULL, NULL);
+    }
+    else
+    {
+        throw memfile_exception_parameter("scheme \"" + scheme + "\" (in \"" + filename.original_filename() + "\") not supported by libdebpackages at this point");
+    }
 
-        // the only type of files we can gather from HTTP are regular files
+    // determine the file format
+    if(filename.basename() == "filesmetadata")
+    {
+        // we cannot really detect the meta format
+        f_format = file_format_meta;
+    }
+    else
+    {
+        f_format = f_buffer.data_to_format(0, f_buffer.size());
+    }
+    if(file_format_wpkg == f_format)
+    {
+        // in this case we should be able to set the package path automatically
+        f_package_path.set_filename(filename.dirname());
+        if(f_package_path.empty())
+        {
+            f_package_path.set_filename(".");
+        }
+    }
+
+    // file loaded successfully
+    f_loaded = true;
+
+    // if user passed an info pointer get extra disk information
+    if(info != NULL)
+    {
+        disk_file_to_info(filename, *info);
+    }
+}
+
+
+/** \brief Read a file from an HTTP server.
+ *
+ * This function sends a GET request for \p filename and saves the
+ * body of the response in this memory file. Redirects are followed.
+ *
+ * When \p etag or \p last_modified point to a non-empty string, the
+ * request is made conditional (If-None-Match and If-Modified-Since.)
+ * On a 304 reply the function returns false and the memory file
+ * remains empty. Otherwise the strings are replaced by the ETag and
+ * Last-Modified fields of the response.
+ *
+ * \param[in] filename  The http URI of the file to read.
+ * \param[in] info  The information about this file when available.
+ * \param[in,out] etag  The entity tag of our copy, or NULL.
+ * \param[in,out] last_modified  The Last-Modified date of our copy, or NULL.
+ *
+ * \return true if the file was read, false if our copy is still current.
+ */
+bool memory_file::read_http_file(const wpkg_filename::uri_filename& filename, file_info *info, std::string *etag, std::string *last_modified)
+{
+    // make a copy of filename so we can handle redirects and not
+    // lose the original filename
+    wpkg_filename::uri_filename uri(filename);
+
+    // the only type of files we can gather from HTTP are regular files
+    if(info != NULL)
+    {
+        info->set_file_type(memory_file::file_info::regular_file);
+        info->set_mode(0644);
+    }
+    wpkg_http::response response;
+    block_manager_output output(f_buffer);
+    response.set_body_output(&output);
+    bool redirect;
+    std::string location;
+    // no caching here: remote packages are saved in the package cache
+    // (see wpkgar_package_cache) before they get loaded and the index
+    // files are re-validated with the etag and last_modified parameters
+    do
+    {
+        std::string name(uri.path_only());
+        redirect = false;
+        location.clear();
+        int port_number(80);
+        std::string port(uri.get_port());
+        if(!port.empty())
+        {
+            port_number = file_info::str_to_int(port.c_str(), static_cast<int>(port.length()), 10);
+        }
         if(info != NULL)
         {
-            info->set_file_type(memory_file::file_info::regular_file);
-            info->set_mode(0644);
+            info->set_filename(name);
         }
-        std::unique_ptr<tcp_client_server::tcp_client> http_client;
-        bool redirect;
-        std::string location;
-        int content_length(-1);
-        // TODO: add cache support
-        do
+        wpkg_http::request request(name);
+        if(!filename.get_username().empty() && !filename.get_password().empty())
         {
-            std::string name(uri.path_only());
-            redirect = false;
-            location.clear();
-            int port_number(80);
-            std::string port(uri.get_port());
-            if(!port.empty())
-            {
-                port_number = file_info::str_to_int(port.c_str(), static_cast<int>(port.length()), 10);
-            }
-            if(info != NULL)
-            {
-                info->set_filename(name);
-            }
-            std::string request("GET " + name + " HTTP/1.1\r\nHost: " + uri.get_domain() + "\r\n");
-            if(!filename.get_username().empty() && !filename.get_password().empty())
-            {
-                std::string credentials(filename.get_username() + ":" + filename.get_password());
-                request += ("Authorization: Basic " + to_base64(credentials.c_str(), credentials.length()) + "\r\n");
-            }
-            request += "\r\n"; // add an empty line
-            http_client.reset(new tcp_client_server::tcp_client(uri.get_domain(), port_number));
-            if(http_client->write(request.c_str(), request.length()) != static_cast<int>(request.length()))
-            {
-                throw memfile_exception_io("error while writing HTTP request for \"" + filename.original_filename() + "\"");
-            }
+            std::string credentials(filename.get_username() + ":" + filename.get_password());
+            request.set_field("Authorization", "Basic " + to_base64(credentials.c_str(), credentials.length()));
+        }
+        if(etag != NULL && !etag->empty())
+        {
+            request.set_field("If-None-Match", *etag);
+        }
+        if(last_modified != NULL && !last_modified->empty())
+        {
+            request.set_field("If-Modified-Since", *last_modified);
+        }
 
-            // the reply is a header followed by the data, here we read the
-            // header because it is throw away data at this point
-            bool first_line(true);
-            for(;;)
-            {
-                case_insensitive::case_insensitive_string field_name("");
-                std::string field_value;
-                bool got_name(false), trim(true);
-                for(;;)
-                {
-                    char c;
-                    if(http_client->read(&c, 1) != 1)
-                    {
-                        throw memfile_exception_io("error while reading HTTP response for \"" + filename.original_filename() + "\"");
-                    }
-                    if(c == '\r')
-                    {
-                        if(http_client->read(&c, 1) != 1)
-                        {
-                            throw memfile_exception_io("error while reading HTTP response for \"" + filename.original_filename() + "\"");
-                        }
-                        if(c != '\n')
-                        {
-                            throw memfile_exception_io("error while reading HTTP response for \"" + filename.original_filename() + "\": expected \\n");
-                        }
-                        break;
-                    }
-                    if(c == '\n')
-                    {
-                        // '\r' missing?!
-                        break;
-                    }
-                    if(got_name)
-                    {
-                        if(trim)
-                        {
-                            trim = isspace(c) != 0;
-                        }
-                        if(!trim)
-                        {
-                            field_value += c;
-                        }
-                    }
-                    else if(c == ':' && !first_line)
-                    {
-                        got_name = true;
-                    }
-                    else
-                    {
-                        field_name += c;
-                    }
-                }
-                if(field_name.empty())
-                {
-                    break;
-                }
-                if(first_line)
-                {
-                    first_line = false;
-                    // the first line must be HTTP/1.0 200 OK or HTTP/1.1 200 OK
-                    // although we want to support 301, 302, and 303 redirects
-                    std::string http_protocol(field_name.substr(0, 9));
-                    if(http_protocol != "HTTP/1.0 " && http_protocol != "HTTP/1.1 ")
-                    {
-                        throw memfile_exception_io("HTTP response: is not HTTP/1.0 or HTTP/1.1");
-                    }
-                    int http_response(file_info::str_to_int(field_name.c_str() + 9, 4, 10));
-                    switch(http_response)
-                    {
-                    case 301: // Moved permanently
-                    case 302: // Found
-                    case 303: // See Other
-                    case 307: // Temporary Redirect
-                    case 308: // Permanent Redirect
-                        // handle redirect
-                        redirect = true;
-                        break;
-
-                    case 200: // OK
-                        // valid response!
-                        break;
-
-                    case 401: // Unauthorized
-                        // TBD:
-                        // at times servers force you to reply to this one instead of
-                        // directly accepting the Authorization: Basic ... field!?
-                    default:
-                        // TODO: we MUST test the field_name string before printing for security reasons
-                        throw memfile_exception_io("HTTP response was " + field_name.substr(9, 3) + ", expected 200 or a redirect");
+        // the client keeps the connection alive so the next file read
+        // from the same server does not require a new connection
+        try
+        {
+            wpkg_http::client::get(uri.get_domain(), port_number, request, response);
+        }
+        catch(const wpkg_http::wpkg_http_exception& e)
+        {
+            throw memfile_exception_io("error while reading HTTP response for \"" + filename.original_filename() + "\": " + e.what());
+        }
+
+        // we want to support 301, 302, 303, 307, and 308 redirects
+        switch(response.get_status())
+        {
+        case 301: // Moved permanently
+        case 302: // Found
+        case 303: // See Other
+        case 307: // Temporary Redirect
+        case 308: // Permanent Redirect
+            // handle redirect
+            redirect = true;
+            location = response.get_field("Location");
+            break;
 
-                    }
-                }
-                else
-                {
-                    if(field_name == "Location")
-                    {
-                        location = field_value;
-                    }
-                    else if(field_name == "Content-Length")
-                    {
-                        content_length = file_info::str_to_int(field_value.c_str(), static_cast<int>(field_value.length()), 10);
-                    }
-                    else if(info != NULL)
-                    {
-                        if(field_name == "Last-Modified")
-                        {
-                            struct tm time_info;
-                            if(strptime(field_value.c_str(), "%a, %d %b %Y %H:%M:%S %z", &time_info) != NULL)
-                            {
-                                // unfortunately the tar format does not support time64_t
-                                info->set_mtime(mktime(&time_info));
-                            }
-                            // else -- silent error?
-                        }
-                    }
-                    // other fields of interest?
-                }
+        case 200: // OK
+            // valid response!
+            // (the validators get replaced by the new ones, if any)
+            if(etag != NULL)
+            {
+                *etag = response.get_field("ETag");
             }
-            if(location.empty())
+            if(last_modified != NULL)
             {
-                if(redirect)
-                {
-                    throw memfile_exception_io("received an HTTP redirect without a Location field");
-                }
+                *last_modified = response.get_field("Last-Modified");
             }
-            else
+            if(info != NULL && response.field_is_defined("Last-Modified"))
             {
-                if(!redirect)
-                {
-                    throw memfile_exception_io("received an HTTP Location field without a redirect response");
-                }
-                uri.set_filename(location);
-                std::string location_scheme(uri.path_scheme());
-                if(location_scheme != "http" && location_scheme != "https")
+                // strptime() does not set all the fields (tm_isdst)
+                struct tm time_info;
+                memset(&time_info, 0, sizeof(time_info));
+                if(strptime(response.get_field("Last-Modified").c_str(), "%a, %d %b %Y %H:%M:%S %z", &time_info) != NULL)
                 {
-                    throw memfile_exception_io("HTTP redirect has a location not using the HTTP or HTTPS scheme");
+                    // unfortunately the tar format does not support time64_t
+                    info->set_mtime(mktime(&time_info));
                 }
-                // note that we ignore the new user and password parameters since
-                // we continue to use filename.get_username() and filename.get_password()
-                // when generating the credentials
+                // else -- silent error?
             }
-        }
-        while(!location.empty());
+            break;
 
-        // now read the file contents
-        // we do not trust the Content-Size (or even whether it is present)
-        // so we read until we get a read_size of zero
-        int pos(0);
-        for(; content_length == -1 || pos < content_length;)
-        {
-            //const int sz(content_length == -1 ? block_manager::BLOCK_MANAGER_BUFFER_SIZE : std::min(content_length - pos, block_manager::BLOCK_MANAGER_BUFFER_SIZE));
-            char buf[block_manager::BLOCK_MANAGER_BUFFER_SIZE];
-            const int read_size(http_client->read(buf, block_manager::BLOCK_MANAGER_BUFFER_SIZE));
-            if(read_size == -1)
+        case 304: // Not Modified
+            if(etag != NULL || last_modified != NULL)
             {
-                // reading of the entire file failed
-                reset();
-                throw memfile_exception_io("I/O error while reading HTTP file");
+                // we sent a conditional request and our copy is current
+                // (a 304 has no body)
+                return false;
             }
-            if(read_size == 0)
+            throw memfile_exception_io("HTTP response was 304 to an unconditional request");
+
+        case 401: // Unauthorized
+            // TBD:
+            // at times servers force you to reply to this one instead of
+            // directly accepting the Authorization: Basic ... field!?
+        default:
             {
-                // done!
-                break;
+                std::stringstream status;
+                status << response.get_status();
+                throw memfile_exception_io("HTTP response was " + status.str() + ", expected 200 or a redirect");
             }
-            f_buffer.write(buf, pos, read_size);
-            pos += read_size;
+
         }
-        if(info != NULL)
+        if(redirect)
         {
-            info->set_size(pos);
+            if(location.empty())
+            {
+                throw memfile_exception_io("received an HTTP redirect without a Location field");
+            }
+            uri.set_filename(location);
+            std::string location_scheme(uri.path_scheme());
+            if(location_scheme != "http" && location_scheme != "https")
+            {
+                throw memfile_exception_io("HTTP redirect has a location not using the HTTP or HTTPS scheme");
+            }
+            // note that we ignore the new user and password parameters since
+            // we continue to use filename.get_username() and filename.get_password()
+            // when generating the credentials
         }
     }
-    else
+    while(redirect);
+
+    // the body was written in f_buffer as it was received
+    // (Content-Length, chunked, or until the server closed)
+    const int64_t size(response.get_body_size());
+    g_bytes_read += size;
+    if(info != NULL)
     {
-        throw memfile_exception_parameter("scheme \"" + scheme + "\" (in \"" + filename.original_filename() + "\") not supported by libdebpackages at this point");
+        info->set_size(size);
     }
 
-    // determine the file format
-    if(filename.basename() == "filesmetadata")
+    return true;
+}
+
+
+/** \brief Read a file unless our copy is still current.
+ *
+ * This function is similar to read_file() except that the request of
+ * an http file is conditional: the \p etag and \p last_modified
+ * validators saved from the previous read are sent along and if the
+ * server says the file did not change, nothing gets transferred and
+ * the function returns false.
+ *
+ * The validators are updated with the values the server returned.
+ * Other schemes do not have validators and are always read.
+ *
+ * \param[in] filename  The name of a file to read from.
+ * \param[in,out] etag  The ETag of our copy, empty if unknown.
+ * \param[in,out] last_modified  The Last-Modified of our copy, empty if unknown.
+ *
+ * \return true if the file was read, false if it was not modified.
+ */
+bool memory_file::read_file_if_modified(const wpkg_filename::uri_filename& filename, std::string& etag, std::string& last_modified)
+{
+    if(filename.path_scheme() != "http")
     {
-        // we cannot really detect the meta format
-        f_format = file_format_meta;
+        read_file(filename);
+        return true;
     }
-    else
+
+    reset();
+
+    f_filename = filename;
+
+    wpkg_output::log("Reading file '%1' if modified.")
+            .quoted_arg(f_filename.original_filename())
+        .debug(wpkg_output::debug_flags::debug_detail_files)
+        .module(wpkg_output::module_repository);
+
+    if(!read_http_file(filename, NULL, &etag, &last_modified))
     {
-        f_format = f_buffer.data_to_format(0, f_buffer.size());
+        return false;
     }
-    if(file_format_wpkg == f_format)
+
+    f_format = f_buffer.data_to_format(0, f_buffer.size());
+    f_loaded = true;
+
+    return true;
+}
+
+
+/** \brief Read the head of an ar archive from disk.
+ *
+ * This function reads the members of an ar archive up to, but not
+ * including, the first member which name starts with \p stop_prefix.
+ * The headers are parsed with seeks so the members that follow are
+ * never read. With "data.tar" as the prefix, a Debian package is loaded
+ * without its data.tar file, which means only a few Kb get read
+ * whatever the size of the package.
+ *
+ * The result is an ar archive including the members found before the
+ * stop member. Remote files (i.e. http) do not support seeking and
+ * files that are not ar archives cannot be parsed so those get read
+ * in full.
+ *
+ * Local files are read without generating any log so the function can
+ * be used by worker threads.
+ *
+ * \param[in] filename  The name of the ar archive to read.
+ * \param[in] stop_prefix  The prefix of the name of the member where the
+ *                        reading stops.
+ */
+void memory_file::read_ar_file(const wpkg_filename::uri_filename& filename, const std::string& stop_prefix)
+{
+    const std::string scheme(filename.path_scheme());
+    if(scheme != "file" && scheme != "smb")
     {
-        // in this case we should be able to set the package path automatically
-        f_package_path.set_filename(filename.dirname());
-        if(f_package_path.empty())
+        read_file(filename);
+        return;
+    }
+
+    reset();
+
+    f_filename = filename;
+
+    wpkg_stream::fstream file;
+    file.open(filename);
+    if(!file.good())
+    {
+        throw memfile_exception_io("cannot open \"" + filename.original_filename() + "\" for reading");
+    }
+    file.seek(0, wpkg_stream::fstream::end);
+    const wpkg_stream::fstream::off_type file_size(file.tell());
+    file.seek(0, wpkg_stream::fstream::beg);
+
+    char buf[block_manager::BLOCK_MANAGER_BUFFER_SIZE];
+    char magic[8];
+    if(file_size < 8 || file.read(magic, 8) != 8 || memcmp(magic, "!<arch>\n", 8) != 0)
+    {
+        // not an ar archive (it may be compressed), let the caller
+        // deal with the whole file
+        file.seek(0, wpkg_stream::fstream::beg);
+        int64_t pos(0);
+        for(int64_t sz(file_size); sz > 0;)
         {
-            f_package_path.set_filename(".");
+            const int64_t read_size(std::min(sz, static_cast<int64_t>(block_manager::BLOCK_MANAGER_BUFFER_SIZE)));
+            if(file.read(buf, read_size) != read_size)
+            {
+                reset();
+                throw memfile_exception_io("reading entire input file \"" + filename.original_filename() + "\" failed");
+            }
+            f_buffer.write(buf, pos, read_size);
+            pos += read_size;
+            sz -= read_size;
         }
+        g_bytes_read += pos;
+        f_format = f_buffer.data_to_format(0, f_buffer.size());
+        f_loaded = true;
+        return;
     }
+    f_buffer.write(magic, 0, 8);
+    int64_t pos(8);
 
-    // file loaded successfully
-    f_loaded = true;
-
-    // if user passed an info pointer get extra disk information
-    if(info != NULL)
+    while(pos + 60 <= file_size)
     {
-        disk_file_to_info(filename, *info);
+        char header[60];
+        file.seek(pos, wpkg_stream::fstream::beg);
+        if(file.read(header, 60) != 60)
+        {
+            throw memfile_exception_io("reading an ar header of \"" + filename.original_filename() + "\" failed");
+        }
+        if(header[58] != '`' || header[59] != 0x0A)
+        {
+            throw memfile_exception_io("invalid magic code in ar header");
+        }
+        if(stop_prefix.length() <= 16
+        && std::string(header, stop_prefix.length()) == stop_prefix)
+        {
+            break;
+        }
+        file_info info;
+        info.set_size(header + 16 + 12 + 6 + 6 + 8, 10, 10);
+        if(pos + 60 + info.get_size() > file_size)
+        {
+            throw memfile_exception_io("ar member out of bounds (invalid size)");
+        }
+        // the padding of the last member may be missing
+        const int64_t member_size(std::min(static_cast<int64_t>((info.get_size() + 1) & -2), static_cast<int64_t>(file_size - pos - 60)));
+        f_buffer.write(header, pos, 60);
+        pos += 60;
+        for(int64_t sz(member_size); sz > 0;)
+        {
+            const int64_t read_size(std::min(sz, static_cast<int64_t>(block_manager::BLOCK_MANAGER_BUFFER_SIZE)));
+            if(file.read(buf, read_size) != read_size)
+            {
+                reset();
+                throw memfile_exception_io("reading an ar member of \"" + filename.original_filename() + "\" failed");
+            }
+            f_buffer.write(buf, pos, read_size);
+            pos += read_size;
+            sz -= read_size;
+        }
     }
+    g_bytes_read += pos;
+
+    f_format = file_format_ar;
+    f_loaded = true;
 }
 
 void memory_file::write_file(const wpkg_filename::uri_filename& filename, bool create_folders, bool force) const
@@ -1980,7 +2571,48 @@ void memory_file::write_file(const wpkg_filename::uri_filename& filename, bool c
         offset += write_size;
         sz -= write_size;
     }
+    g_bytes_written += offset;
+}
+
+
+#if !defined(MO_WINDOWS)
+/** \brief Write the memory file to an open file descriptor.
+ *
+ * This function writes the whole memory file to \p fd. The blocks are
+ * sent to the file descriptor directly (see block_manager::write_fd())
+ * so no intermediate copy is necessary.
+ *
+ * The caller is responsible for opening, and eventually closing, the
+ * file descriptor.
+ *
+ * \exception memfile_exception_io
+ * This exception is raised if the data cannot be written in full.
+ *
+ * \param[in] fd  The file descriptor where the data gets written.
+ * \param[in] filename  The name of the file referenced by \p fd.
+ */
+void memory_file::write_fd(int fd, const wpkg_filename::uri_filename& filename) const
+{
+    if(!f_created && !f_loaded)
+    {
+        throw memfile_exception_undefined("this memory file is still undefined and it cannot be written to \"" + filename.original_filename() + "\"");
+    }
+
+    // this assignment may not always be correct, but in most cases it should be fine
+    const_cast<wpkg_filename::uri_filename&>(f_filename) = filename;
+
+    wpkg_output::log("Writing file '%1'.")
+            .quoted_arg(f_filename.original_filename())
+        .debug(wpkg_output::debug_flags::debug_detail_files)
+        .module(wpkg_output::module_repository);
+
+    if(f_buffer.write_fd(fd) != f_buffer.size())
+    {
+        throw memfile_exception_io("writing the entire file to the output file \"" + filename.original_filename() + "\" failed");
+    }
+    g_bytes_written += f_buffer.size();
 }
+#endif
 
 
 void memory_file::copy(memory_file& destination) const
@@ -2611,6 +3243,66 @@ std::string memory_file::md5sum() const
     return sum.sum();
 }
 
+/** \brief Compute the md5sum of a file on disk.
+ *
+ * This function streams the file through the md5 computation instead of
+ * loading it in memory. It is used when only the md5sum of a large file
+ * is necessary.
+ *
+ * \param[in] filename  The name of the file to compute the md5sum of.
+ *
+ * \return The md5sum as an hexadecimal string.
+ */
+std::string memory_file::file_md5sum(const wpkg_filename::uri_filename& filename)
+{
+    wpkg_stream::fstream file;
+    file.open(filename);
+    if(!file.good())
+    {
+        throw memfile_exception_io("cannot open \"" + filename.original_filename() + "\" to compute its md5sum");
+    }
+    md5::md5sum sum;
+    char buf[block_manager::BLOCK_MANAGER_BUFFER_SIZE];
+    for(;;)
+    {
+        const wpkg_stream::fstream::size_type sz(file.read(buf, sizeof(buf)));
+        if(sz <= 0)
+        {
+            break;
+        }
+        sum.push_back(reinterpret_cast<uint8_t *>(buf), static_cast<size_t>(sz));
+        g_bytes_read += sz;
+    }
+    return sum.sum();
+}
+
+
+/** \brief Retrieve the total number of bytes read from files.
+ *
+ * This function returns the number of bytes that the read_file() function
+ * loaded from disk or over the network since the process started. It is
+ * used to verify how many times the data of a package gets read.
+ *
+ * \return The total number of bytes read.
+ */
+int64_t memory_file::get_bytes_read()
+{
+    return g_bytes_read;
+}
+
+
+/** \brief Retrieve the total number of bytes written to files.
+ *
+ * This function returns the number of bytes that the write_file() and
+ * write_fd() functions saved since the process started.
+ *
+ * \return The total number of bytes written.
+ */
+int64_t memory_file::get_bytes_written()
+{
+    return g_bytes_written;
+}
+
 void memory_file::compress_to_gz(memory_file& result, int zlevel) const
 {
     gz_deflate gz(zlevel);
@@ -2653,6 +3345,92 @@ void memory_file::decompress_from_zst(memory_file& result) const
     zst.decompress(result, f_buffer);
 }
 
+
+
+/** \brief Compress this file in a seekable zstd file.
+ *
+ * This function compresses the memory file with zstd in a set of
+ * independent frames followed by a seek table. The result can be
+ * decompressed with the decompress() function like any zstd file and
+ * parts of it can be decompressed with decompress_range() without
+ * having to decompress the whole file.
+ *
+ * \exception memfile_exception_undefined
+ * This exception is raised if the memory file was not created or loaded.
+ *
+ * \exception memfile_exception_compatibility
+ * This exception is raised if the file is already compressed.
+ *
+ * \param[out] result  The memory file receiving the compressed data.
+ * \param[in] zlevel  The compression level (1 to 9.)
+ */
+void memory_file::compress_seekable(memory_file& result, int zlevel) const
+{
+    if(!f_created && !f_loaded)
+    {
+        throw memfile_exception_undefined("this memory file is still undefined and it cannot be compressed");
+    }
+    if(zlevel < 1 || zlevel > 9)
+    {
+        throw memfile_exception_parameter("zlevel must be between 1 and 9");
+    }
+    if(is_compressed())
+    {
+        throw memfile_exception_compatibility("this memory file is already compressed");
+    }
+    zst_seekable_deflate zst(zlevel);
+    zst.compress(result, f_buffer);
+}
+
+
+/** \brief Check whether this file is a seekable zstd file.
+ *
+ * This function checks whether this memory file is a zstd file with
+ * a valid seek table as created by compress_seekable().
+ *
+ * \return true if decompress_range() can be used with this file.
+ */
+bool memory_file::is_seekable() const
+{
+    if(f_format != file_format_zst)
+    {
+        return false;
+    }
+    zst_seekable_inflate zst(f_buffer);
+    return zst.load_seek_table();
+}
+
+
+/** \brief Decompress part of a seekable zstd file.
+ *
+ * This function decompresses \p size bytes starting at \p offset in
+ * the uncompressed data of this seekable zstd file. Only the frames
+ * that include that data get decompressed.
+ *
+ * If the range goes beyond the end of the data, the result is shorter
+ * than \p size.
+ *
+ * \exception memfile_exception_compatibility
+ * This exception is raised if this file is not a seekable zstd file.
+ *
+ * \param[out] result  The memory file receiving the decompressed data.
+ * \param[in] offset  The offset of the data in the uncompressed file.
+ * \param[in] size  The number of bytes to decompress.
+ */
+void memory_file::decompress_range(memory_file& result, int64_t offset, int64_t size) const
+{
+    if(offset < 0 || size < 0)
+    {
+        throw memfile_exception_parameter("the offset and size of the range to decompress cannot be negative");
+    }
+    zst_seekable_inflate zst(f_buffer);
+    if(f_format != file_format_zst || !zst.load_seek_table())
+    {
+        throw memfile_exception_compatibility("this memory file is not a seekable zstd file");
+    }
+    zst.decompress_range(result, offset, size);
+}
+
 /** \brief Read information about a file from disk.
  *
  * This function directly reads information from the disk directory
@@ -3211,6 +3989,10 @@ void memory_file::dir_next_wpkg(file_info& info, memory_file *data) const
     info.set_raw_md5sum(raw);
     info.set_original_compression(
         static_cast<wpkgar::wpkgar_block_t::wpkgar_compression_t>( static_cast<uint8_t>(header->f_original_compression) ) );
+    if(header->f_data_block != 0)
+    {
+        info.set_data_offset(static_cast<int64_t>(header->f_data_block - 1) * 512);
+    }
 
     info.set_filename(reinterpret_cast<const char *>(header->f_name), 300);
     info.set_link(reinterpret_cast<const char *>(header->f_link), 300);
@@ -4161,6 +4943,11 @@ void memory_file::append_wpkg(const file_info& info, const memory_file& data)
     }
 
     header.f_original_compression = static_cast<uint8_t>(info.get_original_compression());
+    if(info.is_field_defined(file_info::field_name_data_offset)
+    && (info.get_data_offset() & 511) == 0)
+    {
+        header.f_data_block = static_cast<uint32_t>(info.get_data_offset() / 512 + 1);
+    }
     header.f_use = wpkgar::wpkgar_block_t::WPKGAR_USAGE_UNKNOWN;
     header.f_status = wpkgar::wpkgar_block_t::WPKGAR_STATUS_UNKNOWN;
 
@@ -4264,6 +5051,7 @@ void memory_file::file_info::reset()
     f_dev_minor = 0;
     // f_raw_md5sum -- there isn't a clear for this one (necessary?)
     f_original_compression = wpkgar::wpkgar_block_t::WPKGAR_COMPRESSION_NONE;
+    f_data_offset = 0;
 }
 
 bool memory_file::file_info::is_field_defined(field_name_t field) const
@@ -4423,6 +5211,19 @@ wpkgar::wpkgar_block_t::wpkgar_compression_t memory_file::file_info::get_origina
     return f_original_compression;
 }
 
+/** \brief Get the offset of the file in the data archive.
+ *
+ * This function returns the offset of the header of this file in the
+ * data.tar archive of its package. The offset is only valid if the
+ * field_name_data_offset field is defined.
+ *
+ * \return The offset of the file header in data.tar.
+ */
+int64_t memory_file::file_info::get_data_offset() const
+{
+    return f_data_offset;
+}
+
 void memory_file::file_info::set_uri(const wpkg_filename::uri_filename& uri)
 {
     f_uri = uri;
@@ -4632,6 +5433,21 @@ void memory_file::file_info::set_original_compression(wpkgar::wpkgar_block_t::wp
     set_field(field_name_original_compression);
 }
 
+/** \brief Set the offset of the file in the data archive.
+ *
+ * This function saves the offset of the header of this file in the
+ * data.tar archive of its package. The wpkg archive format saves this
+ * offset so a single file can be read from a seekable data.tar without
+ * having to read the whole archive.
+ *
+ * \param[in] offset  The offset of the file header in data.tar.
+ */
+void memory_file::file_info::set_data_offset(int64_t offset)
+{
+    f_data_offset = offset;
+    set_field(field_name_data_offset);
+}
+
 int memory_file::file_info::strnlen(const char *str, int n)
 {
     // compute the string size bounded by the limit
@@ -455,6 +455,24 @@ tcp_server::tcp_server(const std::string& addr, int port, int max_connections, b
         throw tcp_client_server_runtime_error("could not bind the socket to \"" + f_addr + "\"");
     }
 
+    // with port 0 the system picked a free port, retrieve it
+    if(f_port == 0)
+    {
+        struct sockaddr_storage bound_addr;
+        socklen_t bound_len(sizeof(bound_addr));
+        if(getsockname(f_socket, reinterpret_cast<struct sockaddr *>(&bound_addr), &bound_len) == 0)
+        {
+            if(bound_addr.ss_family == AF_INET6)
+            {
+                f_port = ntohs(reinterpret_cast<struct sockaddr_in6 *>(&bound_addr)->sin6_port);
+            }
+            else
+            {
+                f_port = ntohs(reinterpret_cast<struct sockaddr_in *>(&bound_addr)->sin_port);
+            }
+        }
+    }
+
     // start listening, we expect the caller to then call accept() to
     // acquire connections
     if(listen(f_socket, f_max_connections) < 0)
@@ -513,6 +531,8 @@ int tcp_server::get_max_connections() const
  *
  * This function returns the port the server was created with. This port
  * is exactly what the server currently uses. It cannot be changed.
+ * When the server was created with port 0, the port picked by the
+ * system is returned.
  *
  * \return The server port.
  */
@@ -22,7 +22,7 @@
 /** \file
  * \brief Copy files to a backup directory.
  *
- * This class implementation is used to copy files from one directory to
+ * This class implementation is used to move files from one directory to
  * another and eventually restore the backup if the current process fails.
  */
 #include "libdebpackages/wpkg_backup.h"
@@ -39,8 +39,9 @@ namespace wpkg_backup
 /** \class wpkgar_backup
  * \brief The backup class to keep track of backed up files.
  *
- * The backup class implements functions useful to backup (copy) files
- * from their current location to a backup location (the temporary folder).
+ * The backup class implements functions useful to backup (move or copy)
+ * files from their current location to a backup location (the
+ * temporary folder of the database.)
  * A backup object destructor ensures that the backed up files are restored
  * unless the process marked the backup as successful.
  *
@@ -88,9 +89,13 @@ wpkgar_backup::~wpkgar_backup()
 /** \brief Backup the specified file.
  *
  * This function informs the backup object that we are about to replace
- * the specified file. If the file already exists, the function makes
- * a copy by reading the whole file in memory and then saving that back
- * to disk.
+ * or delete the specified file. If the file already exists, the function
+ * saves it in the backup directory.
+ *
+ * The file gets renamed to its backup name so the cost of the backup
+ * does not depend on the size of the file. When the rename is not
+ * possible (i.e. the backup directory is on another device) the file
+ * gets copied and then deleted instead.
  *
  * The backup function also understands that when the file does not
  * exist yet, the \em backup means marking that the new file will need
@@ -103,6 +108,16 @@ wpkgar_backup::~wpkgar_backup()
  * Note that if you try to backup the same file twice, the function returns
  * false as if the second backup failed. This is used as a safeguard.
  *
+ * \warning
+ * When the function returns true, the file does not exist anymore. The
+ * caller does not have to delete it before replacing it.
+ *
+ * \exception wpkg_filename_exception_io
+ * The function throws if the file had to be copied and the original
+ * cannot be deleted afterward.
+ *
+ * \param[in] filename  The name of the file to backup.
+ *
  * \return true if the file gets backed up.
  */
 bool wpkgar_backup::backup(const wpkg_filename::uri_filename& filename)
@@ -146,13 +161,24 @@ bool wpkgar_backup::backup(const wpkg_filename::uri_filename& filename)
 
     ++f_count; // start with file1.bak
     wpkg_filename::uri_filename destination(f_manager->get_database_path().append_child("tmp/backup/file").append_path(f_count).append_path(".bak"));
+    if(f_count == 1)
+    {
+        wpkg_filename::uri_filename(destination.dirname()).os_mkdir_p();
+    }
 
-    // the following may throw if the copy doesn't work (i.e. read or
-    // write fails)
+    // this fails if the backup directory is on another device
+    if(!filename.os_rename(destination))
     {
+        // the following may throw if the copy doesn't work (i.e. read or
+        // write fails)
         memfile::memory_file f;
         f.read_file(filename);
         f.write_file(destination, true); // create backup folder if necessary
+
+        // register the backup first so a restore() puts the file back
+        // even if the following unlink throws
+        f_files[filename.full_path()] = destination.full_path();
+        filename.os_unlink();
     }
 
     // it worked, save the info in our f_files map
@@ -206,12 +232,23 @@ void wpkgar_backup::restore()
                     else
                     {
                         // create intermediate directories
-                        wpkg_filename::uri_filename dirname = wpkg_filename::uri_filename(it->first).dirname();
-                        dirname.os_mkdir_p();
+                        const wpkg_filename::uri_filename original(it->first);
+                        wpkg_filename::uri_filename(original.dirname()).os_mkdir_p();
 
-                        memfile::memory_file f;
-                        f.read_file(it->second);
-                        f.write_file(it->first);
+                        // the new file, if any, is replaced by the backup;
+                        // the rename fails if the backup was copied to
+                        // another device in which case we copy it back
+                        const wpkg_filename::uri_filename backup_file(it->second);
+#if defined(MO_WINDOWS)
+                        // rename() does not overwrite an existing file
+                        original.os_unlink();
+#endif
+                        if(!backup_file.os_rename(original))
+                        {
+                            memfile::memory_file f;
+                            f.read_file(backup_file);
+                            f.write_file(original);
+                        }
                     }
                 }
                 catch(const std::exception&)
@@ -228,7 +265,8 @@ void wpkgar_backup::restore()
                 }
             }
         }
-        // delete the backups if any
+        // delete the backups if any (restored backups were renamed so
+        // there is generally nothing left to delete in that case)
         // we do this in a second loop just in case it were to generate an error we
         // do not catch; that way we first restore everything and then we remove
         // backups which do or do not need to be valid
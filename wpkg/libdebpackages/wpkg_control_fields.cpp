@@ -1009,7 +1009,10 @@ void control_file::field_essential_t::verify_value() const
 // Files
 CONTROL_FILE_FIELD_FACTORY(files, "Files",
     "The Files field is a list of filenames. The format is simply a list "
-    "of filenames: \"filename\"; the filename may include a path."
+    "of filenames: \"filename\"; the filename may include a path. "
+    "In binary packages, the build process replaces this field with the "
+    "list of all the files found in the data.tar archive using the "
+    "longlist format: \"<mode> <size> <md5sum> <filename>\"."
 )
 CONTROL_FILE_FIELD_CONSTRUCTOR(files, control)
 
@@ -89,7 +89,9 @@ void file_list_t::set(const std::string& files)
                     }
                     std::string w(start, s - start);
                     f_words.push_back(w);
-                    for(++s; isspace(*s); ++s);
+                    // the quoted word may be the last one of the line
+                    // so do not skip the end of line characters
+                    for(++s; *s == ' ' || *s == '\t'; ++s);
                     start = s;
                 }
                 else if(isspace(*s))
@@ -407,13 +409,9 @@ void file_item::set_mode(const std::string& line)
     }
     int i(0);
     const char *l(line.c_str());
-    for(; !isspace(*l); ++i, ++l)
+    for(; *l != '\0' && !isspace(*l); ++i, ++l)
     {
-        if(*l == '\0')
-        {
-            throw wpkg_control_exception_invalid("file mode and permission field too short: \"" + line + "\"; it must be exactly 10 characters");
-        }
-        if(i > 10)
+        if(i >= 10)
         {
             throw wpkg_control_exception_invalid("file mode and permission field has to be exactly 10 characters; \"" + line + "\"");
         }
@@ -905,7 +903,7 @@ std::string file_item::to_string(format_t format) const
 
 #ifndef MO_WINDOWS
         case S_IFIFO:
-            mode += "f";
+            mode += "p";
             break;
 
         case S_IFLNK:
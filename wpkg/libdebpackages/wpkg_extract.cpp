@@ -0,0 +1,796 @@
+/*    wpkg_extract.cpp -- write the files of a package to the target
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief Write extracted files to disk.
+ *
+ * This file implements the extractor used by the unpack process to save
+ * the files found in the data.tar archive of a package on the target and
+ * assign them their meta data (permissions, owner, times.)
+ */
+#include "libdebpackages/wpkg_extract.h"
+
+#include    <sstream>
+#include    <errno.h>
+#if defined(MO_LINUX)
+#   include <fcntl.h>
+#   include <linux/fs.h>
+#   include <sys/ioctl.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+#if defined(MO_LINUX) && !defined(FICLONE)
+#   define FICLONE _IOW(0x94, 9, int)
+#endif
+
+namespace wpkg_extract
+{
+
+
+/** \class extractor
+ * \brief Save the files of a package on the target.
+ *
+ * The extractor object is used to write the files extracted from a
+ * package data.tar archive and create its directories.
+ *
+ * Under Linux, the extractor keeps a file descriptor to each directory
+ * it writes into. Files are then created with openat() relative to that
+ * directory, their data is written with writev() directly from the
+ * memory file blocks, and their meta data is applied with fchmod(),
+ * fchown(), and futimens() on the open file. This means the kernel
+ * resolves the path of a directory once instead of resolving the full
+ * path of each file five times (create, write, chmod, chown, utime.)
+ *
+ * On other platforms the extractor uses the path based functions of
+ * the memory_file object.
+ *
+ * When installing the same packages in several root directories, the
+ * extractor can share the files written so far (see set_share_mode().)
+ * A file which data and meta data are identical to a file written
+ * earlier by this process is then hard linked or cloned (reflink)
+ * instead of being written again.
+ *
+ * The files can also be shared between runs through a payload store
+ * (see set_payload_store().) The store is a directory of files named
+ * after their md5sum which the installed files are linked to.
+ */
+
+
+namespace
+{
+
+/** \brief The current share mode.
+ *
+ * This mode is global so all the extractors of the process share the
+ * same list of files.
+ */
+extractor::share_mode_t g_share_mode = extractor::share_mode_none;
+
+/** \brief The path to the payload store.
+ *
+ * When empty, files are only shared within this process.
+ */
+wpkg_filename::uri_filename g_payload_store;
+
+} // no name namespace
+
+
+#if defined(MO_LINUX)
+namespace
+{
+
+/** \brief Maximum number of directories kept open.
+ *
+ * Packages with a very large number of directories would otherwise
+ * use up all the file descriptors available to the process.
+ */
+const size_t EXTRACTOR_MAX_OPEN_DIRECTORIES = 256;
+
+
+/** \brief Close a file descriptor on exit.
+ *
+ * This RAII class makes sure that a file descriptor opened while
+ * writing a file gets closed whatever happens.
+ */
+class auto_close
+{
+public:
+    auto_close(int fd)
+        : f_fd(fd)
+    {
+    }
+
+    ~auto_close()
+    {
+        if(f_fd != -1)
+        {
+            ::close(f_fd);
+        }
+    }
+
+private:
+    int         f_fd;
+};
+
+
+/** \brief A file that other identical files can be linked to.
+ *
+ * The size and modification time are used to detect that the file
+ * was modified since we wrote it (i.e. by a maintainer script) in which
+ * case it cannot be shared anymore.
+ */
+struct shared_file_t
+{
+    std::string     f_path;
+    off_t           f_size;
+    time_t          f_mtime;
+};
+
+/** \brief The files written so far indexed by content.
+ *
+ * The key is generated by share_key().
+ *
+ * This map is per process. When the roots get installed in child
+ * processes, each child starts with the files written by the parent
+ * before the fork() (i.e. the files of the first root of each group)
+ * and the files a child writes are not known to the other children.
+ */
+typedef std::map<std::string, shared_file_t> shared_files_t;
+shared_files_t g_shared_files;
+
+
+/** \brief Generate the key used to find an identical file.
+ *
+ * Hard links share the meta data of the file so the key includes the
+ * mode, owner, and modification time on top of the md5sum and size of
+ * the data.
+ *
+ * \param[in] data  The data of the file.
+ * \param[in] info  The meta data of the file.
+ *
+ * \return The key of the file.
+ */
+std::string share_key(const memfile::memory_file& data, const memfile::memory_file::file_info& info)
+{
+    md5::raw_md5sum raw;
+    data.raw_md5sum(raw);
+    std::stringstream ss;
+    ss << md5::md5sum::sum(raw)
+       << ':' << data.size()
+       << ':' << info.get_mode()
+       << ':' << info.get_user() << '/' << info.get_uid()
+       << ':' << info.get_group() << '/' << info.get_gid()
+       << ':' << info.get_mtime();
+    return ss.str();
+}
+
+
+/** \brief Generate the path of a file in the payload store.
+ *
+ * The objects are saved under "objects/xx/" where xx are the first two
+ * digits of their md5sum so no one directory gets too large.
+ *
+ * Hard linked objects share their meta data with the installed files
+ * so the name of those objects also includes a hash of the meta data
+ * (i.e. the same data installed with two different modes uses two
+ * objects.)
+ *
+ * \param[in] md5sum  The md5sum of the data in hexadecimal.
+ * \param[in] meta  The meta data of the file, empty if it does not matter.
+ *
+ * \return The full path to the object.
+ */
+std::string store_object(const std::string& md5sum, const std::string& meta)
+{
+    std::string name(md5sum);
+    if(!meta.empty() && g_share_mode == extractor::share_mode_hardlink)
+    {
+        md5::md5sum sum;
+        sum.push_back(reinterpret_cast<const uint8_t *>(meta.c_str()), meta.length());
+        name += "." + sum.sum().substr(0, 16);
+    }
+    return g_payload_store.append_child("objects").append_child(md5sum.substr(0, 2)).append_child(name).os_filename().get_utf8();
+}
+
+
+/** \brief Break a path in a directory and a basename.
+ *
+ * \param[in] path  The path to break up.
+ * \param[out] dirname  The directory part of the path.
+ * \param[out] basename  The last segment of the path.
+ */
+void split_path(const std::string& path, std::string& dirname, std::string& basename)
+{
+    const std::string::size_type pos(path.find_last_of('/'));
+    if(pos == std::string::npos)
+    {
+        dirname = ".";
+        basename = path;
+    }
+    else
+    {
+        dirname = pos == 0 ? "/" : path.substr(0, pos);
+        basename = path.substr(pos + 1);
+    }
+}
+
+} // no name namespace
+#endif
+
+
+/** \brief Initialize an extractor object.
+ *
+ * The extractor starts without any directory opened.
+ */
+extractor::extractor()
+#if defined(MO_LINUX)
+    //: f_dir_fds() -- auto-init
+#endif
+{
+}
+
+
+/** \brief Clean up the extractor.
+ *
+ * This function closes all the directories that the extractor opened.
+ */
+extractor::~extractor()
+{
+    close();
+}
+
+
+/** \brief Define how identical files get shared.
+ *
+ * By default (share_mode_none) each file is written. With
+ * share_mode_hardlink or share_mode_reflink, files marked as shareable
+ * in write_file() which data and meta data are identical to a file
+ * this process already wrote get hard linked or cloned to that file.
+ *
+ * Hard linked files share the same inode so modifying one of them in
+ * place modifies all of them. Cloned files do not have that problem but
+ * only some file systems support them (i.e. btrfs, xfs.) When the link
+ * or clone fails, the file gets written as usual.
+ *
+ * This feature is only available under Linux.
+ *
+ * \param[in] mode  The new share mode.
+ */
+void extractor::set_share_mode(share_mode_t mode)
+{
+    g_share_mode = mode;
+}
+
+
+/** \brief Retrieve the current share mode.
+ *
+ * \return The mode defined with set_share_mode().
+ */
+extractor::share_mode_t extractor::get_share_mode()
+{
+    return g_share_mode;
+}
+
+
+/** \brief Define the payload store.
+ *
+ * The payload store is a directory used to share identical files
+ * between runs and between root directories. Each file written by
+ * write_file() with the shareable flag set gets linked (hard link or
+ * clone depending on the share mode) in the store. The next time the
+ * same file is installed, anywhere, it gets linked to that object
+ * instead of being written.
+ *
+ * The data.tar files saved in the database with write_stored_file()
+ * are shared the same way.
+ *
+ * The store must be on the same file system as the roots for hard
+ * links and clones to work. Otherwise the files get written as usual.
+ *
+ * The store is ignored if the share mode is share_mode_none. Use
+ * collect_payload_store() to remove objects that are not used anymore.
+ *
+ * \param[in] store  The path to the store directory, empty to not use a store.
+ */
+void extractor::set_payload_store(const wpkg_filename::uri_filename& store)
+{
+    g_payload_store = store;
+}
+
+
+/** \brief Retrieve the path to the payload store.
+ *
+ * \return The path defined with set_payload_store().
+ */
+const wpkg_filename::uri_filename& extractor::get_payload_store()
+{
+    return g_payload_store;
+}
+
+
+/** \brief Save a file using the payload store.
+ *
+ * This function saves \p data in the \p destination file. If a payload
+ * store is in use, the file is linked to the store object with the same
+ * md5sum if there is one; otherwise the file is written and then added
+ * to the store.
+ *
+ * The destination is always deleted first so a file linked to the store
+ * never gets modified in place.
+ *
+ * This is used for the data.tar files saved in the database.
+ *
+ * \param[in] destination  The name of the file to create.
+ * \param[in] data  The content of the file.
+ */
+void extractor::write_stored_file(const wpkg_filename::uri_filename& destination, const memfile::memory_file& data)
+{
+    destination.os_unlink();
+#if defined(MO_LINUX)
+    if(!g_payload_store.empty() && g_share_mode != share_mode_none)
+    {
+        const std::string path(destination.os_filename().get_utf8());
+        const std::string object(store_object(data.md5sum(), ""));
+        struct stat st;
+        int err(memfile::memory_file::file_info_return_errors);
+        if(stat(object.c_str(), &st) == 0
+        && S_ISREG(st.st_mode)
+        && st.st_size == data.size()
+        && link_file(destination, AT_FDCWD, path, object, NULL, err))
+        {
+            return;
+        }
+        data.write_file(destination);
+        add_to_store(path, object);
+        return;
+    }
+#endif
+    data.write_file(destination);
+}
+
+
+/** \brief Remove the objects that are not used anymore from a store.
+ *
+ * This function goes through the objects of the payload \p store and
+ * deletes the ones that are not hard linked to any other file. It also
+ * deletes temporary files left behind by an interrupted process.
+ *
+ * Files that were cloned (reflink) do not reference the store object
+ * so the objects of a store used with clones all get deleted. This
+ * does not affect the files already installed which keep sharing
+ * their data blocks.
+ *
+ * \param[in] store  The path to the payload store.
+ * \param[out] count  The number of objects deleted.
+ * \param[out] size  The total size of the objects deleted.
+ */
+void extractor::collect_payload_store(const wpkg_filename::uri_filename& store, int64_t& count, int64_t& size)
+{
+    count = 0;
+    size = 0;
+    const wpkg_filename::uri_filename objects(store.append_child("objects"));
+    if(!objects.is_dir())
+    {
+        return;
+    }
+    const time_t now(time(NULL));
+    wpkg_filename::os_dir dir(objects);
+    wpkg_filename::uri_filename sub;
+    while(dir.read(sub))
+    {
+        const std::string sub_name(sub.basename());
+        if(sub_name == "." || sub_name == ".." || !sub.is_dir())
+        {
+            continue;
+        }
+        wpkg_filename::os_dir files(sub);
+        wpkg_filename::uri_filename filename;
+        while(files.read(filename))
+        {
+            wpkg_filename::uri_filename::file_stat s;
+            if(filename.os_stat(s) != 0 || !s.is_reg())
+            {
+                continue;
+            }
+            // temporary files are kept for a while since another
+            // process may still be creating them
+            const bool temporary(filename.basename().find(".tmp-") != std::string::npos);
+            if(temporary ? now - s.get_mtime() > 3600 : s.get_nlink() <= 1)
+            {
+                if(filename.os_unlink())
+                {
+                    ++count;
+                    size += s.get_size();
+                }
+            }
+        }
+    }
+}
+
+
+/** \brief Write one regular file to disk.
+ *
+ * This function writes \p data in the \p destination file and then
+ * assigns the permissions, owner, and times defined in \p info.
+ *
+ * The intermediate directories get created if they do not exist yet.
+ * If the destination already exists and cannot be opened for writing
+ * (i.e. it is read-only) it gets deleted first. If it is hard linked
+ * to other files, it also gets deleted first so the other files are
+ * not modified.
+ *
+ * When \p shareable is true and a share mode is active, the file may
+ * instead be linked to an identical file (see set_share_mode().)
+ *
+ * \exception memfile_exception_io
+ * This exception is raised if the file cannot be created or written,
+ * or when the meta data cannot be applied and \p err does not include
+ * the memory_file::file_info_return_errors flag.
+ *
+ * \param[in] destination  The name of the file to create.
+ * \param[in] data  The content of the file.
+ * \param[in] info  The meta data of the file.
+ * \param[in,out] err  The flags as used by memory_file::info_to_disk_file().
+ * \param[in] shareable  Whether this file can be linked to an identical file.
+ */
+void extractor::write_file(const wpkg_filename::uri_filename& destination, const memfile::memory_file& data, const memfile::memory_file::file_info& info, int& err, bool shareable)
+{
+#if defined(MO_LINUX)
+    std::string dirname;
+    std::string basename;
+    const std::string path(destination.os_filename().get_utf8());
+    split_path(path, dirname, basename);
+
+    const int dfd(dir_fd(dirname));
+
+    std::string key;
+    std::string object;
+    if(shareable && g_share_mode != share_mode_none)
+    {
+        key = share_key(data, info);
+        if(share_file(destination, dfd, basename, key, info, err))
+        {
+            return;
+        }
+        if(!g_payload_store.empty())
+        {
+            // hard linked objects must also have the same modification
+            // time or they were modified in place
+            object = store_object(key.substr(0, 32), key);
+            struct stat st;
+            if(stat(object.c_str(), &st) == 0
+            && S_ISREG(st.st_mode)
+            && st.st_size == data.size()
+            && (g_share_mode != share_mode_hardlink || st.st_mtime == info.get_mtime())
+            && link_file(destination, dfd, basename, object, g_share_mode == share_mode_hardlink ? NULL : &info, err))
+            {
+                return;
+            }
+        }
+    }
+
+    // the file is truncated only once we know it is not hard linked
+    int fd(openat(dfd, basename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666));
+    struct stat st;
+    if(fd != -1 && (fstat(fd, &st) != 0 || st.st_nlink > 1))
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    if(fd == -1)
+    {
+        // files that are read-only cannot be overwritten without
+        // first getting deleted
+        unlinkat(dfd, basename.c_str(), 0);
+        fd = openat(dfd, basename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        if(fd == -1)
+        {
+            throw memfile::memfile_exception_io("opening the output file \"" + destination.original_filename() + "\" failed");
+        }
+    }
+    auto_close guard(fd);
+    if(ftruncate(fd, 0) != 0)
+    {
+        throw memfile::memfile_exception_io("truncating the output file \"" + destination.original_filename() + "\" failed");
+    }
+
+    data.write_fd(fd, destination);
+    memfile::memory_file::info_to_disk_fd(fd, destination, info, err);
+
+    if(!key.empty() && fstat(fd, &st) == 0)
+    {
+        // other identical files can now be linked to this one
+        shared_file_t& shared(g_shared_files[key]);
+        shared.f_path = path;
+        shared.f_size = st.st_size;
+        shared.f_mtime = st.st_mtime;
+    }
+    if(!object.empty())
+    {
+        add_to_store(path, object);
+    }
+#else
+    static_cast<void>(shareable);
+    data.write_file(destination, true, true);
+    memfile::memory_file::info_to_disk_file(destination, info, err);
+#endif
+}
+
+
+/** \brief Create a directory.
+ *
+ * This function creates the \p destination directory, including its
+ * parents, if it does not exist yet, then it assigns the permissions,
+ * owner, and times defined in \p info to it.
+ *
+ * \exception memfile_exception_io
+ * This exception is raised if the directory cannot be created, or when
+ * the meta data cannot be applied and \p err does not include the
+ * memory_file::file_info_return_errors flag.
+ *
+ * \param[in] destination  The name of the directory to create.
+ * \param[in] info  The meta data of the directory.
+ * \param[in,out] err  The flags as used by memory_file::info_to_disk_file().
+ */
+void extractor::make_directory(const wpkg_filename::uri_filename& destination, const memfile::memory_file::file_info& info, int& err)
+{
+#if defined(MO_LINUX)
+    // the directory remains open since files are likely to be
+    // written in it next
+    const int fd(dir_fd(destination.os_filename().get_utf8()));
+    memfile::memory_file::info_to_disk_fd(fd, destination, info, err);
+#else
+    destination.os_mkdir_p();
+    memfile::memory_file::info_to_disk_file(destination, info, err);
+#endif
+}
+
+
+/** \brief Close all the directories.
+ *
+ * This function closes all the directory file descriptors that the
+ * extractor opened. The extractor can still be used after this call.
+ */
+void extractor::close()
+{
+#if defined(MO_LINUX)
+    for(dir_fds_t::const_iterator it(f_dir_fds.begin()); it != f_dir_fds.end(); ++it)
+    {
+        ::close(it->second);
+    }
+    f_dir_fds.clear();
+#endif
+}
+
+
+#if defined(MO_LINUX)
+/** \brief Retrieve a file descriptor to a directory.
+ *
+ * This function returns the file descriptor of the directory named
+ * \p path. If the directory was not opened yet, it gets opened. If it
+ * does not exist, it gets created relative to its parent directory,
+ * which itself is opened or created as required (i.e. mkdir -p.)
+ *
+ * \exception memfile_exception_io
+ * This exception is raised if the directory cannot be opened or
+ * created.
+ *
+ * \param[in] path  The path to the directory.
+ *
+ * \return The file descriptor of the directory.
+ */
+int extractor::dir_fd(const std::string& path)
+{
+    const dir_fds_t::const_iterator it(f_dir_fds.find(path));
+    if(it != f_dir_fds.end())
+    {
+        return it->second;
+    }
+
+    if(f_dir_fds.size() >= EXTRACTOR_MAX_OPEN_DIRECTORIES)
+    {
+        close();
+    }
+
+    int fd(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(fd == -1 && errno == ENOENT)
+    {
+        std::string dirname;
+        std::string basename;
+        split_path(path, dirname, basename);
+        if(basename.empty() || dirname == path)
+        {
+            throw memfile::memfile_exception_io("cannot create directory \"" + path + "\"");
+        }
+        const int parent_fd(dir_fd(dirname));
+        if(mkdirat(parent_fd, basename.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            throw memfile::memfile_exception_io("cannot create directory \"" + path + "\"");
+        }
+        wpkg_filename::os_stat_cache::invalidate(wpkg_filename::uri_filename(path));
+        fd = openat(parent_fd, basename.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if(fd == -1)
+    {
+        throw memfile::memfile_exception_io("cannot open directory \"" + path + "\"");
+    }
+
+    f_dir_fds[path] = fd;
+    return fd;
+}
+
+
+/** \brief Link a file to an identical file written earlier.
+ *
+ * This function searches for a file with the same \p key. If found and
+ * it was not modified since, the destination gets hard linked or cloned
+ * to it depending on the current share mode.
+ *
+ * \param[in] destination  The name of the file to create.
+ * \param[in] dfd  The file descriptor of the destination directory.
+ * \param[in] basename  The name of the file in that directory.
+ * \param[in] key  The key of the file as generated by share_key().
+ * \param[in] info  The meta data of the file.
+ * \param[in,out] err  The flags as used by memory_file::info_to_disk_file().
+ *
+ * \return true if the file was shared, false if it still needs to be written.
+ */
+bool extractor::share_file(const wpkg_filename::uri_filename& destination, int dfd, const std::string& basename, const std::string& key, const memfile::memory_file::file_info& info, int& err)
+{
+    const shared_files_t::const_iterator it(g_shared_files.find(key));
+    if(it == g_shared_files.end())
+    {
+        return false;
+    }
+    struct stat st;
+    if(stat(it->second.f_path.c_str(), &st) != 0
+    || !S_ISREG(st.st_mode)
+    || st.st_size != it->second.f_size
+    || st.st_mtime != it->second.f_mtime)
+    {
+        // the file was modified or deleted
+        return false;
+    }
+
+    return link_file(destination, dfd, basename, it->second.f_path, &info, err);
+}
+
+
+/** \brief Hard link or clone a file.
+ *
+ * This function replaces the destination with a hard link to, or a
+ * clone of, the \p source file depending on the current share mode.
+ *
+ * Hard links share the meta data of the source. Clones get the meta
+ * data defined in \p info, if not NULL.
+ *
+ * \param[in] destination  The name of the file to create.
+ * \param[in] dfd  The file descriptor of the destination directory.
+ * \param[in] basename  The name of the file in that directory.
+ * \param[in] source  The path to the file to link to.
+ * \param[in] info  The meta data of the file or NULL.
+ * \param[in,out] err  The flags as used by memory_file::info_to_disk_file().
+ *
+ * \return true if the file was linked, false if it still needs to be written.
+ */
+bool extractor::link_file(const wpkg_filename::uri_filename& destination, int dfd, const std::string& basename, const std::string& source, const memfile::memory_file::file_info *info, int& err)
+{
+    if(g_share_mode == share_mode_hardlink)
+    {
+        unlinkat(dfd, basename.c_str(), 0);
+        if(linkat(AT_FDCWD, source.c_str(), dfd, basename.c_str(), 0) != 0)
+        {
+            // i.e. the files are on different devices
+            return false;
+        }
+        wpkg_filename::os_stat_cache::invalidate(destination);
+        return true;
+    }
+
+    const int src(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if(src == -1)
+    {
+        return false;
+    }
+    auto_close src_guard(src);
+    unlinkat(dfd, basename.c_str(), 0);
+    const int fd(openat(dfd, basename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if(fd == -1)
+    {
+        return false;
+    }
+    auto_close guard(fd);
+    wpkg_filename::os_stat_cache::invalidate(destination);
+    if(ioctl(fd, FICLONE, src) != 0)
+    {
+        // the file system does not support clones
+        return false;
+    }
+    if(info != NULL)
+    {
+        memfile::memory_file::info_to_disk_fd(fd, destination, *info, err);
+    }
+    return true;
+}
+
+
+/** \brief Add a file to the payload store.
+ *
+ * This function links the file at \p path as the store \p object. With
+ * clones, the object is first created under a temporary name and then
+ * renamed so other processes never see a partial object.
+ *
+ * Errors are ignored, the file simply does not get shared.
+ *
+ * \param[in] path  The path to the file that was just written.
+ * \param[in] object  The path of the object in the store.
+ */
+void extractor::add_to_store(const std::string& path, const std::string& object)
+{
+    std::string dirname;
+    std::string basename;
+    split_path(object, dirname, basename);
+    if(mkdir(dirname.c_str(), 0755) != 0 && errno == ENOENT)
+    {
+        try
+        {
+            wpkg_filename::uri_filename(dirname).os_mkdir_p();
+        }
+        catch(const wpkg_filename::wpkg_filename_exception&)
+        {
+            return;
+        }
+    }
+
+    if(g_share_mode == share_mode_hardlink)
+    {
+        // EEXIST means another process added the same object
+        link(path.c_str(), object.c_str());
+        return;
+    }
+
+    const int src(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(src == -1)
+    {
+        return;
+    }
+    auto_close src_guard(src);
+    std::stringstream tmp;
+    tmp << object << ".tmp-" << getpid();
+    const int fd(open(tmp.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444));
+    if(fd == -1)
+    {
+        return;
+    }
+    {
+        auto_close guard(fd);
+        if(ioctl(fd, FICLONE, src) == 0
+        && rename(tmp.str().c_str(), object.c_str()) == 0)
+        {
+            return;
+        }
+    }
+    unlink(tmp.str().c_str());
+}
+#endif
+
+} // wpkg_extract namespace
+// vim: ts=4 sw=4 et
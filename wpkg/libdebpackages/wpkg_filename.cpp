@@ -53,6 +53,7 @@
 #include    "libdebpackages/case_insensitive_string.h"
 #include    "libdebpackages/compatibility.h"
 #include    <algorithm>
+#include    <mutex>
 #include    <sstream>
 #include    <errno.h>
 #include    <time.h>
@@ -67,6 +68,11 @@
 #else
 #   include <dirent.h>
 #endif
+#if defined(MO_LINUX)
+#   include <fcntl.h>
+#   include <atomic>
+#   include <thread>
+#endif
 #if defined(MO_CYGWIN)
 #   include <netdb.h>
 #endif
@@ -2195,7 +2201,8 @@ bool uri_filename::empty() const
  * This function makes use of the os_stat() function to determine whether
  * the file exists and that function caches the result of the stat() call.
  * This means if it returned true once, it will continue to return true
- * even if the file gets deleted afterward.
+ * even if the file gets deleted afterward. While an os_stat_cache object
+ * exists, a false result is cached too, across all uri_filename objects.
  *
  * \return true if the file exists, false otherwise.
  */
@@ -3160,6 +3167,62 @@ uri_filename uri_filename::os_real_path() const
     return result;
 }
 
+#if !defined(MO_WINDOWS) && !defined(MO_CYGWIN)
+namespace
+{
+
+#if defined(MO_FREEBSD) || defined(__aarch64__)
+// stat is 64 bits by itself
+typedef struct stat     unix_stat_t;
+#else
+typedef struct stat64   unix_stat_t;
+#endif
+
+/** \brief Copy the result of a Unix stat() call in a file_stat.
+ *
+ * \param[in] st  The stat() results.
+ * \param[out] s  The file_stat object to set up.
+ */
+void unix_stat_to_file_stat(const unix_stat_t& st, uri_filename::file_stat& s)
+{
+    s.set_dev(st.st_dev);
+    s.set_inode(st.st_ino);
+    s.set_mode(st.st_mode);
+    s.set_nlink(st.st_nlink);
+    s.set_uid(st.st_uid);
+    s.set_gid(st.st_gid);
+    s.set_rdev(st.st_rdev);
+    s.set_size(st.st_size);
+//#if defined(__USE_MISC) || defined(__USE_XOPEN2K8)
+//    s.set_atime(st.st_atime, st.st_atimensec);
+//    s.set_mtime(st.st_mtime, st.st_mtimensec);
+//    s.set_ctime(st.st_ctime, st.st_ctimensec);
+//#elif defined(_BSD_SOURCE) 
+//   || defined(_SVID_SOURCE) 
+//   || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L) 
+//   || (defined(_XOPEN_SOURCE) && _XOPEN_SOURCE >= 700)
+//    s.set_atime(st.st_atime, st_atim.tv_nsec);
+//    s.set_mtime(st.st_mtime, st_mtim.tv_nsec);
+//    s.set_ctime(st.st_ctime, st_ctim.tv_nsec);
+//#else
+//    // no known nano seconds
+#if defined(MO_LINUX)
+    s.set_atime(st.st_atime, st.st_atim.tv_nsec);
+    s.set_mtime(st.st_mtime, st.st_mtim.tv_nsec);
+    s.set_ctime(st.st_ctime, st.st_ctim.tv_nsec);
+#else
+    s.set_atime(st.st_atime, 0);
+    s.set_mtime(st.st_mtime, 0);
+    s.set_ctime(st.st_ctime, 0);
+#endif
+//#endif
+    s.set_valid();
+}
+
+} // no name namespace
+#endif
+
+
 /** \brief stat() a file.
  *
  * This function runs a stat() that works whatever the filename. It
@@ -3179,6 +3242,10 @@ uri_filename uri_filename::os_real_path() const
  * it successfully returns a copy of the stat() from the first successful
  * call.
  *
+ * When an os_stat_cache object exists, the result, including the fact
+ * that the file does not exist (errno set to ENOENT), is also saved in
+ * a cache shared by all the uri_filename objects.
+ *
  * \param[out] s  The stat() call results, unchanged if the function returns -1.
  *
  * \return 0 if the call succeeds, -1 on error (i.e. the same as the stat(2) call)
@@ -3195,6 +3262,16 @@ int uri_filename::os_stat(file_stat& s) const
 
         f_stat.reset();
         os_filename_t cname(os_filename());
+        if(os_stat_cache::find(cname.get_utf8(), f_stat))
+        {
+            if(!f_stat.is_valid())
+            {
+                errno = ENOENT;
+                return -1;
+            }
+            s = f_stat;
+            return 0;
+        }
 //::stat(cname.c_str(), &f_stat);
 //::fprintf(stderr, "really stating [%s] from [%s] %d (%d/%d)\n", cname.c_str(), f_original.c_str(), (f_stat.st_mode & S_IFMT), S_IFDIR, S_IFREG);
 #if defined(MO_WINDOWS) || defined(MO_CYGWIN)
@@ -3278,48 +3355,30 @@ int uri_filename::os_stat(file_stat& s) const
             }
         }
 #else
+        unix_stat_t st;
 #if defined(MO_FREEBSD) || defined(__aarch64__)
         // stat is 64 bits by itself
-        struct stat st;
         int r(::stat(cname.get_utf8().c_str(), &st));
 #else
-        struct stat64 st;
         int r(::stat64(cname.get_utf8().c_str(), &st));
 #endif
         if(r == 0)
         {
-            f_stat.set_dev(st.st_dev);
-            f_stat.set_inode(st.st_ino);
-            f_stat.set_mode(st.st_mode);
-            f_stat.set_nlink(st.st_nlink);
-            f_stat.set_uid(st.st_uid);
-            f_stat.set_gid(st.st_gid);
-            f_stat.set_rdev(st.st_rdev);
-            f_stat.set_size(st.st_size);
-//#if defined(__USE_MISC) || defined(__USE_XOPEN2K8)
-//            f_stat.set_atime(st.st_atime, st.st_atimensec);
-//            f_stat.set_mtime(st.st_mtime, st.st_mtimensec);
-//            f_stat.set_ctime(st.st_ctime, st.st_ctimensec);
-//#elif defined(_BSD_SOURCE) 
-//   || defined(_SVID_SOURCE) 
-//   || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L) 
-//   || (defined(_XOPEN_SOURCE) && _XOPEN_SOURCE >= 700)
-//            f_stat.set_atime(st.st_atime, st_atim.tv_nsec);
-//            f_stat.set_mtime(st.st_mtime, st_mtim.tv_nsec);
-//            f_stat.set_ctime(st.st_ctime, st_ctim.tv_nsec);
-//#else
-//            // no known nano seconds
-            f_stat.set_atime(st.st_atime, 0);
-            f_stat.set_mtime(st.st_mtime, 0);
-            f_stat.set_ctime(st.st_ctime, 0);
-//#endif
-            f_stat.set_valid();
+            unix_stat_to_file_stat(st, f_stat);
         }
 #endif
         if(!f_stat.is_valid())
         {
+            if(errno == ENOENT)
+            {
+                // remember that this file does not exist
+                const int e(errno);
+                os_stat_cache::save(cname.get_utf8(), f_stat);
+                errno = e;
+            }
             return -1;
         }
+        os_stat_cache::save(cname.get_utf8(), f_stat);
     }
     s = f_stat;
     return 0;
@@ -3448,6 +3507,7 @@ void uri_filename::os_mkdir_p(int mode) const
                 {
                     throw wpkg_filename_exception_io("could not create directory \"" + path.f_path + "\" (" + p.get_utf8() + ")");
                 }
+                os_stat_cache::invalidate(path);
             }
             else
             {
@@ -3530,6 +3590,7 @@ bool uri_filename::os_unlink() const
 
     // clear the cache since we know that the source file is now gone
     const_cast<uri_filename *>(this)->clear_cache();
+    os_stat_cache::invalidate(*this);
 
     return result;
 }
@@ -3679,6 +3740,7 @@ bool uri_filename::os_unlink_rf(bool dryrun) const
 
     // clear the cache since we know that the source file is now gone
     const_cast<uri_filename *>(this)->clear_cache();
+    os_stat_cache::invalidate(*this, true);
 
     return result;
 }
@@ -3706,6 +3768,7 @@ void uri_filename::os_symlink(const uri_filename& destination) const
             throw memfile::memfile_exception_io("I/O error creating soft-link \"" + f_original + " -> " + destination.f_original + "\"");
         }
     }
+    os_stat_cache::invalidate(destination);
 }
 
 /** \brief Rename a file.
@@ -3748,6 +3811,8 @@ bool uri_filename::os_rename(const uri_filename& destination, bool ignore_errors
 
     // clear the cache since we know that the source file is now gone
     const_cast<uri_filename *>(this)->clear_cache();
+    os_stat_cache::invalidate(*this, true);
+    os_stat_cache::invalidate(destination, true);
 
     return true;
 }
@@ -4143,6 +4208,23 @@ void temporary_uri_filename::set_tmpdir(const std::string& tmpdir)
 }
 
 
+/** \brief Forget about the current temporary directory.
+ *
+ * A child process created with fork() inherits the temporary directory
+ * of its parent. Since both processes would then write the same files
+ * in that directory and the first one to exit would delete it, the
+ * child calls this function right after the fork(). The next call to
+ * tmpdir() then creates a new temporary directory for the child.
+ *
+ * The temporary directory of the parent is not deleted.
+ */
+void temporary_uri_filename::detach_tmpdir()
+{
+    // the assignment from a uri_filename does not delete anything
+    g_tmpdir = uri_filename();
+}
+
+
 /** \brief Set whether temporary files should be deleted or not.
  *
  * This function changes the flag used to know whether temporary files
@@ -4518,5 +4600,362 @@ void uri_filename::file_stat::set_ctime(double unix_time)
 
 
 
+/** \class os_stat_cache
+ * \brief Cache the stat() of files for the duration of a transaction.
+ *
+ * While installing packages, the same paths get checked over and over
+ * again (the validation, the backup, and the extraction of each file
+ * check whether the file and its parent directories exist.) When an
+ * os_stat_cache object exists, the results of the os_stat() calls,
+ * including failures because the file does not exist, are saved in a
+ * cache shared by all the uri_filename objects. Further calls for the
+ * same path are then answered from memory.
+ *
+ * The functions modifying the file system (os_mkdir_p(), os_unlink(),
+ * os_rename(), etc.) invalidate the corresponding entries. Code writing
+ * to the file system by other means must call invalidate() or clear().
+ *
+ * The cache is active as long as at least one os_stat_cache object
+ * exists and it gets cleared when the last one is destroyed.
+ *
+ * All the accesses to the cache are protected by a mutex so it can be
+ * used by several threads. Note, however, that a stat() and the save()
+ * of its result are not atomic: a thread modifying a file that another
+ * thread is checking at the same time must call invalidate() after the
+ * modification, as usual, and the other thread may still see the old
+ * status. Threads working on the same files must synchronize between
+ * themselves.
+ */
+
+
+namespace
+{
+
+/** \brief The cached stat() results.
+ *
+ * The map is indexed by the operating system filename. An entry with
+ * an invalid file_stat represents a file that does not exist.
+ *
+ * A sorted map is used so a directory and all of its children can be
+ * invalidated at once.
+ */
+typedef std::map<std::string, uri_filename::file_stat> os_stat_cache_map_t;
+os_stat_cache_map_t g_os_stat_cache;
+
+/** \brief The number of os_stat_cache objects currently defined.
+ *
+ * The cache is only used when this counter is positive.
+ */
+int32_t g_os_stat_cache_count(0);
+
+/** \brief The mutex protecting the cache and its counter.
+ *
+ * The stat() calls themselves are done without holding the mutex.
+ */
+std::mutex g_os_stat_cache_mutex;
+
+} // no name namespace
+
+
+/** \brief Activate the stat() cache.
+ *
+ * Objects of this class can be nested. The cache remains active until
+ * the last object gets destroyed.
+ */
+os_stat_cache::os_stat_cache()
+{
+    std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+    ++g_os_stat_cache_count;
+}
+
+
+/** \brief Deactivate the stat() cache.
+ *
+ * When the last os_stat_cache object gets destroyed, the cache is
+ * cleared so the next transaction starts fresh.
+ */
+os_stat_cache::~os_stat_cache()
+{
+    std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+    --g_os_stat_cache_count;
+    if(g_os_stat_cache_count == 0)
+    {
+        g_os_stat_cache.clear();
+    }
+}
+
+
+/** \brief Check whether the cache is currently active.
+ *
+ * \return true if at least one os_stat_cache object exists.
+ */
+bool os_stat_cache::is_active()
+{
+    std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+    return g_os_stat_cache_count > 0;
+}
+
+
+/** \brief Search the cache for a file.
+ *
+ * If the cache is active and \p os_path was stat()'ed before, this
+ * function copies the result in \p s and returns true. Note that \p s
+ * is then invalid if the file did not exist.
+ *
+ * \param[in] os_path  The operating system filename.
+ * \param[out] s  The cached stat() results.
+ *
+ * \return true if the file was found in the cache.
+ */
+bool os_stat_cache::find(const std::string& os_path, uri_filename::file_stat& s)
+{
+    std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+    if(g_os_stat_cache_count <= 0)
+    {
+        return false;
+    }
+    os_stat_cache_map_t::const_iterator it(g_os_stat_cache.find(os_path));
+    if(it == g_os_stat_cache.end())
+    {
+        return false;
+    }
+    s = it->second;
+    return true;
+}
+
+
+/** \brief Save the result of a stat() call.
+ *
+ * This function saves \p s in the cache if the cache is active. Pass
+ * an invalid file_stat to memorize the fact that the file does not
+ * exist.
+ *
+ * \param[in] os_path  The operating system filename.
+ * \param[in] s  The stat() results to memorize.
+ */
+void os_stat_cache::save(const std::string& os_path, const uri_filename::file_stat& s)
+{
+    std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+    if(g_os_stat_cache_count > 0)
+    {
+        g_os_stat_cache[os_path] = s;
+    }
+}
+
+
+/** \brief Forget about a file.
+ *
+ * This function must be called each time a file gets created, modified,
+ * or deleted while the cache is active. The next os_stat() of that file
+ * calls stat() again.
+ *
+ * \param[in] filename  The file that was modified.
+ * \param[in] recursive  Also forget about all the files under \p filename
+ *                       (i.e. a directory was renamed or deleted.)
+ */
+void os_stat_cache::invalidate(const uri_filename& filename, bool recursive)
+{
+    const std::string os_path(filename.os_filename().get_utf8());
+    std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+    if(g_os_stat_cache_count <= 0 || g_os_stat_cache.empty())
+    {
+        return;
+    }
+    os_stat_cache_map_t::iterator it(g_os_stat_cache.lower_bound(os_path));
+    if(it != g_os_stat_cache.end() && it->first == os_path)
+    {
+        it = g_os_stat_cache.erase(it);
+    }
+    if(recursive)
+    {
+        while(it != g_os_stat_cache.end()
+           && it->first.length() > os_path.length()
+           && it->first.compare(0, os_path.length(), os_path) == 0)
+        {
+            const char sep(it->first[os_path.length()]);
+            if(sep == '/' || sep == '\\')
+            {
+                it = g_os_stat_cache.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+}
+
+
+/** \brief Forget about all the files.
+ *
+ * This function is used when the file system may have been modified
+ * by means the cache does not know about (i.e. a maintainer script.)
+ */
+void os_stat_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+    g_os_stat_cache.clear();
+}
+
+
+/** \brief stat() many files at once.
+ *
+ * This function retrieves the stat() of all the specified files and
+ * saves the results in the cache so the following os_stat() calls on
+ * those files do not hit the disk. Files that are already cached are
+ * ignored. Nothing happens if the cache is not active.
+ *
+ * Under Linux the files are sorted and grouped by directory. Each
+ * directory gets opened once and its files are queried with fstatat()
+ * so the kernel does not resolve the full path of each file. When a
+ * directory does not exist, none of its files are stat()'ed at all.
+ * The groups are distributed between several threads since on a
+ * network file system with cold caches each stat() is a round trip
+ * to the server.
+ *
+ * On other platforms the function does nothing and os_stat() works
+ * as usual.
+ *
+ * \param[in] filenames  The list of files to stat().
+ */
+void os_stat_cache::prefetch(const std::vector<uri_filename>& filenames)
+{
+#if defined(MO_LINUX)
+    if(!is_active())
+    {
+        return;
+    }
+
+    // the list of files not yet cached, sorted so files of the same
+    // directory are next to each other
+    std::vector<std::string> paths;
+    paths.reserve(filenames.size());
+    for(std::vector<uri_filename>::const_iterator it(filenames.begin()); it != filenames.end(); ++it)
+    {
+        if(it->is_direct())
+        {
+            std::string os_path(it->os_filename().get_utf8());
+            paths.push_back(os_path);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+        paths.erase(std::remove_if(paths.begin(), paths.end(),
+                [](const std::string& os_path)
+                {
+                    return g_os_stat_cache.find(os_path) != g_os_stat_cache.end();
+                }), paths.end());
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+    if(paths.empty())
+    {
+        return;
+    }
+
+    struct group_t
+    {
+        std::string                     f_dirname;
+        std::vector<std::string>::size_type f_start;
+        std::vector<std::string>::size_type f_end;
+    };
+    std::vector<group_t> groups;
+    std::vector<std::string::size_type> basenames(paths.size());
+    for(std::vector<std::string>::size_type i(0); i < paths.size(); ++i)
+    {
+        const std::string::size_type pos(paths[i].find_last_of('/'));
+        const std::string dirname(pos == std::string::npos ? "." : (pos == 0 ? "/" : paths[i].substr(0, pos)));
+        basenames[i] = pos == std::string::npos ? 0 : pos + 1;
+        if(groups.empty() || groups.back().f_dirname != dirname)
+        {
+            group_t g;
+            g.f_dirname = dirname;
+            g.f_start = i;
+            g.f_end = i;
+            groups.push_back(g);
+        }
+        ++groups.back().f_end;
+    }
+
+    // result of each fstatat(): 0 -- found, ENOENT -- not found,
+    // other errors are not cached
+    std::vector<unix_stat_t> stats(paths.size());
+    std::vector<int> errors(paths.size(), EINVAL);
+    std::atomic<size_t> next_group(0);
+    auto worker = [&]()
+    {
+        for(;;)
+        {
+            const size_t g(next_group++);
+            if(g >= groups.size())
+            {
+                return;
+            }
+            const group_t& group(groups[g]);
+            const int dfd(open(group.f_dirname.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+            if(dfd == -1)
+            {
+                if(errno == ENOENT)
+                {
+                    // the whole directory is missing
+                    for(size_t i(group.f_start); i < group.f_end; ++i)
+                    {
+                        errors[i] = ENOENT;
+                    }
+                }
+                continue;
+            }
+            for(size_t i(group.f_start); i < group.f_end; ++i)
+            {
+#if defined(MO_FREEBSD) || defined(__aarch64__)
+                const int r(fstatat(dfd, paths[i].c_str() + basenames[i], &stats[i], 0));
+#else
+                const int r(fstatat64(dfd, paths[i].c_str() + basenames[i], &stats[i], 0));
+#endif
+                errors[i] = r == 0 ? 0 : errno;
+            }
+            close(dfd);
+        }
+    };
+
+    // the threads are only worth it with many directories
+    size_t thread_count(std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1U), 8));
+    thread_count = std::min<size_t>(thread_count, groups.size() / 16 + 1);
+    std::vector<std::thread> threads;
+    for(size_t t(1); t < thread_count; ++t)
+    {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for(std::vector<std::thread>::iterator t(threads.begin()); t != threads.end(); ++t)
+    {
+        t->join();
+    }
+
+    std::lock_guard<std::mutex> lock(g_os_stat_cache_mutex);
+    if(g_os_stat_cache_count <= 0)
+    {
+        return;
+    }
+    for(std::vector<std::string>::size_type i(0); i < paths.size(); ++i)
+    {
+        uri_filename::file_stat s;
+        if(errors[i] == 0)
+        {
+            unix_stat_to_file_stat(stats[i], s);
+            g_os_stat_cache[paths[i]] = s;
+        }
+        else if(errors[i] == ENOENT)
+        {
+            g_os_stat_cache[paths[i]] = s;
+        }
+    }
+#else
+    static_cast<void>(filenames);
+#endif
+}
+
+
+
 } // namespace filename
 // vim: ts=4 sw=4 et
@@ -0,0 +1,1979 @@
+/*    wpkg_http.cpp -- implementation of the HTTP/1.1 client
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief Implementation of the HTTP/1.1 client and server.
+ *
+ * The memory_file::read_file() function uses this client to download
+ * files. The client keeps the connections to each server alive so
+ * downloading many small files (control files, packages) from the
+ * same repository does not require a new TCP connection each time.
+ *
+ * The server is used by wpkg --serve-repository to share a repository
+ * directory with such clients.
+ */
+#include    "libdebpackages/wpkg_http.h"
+#include    "libdebpackages/wpkg_stream.h"
+#include    "libdebpackages/compatibility.h"
+#include    <algorithm>
+#include    <mutex>
+#include    <sstream>
+#include    <thread>
+#include    <ctype.h>
+#include    <errno.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <time.h>
+#if defined(MO_WINDOWS)
+#   include    <winsock2.h>
+#else
+#   include    <sys/socket.h>
+#   include    <sys/time.h>
+#   include    <unistd.h>
+#endif
+#if defined(MO_LINUX)
+#   include    <fcntl.h>
+#   include    <sys/sendfile.h>
+#endif
+
+
+namespace wpkg_http
+{
+
+namespace
+{
+
+/** \brief Size of the connection input buffer.
+ *
+ * The replies are read in blocks of that size and the header lines
+ * are then extracted from the buffer.
+ */
+const size_t BUFFER_SIZE = 64 * 1024;
+
+/** \brief Maximum length of a header line.
+ *
+ * A server sending longer lines is considered broken.
+ */
+const size_t MAX_LINE_LENGTH = 64 * 1024;
+
+
+/** \brief Convert a field name to lowercase.
+ *
+ * The field names are case insensitive. They are saved in lowercase
+ * in the response so they can be searched in a map.
+ *
+ * \param[in] name  The name to convert.
+ *
+ * \return The name in lowercase.
+ */
+std::string lowercase(const std::string& name)
+{
+    std::string result(name);
+    for(std::string::iterator it(result.begin()); it != result.end(); ++it)
+    {
+        if(*it >= 'A' && *it <= 'Z')
+        {
+            *it = static_cast<char>(*it | 0x20);
+        }
+    }
+    return result;
+}
+
+
+/** \brief Remove the spaces around a string.
+ *
+ * \param[in] s  The string to trim.
+ *
+ * \return The string without leading and trailing spaces and tabs.
+ */
+std::string trim(const std::string& s)
+{
+    const std::string::size_type start(s.find_first_not_of(" \t"));
+    if(start == std::string::npos)
+    {
+        return "";
+    }
+    const std::string::size_type end(s.find_last_not_of(" \t"));
+    return s.substr(start, end - start + 1);
+}
+
+
+/** \brief Check whether a comma separated field includes a token.
+ *
+ * This is used to check the Connection and Transfer-Encoding fields.
+ *
+ * \param[in] value  The value of the field.
+ * \param[in] token  The token to search, in lowercase.
+ *
+ * \return true if the token is part of the value.
+ */
+bool has_token(const std::string& value, const std::string& token)
+{
+    const std::string v(lowercase(value));
+    std::string::size_type p(0);
+    for(;;)
+    {
+        const std::string::size_type q(v.find(',', p));
+        if(trim(v.substr(p, q == std::string::npos ? std::string::npos : q - p)) == token)
+        {
+            return true;
+        }
+        if(q == std::string::npos)
+        {
+            return false;
+        }
+        p = q + 1;
+    }
+}
+
+
+/** \brief The pool of idle connections.
+ *
+ * The connections are saved per server ("host:port"). A connection is
+ * only used by one thread at a time: it is removed from the pool while
+ * in use and added back once the reply was read.
+ */
+typedef std::map<std::string, std::vector<std::shared_ptr<connection> > > connection_pool_t;
+connection_pool_t       g_pool;
+std::mutex              g_pool_mutex;
+
+
+/** \brief Generate the key of a server in the pool.
+ *
+ * \param[in] host  The name of the server.
+ * \param[in] port  The port of the server.
+ *
+ * \return The key used in g_pool.
+ */
+std::string pool_key(const std::string& host, int port)
+{
+    std::stringstream key;
+    key << host << ":" << port;
+    return key.str();
+}
+
+
+/** \brief Maximum number of pending connections.
+ *
+ * The server listens with that backlog so many clients connecting at
+ * once (i.e. test agents starting an update) do not get refused.
+ */
+const int LISTEN_BACKLOG = 256;
+
+/** \brief Number of seconds before a stalled client gets dropped.
+ *
+ * Sending a reply times out after that many seconds so a client which
+ * stops reading cannot block a server thread forever.
+ */
+const int SEND_TIMEOUT_SECONDS = 60;
+
+/** \brief Maximum number of bytes sent with one sendfile() call.
+ */
+const int64_t SENDFILE_BLOCK_SIZE = 1024 * 1024;
+
+/** \brief Names used to format HTTP dates.
+ *
+ * The strftime() function cannot be used since the %a and %b formats
+ * depend on the locale.
+ */
+const char * const g_day_names[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+const char * const g_month_names[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+
+/** \brief Format a date as defined by HTTP.
+ *
+ * \param[in] t  The time to format.
+ *
+ * \return The date such as "Sun, 06 Nov 1994 08:49:37 GMT".
+ */
+std::string http_date(time_t t)
+{
+    struct tm tm;
+#if defined(MO_WINDOWS)
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+            g_day_names[tm.tm_wday], tm.tm_mday, g_month_names[tm.tm_mon],
+            tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    buf[sizeof(buf) / sizeof(buf[0]) - 1] = '\0';
+    return buf;
+}
+
+
+/** \brief Parse a date as defined by HTTP.
+ *
+ * Only the fixed format generated by http_date() is supported. This
+ * is the format clients are expected to send back in the
+ * If-Modified-Since field.
+ *
+ * \param[in] date  The date to parse.
+ * \param[out] t  The resulting time.
+ *
+ * \return true if the date was valid.
+ */
+bool parse_http_date(const std::string& date, time_t& t)
+{
+    char day[4], month[4];
+    int mday(0), year(0), hour(0), min(0), sec(0);
+    if(sscanf(date.c_str(), "%3s, %d %3s %d %d:%d:%d GMT", day, &mday, month, &year, &hour, &min, &sec) != 7)
+    {
+        return false;
+    }
+    int mon(-1);
+    for(int i(0); i < 12; ++i)
+    {
+        if(strcmp(month, g_month_names[i]) == 0)
+        {
+            mon = i;
+            break;
+        }
+    }
+    if(mon < 0 || mday < 1 || mday > 31 || year < 1970
+    || hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+    {
+        return false;
+    }
+
+    // number of days since 1970-01-01 (timegm() is not portable)
+    const int y(year - (mon < 2 ? 1 : 0));
+    const int era(y / 400);
+    const int yoe(y - era * 400);
+    const int doy((153 * (mon < 2 ? mon + 10 : mon - 2) + 2) / 5 + mday - 1);
+    const int doe(yoe * 365 + yoe / 4 - yoe / 100 + doy);
+    const int64_t days(static_cast<int64_t>(era) * 146097 + doe - 719468);
+    t = static_cast<time_t>(days * 86400 + hour * 3600 + min * 60 + sec);
+    return true;
+}
+
+
+/** \brief Parse a positive decimal number.
+ *
+ * \param[in] s  The string to parse.
+ * \param[out] value  The resulting number.
+ *
+ * \return true if the string is only composed of digits.
+ */
+bool parse_number(const std::string& s, int64_t& value)
+{
+    if(s.empty() || s.length() > 18)
+    {
+        return false;
+    }
+    value = 0;
+    for(std::string::const_iterator it(s.begin()); it != s.end(); ++it)
+    {
+        if(*it < '0' || *it > '9')
+        {
+            return false;
+        }
+        value = value * 10 + (*it - '0');
+    }
+    return true;
+}
+
+
+/** \brief Decode the path of a request.
+ *
+ * The %XX sequences are replaced by the corresponding bytes and the
+ * "." and empty segments are removed (wpkg clients request files such
+ * as "/repository/./index.tar.gz".) The path is refused if it includes
+ * a NUL character, a backslash, or a ".." segment so a client cannot
+ * access files outside of the directory being served.
+ *
+ * \param[in] path  The path as found in the request line.
+ * \param[out] result  The decoded path.
+ *
+ * \return true if the path is valid.
+ */
+bool decode_path(const std::string& path, std::string& result)
+{
+    result.clear();
+    for(std::string::size_type i(0); i < path.length(); ++i)
+    {
+        char c(path[i]);
+        if(c == '%')
+        {
+            if(i + 2 >= path.length() || !isxdigit(static_cast<unsigned char>(path[i + 1])) || !isxdigit(static_cast<unsigned char>(path[i + 2])))
+            {
+                return false;
+            }
+            c = static_cast<char>(strtol(path.substr(i + 1, 2).c_str(), NULL, 16));
+            i += 2;
+        }
+        if(c == '\0' || c == '\\')
+        {
+            return false;
+        }
+#if defined(MO_WINDOWS)
+        if(c == ':')
+        {
+            return false;
+        }
+#endif
+        result += c;
+    }
+    if(result.empty() || result[0] != '/')
+    {
+        return false;
+    }
+
+    // remove the "." and empty segments
+    std::string normalized;
+    std::string::size_type p(1);
+    for(;;)
+    {
+        const std::string::size_type q(result.find('/', p));
+        const std::string segment(result.substr(p, q == std::string::npos ? std::string::npos : q - p));
+        if(segment == "..")
+        {
+            return false;
+        }
+        if(!segment.empty() && segment != ".")
+        {
+            normalized += "/" + segment;
+        }
+        if(q == std::string::npos)
+        {
+            break;
+        }
+        p = q + 1;
+    }
+    result = normalized.empty() ? "/" : normalized;
+    return true;
+}
+
+
+/** \brief Send a buffer to a client.
+ *
+ * \param[in] s  The socket of the client.
+ * \param[in] data  The data to send.
+ * \param[in] size  The number of bytes to send.
+ * \param[in] more  Whether more data (the body) follows right away.
+ *
+ * \return false if the data could not be sent.
+ */
+bool send_all(tcp_client_server::socket_t s, const char *data, size_t size, bool more)
+{
+    int flags(0);
+#if defined(MSG_NOSIGNAL)
+    flags |= MSG_NOSIGNAL;
+#endif
+#if defined(MSG_MORE)
+    if(more)
+    {
+        // let the header go out in the same packet as the file data
+        flags |= MSG_MORE;
+    }
+#else
+    static_cast<void>(more);
+#endif
+    while(size > 0)
+    {
+        const int sz(static_cast<int>(::send(s, data, static_cast<int>(size), flags)));
+        if(sz <= 0)
+        {
+            if(sz < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += sz;
+        size -= sz;
+    }
+    return true;
+}
+
+
+/** \brief Send part of a file to a client.
+ *
+ * On Linux the data is sent with sendfile() so it goes from the file
+ * cache to the socket without being copied in our buffers. Other systems
+ * read the file in a buffer and send that buffer.
+ *
+ * \param[in] s  The socket of the client.
+ * \param[in] filename  The name of the file to send.
+ * \param[in] offset  The position of the first byte to send.
+ * \param[in] length  The number of bytes to send.
+ *
+ * \return false if the file could not be read or the data not sent.
+ */
+bool send_file(tcp_client_server::socket_t s, const wpkg_filename::uri_filename& filename, int64_t offset, int64_t length)
+{
+#if defined(MO_LINUX)
+    const int fd(::open(filename.os_filename().get_utf8().c_str(), O_RDONLY));
+    if(fd < 0)
+    {
+        return false;
+    }
+    off_t pos(static_cast<off_t>(offset));
+    while(length > 0)
+    {
+        const ssize_t sz(sendfile(s, fd, &pos, static_cast<size_t>(std::min(length, SENDFILE_BLOCK_SIZE))));
+        if(sz <= 0)
+        {
+            if(sz < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            // I/O error or the file got truncated
+            close(fd);
+            return false;
+        }
+        length -= sz;
+    }
+    close(fd);
+    return true;
+#else
+    wpkg_stream::fstream file;
+    if(!file.open(filename))
+    {
+        return false;
+    }
+    file.seek(offset, wpkg_stream::fstream::beg);
+    std::vector<char> buffer(BUFFER_SIZE);
+    while(length > 0)
+    {
+        const int64_t sz(file.read(&buffer[0], std::min(length, static_cast<int64_t>(BUFFER_SIZE))));
+        if(sz <= 0 || !send_all(s, &buffer[0], static_cast<size_t>(sz), false))
+        {
+            return false;
+        }
+        length -= sz;
+    }
+    return true;
+#endif
+}
+
+
+/** \brief Set the receive and send timeouts of a socket.
+ *
+ * \param[in] s  The socket to change.
+ * \param[in] receive_seconds  The receive timeout in seconds.
+ * \param[in] send_seconds  The send timeout in seconds.
+ */
+void set_timeouts(tcp_client_server::socket_t s, int receive_seconds, int send_seconds)
+{
+#if defined(MO_WINDOWS)
+    DWORD receive_timeout(receive_seconds * 1000);
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&receive_timeout), sizeof(receive_timeout));
+    DWORD send_timeout(send_seconds * 1000);
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char *>(&send_timeout), sizeof(send_timeout));
+#else
+    struct timeval receive_timeout;
+    receive_timeout.tv_sec = receive_seconds;
+    receive_timeout.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+    struct timeval send_timeout;
+    send_timeout.tv_sec = send_seconds;
+    send_timeout.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+#endif
+}
+
+
+/** \brief Close a client socket gracefully.
+ *
+ * Requests the client pipelined but we did not answer may still be in
+ * the input buffer. Closing the socket right away would make the system
+ * reset the connection and the client could lose the replies we already
+ * sent. So the writing side gets closed first and the input is drained.
+ *
+ * \param[in] s  The socket to close.
+ */
+void lingering_close(tcp_client_server::socket_t s)
+{
+#if defined(MO_WINDOWS)
+    shutdown(s, SD_SEND);
+#else
+    shutdown(s, SHUT_WR);
+#endif
+    set_timeouts(s, 1, 1);
+    char buf[1024];
+    while(::recv(s, buf, sizeof(buf), 0) > 0)
+    {
+    }
+#if defined(MO_WINDOWS)
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+
+/** \brief Generate the beginning of the header of a reply.
+ *
+ * \param[in] status  The status code.
+ * \param[in] reason  The reason phrase.
+ * \param[in] http10  Whether the client uses HTTP/1.0.
+ * \param[in] keep_alive  Whether the connection stays open.
+ *
+ * \return The status line, the Date, Server, and Connection fields.
+ */
+std::string reply_header(int status, const std::string& reason, bool http10, bool keep_alive)
+{
+    std::stringstream header;
+    header << (http10 ? "HTTP/1.0 " : "HTTP/1.1 ") << status << " " << reason << "\r\n"
+           << "Date: " << http_date(time(NULL)) << "\r\n"
+           << "Server: wpkg\r\n";
+    if(!keep_alive)
+    {
+        header << "Connection: close\r\n";
+    }
+    else if(http10)
+    {
+        header << "Connection: keep-alive\r\n";
+    }
+    return header.str();
+}
+
+} // no name namespace
+
+
+
+/** \class request
+ * \brief An HTTP request.
+ *
+ * The request holds the method, the path, and the fields sent to the
+ * server. The Host field is added automatically when the request gets
+ * sent.
+ */
+
+
+/** \brief Initialize a request.
+ *
+ * \param[in] path  The path of the file on the server, including the
+ *                  query string if any.
+ * \param[in] method  The method, "GET" by default.
+ */
+request::request(const std::string& path, const std::string& method)
+    : f_method(method)
+    , f_path(path)
+    //, f_fields() -- auto-init
+{
+}
+
+
+std::string request::get_method() const
+{
+    return f_method;
+}
+
+
+std::string request::get_path() const
+{
+    return f_path;
+}
+
+
+/** \brief Add a field to the request.
+ *
+ * If the field was already defined, its value gets replaced.
+ *
+ * \param[in] name  The name of the field (i.e. "If-None-Match".)
+ * \param[in] value  The value of the field.
+ */
+void request::set_field(const std::string& name, const std::string& value)
+{
+    const std::string lname(lowercase(name));
+    for(std::vector<std::pair<std::string, std::string> >::iterator it(f_fields.begin()); it != f_fields.end(); ++it)
+    {
+        if(lowercase(it->first) == lname)
+        {
+            it->second = value;
+            return;
+        }
+    }
+    f_fields.push_back(std::make_pair(name, value));
+}
+
+
+/** \brief Generate the request as sent to the server.
+ *
+ * \param[in] host  The name of the server, used in the Host field.
+ * \param[in] port  The port of the server, added to the Host field
+ *                  when not 80.
+ *
+ * \return The request with its header and the empty line.
+ */
+std::string request::to_string(const std::string& host, int port) const
+{
+    std::stringstream result;
+    result << f_method << " " << f_path << " HTTP/1.1\r\n"
+           << "Host: " << host;
+    if(port != 80)
+    {
+        result << ":" << port;
+    }
+    result << "\r\n";
+    for(std::vector<std::pair<std::string, std::string> >::const_iterator it(f_fields.begin()); it != f_fields.end(); ++it)
+    {
+        result << it->first << ": " << it->second << "\r\n";
+    }
+    result << "\r\n";
+    return result.str();
+}
+
+
+
+/** \class body_output
+ * \brief Receive the body of a response as it gets read.
+ *
+ * A large file does not need to be kept in a string before it gets
+ * saved elsewhere. When a body_output is attached to a response, the
+ * body of a successful (2xx) reply is passed to its write() function,
+ * one buffer at a time, instead of being saved in the response.
+ */
+
+
+/** \class response
+ * \brief An HTTP response.
+ *
+ * The response is filled by connection::receive(). The body was
+ * already decoded (chunked transfer encoding) when available.
+ */
+
+
+int response::get_status() const
+{
+    return f_status;
+}
+
+
+std::string response::get_status_line() const
+{
+    return f_status_line;
+}
+
+
+bool response::field_is_defined(const std::string& name) const
+{
+    return f_fields.find(lowercase(name)) != f_fields.end();
+}
+
+
+/** \brief Retrieve the value of a field.
+ *
+ * When a field appears multiple times in the reply, the values are
+ * joined with commas.
+ *
+ * \param[in] name  The name of the field, case insensitive.
+ *
+ * \return The value of the field or an empty string.
+ */
+std::string response::get_field(const std::string& name) const
+{
+    field_map_t::const_iterator it(f_fields.find(lowercase(name)));
+    if(it == f_fields.end())
+    {
+        return "";
+    }
+    return it->second;
+}
+
+
+/** \brief Retrieve the body of the response.
+ *
+ * When a body_output is attached to this response, the body of a
+ * successful reply was sent to it and this string remains empty.
+ *
+ * \return The body of the response.
+ */
+const std::string& response::get_body() const
+{
+    return f_body;
+}
+
+
+/** \brief Retrieve the size of the body, whether it was saved or sent.
+ *
+ * \return The number of bytes of the body of the response.
+ */
+int64_t response::get_body_size() const
+{
+    return f_body_size;
+}
+
+
+/** \brief Stream the body of the next successful replies.
+ *
+ * The body of a reply with a 2xx status is sent to \p output instead
+ * of being saved in the response. The body of other replies (i.e. a
+ * redirect or an error page) is still saved in the response.
+ *
+ * The output must remain valid until the response was received.
+ *
+ * \param[in] output  The object receiving the body, or NULL.
+ */
+void response::set_body_output(body_output *output)
+{
+    f_body_output = output;
+}
+
+
+void response::reset()
+{
+    f_status = 0;
+    f_status_line.clear();
+    f_fields.clear();
+    f_body.clear();
+    f_body_size = 0;
+}
+
+
+void response::append_body(const char *data, size_t size)
+{
+    if(f_body_output && f_status >= 200 && f_status < 300)
+    {
+        f_body_output->write(data, size);
+    }
+    else
+    {
+        f_body.append(data, size);
+    }
+    f_body_size += size;
+}
+
+
+
+/** \class connection
+ * \brief One persistent connection to an HTTP server.
+ *
+ * The connection reads the data sent by the server through a buffer
+ * so the header lines do not require one system call per character.
+ * After a reply, the connection can be reused if the server did not
+ * ask to close it and the body was fully read.
+ */
+
+
+/** \brief Connect to an HTTP server.
+ *
+ * \param[in] host  The name or IP address of the server.
+ * \param[in] port  The port of the server.
+ */
+connection::connection(const std::string& host, int port)
+    : f_host(host)
+    , f_port(port)
+    , f_client(new tcp_client_server::tcp_client(host, port))
+    , f_buffer(BUFFER_SIZE)
+    , f_pos(0)
+    , f_end(0)
+    //, f_reusable(false) -- auto-init
+    //, f_responses(0) -- auto-init
+    , f_last_used(time(NULL))
+{
+}
+
+
+std::string connection::get_host() const
+{
+    return f_host;
+}
+
+
+int connection::get_port() const
+{
+    return f_port;
+}
+
+
+/** \brief Check whether the connection can be used for another request.
+ *
+ * \return true if the last reply was fully read and the server did not
+ *         ask to close the connection.
+ */
+bool connection::is_reusable() const
+{
+    return f_reusable;
+}
+
+
+/** \brief Number of replies read on this connection.
+ *
+ * \return The number of replies read so far.
+ */
+uint32_t connection::get_responses() const
+{
+    return f_responses;
+}
+
+
+time_t connection::get_last_used() const
+{
+    return f_last_used;
+}
+
+
+/** \brief Send a request to the server.
+ *
+ * The request is written as a whole. Several requests can be sent
+ * before reading their replies (pipelining.)
+ *
+ * \param[in] r  The request to send.
+ */
+void connection::send(const request& r)
+{
+    const std::string data(r.to_string(f_host, f_port));
+    size_t pos(0);
+    while(pos < data.length())
+    {
+#if defined(MSG_NOSIGNAL)
+        // avoid a SIGPIPE if the server already closed the connection
+        const ssize_t sz(::send(f_client->get_socket(), data.c_str() + pos, data.length() - pos, MSG_NOSIGNAL));
+#else
+        const int sz(f_client->write(data.c_str() + pos, data.length() - pos));
+#endif
+        if(sz <= 0)
+        {
+            if(sz < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            f_reusable = false;
+            throw wpkg_http_exception_closed("error while writing HTTP request to \"" + f_host + "\"");
+        }
+        pos += sz;
+    }
+    f_last_used = time(NULL);
+}
+
+
+/** \brief Read the next reply from the server.
+ *
+ * This function reads the status line, the header fields, and the body
+ * of the next reply. The body length is determined by the chunked
+ * transfer encoding, the Content-Length field, or the end of the
+ * connection, in that order. Informational replies (1xx) are skipped.
+ *
+ * If the server closes the connection before sending anything, the
+ * function throws wpkg_http_exception_closed. This happens when a kept
+ * alive connection timed out on the server side and the request can
+ * then be sent again on a new connection.
+ *
+ * \param[out] r  The response.
+ * \param[in] head  Whether the request was a HEAD, which has no body.
+ */
+void connection::receive(response& r, bool head)
+{
+    f_reusable = false;
+    for(;;)
+    {
+        r.reset();
+
+        // status line
+        if(f_pos >= f_end && !fill())
+        {
+            throw wpkg_http_exception_closed("server \"" + f_host + "\" closed the connection before replying");
+        }
+        r.f_status_line = read_line();
+        if(r.f_status_line.compare(0, 5, "HTTP/") != 0 || r.f_status_line.length() < 12)
+        {
+            throw wpkg_http_exception_invalid("HTTP response is not HTTP/1.0 or HTTP/1.1");
+        }
+        const std::string version(r.f_status_line.substr(0, 8));
+        if(version != "HTTP/1.0" && version != "HTTP/1.1")
+        {
+            throw wpkg_http_exception_invalid("HTTP response is not HTTP/1.0 or HTTP/1.1");
+        }
+        char *end;
+        const std::string status(r.f_status_line.substr(9, 3));
+        r.f_status = static_cast<int>(strtol(status.c_str(), &end, 10));
+        if(end == NULL || *end != '\0' || r.f_status < 100)
+        {
+            throw wpkg_http_exception_invalid("HTTP response has an invalid status code");
+        }
+
+        // header fields
+        std::string last_name;
+        for(;;)
+        {
+            const std::string line(read_line());
+            if(line.empty())
+            {
+                break;
+            }
+            if((line[0] == ' ' || line[0] == '\t') && !last_name.empty())
+            {
+                // obsolete line folding
+                r.f_fields[last_name] += " " + trim(line);
+                continue;
+            }
+            const std::string::size_type colon(line.find(':'));
+            if(colon == std::string::npos || colon == 0)
+            {
+                throw wpkg_http_exception_invalid("HTTP response includes an invalid header line");
+            }
+            last_name = lowercase(trim(line.substr(0, colon)));
+            const std::string value(trim(line.substr(colon + 1)));
+            response::field_map_t::iterator it(r.f_fields.find(last_name));
+            if(it == r.f_fields.end())
+            {
+                r.f_fields[last_name] = value;
+            }
+            else
+            {
+                it->second += ", " + value;
+            }
+        }
+
+        if(r.f_status >= 200 || r.f_status == 101)
+        {
+            break;
+        }
+        // 100 Continue and other informational replies are followed
+        // by the actual reply
+    }
+
+    // by default HTTP/1.1 connections are kept alive
+    bool keep_alive(r.f_status_line.compare(0, 8, "HTTP/1.1") == 0);
+    if(r.field_is_defined("Connection"))
+    {
+        const std::string value(r.get_field("Connection"));
+        if(has_token(value, "close"))
+        {
+            keep_alive = false;
+        }
+        else if(has_token(value, "keep-alive"))
+        {
+            keep_alive = true;
+        }
+    }
+
+    // body
+    if(head || r.f_status == 204 || r.f_status == 304 || r.f_status < 200)
+    {
+        // no body
+    }
+    else if(r.field_is_defined("Transfer-Encoding")
+         && !has_token(r.get_field("Transfer-Encoding"), "identity"))
+    {
+        if(!has_token(r.get_field("Transfer-Encoding"), "chunked"))
+        {
+            throw wpkg_http_exception_invalid("HTTP response uses an unsupported transfer encoding \"" + r.get_field("Transfer-Encoding") + "\"");
+        }
+        read_chunked_body(r);
+    }
+    else if(r.field_is_defined("Content-Length"))
+    {
+        const std::string length(r.get_field("Content-Length"));
+        char *end;
+        const int64_t size(strtoll(length.c_str(), &end, 10));
+        if(end == NULL || *end != '\0' || size < 0 || length.empty())
+        {
+            throw wpkg_http_exception_invalid("HTTP response has an invalid Content-Length");
+        }
+        read_body(r, size);
+    }
+    else
+    {
+        read_body_until_close(r);
+        keep_alive = false;
+    }
+
+    ++f_responses;
+    f_reusable = keep_alive;
+    f_last_used = time(NULL);
+}
+
+
+/** \brief Read more data from the server.
+ *
+ * The data still available in the buffer is moved at the start of the
+ * buffer and more data is read after it.
+ *
+ * \return false if the server closed the connection.
+ */
+bool connection::fill()
+{
+    if(f_pos > 0)
+    {
+        memmove(&f_buffer[0], &f_buffer[f_pos], f_end - f_pos);
+        f_end -= f_pos;
+        f_pos = 0;
+    }
+    if(f_end >= f_buffer.size())
+    {
+        f_buffer.resize(f_buffer.size() * 2);
+    }
+    for(;;)
+    {
+        const int sz(f_client->read(&f_buffer[f_end], f_buffer.size() - f_end));
+        if(sz < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            throw wpkg_http_exception_io("I/O error while reading HTTP response from \"" + f_host + "\"");
+        }
+        if(sz == 0)
+        {
+            return false;
+        }
+        f_end += sz;
+        return true;
+    }
+}
+
+
+/** \brief Read one line of the header.
+ *
+ * The line ends with "\r\n" (or just "\n") which is not included in the
+ * result.
+ *
+ * \return The line.
+ */
+std::string connection::read_line()
+{
+    size_t searched(f_pos);
+    for(;;)
+    {
+        const char *start(&f_buffer[0]);
+        const char *nl(static_cast<const char *>(memchr(start + searched, '\n', f_end - searched)));
+        if(nl != NULL)
+        {
+            size_t len(nl - start - f_pos);
+            std::string line(start + f_pos, len);
+            f_pos += len + 1;
+            if(!line.empty() && line[line.length() - 1] == '\r')
+            {
+                line.resize(line.length() - 1);
+            }
+            return line;
+        }
+        if(f_end - f_pos > MAX_LINE_LENGTH)
+        {
+            throw wpkg_http_exception_invalid("HTTP response header line is too long");
+        }
+        searched = f_end - f_pos;
+        if(!fill())
+        {
+            throw wpkg_http_exception_io("server \"" + f_host + "\" closed the connection in the middle of an HTTP response header");
+        }
+        // fill() moves the data at the start of the buffer
+    }
+}
+
+
+/** \brief Read a body of a known size.
+ *
+ * \param[in,out] r  The response, the data gets appended to its body.
+ * \param[in] size  The number of bytes to read.
+ */
+void connection::read_body(response& r, int64_t size)
+{
+    if(!r.f_body_output)
+    {
+        r.f_body.reserve(r.f_body.length() + static_cast<size_t>(size));
+    }
+    while(size > 0)
+    {
+        if(f_pos >= f_end)
+        {
+            f_pos = f_end = 0;
+            if(!fill())
+            {
+                throw wpkg_http_exception_io("server \"" + f_host + "\" closed the connection in the middle of an HTTP response body");
+            }
+        }
+        const size_t available(std::min(static_cast<int64_t>(f_end - f_pos), size));
+        r.append_body(&f_buffer[f_pos], available);
+        f_pos += available;
+        size -= available;
+    }
+}
+
+
+/** \brief Read a body sent with the chunked transfer encoding.
+ *
+ * Each chunk starts with its size in hexadecimal, possibly followed by
+ * extensions which are ignored. A chunk of size zero ends the body. It
+ * is followed by optional trailer fields which are ignored too.
+ *
+ * \param[in,out] r  The response, the data gets appended to its body.
+ */
+void connection::read_chunked_body(response& r)
+{
+    for(;;)
+    {
+        std::string line(read_line());
+        const std::string::size_type semicolon(line.find(';'));
+        if(semicolon != std::string::npos)
+        {
+            line = line.substr(0, semicolon);
+        }
+        line = trim(line);
+        char *end;
+        const int64_t size(strtoll(line.c_str(), &end, 16));
+        if(line.empty() || end == NULL || *end != '\0' || size < 0)
+        {
+            throw wpkg_http_exception_invalid("HTTP response includes an invalid chunk size");
+        }
+        if(size == 0)
+        {
+            break;
+        }
+        read_body(r, size);
+        if(!read_line().empty())
+        {
+            throw wpkg_http_exception_invalid("HTTP response chunk is not followed by an empty line");
+        }
+    }
+
+    // skip the trailer
+    while(!read_line().empty())
+    {
+    }
+}
+
+
+/** \brief Read a body that ends when the server closes the connection.
+ *
+ * \param[in,out] r  The response, the data gets appended to its body.
+ */
+void connection::read_body_until_close(response& r)
+{
+    for(;;)
+    {
+        if(f_pos < f_end)
+        {
+            r.append_body(&f_buffer[f_pos], f_end - f_pos);
+        }
+        f_pos = f_end = 0;
+        if(!fill())
+        {
+            return;
+        }
+    }
+}
+
+
+
+/** \class client
+ * \brief Send requests using a pool of persistent connections.
+ *
+ * The client functions get a connection to the server from the pool
+ * (or open a new one), send the requests, read the replies, and put
+ * the connection back in the pool if it can be reused. The pool is
+ * shared by all the threads.
+ */
+
+
+/** \brief Send one request and read its reply.
+ *
+ * If the request is sent on a connection from the pool and the server
+ * closed that connection in the meantime, the request is sent again
+ * on a new connection.
+ *
+ * \param[in] host  The name of the server.
+ * \param[in] port  The port of the server.
+ * \param[in] r  The request to send.
+ * \param[out] result  The reply of the server.
+ */
+void client::get(const std::string& host, int port, const request& r, response& result)
+{
+    for(;;)
+    {
+        std::shared_ptr<connection> c(get_connection(host, port));
+        const bool reused(c->get_responses() > 0);
+        try
+        {
+            c->send(r);
+            c->receive(result, r.get_method() == "HEAD");
+        }
+        catch(const wpkg_http_exception_closed&)
+        {
+            if(reused)
+            {
+                // the server closed our idle connection, try again
+                continue;
+            }
+            throw;
+        }
+        release_connection(c);
+        return;
+    }
+}
+
+
+/** \brief Send several requests to the same server.
+ *
+ * The requests are pipelined: up to MAX_PIPELINE requests are sent
+ * before their replies get read. If the server closes the connection
+ * before replying to all the requests, the remaining requests are sent
+ * again on a new connection. This is why only idempotent requests
+ * (GET and HEAD) should be pipelined.
+ *
+ * The replies are saved in \p results in the order of the requests.
+ * The responses already found in \p results are reused so a body_output
+ * attached to them beforehand receives the body of the corresponding
+ * reply (see response::set_body_output().)
+ *
+ * \param[in] host  The name of the server.
+ * \param[in] port  The port of the server.
+ * \param[in] requests  The requests to send.
+ * \param[in,out] results  The replies of the server.
+ */
+void client::pipeline(const std::string& host, int port, const std::vector<request>& requests, std::vector<response>& results)
+{
+    const size_t max(requests.size());
+    results.resize(max);
+    size_t received(0);
+    while(received < max)
+    {
+        std::shared_ptr<connection> c(get_connection(host, port));
+        const bool reused(c->get_responses() > 0);
+        const size_t first(received);
+        size_t sent(received);
+        try
+        {
+            while(received < max)
+            {
+                while(sent < max && sent - received < static_cast<size_t>(MAX_PIPELINE))
+                {
+                    c->send(requests[sent]);
+                    ++sent;
+                }
+                c->receive(results[received], requests[received].get_method() == "HEAD");
+                ++received;
+                if(!c->is_reusable())
+                {
+                    // the other requests were lost, send them again
+                    break;
+                }
+            }
+        }
+        catch(const wpkg_http_exception_closed&)
+        {
+            if(received == first && !reused)
+            {
+                // a new connection did not get any reply, give up
+                throw;
+            }
+            continue;
+        }
+        release_connection(c);
+    }
+}
+
+
+/** \brief Close all the idle connections.
+ *
+ * The connections in the pool are closed. Connections currently in use
+ * are not affected.
+ */
+void client::close_idle_connections()
+{
+    std::lock_guard<std::mutex> lock(g_pool_mutex);
+    g_pool.clear();
+}
+
+
+/** \brief Get a connection to a server.
+ *
+ * The most recently used idle connection to that server is returned
+ * if there is one. Otherwise a new connection is opened.
+ *
+ * \param[in] host  The name of the server.
+ * \param[in] port  The port of the server.
+ *
+ * \return A connection which is only used by the caller.
+ */
+std::shared_ptr<connection> client::get_connection(const std::string& host, int port)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_pool_mutex);
+        connection_pool_t::iterator it(g_pool.find(pool_key(host, port)));
+        if(it != g_pool.end())
+        {
+            const time_t now(time(NULL));
+            while(!it->second.empty())
+            {
+                std::shared_ptr<connection> c(it->second.back());
+                it->second.pop_back();
+                if(now - c->get_last_used() < MAX_IDLE_SECONDS)
+                {
+                    return c;
+                }
+                // too old, servers close idle connections after a while
+            }
+        }
+    }
+
+    return std::shared_ptr<connection>(new connection(host, port));
+}
+
+
+/** \brief Put a connection back in the pool.
+ *
+ * The connection is dropped if it cannot be reused or if the pool
+ * already has enough idle connections to that server.
+ *
+ * \param[in] c  The connection to release.
+ */
+void client::release_connection(const std::shared_ptr<connection>& c)
+{
+    if(!c->is_reusable())
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_pool_mutex);
+    std::vector<std::shared_ptr<connection> >& idle(g_pool[pool_key(c->get_host(), c->get_port())]);
+    if(idle.size() < static_cast<size_t>(MAX_IDLE_CONNECTIONS))
+    {
+        idle.push_back(c);
+    }
+}
+
+
+/** \class server
+ * \brief Serve the files of a directory over HTTP.
+ *
+ * The server is used to share a repository directory with wpkg clients
+ * without the need for a separate web server. It supports what these
+ * clients use: GET and HEAD requests, persistent connections, pipelined
+ * requests, conditional requests (If-None-Match and If-Modified-Since),
+ * and single byte ranges so interrupted downloads can be resumed.
+ *
+ * One thread accepts the connections and a pool of threads serves them.
+ * Each thread handles one connection at a time, until the client closes
+ * it or it stays idle for IDLE_SECONDS.
+ */
+
+
+/** \brief Initialize the server.
+ *
+ * The constructor binds the socket so the port is in use once the
+ * object exists. The connections are only accepted once run() gets
+ * called.
+ *
+ * \param[in] root  The directory to serve.
+ * \param[in] addr  The address to listen on (i.e. "0.0.0.0".)
+ * \param[in] port  The port to listen on.
+ */
+server::server(const wpkg_filename::uri_filename& root, const std::string& addr, int port)
+    : f_root(root)
+    , f_server(new tcp_client_server::tcp_server(addr, port, LISTEN_BACKLOG, true, false))
+    , f_threads(DEFAULT_THREADS)
+    //, f_mutex() -- auto-init
+    //, f_condition() -- auto-init
+    //, f_queue() -- auto-init
+    //, f_active() -- auto-init
+    //, f_stop(false) -- auto-init
+{
+    if(!f_root.is_dir())
+    {
+        throw wpkg_http_exception_io("\"" + f_root.original_filename() + "\" is not a directory");
+    }
+}
+
+
+/** \brief Clean up the server.
+ *
+ * The listening socket gets closed.
+ */
+server::~server()
+{
+}
+
+
+/** \brief Set the number of threads serving connections.
+ *
+ * Since a thread handles one connection at a time, this is also the
+ * maximum number of connections served simultaneously. Additional
+ * connections wait until a thread is available. Threads with an idle
+ * connection close it as soon as other connections are waiting.
+ *
+ * \param[in] threads  The number of threads, at least 1.
+ */
+void server::set_threads(int threads)
+{
+    f_threads = std::max(1, threads);
+}
+
+
+/** \brief Get the address the server listens on.
+ *
+ * \return The address as passed to the constructor.
+ */
+std::string server::get_addr() const
+{
+    return f_server->get_addr();
+}
+
+
+/** \brief Get the port the server listens on.
+ *
+ * \return The port as passed to the constructor.
+ */
+int server::get_port() const
+{
+    return f_server->get_port();
+}
+
+
+/** \brief Accept and serve connections until stop() gets called.
+ *
+ * On Unix systems the caller should ignore SIGPIPE since a client
+ * closing its connection while a file is being sent would otherwise
+ * kill the process.
+ */
+void server::run()
+{
+    std::vector<std::thread> workers;
+    for(int i(0); i < f_threads; ++i)
+    {
+        workers.push_back(std::thread(&server::worker, this));
+    }
+
+    for(;;)
+    {
+        const tcp_client_server::socket_t s(f_server->accept());
+        bool stop(false);
+        {
+            std::lock_guard<std::mutex> lock(f_mutex);
+            stop = f_stop;
+            if(!stop && s != INVALID_SOCKET)
+            {
+                f_queue.push_back(s);
+                f_condition.notify_one();
+            }
+        }
+        if(stop)
+        {
+            if(s != INVALID_SOCKET)
+            {
+                lingering_close(s);
+            }
+            break;
+        }
+        // when s is INVALID_SOCKET the accept() call was interrupted or
+        // the client already went away
+    }
+
+    f_condition.notify_all();
+    for(size_t i(0); i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+
+    // connections accepted but never served
+    for(socket_queue_t::const_iterator it(f_queue.begin()); it != f_queue.end(); ++it)
+    {
+        lingering_close(*it);
+    }
+    f_queue.clear();
+}
+
+
+/** \brief Stop the server.
+ *
+ * This function can be called from any thread (but not from a signal
+ * handler.) The connections being served are interrupted and the run()
+ * function returns once all the threads are done.
+ */
+void server::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        if(f_stop)
+        {
+            return;
+        }
+        f_stop = true;
+        for(socket_set_t::const_iterator it(f_active.begin()); it != f_active.end(); ++it)
+        {
+#if defined(MO_WINDOWS)
+            shutdown(*it, SD_BOTH);
+#else
+            shutdown(*it, SHUT_RDWR);
+#endif
+        }
+    }
+    f_condition.notify_all();
+
+    // wake up the accept() call
+    std::string addr(f_server->get_addr());
+    if(addr == "0.0.0.0")
+    {
+        addr = "127.0.0.1";
+    }
+    else if(addr == "::")
+    {
+        addr = "::1";
+    }
+    try
+    {
+        tcp_client_server::tcp_client wake_up(addr, f_server->get_port());
+    }
+    catch(const tcp_client_server::tcp_client_server_runtime_error&)
+    {
+        // the server is not listening anymore
+    }
+}
+
+
+/** \brief Let the caller prepare a file before it gets served.
+ *
+ * This function is called with the name of each file requested, whether
+ * it exists or not, before the server checks it. It can be overridden
+ * to create or update the file. By default it does nothing.
+ *
+ * If the function throws a runtime_error, the client receives a
+ * "500 Internal Server Error" reply.
+ *
+ * \param[in] filename  The name of the file about to be served.
+ */
+void server::prepare_file(const wpkg_filename::uri_filename& filename)
+{
+    static_cast<void>(filename);
+}
+
+
+/** \brief Let the caller log the requests.
+ *
+ * This function is called once per request after the reply was sent.
+ * It gets called by the serving threads so it has to be thread safe.
+ * By default it does nothing.
+ *
+ * \param[in] request_line  The request line (i.e. "GET /index.tar.gz HTTP/1.1".)
+ * \param[in] status  The status of the reply.
+ * \param[in] size  The number of bytes of the body sent back.
+ */
+void server::log_request(const std::string& request_line, int status, int64_t size)
+{
+    static_cast<void>(request_line);
+    static_cast<void>(status);
+    static_cast<void>(size);
+}
+
+
+/** \brief Serve the connections accepted by run().
+ *
+ * Each thread of the pool runs this loop until the server gets stopped.
+ */
+void server::worker()
+{
+    for(;;)
+    {
+        tcp_client_server::socket_t s;
+        {
+            std::unique_lock<std::mutex> lock(f_mutex);
+            while(f_queue.empty() && !f_stop)
+            {
+                f_condition.wait(lock);
+            }
+            if(f_stop)
+            {
+                return;
+            }
+            s = f_queue.front();
+            f_queue.pop_front();
+            f_active.insert(s);
+        }
+
+        try
+        {
+            serve(s);
+        }
+        catch(const std::exception&)
+        {
+            // drop that connection, keep serving the others
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(f_mutex);
+            f_active.erase(s);
+        }
+        // draining the input can take a moment, do not block the others
+        lingering_close(s);
+    }
+}
+
+
+/** \brief Serve the requests received on one connection.
+ *
+ * The requests are read and answered one after the other. The function
+ * returns when the client closes the connection, a reply requires the
+ * connection to be closed, the connection stays idle for too long, or
+ * other connections are waiting for a thread.
+ *
+ * \param[in] s  The socket of the client.
+ */
+void server::serve(tcp_client_server::socket_t s)
+{
+    set_timeouts(s, IDLE_SECONDS, SEND_TIMEOUT_SECONDS);
+    std::string input;
+    for(;;)
+    {
+        // ignore empty lines between requests
+        const std::string::size_type start(input.find_first_not_of("\r\n"));
+        input.erase(0, start == std::string::npos ? input.length() : start);
+
+        std::string::size_type end(input.find("\r\n\r\n"));
+        while(end == std::string::npos)
+        {
+            if(input.length() > MAX_LINE_LENGTH)
+            {
+                // header too large
+                return;
+            }
+            char buf[4096];
+            const int sz(static_cast<int>(::recv(s, buf, sizeof(buf), 0)));
+            if(sz <= 0)
+            {
+                if(sz < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                // closed, idle for too long, or stopped
+                return;
+            }
+            input.append(buf, sz);
+            end = input.find("\r\n\r\n");
+        }
+        const std::string header(input.substr(0, end));
+        input.erase(0, end + 4);
+
+        bool keep_alive(false);
+        if(!reply(s, header, input, keep_alive) || !keep_alive)
+        {
+            return;
+        }
+
+        if(input.empty())
+        {
+            // let the clients waiting for a thread in
+            std::lock_guard<std::mutex> lock(f_mutex);
+            if(!f_queue.empty() || f_stop)
+            {
+                return;
+            }
+        }
+    }
+}
+
+
+/** \brief Reply to one request.
+ *
+ * \param[in] s  The socket of the client.
+ * \param[in] header  The request line and the header fields.
+ * \param[in,out] input  The data received after the header; the body
+ *                       of the request, if any, gets removed from it.
+ * \param[out] keep_alive  Whether the connection can be used for another
+ *                         request.
+ *
+ * \return false if the connection cannot be used anymore.
+ */
+bool server::reply(tcp_client_server::socket_t s, const std::string& header, std::string& input, bool& keep_alive)
+{
+    // parse the request line and the fields
+    std::string::size_type eol(header.find("\r\n"));
+    const std::string request_line(header.substr(0, eol));
+    std::map<std::string, std::string> fields;
+    while(eol != std::string::npos)
+    {
+        const std::string::size_type start(eol + 2);
+        eol = header.find("\r\n", start);
+        const std::string line(header.substr(start, eol == std::string::npos ? std::string::npos : eol - start));
+        const std::string::size_type colon(line.find(':'));
+        if(colon != std::string::npos)
+        {
+            const std::string name(lowercase(trim(line.substr(0, colon))));
+            const std::string value(trim(line.substr(colon + 1)));
+            std::string& field(fields[name]);
+            field = field.empty() ? value : field + ", " + value;
+        }
+    }
+    const std::string::size_type sp1(request_line.find(' '));
+    const std::string::size_type sp2(sp1 == std::string::npos ? std::string::npos : request_line.find(' ', sp1 + 1));
+    const std::string method(request_line.substr(0, sp1));
+    const std::string target(sp2 == std::string::npos ? "" : request_line.substr(sp1 + 1, sp2 - sp1 - 1));
+    const std::string version(sp2 == std::string::npos ? "" : request_line.substr(sp2 + 1));
+    const bool http10(version == "HTTP/1.0");
+    keep_alive = http10 ? has_token(fields["connection"], "keep-alive") : !has_token(fields["connection"], "close");
+
+    int status(0);
+    std::string reason;
+    std::string extra_fields;
+    if(version.compare(0, 5, "HTTP/") != 0 || target.empty())
+    {
+        status = 400;
+        reason = "Bad Request";
+        keep_alive = false;
+    }
+    else if(!fields["transfer-encoding"].empty())
+    {
+        // we do not expect requests with a body
+        status = 411;
+        reason = "Length Required";
+        keep_alive = false;
+    }
+    else if(!fields["content-length"].empty())
+    {
+        int64_t length(0);
+        if(!parse_number(fields["content-length"], length))
+        {
+            status = 400;
+            reason = "Bad Request";
+            keep_alive = false;
+        }
+        else
+        {
+            // skip the body; what follows it in the input buffer is
+            // the next request and must be kept
+            const int64_t buffered(std::min(length, static_cast<int64_t>(input.length())));
+            input.erase(0, static_cast<std::string::size_type>(buffered));
+            length -= buffered;
+            while(length > 0)
+            {
+                char buf[4096];
+                const int sz(static_cast<int>(::recv(s, buf, static_cast<size_t>(std::min(length, static_cast<int64_t>(sizeof(buf)))), 0)));
+                if(sz <= 0)
+                {
+                    if(sz < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    return false;
+                }
+                length -= sz;
+            }
+        }
+    }
+    if(status == 0 && method != "GET" && method != "HEAD")
+    {
+        status = 405;
+        reason = "Method Not Allowed";
+        extra_fields = "Allow: GET, HEAD\r\n";
+    }
+
+    // find the file
+    std::string path(target);
+    if(path.compare(0, 7, "http://") == 0)
+    {
+        const std::string::size_type slash(path.find('/', 7));
+        path = slash == std::string::npos ? "/" : path.substr(slash);
+    }
+    path = path.substr(0, path.find('?'));
+    std::string decoded;
+    if(status == 0 && !decode_path(path, decoded))
+    {
+        status = 400;
+        reason = "Bad Request";
+    }
+    const wpkg_filename::uri_filename filename(decoded.length() <= 1 ? f_root : f_root.append_child(decoded.substr(1)));
+    wpkg_filename::uri_filename::file_stat st;
+    if(status == 0)
+    {
+        try
+        {
+            prepare_file(filename);
+        }
+        catch(const std::runtime_error&)
+        {
+            status = 500;
+            reason = "Internal Server Error";
+        }
+    }
+    if(status == 0 && (filename.os_stat(st) != 0 || !st.is_reg()))
+    {
+        status = 404;
+        reason = "Not Found";
+    }
+
+    // errors have a short text body
+    const bool head(method == "HEAD");
+    if(status != 0)
+    {
+        std::stringstream body;
+        body << status << " " << reason << "\n";
+        std::stringstream out;
+        out << reply_header(status, reason, http10, keep_alive)
+            << extra_fields
+            << "Content-Type: text/plain\r\n"
+            << "Content-Length: " << body.str().length() << "\r\n"
+            << "\r\n";
+        if(!head)
+        {
+            out << body.str();
+        }
+        const std::string data(out.str());
+        const bool sent(send_all(s, data.c_str(), data.length(), false));
+        log_request(request_line, status, head ? 0 : body.str().length());
+        return sent;
+    }
+
+    // the validators
+    const int64_t size(st.get_size());
+    const time_t mtime(st.get_mtime());
+    // the nanoseconds make sure a file replaced within the same second
+    // (i.e. an index regenerated right away) gets a new ETag
+    char etag_buf[64];
+    snprintf(etag_buf, sizeof(etag_buf), "\"%llx-%llx.%llx\"", static_cast<unsigned long long>(size), static_cast<unsigned long long>(mtime), static_cast<unsigned long long>(st.get_mtime_nano()));
+    etag_buf[sizeof(etag_buf) / sizeof(etag_buf[0]) - 1] = '\0';
+    const std::string etag(etag_buf);
+    const std::string last_modified(http_date(mtime));
+
+    bool not_modified(false);
+    if(!fields["if-none-match"].empty())
+    {
+        const std::string& value(fields["if-none-match"]);
+        std::string::size_type p(0);
+        for(;;)
+        {
+            const std::string::size_type q(value.find(',', p));
+            std::string tag(trim(value.substr(p, q == std::string::npos ? std::string::npos : q - p)));
+            if(tag.compare(0, 2, "W/") == 0)
+            {
+                tag = tag.substr(2);
+            }
+            if(tag == "*" || tag == etag)
+            {
+                not_modified = true;
+                break;
+            }
+            if(q == std::string::npos)
+            {
+                break;
+            }
+            p = q + 1;
+        }
+    }
+    else if(!fields["if-modified-since"].empty())
+    {
+        time_t since(0);
+        not_modified = parse_http_date(fields["if-modified-since"], since) && mtime <= since;
+    }
+
+    // a range is only honored if the file did not change
+    int64_t first(0);
+    int64_t last(size - 1);
+    const std::string& if_range(fields["if-range"]);
+    const std::string& range(fields["range"]);
+    if(!not_modified && range.compare(0, 6, "bytes=") == 0 && range.find(',') == std::string::npos
+    && (if_range.empty() || if_range == etag || if_range == last_modified))
+    {
+        const std::string spec(trim(range.substr(6)));
+        const std::string::size_type dash(spec.find('-'));
+        if(dash != std::string::npos)
+        {
+            const std::string from(trim(spec.substr(0, dash)));
+            const std::string to(trim(spec.substr(dash + 1)));
+            int64_t a(0);
+            int64_t b(0);
+            if(from.empty())
+            {
+                // the last b bytes
+                if(parse_number(to, b))
+                {
+                    if(b == 0 || size == 0)
+                    {
+                        status = 416;
+                    }
+                    else
+                    {
+                        status = 206;
+                        first = std::max(static_cast<int64_t>(0), size - b);
+                    }
+                }
+            }
+            else if(parse_number(from, a) && (to.empty() || (parse_number(to, b) && b >= a)))
+            {
+                if(a >= size)
+                {
+                    status = 416;
+                }
+                else
+                {
+                    status = 206;
+                    first = a;
+                    if(!to.empty())
+                    {
+                        last = std::min(b, size - 1);
+                    }
+                }
+            }
+            // otherwise the Range field is invalid and ignored
+        }
+    }
+    if(status == 0)
+    {
+        status = not_modified ? 304 : 200;
+    }
+
+    std::stringstream out;
+    int64_t length(0);
+    switch(status)
+    {
+    case 200:
+        out << reply_header(status, "OK", http10, keep_alive);
+        length = size;
+        break;
+
+    case 206:
+        out << reply_header(status, "Partial Content", http10, keep_alive)
+            << "Content-Range: bytes " << first << "-" << last << "/" << size << "\r\n";
+        length = last - first + 1;
+        break;
+
+    case 304:
+        out << reply_header(status, "Not Modified", http10, keep_alive);
+        break;
+
+    default: // 416
+        out << reply_header(status, "Range Not Satisfiable", http10, keep_alive)
+            << "Content-Range: bytes */" << size << "\r\n";
+        break;
+
+    }
+    out << "ETag: " << etag << "\r\n"
+        << "Last-Modified: " << last_modified << "\r\n"
+        << "Accept-Ranges: bytes\r\n";
+    if(status != 304)
+    {
+        out << "Content-Type: application/octet-stream\r\n"
+            << "Content-Length: " << length << "\r\n";
+    }
+    out << "\r\n";
+    const std::string data(out.str());
+    const bool has_body(!head && length > 0);
+    if(!send_all(s, data.c_str(), data.length(), has_body))
+    {
+        return false;
+    }
+    if(has_body && !send_file(s, filename, first, length))
+    {
+        // the client cannot know where the body ends anymore
+        keep_alive = false;
+        return false;
+    }
+    log_request(request_line, status, has_body ? length : 0);
+    return true;
+}
+
+
+} // namespace wpkg_http
+// vim: ts=4 sw=4 et
@@ -32,6 +32,7 @@
 #include    "libdebpackages/wpkg_output.h"
 #include    "libdebpackages/compatibility.h"
 #include    <time.h>
+#include    <mutex>
 #include    <sstream>
 
 #if !defined(MO_WINDOWS)
@@ -758,6 +759,17 @@ namespace
  */
 controlled_vars::ptr_auto_init<output> g_log_output;
 
+/** \brief Serialize the messages sent to the output object.
+ *
+ * Some functions (i.e. reading the indexes of several repositories)
+ * work in multiple threads. The output objects are not expected to
+ * be thread safe so the messages are sent one at a time.
+ *
+ * The mutex is recursive in case an output object logs a message
+ * while processing another.
+ */
+std::recursive_mutex g_log_mutex;
+
 } // no name namespace
 
 
@@ -1063,6 +1075,7 @@ log::~log()
         f_message.set_raw_message(replace_arguments());
 
         // send the log message
+        std::lock_guard<std::recursive_mutex> lock(g_log_mutex);
         g_log_output->log(f_message);
     }
 }
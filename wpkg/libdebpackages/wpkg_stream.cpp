@@ -42,6 +42,11 @@
  */
 #include    "libdebpackages/wpkg_stream.h"
 
+#include    <errno.h>
+#if !defined(MO_WINDOWS)
+#   include <unistd.h>
+#endif
+
 
 /** \brief The wpkg_stream for the libdepackages file handling.
  *
@@ -98,6 +103,10 @@ bool fstream::create(const wpkg_filename::uri_filename& filename)
 {
     close();
 
+    // the file gets created or truncated, forget its previous stat()
+    wpkg_filename::os_stat_cache::invalidate(filename);
+    f_filename = filename;
+
 #if defined(MO_WINDOWS)
     // MS-Windows uses Unicode (wchar_t) to open any one file
     // Also the CreateFileW() is generally better than _wfopen()
@@ -175,6 +184,9 @@ bool fstream::append(const wpkg_filename::uri_filename& filename)
     }
     else
     {
+        wpkg_filename::os_stat_cache::invalidate(filename);
+        f_filename = filename;
+
         // MS-Windows uses Unicode (wchar_t) to open any one file
         // Also the CreateFileW() is generally better than _wfopen()
         f_file = CreateFileW(
@@ -195,6 +207,8 @@ bool fstream::append(const wpkg_filename::uri_filename& filename)
     }
     else
     {
+        wpkg_filename::os_stat_cache::invalidate(filename);
+        f_filename = filename;
         f_file = fopen(filename.os_filename().get_utf8().c_str(), "ab");
     }
     return f_file;
@@ -235,6 +249,13 @@ void fstream::close()
     }
 #endif
     f_do_not_close = false;
+
+    // the size and modification time of a file we wrote changed
+    if(!f_filename.empty())
+    {
+        wpkg_filename::os_stat_cache::invalidate(f_filename);
+        f_filename.clear();
+    }
 }
 
 
@@ -429,5 +450,51 @@ fstream::size_type fstream::write(const void *buffer, size_type size) const
 }
 
 
+/** \brief Flush the data written to the stream to disk.
+ *
+ * This function makes sure that the data written to the stream so far
+ * reached the disk. It first flushes the buffers of the stream, then
+ * asks the operating system to write its own buffers to disk (i.e.
+ * fdatasync() under Linux.)
+ *
+ * Streams which do not support such synchronization (i.e. stdout
+ * connected to a terminal or a pipe) are considered flushed once
+ * their buffers were written.
+ *
+ * \note
+ * If an error occurs then the streams gets closed instantaneously. The
+ * good() function then returns false.
+ *
+ * \return true if the data is safe on disk.
+ */
+bool fstream::flush()
+{
+    bool result(false);
+
+#if defined(MO_WINDOWS)
+    if(f_file != INVALID_HANDLE_VALUE)
+    {
+        result = FlushFileBuffers(f_file) != 0 || f_do_not_close;
+    }
+#else
+    if(f_file && fflush(f_file.get()) == 0)
+    {
+#if defined(MO_LINUX)
+        result = fdatasync(fileno(f_file.get())) == 0 || errno == EINVAL;
+#else
+        result = fsync(fileno(f_file.get())) == 0 || errno == EINVAL;
+#endif
+    }
+#endif
+
+    if(!result)
+    {
+        close();
+    }
+    return result;
+}
+
+
+
 } // wpkg_stream namespace
 // vim: ts=4 sw=4 et
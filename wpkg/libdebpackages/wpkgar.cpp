@@ -32,9 +32,13 @@
 #include    "libdebpackages/debian_packages.h"
 #include    "libdebpackages/wpkg_util.h"
 #include    <algorithm>
+#include    <atomic>
+#include    <condition_variable>
 #include    <fstream>
 #include    <iostream>
+#include    <mutex>
 #include    <sstream>
+#include    <thread>
 #include    <fcntl.h>
 #include    <errno.h>
 #include    <time.h>
@@ -107,6 +111,373 @@ namespace wpkgar
 {
 
 
+namespace
+{
+
+/** \brief Maximum size of the data.tar files kept in memory.
+ *
+ * When loading a temporary package (a .deb file) the uncompressed data.tar
+ * is kept in memory so the database and the unpack process do not have
+ * to read it back from disk. This is the maximum number of bytes all the
+ * packages loaded at once can retain. Once that amount is reached, the
+ * data.tar files are saved in the temporary directory as usual.
+ */
+const int64_t WPKGAR_MAX_RETAINED_DATA_SIZE = 512 * 1024 * 1024;
+
+/** \brief Number of bytes currently retained by packages.
+ *
+ * The total size of the data.tar files currently kept in memory by the
+ * loaded packages. Packages can be loaded by several managers, each in
+ * its own thread, so the counter is atomic; use retain_data() to add
+ * to it.
+ */
+std::atomic<int64_t> g_retained_data_size(0);
+
+/** \brief Reserve space for a data.tar file to be kept in memory.
+ *
+ * This function adds \p size to g_retained_data_size unless the total
+ * would go over WPKGAR_MAX_RETAINED_DATA_SIZE.
+ *
+ * \param[in] size  The size of the data.tar file.
+ *
+ * \return true if the data can be kept in memory.
+ */
+bool retain_data(int64_t size)
+{
+    int64_t current(g_retained_data_size.load());
+    do
+    {
+        if(current + size > WPKGAR_MAX_RETAINED_DATA_SIZE)
+        {
+            return false;
+        }
+    }
+    while(!g_retained_data_size.compare_exchange_weak(current, current + size));
+    return true;
+}
+
+/** \brief Whether the data.tar files are shared between managers.
+ *
+ * See wpkgar_manager::share_data_tar() for details.
+ */
+bool g_share_data_tar = false;
+
+/** \brief An uncompressed data.tar shared between managers.
+ *
+ * The md5sum is kept along the data so it does not need to be
+ * computed again each time the package is loaded.
+ */
+struct shared_data_tar_t
+{
+    std::shared_ptr<memfile::memory_file>   f_data_tar;
+    md5::raw_md5sum                         f_md5sum;
+};
+
+/** \brief The shared data.tar files.
+ *
+ * The key is generated by wpkgar_package::data_tar_share_key() from the
+ * path to the .deb file, its size, and modification time.
+ */
+typedef std::map<std::string, shared_data_tar_t> shared_data_tars_t;
+shared_data_tars_t g_shared_data_tars;
+
+
+/** \brief Maximum number of bytes read ahead of the unpack process.
+ *
+ * The prefetcher stops reading packages ahead once the packages it read
+ * and did not hand over yet use that many bytes (compressed .deb plus
+ * uncompressed data.tar.)
+ */
+const int64_t WPKGAR_MAX_PREFETCH_SIZE = 256 * 1024 * 1024;
+
+
+/** \brief Generate the key of a .deb file.
+ *
+ * The key is the path to the .deb file with its size and modification
+ * time so a package rebuilt in between does not reuse the old data.
+ *
+ * \param[in] fullname  The full path to the .deb file.
+ *
+ * \return The key or an empty string if the file cannot be stat()'ed.
+ */
+std::string package_file_key(const wpkg_filename::uri_filename& fullname)
+{
+    wpkg_filename::uri_filename::file_stat s;
+    if(!fullname.is_direct() || fullname.os_stat(s) != 0)
+    {
+        return "";
+    }
+    std::stringstream ss;
+    ss << fullname.full_path() << ':' << s.get_size() << ':' << s.get_mtime();
+    return ss.str();
+}
+
+
+/** \brief A package read ahead by the prefetcher.
+ *
+ * The f_deb and f_data_tar pointers are set once the package was read
+ * and its data.tar decompressed (f_done is true.)
+ */
+struct prefetch_item_t
+{
+    prefetch_item_t()
+        : f_size(0)
+        , f_started(false)
+        , f_done(false)
+        , f_failed(false)
+    {
+    }
+
+    std::string                             f_key;
+    wpkg_filename::uri_filename::os_filename_t  f_os_filename;
+    int64_t                                 f_size;
+    bool                                    f_started;
+    bool                                    f_done;
+    bool                                    f_failed;
+    std::shared_ptr<memfile::memory_file>   f_deb;
+    std::shared_ptr<memfile::memory_file>   f_data_tar;
+    md5::raw_md5sum                         f_md5sum;
+};
+
+
+/** \brief Read packages ahead of the unpack process.
+ *
+ * The prefetcher runs a background thread which reads the .deb files
+ * that are about to be unpacked, in the order they will be unpacked,
+ * and decompresses their data.tar. The unpack process then gets the
+ * data ready in memory (see take()) instead of waiting on the disk and
+ * the decompressor.
+ *
+ * The background thread only works on memory_file objects it owns and
+ * reads the files with plain C functions because the rest of the
+ * library (i.e. the stat() cache, the output) is not thread safe.
+ */
+class prefetcher
+{
+public:
+    prefetcher()
+        : f_next(0)
+        , f_size(0)
+        , f_stop(false)
+    {
+    }
+
+    ~prefetcher()
+    {
+        stop();
+    }
+
+    void start(const std::vector<prefetch_item_t>& items)
+    {
+        stop();
+        if(items.empty())
+        {
+            return;
+        }
+        f_items = items;
+        f_next = 0;
+        f_size = 0;
+        f_stop = false;
+        f_thread = std::thread(&prefetcher::run, this);
+    }
+
+    void stop()
+    {
+        {
+            std::unique_lock<std::mutex> lock(f_mutex);
+            f_stop = true;
+        }
+        f_cond.notify_all();
+        if(f_thread.joinable())
+        {
+            f_thread.join();
+        }
+        f_items.clear();
+        f_size = 0;
+    }
+
+    /** \brief Retrieve a package read ahead.
+     *
+     * If the package is being read, the function waits for it. If it
+     * was not started yet, it gets skipped and the caller has to read
+     * it. The packages before this one in the list are released since
+     * the unpack process went past them.
+     */
+    bool take(const std::string& key, prefetch_item_t& result)
+    {
+        std::unique_lock<std::mutex> lock(f_mutex);
+        size_t idx(0);
+        for(; idx < f_items.size() && f_items[idx].f_key != key; ++idx);
+        if(idx >= f_items.size())
+        {
+            return false;
+        }
+        for(size_t i(0); i < idx; ++i)
+        {
+            release(f_items[i]);
+        }
+        if(!f_items[idx].f_started)
+        {
+            // do not wait on the packages in between
+            f_next = std::max(f_next, idx + 1);
+            f_cond.notify_all();
+            return false;
+        }
+        while(!f_items[idx].f_done && !f_stop)
+        {
+            f_cond.wait(lock);
+        }
+        const bool ok(f_items[idx].f_done && !f_items[idx].f_failed && f_items[idx].f_deb);
+        if(ok)
+        {
+            result = f_items[idx];
+        }
+        release(f_items[idx]);
+        f_cond.notify_all();
+        return ok;
+    }
+
+private:
+    void release(prefetch_item_t& item)
+    {
+        // the caller holds the lock
+        if(item.f_done && !item.f_failed && item.f_deb)
+        {
+            f_size -= item.f_size;
+        }
+        item.f_deb.reset();
+        item.f_data_tar.reset();
+        item.f_failed = true;
+    }
+
+    void run()
+    {
+        for(;;)
+        {
+            size_t idx;
+            {
+                std::unique_lock<std::mutex> lock(f_mutex);
+                while(!f_stop && f_next < f_items.size() && f_size >= WPKGAR_MAX_PREFETCH_SIZE)
+                {
+                    f_cond.wait(lock);
+                }
+                if(f_stop || f_next >= f_items.size())
+                {
+                    return;
+                }
+                idx = f_next++;
+                f_items[idx].f_started = true;
+            }
+
+            prefetch_item_t item;
+            item.f_os_filename = f_items[idx].f_os_filename;
+            bool failed(true);
+            try
+            {
+                failed = !read(item);
+            }
+            catch(const std::exception&)
+            {
+                // the unpack process reads the package and reports the error
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(f_mutex);
+                prefetch_item_t& it(f_items[idx]);
+                it.f_done = true;
+                if(!failed && !it.f_failed)
+                {
+                    it.f_deb = item.f_deb;
+                    it.f_data_tar = item.f_data_tar;
+                    it.f_md5sum = item.f_md5sum;
+                    it.f_size = item.f_deb->size() + item.f_data_tar->size();
+                    f_size += it.f_size;
+                }
+                else
+                {
+                    it.f_failed = true;
+                }
+            }
+            f_cond.notify_all();
+        }
+    }
+
+    static bool read(prefetch_item_t& item)
+    {
+#if defined(MO_WINDOWS)
+        FILE *f(_wfopen(item.f_os_filename.get_utf16().c_str(), L"rb"));
+#else
+        FILE *f(fopen(item.f_os_filename.get_utf8().c_str(), "rb"));
+#endif
+        if(f == NULL)
+        {
+            return false;
+        }
+        std::shared_ptr<memfile::memory_file> deb(new memfile::memory_file);
+        deb->create(memfile::memory_file::file_format_ar);
+        char buf[64 * 1024];
+        int64_t pos(0);
+        for(;;)
+        {
+            const size_t r(fread(buf, 1, sizeof(buf), f));
+            if(r == 0)
+            {
+                break;
+            }
+            deb->write(buf, pos, static_cast<int64_t>(r));
+            pos += r;
+        }
+        const bool error(ferror(f) != 0);
+        fclose(f);
+        char magic[8];
+        if(error || pos < 8 || deb->read(magic, 0, 8) != 8 || memcmp(magic, "!<arch>\n", 8) != 0)
+        {
+            // not an uncompressed ar archive, let the unpack process deal with it
+            return false;
+        }
+
+        deb->dir_rewind();
+        for(;;)
+        {
+            memfile::memory_file::file_info info;
+            memfile::memory_file data;
+            if(!deb->dir_next(info, &data))
+            {
+                return false;
+            }
+            if(info.get_filename().substr(0, 8) == "data.tar")
+            {
+                std::shared_ptr<memfile::memory_file> tar(new memfile::memory_file);
+                if(data.is_compressed())
+                {
+                    data.decompress(*tar);
+                }
+                else
+                {
+                    data.copy(*tar);
+                }
+                tar->raw_md5sum(item.f_md5sum);
+                item.f_deb = deb;
+                item.f_data_tar = tar;
+                return true;
+            }
+        }
+    }
+
+    std::mutex                      f_mutex;
+    std::condition_variable         f_cond;
+    std::thread                     f_thread;
+    std::vector<prefetch_item_t>    f_items;
+    size_t                          f_next;
+    int64_t                         f_size;
+    bool                            f_stop;
+};
+
+prefetcher g_prefetcher;
+
+} // no name namespace
+
+
 /** \class wpkgar_exception
  * \brief The base exception of all the archive manager exceptions.
  *
@@ -301,18 +672,24 @@ public:
         wpkgar_manager *manager,
         const wpkg_filename::uri_filename& fullname,
         std::shared_ptr<wpkg_control::control_file::control_file_state_t> control_file_state);
+    ~wpkgar_package();
 
     void get_wpkgar_file(memfile::memory_file *& wpkgar_file_out);
     void set_package_path(const wpkg_filename::uri_filename& path);
     const wpkg_filename::uri_filename& get_package_path() const;
     const wpkg_filename::uri_filename& get_fullname() const;
+    bool is_data_skipped() const;
+    bool is_md5sums_verified() const;
     void check_contents();
     void set_field_variable(const std::string& name, const std::string& value);
 
     void read_archive(memfile::memory_file& p, bool skip_data = false);
+    void set_prefetched_data_tar(std::shared_ptr<memfile::memory_file> data_tar, const md5::raw_md5sum& sum);
+    std::string data_tar_share_key() const;
     void read_package();
     bool has_control_file(const std::string& filename);
     void read_control_file(memfile::memory_file& p, std::string& filename, bool compress);
+    void read_data_file(memfile::memory_file& p, const std::string& filename);
     bool validate_fields(const std::string& expression);
     bool load_conffiles();
     void conffiles(wpkgar_manager::conffiles_t& conf_files);
@@ -330,6 +707,7 @@ private:
 
     void read_control(memfile::memory_file& p);
     void read_data(memfile::memory_file& p);
+    bool verify_md5sum(const std::string& filename, const md5::raw_md5sum& sum) const;
 
     /** \brief Class used to memorize the location of files in an archive.
      *
@@ -346,6 +724,7 @@ private:
 
         void set_data_dir_pos(int pos);
         int get_data_dir_pos() const;
+        const memfile::memory_file::file_info& get_info() const;
 
     private:
         // avoid copies
@@ -365,10 +744,17 @@ private:
     wpkg_filename::uri_filename f_package_path;
     wpkg_filename::uri_filename f_fullname;
     controlled_vars::zbool_t    f_modified;         // if one or more files were modified
+    controlled_vars::zbool_t    f_data_skipped;     // read_archive() did not read data.tar
     controlled_vars::zbool_t    f_conffiles_defined;
     conffiles_t                 f_conffiles;
     file_t                      f_files;
     memfile::memory_file        f_wpkgar_file;
+    std::shared_ptr<memfile::memory_file> f_data_tar;   // uncompressed data.tar kept in memory (may be null)
+    controlled_vars::zbool_t    f_data_tar_shared;  // f_data_tar is also held by g_shared_data_tars
+    std::shared_ptr<memfile::memory_file> f_prefetched_data_tar;    // data.tar decompressed by the prefetcher (may be null)
+    md5::raw_md5sum             f_prefetched_md5sum;
+    wpkg_util::md5sums_map_t    f_md5sums;          // md5sums file of a .deb, used to verify its data files
+    controlled_vars::zbool_t    f_md5sums_verified; // read_data() found all the data files in f_md5sums
     wpkg_control::binary_control_file  f_control_file;     // control fields
     wpkg_control::status_control_file  f_status_file;      // control fields in the status file
 };
@@ -433,6 +819,18 @@ int wpkgar_package::wpkgar_file::get_data_dir_pos() const
     return f_data_dir_pos;
 }
 
+/** \brief Retrieve the file information.
+ *
+ * This function returns the information about this file as passed to
+ * the constructor.
+ *
+ * \return A reference to the file information.
+ */
+const memfile::memory_file::file_info& wpkgar_package::wpkgar_file::get_info() const
+{
+    return f_info;
+}
+
 
 wpkgar_package::wpkgar_package(
         wpkgar_manager *manager,
@@ -442,14 +840,30 @@ wpkgar_package::wpkgar_package(
     //, f_package_path -- auto-init (to invalid)
     , f_fullname(fullname)
     //, f_modified -- auto-init
+    //, f_data_skipped -- auto-init
     //, f_files -- auto-init
     //, f_wpkgar_file -- auto-init
+    //, f_data_tar -- auto-init
+    //, f_data_tar_shared -- auto-init
+    //, f_prefetched_data_tar -- auto-init
+    //, f_prefetched_md5sum -- auto-init
+    //, f_md5sums -- auto-init
+    //, f_md5sums_verified -- auto-init
     , f_control_file(control_file_state)
     , f_status_file()
 {
     manager->set_control_variables(f_control_file);
 }
 
+wpkgar_package::~wpkgar_package()
+{
+    // a shared data.tar remains in memory until the process exits
+    if(f_data_tar && !f_data_tar_shared)
+    {
+        g_retained_data_size -= f_data_tar->size();
+    }
+}
+
 void wpkgar_package::get_wpkgar_file(memfile::memory_file *& wpkgar_file_out)
 {
     wpkgar_file_out = &f_wpkgar_file;
@@ -470,6 +884,33 @@ const wpkg_filename::uri_filename& wpkgar_package::get_fullname() const
     return f_fullname;
 }
 
+/** \brief Check whether the data.tar archive was read.
+ *
+ * When a package is loaded with the skip_data flag set to true, the
+ * reading stops once the control.tar archive was read. This function
+ * returns true in that case.
+ *
+ * \return true if the data.tar archive of this package was not read.
+ */
+bool wpkgar_package::is_data_skipped() const
+{
+    return f_data_skipped;
+}
+
+/** \brief Check whether the data files were verified.
+ *
+ * This function returns true once read_data() checked every regular
+ * file of the data.tar archive against the md5sums file of the package.
+ * It returns false when the data.tar archive was not read, or when some
+ * of its files are not listed in the md5sums file.
+ *
+ * \return true if all the data files were verified.
+ */
+bool wpkgar_package::is_md5sums_verified() const
+{
+    return f_md5sums_verified;
+}
+
 void wpkgar_package::read_package()
 {
     if(f_wpkgar_file.size() != 0)
@@ -494,7 +935,11 @@ void wpkgar_package::read_package()
         }
         std::shared_ptr<wpkgar_file> file(new wpkgar_file(p, info));
         f_files[info.get_filename()] = file;
-        // we don't have the offset in the data file so that's it here
+        if(info.is_field_defined(memfile::memory_file::file_info::field_name_data_offset))
+        {
+            // offset of the file in the data.tar archive
+            file->set_data_dir_pos(static_cast<int>(info.get_data_offset()));
+        }
     }
 
     // control file
@@ -620,23 +1065,71 @@ void wpkgar_package::read_archive(memfile::memory_file& p, bool skip_data)
             has_control_tar_gz = true;
             if( skip_data )
             {
+                f_data_skipped = true;
                 break;
             }
         }
         else if(filename.substr(0, 8) == "data.tar")
         { // ignore compression extension
             f_files["data.tar"] = file;
-            // this is the data file, read its contents
-            if(data.is_compressed())
-            {
-                memfile::memory_file d;
-                data.copy(d);
-                d.decompress(data);
-            }
             // we save the file uncompressed in our db
             info.set_filename("data.tar");
-            f_wpkgar_file.append_file(info, data);
-            read_data(data);
+            const std::string share_key(g_share_data_tar ? data_tar_share_key() : "");
+            const shared_data_tars_t::iterator shared(g_shared_data_tars.find(share_key));
+            if(!share_key.empty() && shared != g_shared_data_tars.end())
+            {
+                // another manager already decompressed this very file
+                f_data_tar = shared->second.f_data_tar;
+                f_data_tar_shared = true;
+                info.set_raw_md5sum(shared->second.f_md5sum);
+                info.set_size(f_data_tar->size());
+                memfile::memory_file empty;
+                f_wpkgar_file.append_file(info, empty);
+                read_data(*f_data_tar);
+                has_data_tar_gz = true;
+                continue;
+            }
+            // this is the data file, read its contents unless the
+            // prefetcher already did so
+            std::shared_ptr<memfile::memory_file> tar(f_prefetched_data_tar);
+            md5::raw_md5sum sum(f_prefetched_md5sum);
+            f_prefetched_data_tar.reset();
+            if(!tar)
+            {
+                tar.reset(new memfile::memory_file);
+                if(data.is_compressed())
+                {
+                    data.decompress(*tar);
+                }
+                else
+                {
+                    data.copy(*tar);
+                }
+                tar->raw_md5sum(sum);
+            }
+            if(retain_data(tar->size()))
+            {
+                // keep the data in memory instead of writing it in the
+                // temporary directory; the database and the unpack
+                // process get it from here
+                f_data_tar = tar;
+                info.set_raw_md5sum(sum);
+                info.set_size(f_data_tar->size());
+                memfile::memory_file empty;
+                f_wpkgar_file.append_file(info, empty);
+                if(!share_key.empty())
+                {
+                    shared_data_tar_t& s(g_shared_data_tars[share_key]);
+                    s.f_data_tar = f_data_tar;
+                    s.f_md5sum = sum;
+                    f_data_tar_shared = true;
+                }
+            }
+            else
+            {
+                f_wpkgar_file.append_file(info, *tar);
+            }
+            read_data(*tar);
             has_data_tar_gz = true;
         }
         else
@@ -666,6 +1159,34 @@ void wpkgar_package::read_archive(memfile::memory_file& p, bool skip_data)
     f_wpkgar_file.write_file(f_package_path.append_child("index.wpkgar"), true);
 }
 
+/** \brief Generate the key used to share the data.tar of this package.
+ *
+ * The key is the path to the .deb file with its size and modification
+ * time so a package rebuilt in between does not reuse the old data.
+ *
+ * \return The key or an empty string if the .deb file cannot be stat()'ed.
+ */
+std::string wpkgar_package::data_tar_share_key() const
+{
+    return package_file_key(f_fullname);
+}
+
+
+/** \brief Use a data.tar decompressed by the prefetcher.
+ *
+ * The next call to read_archive() uses this data.tar instead of
+ * decompressing the one found in the .deb file.
+ *
+ * \param[in] data_tar  The uncompressed data.tar.
+ * \param[in] sum  The md5sum of \p data_tar.
+ */
+void wpkgar_package::set_prefetched_data_tar(std::shared_ptr<memfile::memory_file> data_tar, const md5::raw_md5sum& sum)
+{
+    f_prefetched_data_tar = data_tar;
+    f_prefetched_md5sum = sum;
+}
+
+
 void wpkgar_package::read_control(memfile::memory_file& p)
 {
     p.dir_rewind();
@@ -732,8 +1253,10 @@ void wpkgar_package::read_control(memfile::memory_file& p)
         }
         else if(filename == "md5sums")
         {
-            // TODO: verify the contents of the md5sums file?
-            //       verify so as we read the data file?
+            // the data files get verified against this list as we
+            // read the data.tar file (see read_data())
+            f_md5sums.clear();
+            wpkg_util::parse_md5sums(f_md5sums, data);
             has_md5sums = true;
         }
         // other files are optional
@@ -765,6 +1288,8 @@ void wpkgar_package::read_data(memfile::memory_file& p)
 {
     p.dir_rewind();
     bool has_data(false);
+    bool verified(true);
+    f_md5sums_verified = false;
     for(;;)
     {
         memfile::memory_file::file_info info;
@@ -777,6 +1302,7 @@ void wpkgar_package::read_data(memfile::memory_file& p)
                 // is that true? pseudo packages probably don't even have a data.tar.gz file?
                 throw wpkgar_exception_invalid("the data.tar.gz file cannot be empty");
             }
+            f_md5sums_verified = verified;
             break;
         }
         // should we consider directories as not being data? (although for them
@@ -799,6 +1325,9 @@ void wpkgar_package::read_data(memfile::memory_file& p)
             filename = "/" + filename;
         }
         info.set_filename(filename);
+        // the offset is also saved in the index so we can retrieve this
+        // file from the database data.tar without reading all of it
+        info.set_data_offset(dir_pos);
         std::shared_ptr<wpkgar_file> file(new wpkgar_file(f_wpkgar_file.size(), info));
         if(f_files.find(filename) != f_files.end())
         {
@@ -807,8 +1336,67 @@ void wpkgar_package::read_data(memfile::memory_file& p)
         // save offset for very fast retrieval
         file->set_data_dir_pos(dir_pos);
         f_files[filename] = file;
-        f_wpkgar_file.append_file(info, data);
+        switch(info.get_file_type())
+        {
+        case memfile::memory_file::file_info::regular_file:
+        case memfile::memory_file::file_info::continuous:
+            {
+                // the digest saved in the index is verified against the
+                // md5sums file so the database only holds valid digests
+                md5::raw_md5sum sum;
+                data.raw_md5sum(sum);
+                if(!verify_md5sum(filename, sum))
+                {
+                    verified = false;
+                }
+                info.set_raw_md5sum(sum);
+                memfile::memory_file empty;
+                f_wpkgar_file.append_file(info, empty);
+            }
+            break;
+
+        default:
+            f_wpkgar_file.append_file(info, data);
+            break;
+
+        }
+    }
+}
+
+
+/** \brief Verify the md5sum of a data file.
+ *
+ * This function checks the md5sum of a file found in the data.tar
+ * archive against the md5sums file of the package. Files that are
+ * not listed are accepted (Debian packages often do not list their
+ * configuration files.)
+ *
+ * \exception wpkgar_exception_invalid
+ * The md5sum of the file does not match the one found in the md5sums
+ * file (i.e. the package is corrupted.)
+ *
+ * \param[in] filename  The name of the file, with a leading slash.
+ * \param[in] sum  The md5sum of the file data.
+ *
+ * \return true if the file was verified, false if it is not listed.
+ */
+bool wpkgar_package::verify_md5sum(const std::string& filename, const md5::raw_md5sum& sum) const
+{
+    // the md5sums file uses paths without the leading slash
+    wpkg_util::md5sums_map_t::const_iterator it(f_md5sums.find(filename.substr(1)));
+    if(it == f_md5sums.end())
+    {
+        it = f_md5sums.find("." + filename);
+        if(it == f_md5sums.end())
+        {
+            return false;
+        }
+    }
+    if(it->second != md5::md5sum::sum(sum))
+    {
+        throw wpkgar_exception_invalid("the md5sum of \"" + filename + "\" in package \"" + f_fullname.original_filename() + "\" does not match its md5sums entry; the package is corrupted");
     }
+    return true;
 }
 
 bool wpkgar_package::has_control_file(const std::string& filename)
@@ -826,7 +1414,22 @@ void wpkgar_package::read_control_file(memfile::memory_file& p, std::string& fil
     }
     wpkgar::wpkgar_block_t header;
     f_wpkgar_file.read(reinterpret_cast<char *>(&header), it->second->get_offset(), sizeof(header));
-    p.read_file(f_package_path.append_child(filename));
+    if(f_data_tar && filename == "data.tar")
+    {
+        // the data.tar was kept in memory
+        f_data_tar->copy(p);
+    }
+    else
+    {
+        p.read_file(f_package_path.append_child(filename));
+        if(filename == "data.tar" && p.is_compressed())
+        {
+            // the database saves data.tar as a seekable zstd file
+            memfile::memory_file d;
+            p.copy(d);
+            d.decompress(p);
+        }
+    }
     if(compress && header.f_original_compression != wpkgar::wpkgar_block_t::WPKGAR_COMPRESSION_NONE)
     {
         memfile::memory_file::file_format_t format(memfile::memory_file::file_format_undefined);
@@ -867,6 +1470,85 @@ void wpkgar_package::read_control_file(memfile::memory_file& p, std::string& fil
     }
 }
 
+/** \brief Read one file from the data.tar archive.
+ *
+ * This function reads the file named \p filename from the data.tar of
+ * this package. The \p filename is the name as found in the index, i.e.
+ * it starts with a slash.
+ *
+ * When the data.tar is a seekable zstd file (as saved in the database)
+ * and the offset of the file in the archive is known, only the frames
+ * that include that file get decompressed. Otherwise the whole archive
+ * is read and searched.
+ *
+ * \exception wpkgar_exception_parameter
+ * This exception is raised if \p filename is not a file of this package.
+ *
+ * \param[out] p  The memory file receiving the file data.
+ * \param[in] filename  The name of the file to read.
+ */
+void wpkgar_package::read_data_file(memfile::memory_file& p, const std::string& filename)
+{
+    file_t::const_iterator it(f_files.find(filename));
+    if(it == f_files.end() || filename.empty() || filename[0] != '/')
+    {
+        throw wpkgar_exception_parameter("file \"" + filename + "\" is not a data file of this package");
+    }
+    const memfile::memory_file::file_info& file_info(it->second->get_info());
+
+    memfile::memory_file tar;
+    if(!f_data_tar)
+    {
+        memfile::memory_file data;
+        data.read_file(f_package_path.append_child("data.tar"));
+        if(data.is_seekable()
+        && file_info.is_field_defined(memfile::memory_file::file_info::field_name_data_offset))
+        {
+            // the header, long filename, and long link blocks, then the data
+            const int64_t block_size(512);
+            const int64_t name_size((file_info.get_filename().length() + block_size) & -block_size);
+            const int64_t link_size((file_info.get_link().length() + block_size) & -block_size);
+            const int64_t data_size((file_info.get_size() + block_size - 1) & -block_size);
+            data.decompress_range(tar, it->second->get_data_dir_pos(), block_size * 3 + name_size + link_size + data_size);
+        }
+        else if(data.is_compressed())
+        {
+            data.decompress(tar);
+        }
+        else
+        {
+            data.copy(tar);
+        }
+    }
+    memfile::memory_file& archive(f_data_tar ? *f_data_tar : tar);
+
+    archive.dir_rewind();
+    for(;;)
+    {
+        memfile::memory_file::file_info info;
+        if(!archive.dir_next(info, &p))
+        {
+            break;
+        }
+        // same transformation as in read_data()
+        std::string name(info.get_filename());
+        if(name.length() >= 2 && name[0] == '.' && name[1] == '/')
+        {
+            name.erase(0, 1);
+        }
+        else
+        {
+            name = "/" + name;
+        }
+        if(name == filename)
+        {
+            return;
+        }
+    }
+
+    throw wpkgar_exception_invalid("file \"" + filename + "\" was not found in the data.tar archive");
+}
+
 bool wpkgar_package::validate_fields(const std::string& expression)
 {
     return f_control_file.validate_fields(expression);
@@ -960,6 +1642,8 @@ wpkgar_manager::wpkgar_manager()
     //, f_selves(0) -- auto-init
     //, f_include_selves(NULL) -- auto-init
     //, f_tracker(NULL) -- auto-init
+    //, f_status_transaction_count(0) -- auto-init
+    //, f_status_transaction() -- auto-init
 {
 }
 
@@ -974,6 +1658,9 @@ wpkgar_manager::wpkgar_manager()
  */
 wpkgar_manager::~wpkgar_manager()
 {
+    // the packages read ahead are of no use past this manager
+    g_prefetcher.stop();
+
     // safely clear the tracker before we get cleared
     std::shared_ptr<wpkgar_tracker_interface> tracker;
     tracker.swap(f_tracker);
@@ -1458,7 +2145,9 @@ void wpkgar_manager::set_database_path(const wpkg_filename::uri_filename& databa
  * \param[in] filename  The name of the file to load.
  * \param[in] force_reload  If the package is installed, force a reload
  *                          (useful after an install/upgrade.)
- * \param[in] skip_data  Do not load data.tar file.
+ * \param[in] skip_data  Do not load data.tar file. A package file first
+ *                       loaded with skip_data set to true gets read again
+ *                       when later loaded with skip_data set to false.
  */
 void wpkgar_manager::load_package(const wpkg_filename::uri_filename& filename, bool force_reload, bool skip_data)
 {
@@ -1560,13 +2249,43 @@ void wpkgar_manager::load_temporary_package(const wpkg_filename::uri_filename& f
                << " They cannot be used at the same time! Please reinitialize your distribution root as it is likely corrupt!";
             throw wpkgar_exception_invalid(ss.str());
         }
-        return;
+        if(skip_data || !second_package->is_data_skipped())
+        {
+            return;
+        }
+        // the first load stopped after the control.tar archive and
+        // now the data is required, so read the whole package again
+        f_packages.erase(basename);
     }
 
     // in this case filename is a direct reference to a package (the .deb file)
-    memfile::memory_file p;
-    // load only the first 16 MB when we want to skip the data file
-    p.read_file(filename, NULL, skip_data ? 256 : -1);
+    memfile::memory_file file;
+    memfile::memory_file *deb(&file);
+    prefetch_item_t prefetched;
+    if(!skip_data && g_prefetcher.take(package_file_key(fullname), prefetched))
+    {
+        // the prefetcher already read this package
+        deb = prefetched.f_deb.get();
+        wpkg_output::log("package %1 was read ahead of its unpacking")
+                .quoted_arg(fullname)
+            .debug(wpkg_output::debug_flags::debug_progress)
+            .module(wpkg_output::module_unpack_package)
+            .package(fullname);
+    }
+    else
+    {
+        // read only the members before data.tar when we want to skip
+        // the data file
+        if(skip_data)
+        {
+            file.read_ar_file(filename, "data.tar");
+        }
+        else
+        {
+            file.read_file(filename);
+        }
+    }
+    memfile::memory_file& p(*deb);
     if(p.is_compressed())
     {
         // the file should not be compressed though
@@ -1583,6 +2302,10 @@ void wpkgar_manager::load_temporary_package(const wpkg_filename::uri_filename& f
     // the file looks proper, create a package and load the files
     std::shared_ptr<wpkgar_package> package(new wpkgar_package(this, fullname, f_control_file_state));
     package->set_package_path(wpkg_filename::uri_filename::tmpdir("packages").append_child(basename));
+    if(prefetched.f_data_tar)
+    {
+        package->set_prefetched_data_tar(prefetched.f_data_tar, prefetched.f_md5sum);
+    }
     package->read_archive(p, skip_data);
     f_packages[basename] = package;
 }
@@ -1620,6 +2343,21 @@ void wpkgar_manager::get_wpkgar_file(const wpkg_filename::uri_filename& package_
     get_package(package_name)->get_wpkgar_file(wpkgar_file);
 }
 
+/** \brief Check whether the data files of a package were verified.
+ *
+ * When a .deb file gets loaded, the files of its data.tar archive are
+ * checked against its md5sums file. This function returns true if that
+ * verification ran and covered all the regular files of the package.
+ *
+ * \param[in] package_name  The name of the package, which must be loaded.
+ *
+ * \return true if all the data files were verified.
+ */
+bool wpkgar_manager::md5sums_verified(const wpkg_filename::uri_filename& package_name) const
+{
+    return get_package(package_name)->is_md5sums_verified();
+}
+
 /** \brief Retrieve the status of an installed package.
  *
  * This function retrieves the status as defined in the X-Status field
@@ -1730,14 +2468,101 @@ wpkgar_manager::package_status_t wpkgar_manager::package_status(const wpkg_filen
  */
 wpkgar_manager::package_status_t wpkgar_manager::safe_package_status(const wpkg_filename::uri_filename& name)
 {
-    try
-    {
-        return package_status(name);
-    }
-    catch(...)
+    try
+    {
+        return package_status(name);
+    }
+    catch(...)
+    {
+        return not_installed;
+    }
+}
+
+
+/** \brief Share the uncompressed data.tar of packages between managers.
+ *
+ * By default the uncompressed data.tar of a .deb file is kept by the
+ * package object of one manager. When the same .deb files get installed
+ * in several roots by this process (one manager per root), turning this
+ * feature on keeps the uncompressed data.tar files of the .deb files in
+ * a process wide cache so each .deb file gets decompressed only once.
+ * A .deb file which size or modification time changed is decompressed
+ * again.
+ *
+ * The data.tar files shared in this way remain in memory until this
+ * function is called with false. The same memory limit as for the
+ * data.tar files kept by packages applies. Larger files are not shared.
+ *
+ * Since the memory is inherited by child processes, a process can load
+ * the packages first and then fork() one child per root.
+ *
+ * \param[in] share  Whether the data.tar files get shared; false also
+ *                   releases the data.tar files shared so far.
+ */
+void wpkgar_manager::share_data_tar(bool share)
+{
+    g_share_data_tar = share;
+    if(!share)
+    {
+        // packages still holding one of these data.tar files do not
+        // count it since it was flagged as shared
+        for(shared_data_tars_t::const_iterator it(g_shared_data_tars.begin()); it != g_shared_data_tars.end(); ++it)
+        {
+            g_retained_data_size -= it->second.f_data_tar->size();
+        }
+        g_shared_data_tars.clear();
+    }
+}
+
+
+/** \brief Read packages ahead of their unpacking.
+ *
+ * This function starts a background thread which reads the specified
+ * .deb files, in order, and decompresses their data.tar archive. When
+ * one of those packages later gets loaded with load_package(), the data
+ * read by the background thread is used instead of reading the file
+ * again. If the package is still being read, load_package() waits for
+ * it. This way reading and decompressing the next packages overlaps
+ * with writing the files of the current package and running its
+ * scripts.
+ *
+ * The background thread stops reading ahead once the packages it read
+ * and that were not loaded yet use 256Mb. Packages that are already
+ * fully loaded and remote packages are ignored.
+ *
+ * Calling this function again replaces the previous list. Calling it
+ * with an empty list stops the background thread and releases the
+ * packages read ahead.
+ *
+ * \param[in] filenames  The .deb files in the order they will be loaded.
+ */
+void wpkgar_manager::prefetch_packages(const wpkg_filename::filename_list_t& filenames)
+{
+    std::vector<prefetch_item_t> items;
+    for(wpkg_filename::filename_list_t::const_iterator it(filenames.begin()); it != filenames.end(); ++it)
     {
-        return not_installed;
+        if(it->is_deb() || !it->is_direct())
+        {
+            // installed or remote package
+            continue;
+        }
+        const wpkg_filename::uri_filename fullname(it->os_real_path());
+        packages_t::const_iterator pkg(f_packages.find(it->basename()));
+        if(pkg != f_packages.end() && !pkg->second->is_data_skipped())
+        {
+            // already fully loaded
+            continue;
+        }
+        prefetch_item_t item;
+        item.f_key = package_file_key(fullname);
+        if(item.f_key.empty())
+        {
+            continue;
+        }
+        item.f_os_filename = fullname.os_filename();
+        items.push_back(item);
     }
+    g_prefetcher.start(items);
 }
 
 
@@ -1868,6 +2693,143 @@ void wpkgar_manager::list_installed_packages(package_list_t& list)
 }
 
 
+/** \brief Compact the data of an installed package.
+ *
+ * Older versions of wpkg saved the data.tar of installed packages
+ * uncompressed in the database. This function converts that file to a
+ * seekable zstd file and saves the offset of each file of the archive
+ * in the index.wpkgar file so single files can be read back with
+ * get_data_file() without decompressing the whole archive.
+ *
+ * The new data.tar is first saved under a temporary name and then
+ * renamed so the database never includes a partial archive.
+ *
+ * \param[in] package_name  The name of the installed package to compact.
+ *
+ * \return true if the package was compacted, false if it did not need it.
+ */
+bool wpkgar_manager::compact_package(const std::string& package_name)
+{
+    load_package(package_name);
+    const wpkg_filename::uri_filename package_path(get_package_path(package_name));
+    const wpkg_filename::uri_filename data_filename(package_path.append_child("data.tar"));
+    if(!data_filename.exists())
+    {
+        // nothing to compact (i.e. purged package)
+        return false;
+    }
+
+    memfile::memory_file index;
+    index.read_file(package_path.append_child("index.wpkgar"));
+    bool has_offsets(true);
+    index.dir_rewind();
+    for(;;)
+    {
+        memfile::memory_file::file_info info;
+        if(!index.dir_next(info, NULL))
+        {
+            break;
+        }
+        if(info.get_filename().find('/') != std::string::npos
+        && !info.is_field_defined(memfile::memory_file::file_info::field_name_data_offset))
+        {
+            has_offsets = false;
+            break;
+        }
+    }
+
+    memfile::memory_file data;
+    data.read_file(data_filename);
+    if(has_offsets && data.is_seekable())
+    {
+        // already compacted
+        return false;
+    }
+
+    memfile::memory_file tar;
+    if(data.is_compressed())
+    {
+        data.decompress(tar);
+    }
+    else
+    {
+        data.copy(tar);
+    }
+
+    // determine the offset of each file in the archive
+    std::map<std::string, int64_t> offsets;
+    tar.dir_rewind();
+    for(;;)
+    {
+        memfile::memory_file::file_info info;
+        const int64_t dir_pos(tar.dir_pos());
+        if(!tar.dir_next(info, NULL))
+        {
+            break;
+        }
+        std::string filename(info.get_filename());
+        if(filename.length() >= 2 && filename[0] == '.' && filename[1] == '/')
+        {
+            filename.erase(0, 1);
+        }
+        else
+        {
+            filename = "/" + filename;
+        }
+        offsets[filename] = dir_pos;
+    }
+
+    // regenerate the index with the offsets
+    memfile::memory_file index_out;
+    index_out.create(memfile::memory_file::file_format_wpkg);
+    index_out.set_package_path(package_path);
+    index.dir_rewind();
+    for(;;)
+    {
+        memfile::memory_file::file_info info;
+        if(!index.dir_next(info, NULL))
+        {
+            break;
+        }
+        std::map<std::string, int64_t>::const_iterator it(offsets.find(info.get_filename()));
+        if(it != offsets.end())
+        {
+            info.set_data_offset(it->second);
+        }
+        memfile::memory_file empty;
+        index_out.append_file(info, empty);
+    }
+
+    memfile::memory_file compressed;
+    tar.compress_seekable(compressed, WPKGAR_DATABASE_COMPRESSION_LEVEL);
+    const wpkg_filename::uri_filename new_data_filename(package_path.append_child("data.tar.wpkg-new"));
+    compressed.write_file(new_data_filename);
+#if defined(MO_WINDOWS)
+    // rename() does not overwrite an existing file under MS-Windows
+    data_filename.os_unlink();
+#endif
+    if(!new_data_filename.os_rename(data_filename))
+    {
+        throw wpkgar_exception_io("could not rename \"" + new_data_filename.original_filename() + "\" to \"" + data_filename.original_filename() + "\"");
+    }
+    index_out.write_file(package_path.append_child("index.wpkgar"));
+
+    wpkg_output::log("package %1 data compacted from %2 to %3 bytes")
+            .quoted_arg(package_name)
+            .arg(data.size())
+            .arg(compressed.size())
+        .debug(wpkg_output::debug_flags::debug_progress)
+        .module(wpkg_output::module_tool)
+        .package(package_name)
+        .action("compact");
+
+    // the files offsets changed, reload the package
+    load_package(package_name, true);
+
+    return true;
+}
+
+
 /*===================================================================================*/
 std::string source::get_type() const
 {
@@ -2121,6 +3083,22 @@ void wpkgar_manager::get_control_file(memfile::memory_file& p, const wpkg_filena
     get_package(package_name)->read_control_file(p, control_filename, compress);
 }
 
+/** \brief Read one file from the data of a package.
+ *
+ * This function reads the file named \p filename (i.e. "/usr/bin/wpkg")
+ * from the data.tar archive of the specified package. For installed
+ * packages with a seekable data.tar, only the part of the archive that
+ * includes the file gets decompressed.
+ *
+ * \param[out] p  The memory file receiving the file data.
+ * \param[in] package_name  The name of the package.
+ * \param[in] filename  The name of the file to read.
+ */
+void wpkgar_manager::get_data_file(memfile::memory_file& p, const wpkg_filename::uri_filename& package_name, const std::string& filename)
+{
+    get_package(package_name)->read_data_file(p, filename);
+}
+
 bool wpkgar_manager::validate_fields(const wpkg_filename::uri_filename& package_name, const std::string& expression)
 {
     return get_package(package_name)->validate_fields(expression);
@@ -2142,6 +3120,91 @@ bool wpkgar_manager::field_is_defined(const wpkg_filename::uri_filename& package
         || get_package(package_name)->get_status_file_info().field_is_defined(name);
 }
 
+/** \brief Start a status transaction.
+ *
+ * While a status transaction is active, the set_field() functions called
+ * with \p save set to true only mark the status file of the package as
+ * modified. All the modified status files get written once when the
+ * last commit_status_transaction() gets called.
+ *
+ * This is used to apply all the field changes of one state transition
+ * of a package (i.e. X-Status and the corresponding dates) with a single
+ * write of its wpkg-status file.
+ *
+ * Transactions can be nested, only the outer most commit writes the
+ * files. You generally want to use the wpkgar_status_transaction class
+ * instead of calling this function directly.
+ *
+ * \sa commit_status_transaction()
+ */
+void wpkgar_manager::begin_status_transaction()
+{
+    ++f_status_transaction_count;
+}
+
+
+/** \brief Commit a status transaction.
+ *
+ * This function ends a status transaction started with
+ * begin_status_transaction(). If it was the outer most transaction,
+ * the status files modified since the transaction started get saved.
+ *
+ * \exception wpkgar_exception_invalid
+ * This exception is raised if no status transaction was started.
+ *
+ * \sa begin_status_transaction()
+ */
+void wpkgar_manager::commit_status_transaction()
+{
+    if(f_status_transaction_count <= 0)
+    {
+        throw wpkgar_exception_invalid("commit_status_transaction() called without a corresponding begin_status_transaction()");
+    }
+    --f_status_transaction_count;
+    if(f_status_transaction_count == 0)
+    {
+        status_transaction_t packages;
+        packages.swap(f_status_transaction);
+        for(status_transaction_t::const_iterator it(packages.begin()); it != packages.end(); ++it)
+        {
+            save_status_file(it->second);
+        }
+    }
+}
+
+
+/** \brief Save the status file of a package.
+ *
+ * This function writes the wpkg-status file of the specified package.
+ * The file is first written under a temporary name and then renamed
+ * so the status file on disk is always complete.
+ *
+ * If a status transaction is active, the package is only marked as
+ * modified and the file gets written on commit.
+ *
+ * \param[in] p  The package which status file is to be saved.
+ */
+void wpkgar_manager::save_status_file(const std::shared_ptr<wpkgar_package>& p)
+{
+    const wpkg_filename::uri_filename status_filename(p->get_package_path().append_child("wpkg-status"));
+    if(f_status_transaction_count > 0)
+    {
+        f_status_transaction[status_filename.full_path()] = p;
+        return;
+    }
+
+    memfile::memory_file ctrl;
+    p->get_status_file_info().write(ctrl, wpkg_field::field_file::WRITE_MODE_FIELD_ONLY);
+    const wpkg_filename::uri_filename new_filename(status_filename.append_path(".wpkg-new"));
+    ctrl.write_file(new_filename, true);
+#if defined(MO_WINDOWS)
+    // rename() does not overwrite an existing file
+    status_filename.os_unlink();
+#endif
+    new_filename.os_rename(status_filename, true);
+}
+
+
 void wpkgar_manager::set_field(const wpkg_filename::uri_filename& package_name, const std::string& name, const std::string& value, bool save)
 {
     const std::shared_ptr<wpkgar_package> p(get_package(package_name));
@@ -2149,9 +3212,7 @@ void wpkgar_manager::set_field(const wpkg_filename::uri_filename& package_name,
     cf.set_field(name, value);
     if(save)
     {
-        memfile::memory_file ctrl;
-        cf.write(ctrl, wpkg_field::field_file::WRITE_MODE_FIELD_ONLY);
-        ctrl.write_file(p->get_package_path().append_child("wpkg-status"), true);
+        save_status_file(p);
     }
 }
 
@@ -2162,9 +3223,7 @@ void wpkgar_manager::set_field(const wpkg_filename::uri_filename& package_name,
     cf.set_field(name, value);
     if(save)
     {
-        memfile::memory_file ctrl;
-        cf.write(ctrl, wpkg_field::field_file::WRITE_MODE_FIELD_ONLY);
-        ctrl.write_file(p->get_package_path().append_child("wpkg-status"), true);
+        save_status_file(p);
     }
 }
 
@@ -2287,6 +3346,22 @@ void wpkgar_manager::track(const std::string& command, const std::string& packag
 }
 
 
+/** \brief Make sure the tracked commands are saved.
+ *
+ * This function must be called after track() and before applying the
+ * corresponding action so the tracker has a chance to save its journal
+ * first. The tracker may save the commands tracked since the last call
+ * all at once.
+ */
+void wpkgar_manager::sync_tracker()
+{
+    if(f_tracker)
+    {
+        f_tracker->sync();
+    }
+}
+
+
 /** \brief Add one global hook.
  *
  * This function adds one global hook to the wpkg administration system.
@@ -2385,13 +3460,10 @@ void wpkgar_manager::install_hooks(const std::string& package_name)
     package_dir.dir_rewind(package_path, false);
     for(;;)
     {
-        // IMPORTANT NOTE: We probably should not read the data of all
-        //                 the files in this case since we really only
-        //                 are interested by the data of the very few
-        //                 hooks defined in this package (possibly zero!)
+        // only read the data of the very few hooks defined in this
+        // package (possibly zero!) and not the data of all the files
         memfile::memory_file::file_info info;
-        memfile::memory_file data;
-        if(!package_dir.dir_next(info, &data))
+        if(!package_dir.dir_next(info, NULL))
         {
             break;
         }
@@ -2432,6 +3504,8 @@ void wpkgar_manager::install_hooks(const std::string& package_name)
                 const char *ext("");
 #endif
                 const wpkg_filename::uri_filename destination(hooks_path.append_child(basename + ext));
+                memfile::memory_file data;
+                data.read_file(info.get_filename());
                 data.write_file(destination, true);
             }
         }
@@ -2561,9 +3635,110 @@ wpkgar_manager::hooks_t wpkgar_manager::list_hooks() const
  */
 bool wpkgar_manager::run_script(const wpkg_filename::uri_filename& package_name, script_t script, script_parameters_t params)
 {
-    // make sure it's loaded
-    load_package(package_name);
+    // make sure it's loaded (the scripts are in the control.tar archive
+    // so a package file does not need its data.tar loaded yet)
+    load_package(package_name, false, true);
+
+    wpkg_filename::filename_list_t scripts;
+    std::string interpreter;
+    find_scripts(package_name, script, scripts, interpreter);
+    const std::string parameters(script_parameters(params));
+    for(wpkg_filename::filename_list_t::const_iterator it(scripts.begin()); it != scripts.end(); ++it)
+    {
+        if(!run_one_script(package_name, interpreter, *it, parameters))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/** \brief Get the commands that run_script() would execute.
+ *
+ * This function returns the command lines that run_script() would pass
+ * to system() for the specified package script, in order. Each command
+ * includes the WPKG_... environment variables so it can be executed
+ * without changing the environment of this process, i.e. from another
+ * thread with run_script_command().
+ *
+ * \param[in] package_name  Name of the package of which the script is used.
+ * \param[in] script  The script to run.
+ * \param[in] params  A list of parameters which is not expected to be empty.
+ * \param[out] commands  The list of commands, empty if the package does
+ *                       not have such a script.
+ *
+ * \sa run_script()
+ */
+void wpkgar_manager::get_script_commands(const wpkg_filename::uri_filename& package_name, script_t script, const script_parameters_t& params, script_commands_t& commands)
+{
+    load_package(package_name, false, true);
+
+    wpkg_filename::filename_list_t scripts;
+    std::string interpreter;
+    find_scripts(package_name, script, scripts, interpreter);
+    const std::string parameters(script_parameters(params));
+    commands.clear();
+    for(wpkg_filename::filename_list_t::const_iterator it(scripts.begin()); it != scripts.end(); ++it)
+    {
+        std::string cmd(script_command(interpreter, *it, parameters));
+
+        // insert the environment right before the interpreter
+        const std::string cd("cd " + wpkg_util::make_safe_console_string(get_root_path().full_path()) + " && ");
+        script_environment_t env;
+        script_environment(package_name, env);
+        std::string vars;
+        for(script_environment_t::const_iterator e(env.begin()); e != env.end(); ++e)
+        {
+#ifdef MO_WINDOWS
+            std::string value(e->second);
+            std::replace(value.begin(), value.end(), '/', '\\');
+            vars += "set \"" + e->first + "=" + value + "\" && ";
+#else
+            vars += e->first + "=" + wpkg_util::make_safe_console_string(e->second) + " ";
+#endif
+        }
+        cmd.insert(cd.length(), vars);
+        commands.push_back(cmd);
+    }
+}
+
+
+/** \brief Run one of the commands returned by get_script_commands().
+ *
+ * This function runs the command with system() and appends its output
+ * (stdout and stderr) to the \p output file. It does not log anything
+ * and does not touch the manager so it can be called from any thread.
+ *
+ * \param[in] command  The command to execute.
+ * \param[in] output  The file receiving the output of the command.
+ *
+ * \return The value returned by system().
+ */
+int wpkgar_manager::run_script_command(const std::string& command, const wpkg_filename::uri_filename& output)
+{
+    const std::string cmd("(" + command + ") >>" + wpkg_util::make_safe_console_string(output.full_path()) + " 2>&1");
+#ifdef MO_WINDOWS
+    return _wsystem(libutf8::mbstowcs(cmd).c_str());
+#else
+    return system(cmd.c_str());
+#endif
+}
 
+
+/** \brief Search the files of a package script.
+ *
+ * The "core" package may have any number of hooks for one script. Other
+ * packages have zero or one script.
+ *
+ * \param[in] package_name  Name of the package of which the script is used.
+ * \param[in] script  The script to search.
+ * \param[out] scripts  The list of script files.
+ * \param[out] interpreter  The interpreter used to run those scripts.
+ */
+void wpkgar_manager::find_scripts(const wpkg_filename::uri_filename& package_name, script_t script, wpkg_filename::filename_list_t& scripts, std::string& interpreter)
+{
     // search for that script
     std::string control_filename;
     switch(script)
@@ -2597,16 +3772,11 @@ bool wpkgar_manager::run_script(const wpkg_filename::uri_filename& package_name,
     // (the --build does not check for binaries yet)
     control_filename += ".bat";
     // the MS-Windows batch cmd:
-    const std::string interpreter("%COMSPEC% /q /c");
+    interpreter = "%COMSPEC% /q /c";
 #else
     // default interpreter for Unix systems
-    const std::string interpreter("sh -e");
+    interpreter = "sh -e";
 #endif
-    std::string parameters;
-    for(script_parameters_t::const_iterator it(params.begin()); it != params.end(); ++it)
-    {
-        parameters += " " + wpkg_util::make_safe_console_string(*it);
-    }
     if(package_name.original_filename() == "core")
     {
         // if the package name is core then the name of the scripts are
@@ -2629,10 +3799,7 @@ bool wpkgar_manager::run_script(const wpkg_filename::uri_filename& package_name,
                 }
                 if(info.get_uri().glob(pattern.c_str()))
                 {
-                    if(!run_one_script(package_name, interpreter, info.get_filename(), parameters))
-                    {
-                        return false;
-                    }
+                    scripts.push_back(info.get_filename());
                 }
             }
         }
@@ -2640,15 +3807,23 @@ bool wpkgar_manager::run_script(const wpkg_filename::uri_filename& package_name,
     else if(has_control_file(package_name, control_filename))
     {
         const wpkg_filename::uri_filename& path(get_package(package_name)->get_package_path());
-        wpkg_filename::uri_filename script_name(path.append_child(control_filename));
-        return run_one_script(package_name, interpreter, script_name, parameters);
+        scripts.push_back(path.append_child(control_filename));
     }
+}
 
-    return true;
+
+std::string wpkgar_manager::script_parameters(const script_parameters_t& params)
+{
+    std::string parameters;
+    for(script_parameters_t::const_iterator it(params.begin()); it != params.end(); ++it)
+    {
+        parameters += " " + wpkg_util::make_safe_console_string(*it);
+    }
+    return parameters;
 }
 
 
-bool wpkgar_manager::run_one_script(const wpkg_filename::uri_filename& package_name, const std::string& interpreter, const wpkg_filename::uri_filename& script_name, const std::string& parameters)
+std::string wpkgar_manager::script_command(const std::string& interpreter, const wpkg_filename::uri_filename& script_name, const std::string& parameters) const
 {
     std::string cmd("cd " + wpkg_util::make_safe_console_string(get_root_path().full_path()) + " && " + interpreter + " ");
     std::string script(wpkg_util::make_safe_console_string(script_name.full_path()));
@@ -2666,6 +3841,21 @@ bool wpkgar_manager::run_one_script(const wpkg_filename::uri_filename& package_n
         cmd += '"';
     }
 #endif
+    return cmd;
+}
+
+
+void wpkgar_manager::script_environment(const wpkg_filename::uri_filename& package_name, script_environment_t& env) const
+{
+    env["WPKG_ROOT_PATH"]     = f_root_path.os_filename().get_utf8();
+    env["WPKG_DATABASE_PATH"] = f_database_path.os_filename().get_utf8();
+    env["WPKG_PACKAGE_NAME"]  = package_name.os_filename().get_utf8();
+}
+
+
+bool wpkgar_manager::run_one_script(const wpkg_filename::uri_filename& package_name, const std::string& interpreter, const wpkg_filename::uri_filename& script_name, const std::string& parameters)
+{
+    const std::string cmd(script_command(interpreter, script_name, parameters));
 
     wpkg_output::log("system(%1).")
             .quoted_arg(cmd)
@@ -2680,17 +3870,13 @@ bool wpkgar_manager::run_one_script(const wpkg_filename::uri_filename& package_n
     // we may want to reset our own environment to not leak stuff that should
     // not be visible to those scripts
     //
-    typedef std::map<std::string, std::string> env_map_t;
-    env_map_t env;
-    //
-    env["WPKG_ROOT_PATH"]     = f_root_path.os_filename().get_utf8();
-    env["WPKG_DATABASE_PATH"] = f_database_path.os_filename().get_utf8();
-    env["WPKG_PACKAGE_NAME"]  = package_name.os_filename().get_utf8();
+    script_environment_t env;
+    script_environment(package_name, env);
 
 #ifdef MO_WINDOWS
     int r;
 
-    for( env_map_t::const_iterator it = env.cbegin(); it != env.cend(); ++it )
+    for( script_environment_t::const_iterator it = env.cbegin(); it != env.cend(); ++it )
     {
         std::string value (it->second);
         //
@@ -2715,13 +3901,16 @@ bool wpkgar_manager::run_one_script(const wpkg_filename::uri_filename& package_n
 #else
     int r;
 
-    for( env_map_t::const_iterator it = env.cbegin(); it != env.cend(); ++it )
+    for( script_environment_t::const_iterator it = env.cbegin(); it != env.cend(); ++it )
     {
         r = setenv( it->first.c_str(), it->second.c_str(), 1 );
     }
 
     r = system( cmd.c_str() );
 #endif
+    // the script may have modified any file
+    wpkg_filename::os_stat_cache::clear();
+
     wpkg_output::log("system() call returned %1")
             .arg(r)
         .debug(wpkg_output::debug_flags::debug_scripts)
@@ -2782,6 +3971,57 @@ void wpkgar_lock::unlock()
     }
 }
 
+
+/** \brief Start a status transaction.
+ *
+ * The constructor calls wpkgar_manager::begin_status_transaction(). The
+ * transaction gets committed when commit() is called or when the object
+ * gets destroyed.
+ *
+ * \param[in] manager  The manager handling the packages.
+ */
+wpkgar_status_transaction::wpkgar_status_transaction(wpkgar_manager *manager)
+    : f_manager(manager)
+{
+    f_manager->begin_status_transaction();
+}
+
+
+/** \brief Commit the transaction if still active.
+ *
+ * The destructor commits the transaction if commit() was not called
+ * yet. Errors are ignored since a destructor cannot throw. This happens
+ * when an exception is being propagated, the status files then still
+ * get saved with the fields set so far.
+ */
+wpkgar_status_transaction::~wpkgar_status_transaction()
+{
+    try
+    {
+        commit();
+    }
+    catch(const std::exception&)
+    {
+    }
+}
+
+
+/** \brief Commit the transaction.
+ *
+ * This function saves the status files modified while the transaction
+ * was active (unless an outer transaction is still active.) Calling it
+ * more than once has no further effect.
+ */
+void wpkgar_status_transaction::commit()
+{
+    if(f_manager != NULL)
+    {
+        wpkgar_manager *manager(f_manager);
+        f_manager = NULL;
+        manager->commit_status_transaction();
+    }
+}
+
 wpkgar_interrupt::~wpkgar_interrupt()
 {
 }
@@ -2817,5 +4057,18 @@ void wpkgar_tracker_interface::track(const std::string& command, const std::stri
 }
 
 
+/** \brief Save the tracked events.
+ *
+ * A tracker may buffer the events passed to track(). This function is
+ * called right before an action is applied to the target and it must
+ * make sure that the events tracked so far are safe.
+ *
+ * The default function does nothing.
+ */
+void wpkgar_tracker_interface::sync()
+{
+}
+
+
 }
 // vim: ts=4 sw=4 et
@@ -0,0 +1,876 @@
+/*    wpkgar_binary_index.cpp -- implementation of the binary repository index
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief Implementation of the binary repository index.
+ *
+ * The binary index holds the same data as the index.tar.gz file of a
+ * repository in a format which does not need to be parsed. The file is
+ * composed of:
+ *
+ * \li a header (64 bytes) with a magic code, a version, the number of
+ *     packages, the offsets of the other tables, and the size,
+ *     modification time, and inode of the tar index the binary index
+ *     was created from;
+ * \li a string table, all the strings are null terminated;
+ * \li a package table with one 64 bytes record per package, sorted by
+ *     name, version, and architecture; each record references the name,
+ *     version, architecture, filename, and dependency fields in the string
+ *     table and the control file in the control frames;
+ * \li a frame table, one 16 bytes entry per frame;
+ * \li the control frames, each frame holds the control files of several
+ *     packages and is optionally compressed with zstd independently of
+ *     the other frames.
+ *
+ * All the numbers are saved in little endian.
+ *
+ * Once opened (memory mapped when possible), finding a package and reading
+ * its dependency fields does not require any parsing. Only the frame of a
+ * control file which gets used is decompressed.
+ */
+#include    "libdebpackages/wpkgar_binary_index.h"
+#include    "libdebpackages/compatibility.h"
+
+#ifdef debpackages_EXPORTS
+#define ZSTD_DLL 1
+#endif
+#include    "zstd.h"
+
+#include    <algorithm>
+#include    <sstream>
+#include    <string.h>
+#if !defined(MO_WINDOWS)
+#include    <fcntl.h>
+#include    <sys/mman.h>
+#include    <sys/stat.h>
+#include    <unistd.h>
+#endif
+
+
+namespace wpkgar
+{
+
+
+namespace
+{
+
+const char      BINARY_INDEX_MAGIC[8] = { 'W', 'P', 'K', 'G', 'B', 'I', 'X', '1' };
+const uint32_t  BINARY_INDEX_VERSION = 3;
+const uint32_t  BINARY_INDEX_FLAG_ZSTD = 0x0001;
+const uint32_t  BINARY_INDEX_HEADER_SIZE = 64;
+const uint32_t  BINARY_INDEX_RECORD_SIZE = 64;
+const uint32_t  BINARY_INDEX_FRAME_SIZE = 16;
+const uint32_t  BINARY_INDEX_NO_STRING = 0xFFFFFFFF;
+
+// offset of the validator string of the tar index in the header
+const uint32_t  HEADER_INDEX_VALIDATOR = 56;
+
+/** \brief Approximate size of the uncompressed control frames.
+ *
+ * A control file is never split between two frames so a frame may be
+ * a little larger than this size.
+ */
+const uint32_t  BINARY_INDEX_MAX_FRAME_DATA = 64 * 1024;
+
+
+/** \brief Compute the validator of a tar index.
+ *
+ * The validator is the size, modification time (including nanoseconds),
+ * and inode of the tar index file. It changes whenever the file gets
+ * rewritten and computing it does not require reading the file.
+ *
+ * \param[in] tar_index  The name of the tar index file.
+ *
+ * \return The validator or an empty string if stat() fails.
+ */
+std::string tar_index_validator(const wpkg_filename::uri_filename& tar_index)
+{
+    // use a new object so we do not get a cached stat() result
+    wpkg_filename::uri_filename::file_stat s;
+    if(wpkg_filename::uri_filename(tar_index.full_path()).os_stat(s) != 0)
+    {
+        return "";
+    }
+    std::stringstream ss;
+    ss << s.get_size() << " " << s.get_mtime() << " " << s.get_mtime_nano() << " " << s.get_inode();
+    return ss.str();
+}
+
+/** \brief The fields saved in the package records.
+ *
+ * The order must match the index_field_t enumeration.
+ */
+const char * const g_index_fields[wpkgar_binary_index::index_field_max] =
+{
+    "Depends",
+    "Pre-Depends",
+    "Provides",
+    "Conflicts",
+    "Breaks",
+    "Replaces"
+};
+
+// offsets of the data in a package record
+const uint32_t  RECORD_NAME = 0;
+const uint32_t  RECORD_VERSION = 4;
+const uint32_t  RECORD_ARCHITECTURE = 8;
+const uint32_t  RECORD_FILENAME = 12;
+const uint32_t  RECORD_FIELDS = 16;
+const uint32_t  RECORD_FRAME = 40;
+const uint32_t  RECORD_FRAME_OFFSET = 44;
+const uint32_t  RECORD_CONTROL_SIZE = 48;
+const uint32_t  RECORD_MTIME = 56;
+
+
+void put_uint32(std::vector<char>& out, uint32_t value)
+{
+    for(int i(0); i < 4; ++i)
+    {
+        out.push_back(static_cast<char>(value >> (i * 8)));
+    }
+}
+
+void put_uint64(std::vector<char>& out, uint64_t value)
+{
+    for(int i(0); i < 8; ++i)
+    {
+        out.push_back(static_cast<char>(value >> (i * 8)));
+    }
+}
+
+void set_uint32(std::vector<char>& out, size_t offset, uint32_t value)
+{
+    for(int i(0); i < 4; ++i)
+    {
+        out[offset + i] = static_cast<char>(value >> (i * 8));
+    }
+}
+
+void set_uint64(std::vector<char>& out, size_t offset, uint64_t value)
+{
+    for(int i(0); i < 8; ++i)
+    {
+        out[offset + i] = static_cast<char>(value >> (i * 8));
+    }
+}
+
+uint32_t get_uint32(const char *in)
+{
+    const unsigned char *u(reinterpret_cast<const unsigned char *>(in));
+    return static_cast<uint32_t>(u[0])
+        | (static_cast<uint32_t>(u[1]) << 8)
+        | (static_cast<uint32_t>(u[2]) << 16)
+        | (static_cast<uint32_t>(u[3]) << 24);
+}
+
+uint64_t get_uint64(const char *in)
+{
+    return static_cast<uint64_t>(get_uint32(in))
+        | (static_cast<uint64_t>(get_uint32(in + 4)) << 32);
+}
+
+
+/** \brief The strings of a binary index being created.
+ *
+ * Identical strings (architectures, dependencies...) are saved once.
+ */
+class string_table
+{
+public:
+    uint32_t add(const std::string& str)
+    {
+        std::map<std::string, uint32_t>::const_iterator it(f_offsets.find(str));
+        if(it != f_offsets.end())
+        {
+            return it->second;
+        }
+        const uint32_t offset(static_cast<uint32_t>(f_data.size()));
+        f_data.insert(f_data.end(), str.begin(), str.end());
+        f_data.push_back('\0');
+        f_offsets[str] = offset;
+        return offset;
+    }
+
+    const std::vector<char>& data() const
+    {
+        return f_data;
+    }
+
+private:
+    std::map<std::string, uint32_t> f_offsets;
+    std::vector<char>               f_data;
+};
+
+
+/** \brief A package of a binary index being created.
+ */
+struct index_package_t
+{
+    std::string                             f_name;
+    std::string                             f_version;
+    std::string                             f_architecture;
+    const wpkgar_repository::index_entry *  f_entry;
+    std::string                             f_fields[wpkgar_binary_index::index_field_max];
+    bool                                    f_defined[wpkgar_binary_index::index_field_max];
+
+    bool operator < (const index_package_t& rhs) const
+    {
+        if(f_name != rhs.f_name)
+        {
+            return f_name < rhs.f_name;
+        }
+        if(f_version != rhs.f_version)
+        {
+            return f_version < rhs.f_version;
+        }
+        if(f_architecture != rhs.f_architecture)
+        {
+            return f_architecture < rhs.f_architecture;
+        }
+        return f_entry->f_info.get_filename() < rhs.f_entry->f_info.get_filename();
+    }
+};
+
+} // no name namespace
+
+
+
+/** \class wpkgar_binary_index
+ * \brief Handle a binary repository index.
+ *
+ * This class creates and reads binary repository indexes. The create()
+ * function transforms the entries of a tar index (see
+ * wpkgar_repository::load_index()) in a binary index. The open() function
+ * memory maps such a file and the other functions give access to its
+ * packages.
+ *
+ * The functions returning strings and control files validate the offsets
+ * before using them so an invalid file generates an exception instead of
+ * a crash.
+ */
+
+
+wpkgar_binary_index::wpkgar_binary_index()
+    : f_data(NULL)
+    //, f_size(0) -- auto-init
+    //, f_buffer() -- auto-init
+    , f_mapped(NULL)
+    //, f_count(0) -- auto-init
+    //, f_frame_count(0) -- auto-init
+    //, f_strings_offset(0) -- auto-init
+    //, f_strings_size(0) -- auto-init
+    //, f_packages_offset(0) -- auto-init
+    //, f_frames_offset(0) -- auto-init
+    //, f_index_validator(BINARY_INDEX_NO_STRING) -- auto-init
+    //, f_compressed(false) -- auto-init
+    , f_frame_idx(-1)
+    //, f_frame() -- auto-init
+{
+}
+
+
+wpkgar_binary_index::~wpkgar_binary_index()
+{
+    close();
+}
+
+
+/** \brief Create a binary index from the entries of a tar index.
+ *
+ * The control file of each entry is parsed to extract its name, version,
+ * architecture, and dependency fields. The control files themselves are
+ * saved as is in the control frames.
+ *
+ * The \p tar_index parameter is the name of the tar index file as
+ * saved on disk. Its size, modification time, and inode are saved in the
+ * binary index to know whether it is still current (see is_current().)
+ *
+ * \param[in] entries  The entries as loaded by wpkgar_repository::load_index().
+ * \param[out] output  The memory file receiving the binary index.
+ * \param[in] compress  Whether the control frames get compressed with zstd.
+ * \param[in] tar_index  The name of the tar index file.
+ */
+void wpkgar_binary_index::create(const wpkgar_repository::entry_vector_t& entries, memfile::memory_file& output, bool compress, const wpkg_filename::uri_filename& tar_index)
+{
+    std::vector<index_package_t> packages;
+    packages.reserve(entries.size());
+    for(wpkgar_repository::entry_vector_t::const_iterator it(entries.begin()); it != entries.end(); ++it)
+    {
+        wpkg_control::binary_control_file ctrl(std::shared_ptr<wpkg_control::control_file::control_file_state_t>(new wpkg_control::control_file::control_file_state_t));
+        ctrl.set_input_file(&*it->f_control);
+        ctrl.read();
+        ctrl.set_input_file(NULL);
+
+        index_package_t p;
+        p.f_name = ctrl.get_field(wpkg_control::control_file::field_package_factory_t::canonicalized_name());
+        p.f_version = ctrl.get_field(wpkg_control::control_file::field_version_factory_t::canonicalized_name());
+        p.f_architecture = ctrl.get_field(wpkg_control::control_file::field_architecture_factory_t::canonicalized_name());
+        p.f_entry = &*it;
+        for(int f(0); f < index_field_max; ++f)
+        {
+            p.f_defined[f] = ctrl.field_is_defined(g_index_fields[f]);
+            if(p.f_defined[f])
+            {
+                p.f_fields[f] = ctrl.get_field(g_index_fields[f]);
+            }
+        }
+        packages.push_back(p);
+    }
+    std::sort(packages.begin(), packages.end());
+
+    // generate the strings, records, and frames
+    string_table strings;
+    const std::string validator(tar_index.empty() ? std::string() : tar_index_validator(tar_index));
+    const uint32_t validator_offset(validator.empty() ? BINARY_INDEX_NO_STRING : strings.add(validator));
+    std::vector<char> records;
+    std::vector<std::vector<char> > frames;
+    std::vector<uint32_t> frame_sizes;
+    std::vector<char> frame;
+    for(std::vector<index_package_t>::const_iterator it(packages.begin()); it != packages.end(); ++it)
+    {
+        put_uint32(records, strings.add(it->f_name));
+        put_uint32(records, strings.add(it->f_version));
+        put_uint32(records, strings.add(it->f_architecture));
+        put_uint32(records, strings.add(it->f_entry->f_info.get_filename()));
+        for(int f(0); f < index_field_max; ++f)
+        {
+            put_uint32(records, it->f_defined[f] ? strings.add(it->f_fields[f]) : BINARY_INDEX_NO_STRING);
+        }
+
+        const memfile::memory_file& control(*it->f_entry->f_control);
+        const int64_t size(control.size());
+        put_uint32(records, static_cast<uint32_t>(frames.size()));
+        put_uint32(records, static_cast<uint32_t>(frame.size()));
+        put_uint32(records, static_cast<uint32_t>(size));
+        put_uint32(records, 0);
+        put_uint64(records, static_cast<uint64_t>(it->f_entry->f_info.get_mtime()));
+
+        const size_t pos(frame.size());
+        frame.resize(pos + size);
+        if(size > 0)
+        {
+            control.read(&frame[pos], 0, static_cast<int>(size));
+        }
+        if(frame.size() >= BINARY_INDEX_MAX_FRAME_DATA)
+        {
+            frame_sizes.push_back(static_cast<uint32_t>(frame.size()));
+            frames.push_back(frame);
+            frame.clear();
+        }
+    }
+    if(!frame.empty())
+    {
+        frame_sizes.push_back(static_cast<uint32_t>(frame.size()));
+        frames.push_back(frame);
+    }
+
+    if(compress)
+    {
+        for(std::vector<std::vector<char> >::iterator f(frames.begin()); f != frames.end(); ++f)
+        {
+            std::vector<char> z(ZSTD_compressBound(f->size()));
+            const size_t r(ZSTD_compress(&z[0], z.size(), &(*f)[0], f->size(), 19));
+            if(ZSTD_isError(r))
+            {
+                throw wpkgar_exception_io(std::string("zstd failed compressing a binary index frame: ") + ZSTD_getErrorName(r));
+            }
+            z.resize(r);
+            f->swap(z);
+        }
+    }
+
+    // now save everything in the output
+    std::vector<char> out;
+    out.insert(out.end(), BINARY_INDEX_MAGIC, BINARY_INDEX_MAGIC + sizeof(BINARY_INDEX_MAGIC));
+    put_uint32(out, BINARY_INDEX_VERSION);
+    put_uint32(out, compress ? BINARY_INDEX_FLAG_ZSTD : 0);
+    put_uint32(out, static_cast<uint32_t>(packages.size()));
+    put_uint32(out, static_cast<uint32_t>(frames.size()));
+    const size_t offsets(out.size());
+    out.resize(BINARY_INDEX_HEADER_SIZE, '\0');
+
+    set_uint32(out, HEADER_INDEX_VALIDATOR, validator_offset);
+    set_uint64(out, offsets, out.size());
+    set_uint64(out, offsets + 8, strings.data().size());
+    out.insert(out.end(), strings.data().begin(), strings.data().end());
+    out.resize((out.size() + 7) & ~static_cast<size_t>(7), '\0');
+
+    set_uint64(out, offsets + 16, out.size());
+    out.insert(out.end(), records.begin(), records.end());
+
+    set_uint64(out, offsets + 24, out.size());
+    uint64_t frame_offset(out.size() + frames.size() * BINARY_INDEX_FRAME_SIZE);
+    for(size_t i(0); i < frames.size(); ++i)
+    {
+        put_uint64(out, frame_offset);
+        put_uint32(out, static_cast<uint32_t>(frames[i].size()));
+        put_uint32(out, frame_sizes[i]);
+        frame_offset += frames[i].size();
+    }
+    for(std::vector<std::vector<char> >::const_iterator f(frames.begin()); f != frames.end(); ++f)
+    {
+        out.insert(out.end(), f->begin(), f->end());
+    }
+
+    output.create(memfile::memory_file::file_format_other);
+    if(!out.empty())
+    {
+        output.write(&out[0], 0, static_cast<int>(out.size()));
+    }
+}
+
+
+/** \brief Check whether a file is a binary index.
+ *
+ * \param[in] file  The file to check.
+ *
+ * \return true if the file starts with the binary index magic code.
+ */
+bool wpkgar_binary_index::is_binary_index(const memfile::memory_file& file)
+{
+    char magic[sizeof(BINARY_INDEX_MAGIC)];
+    return file.size() >= BINARY_INDEX_HEADER_SIZE
+        && file.read(magic, 0, sizeof(magic)) == sizeof(magic)
+        && memcmp(magic, BINARY_INDEX_MAGIC, sizeof(magic)) == 0;
+}
+
+
+/** \brief Get the name of the binary index saved along a tar index.
+ *
+ * The binary index has the same name as the tar index with the .tar and
+ * compression extensions replaced by .wpkgidx. So the binary index of a
+ * repository is named index.wpkgidx.
+ *
+ * \param[in] tar_index  The name of the tar index (i.e. index.tar.gz).
+ *
+ * \return The name of the binary index.
+ */
+wpkg_filename::uri_filename wpkgar_binary_index::index_filename(const wpkg_filename::uri_filename& tar_index)
+{
+    std::string name(tar_index.original_filename());
+    const std::string::size_type slash(name.find_last_of('/'));
+    const std::string::size_type p(name.rfind(".tar"));
+    if(p != std::string::npos && (slash == std::string::npos || p > slash))
+    {
+        name = name.substr(0, p);
+    }
+    return wpkg_filename::uri_filename(name + ".wpkgidx");
+}
+
+
+/** \brief Open a binary index file.
+ *
+ * Local files get memory mapped so only the pages of the packages being
+ * used are read from disk. Other files are read in memory.
+ *
+ * \param[in] filename  The name of the binary index.
+ */
+void wpkgar_binary_index::open(const wpkg_filename::uri_filename& filename)
+{
+    close();
+
+#if !defined(MO_WINDOWS)
+    if(filename.is_direct())
+    {
+        const int fd(::open(filename.os_filename().get_utf8().c_str(), O_RDONLY));
+        if(fd == -1)
+        {
+            throw wpkgar_exception_io("could not open binary index \"" + filename.original_filename() + "\"");
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            throw wpkgar_exception_io("could not stat binary index \"" + filename.original_filename() + "\"");
+        }
+        if(st.st_size > 0)
+        {
+            void *ptr(mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0));
+            if(ptr != MAP_FAILED)
+            {
+                f_mapped = ptr;
+                f_data = static_cast<const char *>(ptr);
+                f_size = st.st_size;
+            }
+        }
+        ::close(fd);
+        if(f_mapped != NULL)
+        {
+            validate();
+            return;
+        }
+    }
+#endif
+
+    // cannot map, read the whole file instead
+    memfile::memory_file file;
+    file.read_file(filename);
+    load(file);
+}
+
+
+/** \brief Load a binary index from a memory file.
+ *
+ * The data is copied so the memory file can be released.
+ *
+ * \param[in] file  The file with the binary index.
+ */
+void wpkgar_binary_index::load(const memfile::memory_file& file)
+{
+    close();
+
+    f_buffer.resize(static_cast<size_t>(file.size()));
+    if(!f_buffer.empty())
+    {
+        file.read(&f_buffer[0], 0, static_cast<int>(f_buffer.size()));
+        f_data = &f_buffer[0];
+    }
+    f_size = f_buffer.size();
+    validate();
+}
+
+
+/** \brief Release the binary index.
+ */
+void wpkgar_binary_index::close()
+{
+#if !defined(MO_WINDOWS)
+    if(f_mapped != NULL)
+    {
+        munmap(f_mapped, static_cast<size_t>(f_size));
+    }
+#endif
+    f_mapped = NULL;
+    f_data = NULL;
+    f_size = 0;
+    f_buffer.clear();
+    f_count = 0;
+    f_frame_count = 0;
+    f_index_validator = BINARY_INDEX_NO_STRING;
+    f_frame_idx = -1;
+    f_frame.clear();
+}
+
+
+/** \brief Verify the header of the binary index.
+ *
+ * The function checks the magic code, the version, and that the tables
+ * are within the file.
+ */
+void wpkgar_binary_index::validate()
+{
+    if(f_data == NULL
+    || f_size < BINARY_INDEX_HEADER_SIZE
+    || memcmp(f_data, BINARY_INDEX_MAGIC, sizeof(BINARY_INDEX_MAGIC)) != 0)
+    {
+        close();
+        throw wpkgar_exception_invalid("this file is not a binary repository index");
+    }
+    if(get_uint32(f_data + 8) != BINARY_INDEX_VERSION)
+    {
+        close();
+        throw wpkgar_exception_compatibility("unsupported binary repository index version");
+    }
+    f_compressed = (get_uint32(f_data + 12) & BINARY_INDEX_FLAG_ZSTD) != 0;
+    f_count = get_uint32(f_data + 16);
+    f_frame_count = get_uint32(f_data + 20);
+    f_strings_offset = get_uint64(f_data + 24);
+    f_strings_size = get_uint64(f_data + 32);
+    f_packages_offset = get_uint64(f_data + 40);
+    f_frames_offset = get_uint64(f_data + 48);
+    f_index_validator = get_uint32(f_data + HEADER_INDEX_VALIDATOR);
+    if(f_strings_offset > f_size
+    || f_strings_size > f_size - f_strings_offset
+    || f_packages_offset > f_size
+    || static_cast<uint64_t>(f_count) * BINARY_INDEX_RECORD_SIZE > f_size - f_packages_offset
+    || f_frames_offset > f_size
+    || static_cast<uint64_t>(f_frame_count) * BINARY_INDEX_FRAME_SIZE > f_size - f_frames_offset)
+    {
+        close();
+        throw wpkgar_exception_invalid("the binary repository index tables are out of bounds");
+    }
+}
+
+
+/** \brief Get the number of packages in the binary index.
+ */
+wpkgar_binary_index::entry_t wpkgar_binary_index::size() const
+{
+    return f_count;
+}
+
+
+/** \brief Check whether the binary index matches a tar index.
+ *
+ * The binary index saves the size, modification time, and inode of the
+ * tar index it was created from. When any one of them changes, the tar
+ * index was rewritten and the binary index is stale and must not be
+ * used anymore. The tar index itself is not read.
+ *
+ * \param[in] tar_index  The name of the tar index file.
+ *
+ * \return true if the binary index was created from that tar index.
+ */
+bool wpkgar_binary_index::is_current(const wpkg_filename::uri_filename& tar_index) const
+{
+    if(f_index_validator == BINARY_INDEX_NO_STRING)
+    {
+        return false;
+    }
+    const std::string validator(tar_index_validator(tar_index));
+    return !validator.empty() && validator == string_at(f_index_validator);
+}
+
+
+const char *wpkgar_binary_index::package_record(entry_t idx) const
+{
+    if(idx >= f_count)
+    {
+        throw wpkgar_exception_parameter("binary repository index entry out of bounds");
+    }
+    return f_data + f_packages_offset + static_cast<uint64_t>(idx) * BINARY_INDEX_RECORD_SIZE;
+}
+
+
+std::string wpkgar_binary_index::string_at(uint32_t offset) const
+{
+    if(offset >= f_strings_size)
+    {
+        throw wpkgar_exception_invalid("binary repository index string out of bounds");
+    }
+    const char *s(f_data + f_strings_offset + offset);
+    const void *end(memchr(s, '\0', static_cast<size_t>(f_strings_size - offset)));
+    if(end == NULL)
+    {
+        throw wpkgar_exception_invalid("binary repository index string is not terminated");
+    }
+    return std::string(s, static_cast<const char *>(end) - s);
+}
+
+
+/** \brief Search the packages with the specified name.
+ *
+ * The packages are sorted by name so this is a binary search. Only the
+ * names of the packages being compared are read.
+ *
+ * \param[in] name  The name of the package to search.
+ * \param[out] first  The first package with that name.
+ * \param[out] last  The package after the last package with that name.
+ *
+ * \return true if at least one package has that name.
+ */
+bool wpkgar_binary_index::find(const std::string& name, entry_t& first, entry_t& last) const
+{
+    entry_t lo(0), hi(f_count);
+    while(lo < hi)
+    {
+        const entry_t mid(lo + (hi - lo) / 2);
+        if(get_name(mid) < name)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    first = lo;
+    hi = f_count;
+    while(lo < hi)
+    {
+        const entry_t mid(lo + (hi - lo) / 2);
+        if(get_name(mid) == name)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    last = lo;
+    return first < last;
+}
+
+
+std::string wpkgar_binary_index::get_name(entry_t idx) const
+{
+    return string_at(get_uint32(package_record(idx) + RECORD_NAME));
+}
+
+
+std::string wpkgar_binary_index::get_version(entry_t idx) const
+{
+    return string_at(get_uint32(package_record(idx) + RECORD_VERSION));
+}
+
+
+std::string wpkgar_binary_index::get_architecture(entry_t idx) const
+{
+    return string_at(get_uint32(package_record(idx) + RECORD_ARCHITECTURE));
+}
+
+
+/** \brief Get the filename of the control file of a package.
+ *
+ * This is the name of the entry in the tar index, the path of the
+ * package in the repository with the .deb extension replaced by .ctrl.
+ */
+std::string wpkgar_binary_index::get_filename(entry_t idx) const
+{
+    return string_at(get_uint32(package_record(idx) + RECORD_FILENAME));
+}
+
+
+time_t wpkgar_binary_index::get_mtime(entry_t idx) const
+{
+    return static_cast<time_t>(get_uint64(package_record(idx) + RECORD_MTIME));
+}
+
+
+/** \brief Check whether a field is saved in the package records.
+ *
+ * \param[in] name  The name of the field (case insensitive.)
+ * \param[out] field  The field number when found.
+ *
+ * \return true if the field is saved in the package records.
+ */
+bool wpkgar_binary_index::is_index_field(const std::string& name, index_field_t& field)
+{
+    for(int f(0); f < index_field_max; ++f)
+    {
+        if(strcasecmp(name.c_str(), g_index_fields[f]) == 0)
+        {
+            field = static_cast<index_field_t>(f);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool wpkgar_binary_index::field_is_defined(entry_t idx, index_field_t field) const
+{
+    return get_uint32(package_record(idx) + RECORD_FIELDS + field * 4) != BINARY_INDEX_NO_STRING;
+}
+
+
+std::string wpkgar_binary_index::get_field(entry_t idx, index_field_t field) const
+{
+    const uint32_t offset(get_uint32(package_record(idx) + RECORD_FIELDS + field * 4));
+    if(offset == BINARY_INDEX_NO_STRING)
+    {
+        return "";
+    }
+    return string_at(offset);
+}
+
+
+/** \brief Retrieve the control file of a package.
+ *
+ * The frame including the control file is decompressed if necessary. The
+ * last decompressed frame is kept so the packages saved next to each
+ * other do not decompress the same frame again.
+ *
+ * \param[in] idx  The package.
+ * \param[out] ctrl  The memory file receiving the control file.
+ */
+void wpkgar_binary_index::get_control(entry_t idx, memfile::memory_file& ctrl) const
+{
+    const char *record(package_record(idx));
+    const uint32_t frame_idx(get_uint32(record + RECORD_FRAME));
+    const uint32_t offset(get_uint32(record + RECORD_FRAME_OFFSET));
+    const uint32_t size(get_uint32(record + RECORD_CONTROL_SIZE));
+    if(frame_idx >= f_frame_count)
+    {
+        throw wpkgar_exception_invalid("binary repository index frame out of bounds");
+    }
+    const char *frame(f_data + f_frames_offset + static_cast<uint64_t>(frame_idx) * BINARY_INDEX_FRAME_SIZE);
+    const uint64_t frame_offset(get_uint64(frame));
+    const uint32_t frame_size(get_uint32(frame + 8));
+    const uint32_t data_size(get_uint32(frame + 12));
+    if(frame_offset > f_size
+    || frame_size > f_size - frame_offset
+    || static_cast<uint64_t>(offset) + size > data_size)
+    {
+        throw wpkgar_exception_invalid("binary repository index control file out of bounds");
+    }
+
+    const char *data(f_data + frame_offset);
+    if(f_compressed)
+    {
+        if(f_frame_idx != static_cast<int64_t>(frame_idx))
+        {
+            f_frame_idx = -1;
+            f_frame.resize(data_size);
+            const size_t r(ZSTD_decompress(f_frame.empty() ? NULL : &f_frame[0], data_size, data, frame_size));
+            if(ZSTD_isError(r) || r != data_size)
+            {
+                throw wpkgar_exception_invalid("binary repository index frame could not be decompressed");
+            }
+            f_frame_idx = frame_idx;
+        }
+        data = f_frame.empty() ? NULL : &f_frame[0];
+    }
+    else if(frame_size != data_size)
+    {
+        throw wpkgar_exception_invalid("binary repository index frame has an invalid size");
+    }
+
+    ctrl.create(memfile::memory_file::file_format_other);
+    if(size > 0)
+    {
+        ctrl.write(data + offset, 0, static_cast<int>(size));
+    }
+}
+
+
+/** \brief Transform the binary index in a list of tar index entries.
+ *
+ * This function generates the same entries as
+ * wpkgar_repository::load_index() would for the corresponding tar index,
+ * although sorted by package name. It reads all the control files.
+ *
+ * \param[out] entries  The vector receiving the entries.
+ */
+void wpkgar_binary_index::get_entries(wpkgar_repository::entry_vector_t& entries) const
+{
+    for(entry_t idx(0); idx < f_count; ++idx)
+    {
+        wpkgar_repository::index_entry e;
+        e.f_control.reset(new memfile::memory_file);
+        get_control(idx, *e.f_control);
+        e.f_info.set_filename(get_filename(idx));
+        e.f_info.set_file_type(memfile::memory_file::file_info::regular_file);
+        e.f_info.set_user("root");
+        e.f_info.set_group("root");
+        e.f_info.set_uid(0);
+        e.f_info.set_gid(0);
+        e.f_info.set_mode(0644);
+        e.f_info.set_mtime(get_mtime(idx));
+        e.f_info.set_size(e.f_control->size());
+        entries.push_back(e);
+    }
+}
+
+
+}   // namespace wpkgar
+// vim: ts=4 sw=4 et
@@ -126,6 +126,88 @@ const char * const non_binary_fields[] =
     NULL
 };
 
+
+/** \brief Describe one data.tar file in the Files field.
+ *
+ * Binary packages get a Files field listing all the files found in
+ * their data.tar archive in the longlist format (mode, size, md5sum,
+ * filename). This allows the installation validation to check sizes
+ * and overwrites without having to load the data.tar archive.
+ *
+ * The filename is saved with a leading slash, as in the index of the
+ * package in the database.
+ *
+ * \param[in,out] data_files  The list of files to add the item to.
+ * \param[in] info  The information about the file added to data.tar.
+ * \param[in] raw  The md5sum of the file data, or NULL if the file has
+ *                 no data (i.e. a directory.)
+ *
+ * \return false if the file type cannot be represented in a Files field
+ *         on this platform.
+ */
+bool add_data_file(wpkg_control::file_list_t& data_files, const memfile::memory_file::file_info& info, const md5::raw_md5sum *raw)
+{
+    mode_t type(0);
+    switch(info.get_file_type())
+    {
+    case memfile::memory_file::file_info::regular_file:
+    case memfile::memory_file::file_info::continuous:
+    case memfile::memory_file::file_info::hard_link:
+        type = S_IFREG;
+        break;
+
+    case memfile::memory_file::file_info::directory:
+        type = S_IFDIR;
+        break;
+
+    case memfile::memory_file::file_info::character_special:
+        type = S_IFCHR;
+        break;
+
+#ifndef MO_WINDOWS
+    case memfile::memory_file::file_info::symbolic_link:
+        type = S_IFLNK;
+        break;
+
+    case memfile::memory_file::file_info::block_special:
+        type = S_IFBLK;
+        break;
+
+    case memfile::memory_file::file_info::fifo:
+        type = S_IFIFO;
+        break;
+#endif
+
+    default:
+        return false;
+
+    }
+
+    std::string filename(info.get_filename());
+    if(filename.empty() || filename[0] != '/')
+    {
+        filename = "/" + filename;
+    }
+
+    wpkg_control::file_item item;
+    item.set_format(wpkg_control::file_item::format_longlist);
+    item.set_filename(filename);
+    item.set_mode(type | (info.get_mode() & 07777));
+    item.set_size(info.get_size());
+    if(raw == NULL)
+    {
+        // the longlist format requires a checksum, use the empty one
+        item.set_checksum(md5::md5sum().sum());
+    }
+    else
+    {
+        item.set_checksum(md5::md5sum::sum(*raw));
+    }
+    data_files.push_back(item);
+
+    return true;
+}
+
 } // no name namespace
 
 
@@ -3522,6 +3604,8 @@ void wpkgar_build::build_deb(const wpkg_filename::uri_filename& dir_name)
     data_tar.create(memfile::memory_file::file_format_tar);
     memfile::memory_file md5sums;
     md5sums.create(memfile::memory_file::file_format_other);
+    wpkg_control::file_list_t data_files(wpkg_control::control_file::field_files_factory_t::canonicalized_name());
+    bool has_data_files(true);
     memfile::memory_file in;
     size_t total_size(0);
 //::fprintf(stderr, "*** start dir_name = [%s]\n", dir_name.original_filename().c_str());
@@ -3599,6 +3683,7 @@ void wpkgar_build::build_deb(const wpkg_filename::uri_filename& dir_name)
         }
         memfile::memory_file empty_data;
         append_file(data_tar, info, empty_data);
+        has_data_files = add_data_file(data_files, info, NULL) && has_data_files;
         found[directory_name.full_path()] = info;
         case_sensitive_found[directory_name.full_path()] = info;
 
@@ -3715,6 +3800,7 @@ void wpkgar_build::build_deb(const wpkg_filename::uri_filename& dir_name)
                             case memfile::memory_file::file_info::field_name_size:
                             case memfile::memory_file::file_info::field_name_raw_md5sum:
                             case memfile::memory_file::file_info::field_name_original_compression:
+                            case memfile::memory_file::file_info::field_name_data_offset:
                             case memfile::memory_file::file_info::field_name_max:
                                 throw wpkgar_exception_invalid("invalid field name defined for a file meta data parameter");
 
@@ -3837,14 +3923,20 @@ void wpkgar_build::build_deb(const wpkg_filename::uri_filename& dir_name)
             case_sensitive_found[filename.full_path()] = info;
 
             // regular files get an md5sums
-            if(type == memfile::memory_file::file_info::regular_file
-            || type == memfile::memory_file::file_info::continuous)
+            const bool has_data(type == memfile::memory_file::file_info::regular_file
+                             || type == memfile::memory_file::file_info::continuous);
+            md5::raw_md5sum raw;
+            if(has_data)
+            {
+                input_data.raw_md5sum(raw);
+            }
+            has_data_files = add_data_file(data_files, info, has_data ? &raw : NULL) && has_data_files;
+
+            if(has_data)
             {
                 // round up the size to the next block
                 // TODO: let users define the block size
                 total_size += (info.get_size() + 511) & -512;
-                md5::raw_md5sum raw;
-                input_data.raw_md5sum(raw);
                 md5sums.printf("%s %c%s\n",
                         md5::md5sum::sum(raw).c_str(),
                         input_data.is_text() ? ' ' : '*',
@@ -3886,6 +3978,7 @@ void wpkgar_build::build_deb(const wpkg_filename::uri_filename& dir_name)
             case memfile::memory_file::file_info::directory: // TODO: order is important for directories...
             case memfile::memory_file::file_info::symbolic_link:
                 append_file(data_tar, add, input_data);
+                has_data_files = add_data_file(data_files, add, NULL) && has_data_files;
                 break;
 
             default:
@@ -4038,6 +4131,23 @@ void wpkgar_build::build_deb(const wpkg_filename::uri_filename& dir_name)
     // save the version of the packager used to create this package
     fields.set_field(wpkg_control::control_file::field_packagerversion_factory_t::canonicalized_name(), debian_packages_version_string());
 
+    // binary packages describe all their files in the Files field so the
+    // installation can be validated without loading the data.tar file;
+    // a Files field that does not describe the data.tar archive would be
+    // misleading so it gets removed if we cannot generate ours
+    if(!is_source)
+    {
+        if(has_data_files)
+        {
+            fields.set_field(wpkg_control::control_file::field_files_factory_t::canonicalized_name(),
+                    data_files.to_string(wpkg_control::file_item::format_longlist, true));
+        }
+        else if(fields.field_is_defined(wpkg_control::control_file::field_files_factory_t::canonicalized_name()))
+        {
+            fields.delete_field(wpkg_control::control_file::field_files_factory_t::canonicalized_name());
+        }
+    }
+
     // now create the control_tar file with the control and md5sum files
     memfile::memory_file control_tar;
     control_tar.create(memfile::memory_file::file_format_tar);
@@ -0,0 +1,480 @@
+/*    wpkgar_contents_index.cpp -- implementation of the repository contents index
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief Implementation of the repository contents index.
+ *
+ * The contents index is a gzip compressed text file with one line per
+ * file of each package of the repository:
+ *
+ * \code
+ * <path>\t<package>_<version>_<architecture>
+ * \endcode
+ *
+ * The path is absolute (i.e. "/usr/lib/libfoo.so".) The lines are sorted
+ * by basename, then by path, and then by package so a search for a file
+ * name, with or without its directory, is a binary search. Directories
+ * are not listed.
+ *
+ * The files are taken from the Files field of the control files found
+ * in the repository index. Packages without such a field (i.e. packages
+ * not created by wpkg) get their data.tar archive read instead.
+ */
+#include    "libdebpackages/wpkgar_contents_index.h"
+#include    "libdebpackages/wpkg_control.h"
+#include    "libdebpackages/compatibility.h"
+
+#include    <algorithm>
+#include    <sys/stat.h>
+
+
+namespace wpkgar
+{
+
+
+namespace
+{
+
+/** \brief Get the basename of a path in a contents line.
+ *
+ * \param[in] line  The line or path.
+ * \param[in] end  The position of the end of the path in \p line.
+ *
+ * \return The position of the first character of the basename.
+ */
+std::string::size_type basename_start(const std::string& line, std::string::size_type end)
+{
+    const std::string::size_type slash(line.find_last_of('/', end == 0 ? 0 : end - 1));
+    return slash == std::string::npos ? 0 : slash + 1;
+}
+
+
+/** \brief Compare two contents lines.
+ *
+ * The lines are sorted by basename first, then by path (which includes
+ * the basename) and finally by package.
+ *
+ * \param[in] lhs  The left hand side line.
+ * \param[in] rhs  The right hand side line.
+ *
+ * \return true if \p lhs is before \p rhs.
+ */
+bool line_less(const std::string& lhs, const std::string& rhs)
+{
+    const std::string::size_type lhs_tab(lhs.find('\t'));
+    const std::string::size_type rhs_tab(rhs.find('\t'));
+    const std::string::size_type lhs_base(basename_start(lhs, lhs_tab));
+    const std::string::size_type rhs_base(basename_start(rhs, rhs_tab));
+    const int r(lhs.compare(lhs_base, lhs_tab - lhs_base, rhs, rhs_base, rhs_tab - rhs_base));
+    if(r != 0)
+    {
+        return r < 0;
+    }
+    return lhs < rhs;
+}
+
+
+/** \brief Get the list of files from a control file.
+ *
+ * This function reads the Files field as created by wpkg (a format
+ * including the mode of the files, usually the longlist format) and
+ * keeps all the entries which are not directories.
+ *
+ * \param[in] control  The control file.
+ * \param[out] files  The absolute paths of the files of the package.
+ *
+ * \return false if the package does not have a usable Files field.
+ */
+bool files_from_control(const memfile::memory_file& control, std::vector<std::string>& files)
+{
+    wpkg_control::binary_control_file ctrl(std::shared_ptr<wpkg_control::control_file::control_file_state_t>(new wpkg_control::control_file::control_file_state_t));
+    ctrl.set_input_file(&control);
+    ctrl.read();
+    ctrl.set_input_file(NULL);
+
+    const std::string files_field(wpkg_control::control_file::field_files_factory_t::canonicalized_name());
+    if(!ctrl.field_is_defined(files_field))
+    {
+        return false;
+    }
+    wpkg_control::file_list_t list(files_field);
+    list.set(ctrl.get_field(files_field));
+    for(wpkg_control::file_list_t::const_iterator it(list.begin()); it != list.end(); ++it)
+    {
+        const std::string& filename(it->get_filename());
+        const wpkg_control::file_item::format_t format(it->get_format());
+        if((format != wpkg_control::file_item::format_modelist
+         && format != wpkg_control::file_item::format_longlist
+         && format != wpkg_control::file_item::format_metadata)
+        || filename.empty() || filename[0] != '/')
+        {
+            // not a Files field generated by wpkg
+            files.clear();
+            return false;
+        }
+        if((it->get_mode() & S_IFMT) != S_IFDIR)
+        {
+            files.push_back(filename);
+        }
+    }
+    return true;
+}
+
+
+/** \brief Get the list of files from a package data.tar archive.
+ *
+ * \param[in] package  The name of the .deb file.
+ * \param[out] files  The absolute paths of the files of the package.
+ *
+ * \return false if the package has no data.tar archive.
+ */
+bool files_from_package(const wpkg_filename::uri_filename& package, std::vector<std::string>& files)
+{
+    memfile::memory_file deb;
+    deb.read_file(package);
+    deb.dir_rewind();
+    for(;;)
+    {
+        memfile::memory_file::file_info info;
+        memfile::memory_file data;
+        if(!deb.dir_next(info, &data))
+        {
+            return false;
+        }
+        if(info.get_filename().compare(0, 8, "data.tar") != 0)
+        {
+            continue;
+        }
+        if(data.is_compressed())
+        {
+            memfile::memory_file compressed;
+            data.copy(compressed);
+            compressed.decompress(data);
+        }
+        data.dir_rewind();
+        for(;;)
+        {
+            memfile::memory_file::file_info data_info;
+            if(!data.dir_next(data_info, NULL))
+            {
+                return true;
+            }
+            if(data_info.get_file_type() == memfile::memory_file::file_info::directory)
+            {
+                continue;
+            }
+            std::string filename(data_info.get_filename());
+            if(filename.compare(0, 2, "./") == 0)
+            {
+                filename = filename.substr(1);
+            }
+            else if(filename.empty() || filename[0] != '/')
+            {
+                filename = "/" + filename;
+            }
+            files.push_back(filename);
+        }
+    }
+}
+
+} // no name namespace
+
+
+
+/** \class wpkgar_contents_index
+ * \brief Create and search a repository contents index.
+ *
+ * The create() function generates the index from the entries of a
+ * repository index. The load() and find() functions are used to search
+ * it.
+ */
+
+
+/** \class wpkgar_contents_index::match_t
+ * \brief One file found in the contents index.
+ */
+
+
+/** \brief Initialize a match.
+ *
+ * \param[in] path  The absolute path of the file.
+ * \param[in] package  The package name, version, and architecture.
+ */
+wpkgar_contents_index::match_t::match_t(const std::string& path, const std::string& package)
+    : f_path(path)
+    , f_package(package)
+{
+}
+
+
+/** \brief Get the path of the file that matched.
+ *
+ * \return The absolute path of the file.
+ */
+const std::string& wpkgar_contents_index::match_t::get_path() const
+{
+    return f_path;
+}
+
+
+/** \brief Get the package including the file that matched.
+ *
+ * \return The package as \<name>_\<version>_\<architecture>.
+ */
+const std::string& wpkgar_contents_index::match_t::get_package() const
+{
+    return f_package;
+}
+
+
+/** \brief Create a contents index.
+ *
+ * This function creates the contents index of the packages listed in
+ * \p entries, as loaded from a repository index. The packages without
+ * a Files field are searched in \p repositories and their data.tar
+ * archive gets read.
+ *
+ * \param[in] entries  The entries of the repository index.
+ * \param[in] repositories  The repositories the index was created from.
+ * \param[out] output  The resulting gzip compressed contents index.
+ */
+void wpkgar_contents_index::create(const wpkgar_repository::entry_vector_t& entries, const wpkg_filename::filename_list_t& repositories, memfile::memory_file& output)
+{
+    std::vector<std::string> lines;
+    for(wpkgar_repository::entry_vector_t::const_iterator it(entries.begin()); it != entries.end(); ++it)
+    {
+        const wpkg_filename::uri_filename ctrl_name(it->f_info.get_filename());
+        const std::string package(ctrl_name.basename());
+        std::vector<std::string> files;
+        if(!files_from_control(*it->f_control, files))
+        {
+            const std::string deb_name(ctrl_name.path_only().substr(0, ctrl_name.path_only().length() - 5) + ".deb");
+            for(wpkg_filename::filename_list_t::const_iterator r(repositories.begin()); r != repositories.end(); ++r)
+            {
+                const wpkg_filename::uri_filename deb(r->append_child(deb_name));
+                if(deb.is_direct() && deb.exists())
+                {
+                    files_from_package(deb, files);
+                    break;
+                }
+            }
+            if(files.empty())
+            {
+                wpkg_output::log("package %1 has no Files field and its .deb file was not found; its files are not part of the contents index.")
+                        .quoted_arg(ctrl_name)
+                    .level(wpkg_output::level_warning)
+                    .module(wpkg_output::module_repository)
+                    .package(package)
+                    .action("repository-index");
+                continue;
+            }
+        }
+        for(std::vector<std::string>::const_iterator f(files.begin()); f != files.end(); ++f)
+        {
+            // tabs and new lines would break the format
+            if(f->find_first_of("\t\n") == std::string::npos)
+            {
+                lines.push_back(*f + "\t" + package);
+            }
+        }
+    }
+
+    std::sort(lines.begin(), lines.end(), line_less);
+    lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+    memfile::memory_file contents;
+    contents.create(memfile::memory_file::file_format_other);
+    for(std::vector<std::string>::const_iterator it(lines.begin()); it != lines.end(); ++it)
+    {
+        contents.printf("%s\n", it->c_str());
+    }
+    contents.compress(output, memfile::memory_file::file_format_gz);
+}
+
+
+/** \brief Compute the name of the contents index of a repository index.
+ *
+ * The contents index is saved next to the index. Its name is the name
+ * of the index with the ".tar..." extensions replaced by ".contents.gz".
+ * So the contents of "index.tar.gz" is "index.contents.gz".
+ *
+ * \param[in] tar_index  The name of the repository index.
+ *
+ * \return The name of the corresponding contents index.
+ */
+wpkg_filename::uri_filename wpkgar_contents_index::index_filename(const wpkg_filename::uri_filename& tar_index)
+{
+    std::string name(tar_index.original_filename());
+    const std::string::size_type slash(name.find_last_of('/'));
+    const std::string::size_type p(name.rfind(".tar"));
+    if(p != std::string::npos && (slash == std::string::npos || p > slash))
+    {
+        name = name.substr(0, p);
+    }
+    return wpkg_filename::uri_filename(name + ".contents.gz");
+}
+
+
+/** \brief Load a contents index.
+ *
+ * The file is decompressed and the position of each line is saved so
+ * the lines can be searched with a binary search.
+ *
+ * \param[in] file  The contents index, compressed or not.
+ */
+void wpkgar_contents_index::load(const memfile::memory_file& file)
+{
+    memfile::memory_file contents;
+    if(file.is_compressed())
+    {
+        file.decompress(contents);
+    }
+    else
+    {
+        file.copy(contents);
+    }
+
+    f_data.resize(static_cast<size_t>(contents.size()));
+    if(!f_data.empty())
+    {
+        contents.read(&f_data[0], 0, contents.size());
+    }
+    f_lines.clear();
+    for(size_t pos(0); pos < f_data.size();)
+    {
+        const size_t eol(f_data.find('\n', pos));
+        const size_t tab(f_data.find('\t', pos));
+        if(tab == std::string::npos || (eol != std::string::npos && tab > eol))
+        {
+            throw wpkgar_exception_invalid("invalid line in contents index, tab character missing");
+        }
+        f_lines.push_back(pos);
+        if(eol == std::string::npos)
+        {
+            break;
+        }
+        pos = eol + 1;
+    }
+}
+
+
+/** \brief Get the number of files in the contents index.
+ *
+ * \return The number of lines loaded.
+ */
+size_t wpkgar_contents_index::size() const
+{
+    return f_lines.size();
+}
+
+
+/** \brief Search the contents index.
+ *
+ * The \p pattern is a path or a glob pattern (see uri_filename::glob().)
+ * A pattern without a slash is matched against the basename of the
+ * files. Otherwise it is matched against the whole path; a pattern which
+ * does not start with a slash or an asterisk gets a slash prepended.
+ *
+ * When the basename part of the pattern starts with a literal string
+ * (i.e. "libfoo.so", "*\/libfoo*", "/usr/lib/libfoo.so.?"), the lines
+ * with a basename starting with that string are found with a binary
+ * search so only those lines get checked against the pattern. Patterns
+ * with a basename starting with a wildcard (i.e. "/usr/bin/ *") require
+ * a check of all the lines.
+ *
+ * \param[in] pattern  The path or glob pattern to search.
+ * \param[out] matches  The files that matched, sorted by basename.
+ */
+void wpkgar_contents_index::find(const std::string& pattern, match_list_t& matches) const
+{
+    matches.clear();
+
+    const std::string::size_type slash(pattern.find_last_of('/'));
+    const bool full_path(slash != std::string::npos);
+    std::string pat(pattern);
+    if(full_path && pat[0] != '/' && pat[0] != '*')
+    {
+        pat = "/" + pat;
+    }
+    const std::string base_pattern(full_path ? pattern.substr(slash + 1) : pattern);
+    const std::string prefix(base_pattern.substr(0, base_pattern.find_first_of("*?[\\")));
+
+    // first line which basename may start with prefix
+    size_t first(0);
+    size_t last(f_lines.size());
+    if(!prefix.empty())
+    {
+        size_t lo(0);
+        size_t hi(f_lines.size());
+        while(lo < hi)
+        {
+            const size_t mid((lo + hi) / 2);
+            const std::string line(get_line(mid));
+            const std::string::size_type tab(line.find('\t'));
+            const std::string::size_type base(basename_start(line, tab));
+            if(line.compare(base, tab - base, prefix) < 0)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        first = lo;
+    }
+
+    for(size_t idx(first); idx < last; ++idx)
+    {
+        const std::string line(get_line(idx));
+        const std::string::size_type tab(line.find('\t'));
+        const std::string::size_type base(basename_start(line, tab));
+        if(!prefix.empty() && line.compare(base, std::min(prefix.length(), tab - base), prefix) != 0)
+        {
+            // past the lines with that prefix
+            break;
+        }
+        const std::string path(line.substr(0, tab));
+        const wpkg_filename::uri_filename filename(full_path ? path : line.substr(base, tab - base));
+        if(filename.glob(pat.c_str()))
+        {
+            matches.push_back(match_t(path, line.substr(tab + 1)));
+        }
+    }
+}
+
+
+/** \brief Get one line of the contents index.
+ *
+ * \param[in] idx  The index of the line.
+ *
+ * \return The line without the new line character.
+ */
+std::string wpkgar_contents_index::get_line(size_t idx) const
+{
+    const size_t start(f_lines[idx]);
+    const size_t eol(f_data.find('\n', start));
+    return f_data.substr(start, eol == std::string::npos ? std::string::npos : eol - start);
+}
+
+
+}   // namespace wpkgar
+// vim: ts=4 sw=4 et
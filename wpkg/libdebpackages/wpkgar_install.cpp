@@ -30,15 +30,24 @@
  */
 #include    "libdebpackages/wpkgar_install.h"
 #include    "libdebpackages/wpkgar_repository.h"
+#include    "libdebpackages/wpkgar_binary_index.h"
+#include    "libdebpackages/wpkgar_package_cache.h"
 #include    "libdebpackages/debian_version.h"
 #include    "libdebpackages/wpkg_backup.h"
+#include    "libdebpackages/wpkg_extract.h"
 #include    "libdebpackages/wpkg_util.h"
 #include    "libdebpackages/debian_packages.h"
 #include    <algorithm>
+#include    <atomic>
+#include    <chrono>
+#include    <condition_variable>
+#include    <exception>
 #include    <set>
 #include    <fstream>
 #include    <iostream>
+#include    <mutex>
 #include    <sstream>
+#include    <thread>
 #include    <stdarg.h>
 #include    <errno.h>
 #include    <time.h>
@@ -146,6 +155,7 @@ wpkgar_install::package_item_t::package_item_t(wpkgar_manager *manager, const wp
     //, f_architecture("") -- auto-init
     //, f_version("") -- auto-init
     , f_upgrade(-1) // no upgrade
+    //, f_bytes_read(0) -- auto-init
 {
 }
 
@@ -162,15 +172,71 @@ wpkgar_install::package_item_t::package_item_t(wpkgar_manager *manager, const wp
     //, f_architecture("") -- auto-init
     //, f_version("") -- auto-init
     , f_upgrade(-1) // no upgrade
+    //, f_bytes_read(0) -- auto-init
 {
     ctrl.copy(*f_ctrl);
 }
 
-void wpkgar_install::package_item_t::load(bool ctrl)
+/** \brief Initialize a package found in a binary repository index.
+ *
+ * The name, version, and architecture come from the index. The control
+ * file is only extracted from the index once a field that the index does
+ * not include gets used.
+ *
+ * \param[in] manager  The manager.
+ * \param[in] filename  The name of the .deb file in the repository.
+ * \param[in] type  The type of package.
+ * \param[in] index  The binary index defining this package.
+ * \param[in] entry  The package number in the binary index.
+ */
+wpkgar_install::package_item_t::package_item_t(wpkgar_manager *manager, const wpkg_filename::uri_filename& filename, package_type_t type, const std::shared_ptr<wpkgar_binary_index>& index, uint32_t entry)
+    : f_manager(manager)
+    , f_filename(filename)
+    , f_type(type)
+    //, f_ctrl(NULL) -- auto-init
+    //, f_fields(NULL) -- auto-init
+    //, f_loaded(false) -- auto-init
+    //, f_depends_done(false) -- auto-init
+    //, f_unpacked(false) -- auto-init
+    , f_name(index->get_name(entry))
+    , f_architecture(index->get_architecture(entry))
+    , f_version(index->get_version(entry))
+    , f_original_status(wpkgar_manager::unknown)
+    , f_upgrade(-1) // no upgrade
+    //, f_bytes_read(0) -- auto-init
+    , f_index(index)
+    , f_index_entry(entry)
+{
+}
+
+/** \brief Load the package.
+ *
+ * When \p ctrl is true, only the fields of the package are required.
+ * They come from the control file found in the repository index if
+ * available, otherwise from the control.tar archive of the package
+ * (local files only) or the whole package.
+ *
+ * When \p ctrl_archive is also true, the control.tar archive of the
+ * package gets loaded even if the fields are available from the
+ * repository index, i.e. to access the md5sums file. Remote packages
+ * get fully loaded in that case.
+ *
+ * When \p ctrl is false, the whole package gets loaded.
+ *
+ * \param[in] ctrl  Whether the control information is enough.
+ * \param[in] ctrl_archive  Whether the control.tar archive is required.
+ */
+void wpkgar_install::package_item_t::load(bool ctrl, bool ctrl_archive)
 {
+    if(ctrl && !f_ctrl && f_index)
+    {
+        f_ctrl.reset(new memfile::memory_file);
+        f_index->get_control(f_index_entry, *f_ctrl);
+    }
+
     // if we are only interested in a control file and it is available, then
     // load that data from the accompanying control file
-    if(ctrl && f_ctrl)
+    if(ctrl && f_ctrl && !ctrl_archive)
     {
         if(load_state_not_loaded == f_loaded)
         {
@@ -187,10 +253,36 @@ void wpkgar_install::package_item_t::load(bool ctrl)
         return;
     }
 
+    // a package file that is not installed yet only needs its control.tar
+    // archive to give access to its fields; its data.tar archive gets
+    // read once we unpack it (this is only done with local files since
+    // remote files would otherwise be downloaded twice)
+    const std::string scheme(f_filename.path_scheme());
+    if(ctrl && !f_filename.is_deb() && (scheme == "file" || scheme == "smb"))
+    {
+        if(load_state_not_loaded == f_loaded || load_state_control_file == f_loaded)
+        {
+            const int64_t bytes_read(memfile::memory_file::get_bytes_read());
+            f_manager->load_package(f_filename, false, true);
+            f_bytes_read += memfile::memory_file::get_bytes_read() - bytes_read;
+            if(load_state_not_loaded == f_loaded)
+            {
+                f_name = f_manager->get_field(f_filename, wpkg_control::control_file::field_package_factory_t::canonicalized_name());
+                f_architecture = f_manager->get_field(f_filename, wpkg_control::control_file::field_architecture_factory_t::canonicalized_name());
+                f_version = f_manager->get_field(f_filename, wpkg_control::control_file::field_version_factory_t::canonicalized_name());
+            }
+            f_original_status = f_manager->package_status(f_filename);
+            f_loaded = load_state_control_archive;
+        }
+        return;
+    }
+
     if(load_state_full != f_loaded)
     {
+        const int64_t bytes_read(memfile::memory_file::get_bytes_read());
         f_manager->load_package(f_filename);
-        if(load_state_control_file != f_loaded)
+        f_bytes_read += memfile::memory_file::get_bytes_read() - bytes_read;
+        if(load_state_not_loaded == f_loaded)
         {
             f_name = f_manager->get_field(f_filename, wpkg_control::control_file::field_package_factory_t::canonicalized_name());
             f_architecture = f_manager->get_field(f_filename, wpkg_control::control_file::field_architecture_factory_t::canonicalized_name());
@@ -206,6 +298,36 @@ const wpkg_filename::uri_filename& wpkgar_install::package_item_t::get_filename(
     return f_filename;
 }
 
+/** \brief Use a copy of the package from the package cache.
+ *
+ * The package must not have been loaded from its repository yet. The
+ * cached file has the same basename so the package keeps its name.
+ *
+ * \param[in] filename  The name of the file in the package cache.
+ */
+void wpkgar_install::package_item_t::set_cached_filename(const wpkg_filename::uri_filename& filename)
+{
+    if(load_state_full == f_loaded || load_state_control_archive == f_loaded)
+    {
+        throw std::logic_error("a package cannot be replaced by its cached file once loaded");
+    }
+    f_filename = filename;
+}
+
+/** \brief Check whether the control file comes from a repository index.
+ *
+ * \return true if the fields can be read without loading the package.
+ */
+bool wpkgar_install::package_item_t::has_index_control() const
+{
+    return f_ctrl || f_index;
+}
+
+bool wpkgar_install::package_item_t::is_fully_loaded() const
+{
+    return load_state_full == f_loaded;
+}
+
 void wpkgar_install::package_item_t::set_type(const package_type_t type)
 {
     f_type = type;
@@ -218,32 +340,49 @@ wpkgar_install::package_item_t::package_type_t wpkgar_install::package_item_t::g
 
 const std::string& wpkgar_install::package_item_t::get_name() const
 {
-    const_cast<package_item_t *>(this)->load(true);
+    if(!f_index)
+    {
+        const_cast<package_item_t *>(this)->load(true);
+    }
     return f_name;
 }
 
 const std::string& wpkgar_install::package_item_t::get_architecture() const
 {
-    const_cast<package_item_t *>(this)->load(true);
+    if(!f_index)
+    {
+        const_cast<package_item_t *>(this)->load(true);
+    }
     return f_architecture;
 }
 
 const std::string& wpkgar_install::package_item_t::get_version() const
 {
-    const_cast<package_item_t *>(this)->load(true);
+    if(!f_index)
+    {
+        const_cast<package_item_t *>(this)->load(true);
+    }
     return f_version;
 }
 
 wpkgar_manager::package_status_t wpkgar_install::package_item_t::get_original_status() const
 {
-    const_cast<package_item_t *>(this)->load(true);
+    if(!f_index)
+    {
+        const_cast<package_item_t *>(this)->load(true);
+    }
     return f_original_status;
 }
 
 bool wpkgar_install::package_item_t::field_is_defined(const std::string& name) const
 {
+    wpkgar_binary_index::index_field_t field;
+    if(f_index && load_state_not_loaded == f_loaded && wpkgar_binary_index::is_index_field(name, field))
+    {
+        return f_index->field_is_defined(f_index_entry, field);
+    }
     const_cast<package_item_t *>(this)->load(true);
-    if(load_state_full == f_loaded)
+    if(load_state_full == f_loaded || load_state_control_archive == f_loaded)
     {
         return f_manager->field_is_defined(f_filename, name);
     }
@@ -256,8 +395,13 @@ bool wpkgar_install::package_item_t::field_is_defined(const std::string& name) c
 
 std::string wpkgar_install::package_item_t::get_field(const std::string& name) const
 {
+    wpkgar_binary_index::index_field_t field;
+    if(f_index && load_state_not_loaded == f_loaded && wpkgar_binary_index::is_index_field(name, field))
+    {
+        return f_index->get_field(f_index_entry, field);
+    }
     const_cast<package_item_t *>(this)->load(true);
-    if(load_state_full == f_loaded)
+    if(load_state_full == f_loaded || load_state_control_archive == f_loaded)
     {
         return f_manager->get_field(f_filename, name);
     }
@@ -267,7 +411,7 @@ std::string wpkgar_install::package_item_t::get_field(const std::string& name) c
 bool wpkgar_install::package_item_t::get_boolean_field(const std::string& name) const
 {
     const_cast<package_item_t *>(this)->load(true);
-    if(load_state_full == f_loaded)
+    if(load_state_full == f_loaded || load_state_control_archive == f_loaded)
     {
         return f_manager->get_field_boolean(f_filename, name);
     }
@@ -284,7 +428,7 @@ bool wpkgar_install::package_item_t::get_boolean_field(const std::string& name)
 bool wpkgar_install::package_item_t::validate_fields(const std::string& expression) const
 {
     const_cast<package_item_t *>(this)->load(true);
-    if(load_state_full == f_loaded)
+    if(load_state_full == f_loaded || load_state_control_archive == f_loaded)
     {
         return f_manager->validate_fields(f_filename, expression);
     }
@@ -297,7 +441,9 @@ bool wpkgar_install::package_item_t::validate_fields(const std::string& expressi
 
 bool wpkgar_install::package_item_t::is_conffile(const std::string& path) const
 {
-    const_cast<package_item_t *>(this)->load(false);
+    // the conffiles file is part of the control.tar archive so the data
+    // does not need to be loaded unless all we have is the control file
+    const_cast<package_item_t *>(this)->load(!f_ctrl && !f_index);
     return const_cast<package_item_t *>(this)->f_manager->is_conffile(f_filename, path);
 }
 
@@ -321,6 +467,32 @@ bool wpkgar_install::package_item_t::is_unpacked() const
     return f_unpacked;
 }
 
+/** \brief Add to the number of bytes read for this package.
+ *
+ * This function is used to accumulate the number of bytes that were read
+ * from disk (or the network) in order to load and install this package.
+ *
+ * \param[in] size  The number of bytes to add.
+ */
+void wpkgar_install::package_item_t::add_bytes_read(int64_t size)
+{
+    f_bytes_read += size;
+}
+
+/** \brief Retrieve the number of bytes read for this package.
+ *
+ * This function returns the number of bytes read from disk (or the
+ * network) to load and install this package. When everything works as
+ * expected, this is about the size of the .deb file since the package
+ * is read only once.
+ *
+ * \return The number of bytes read so far for this package.
+ */
+int64_t wpkgar_install::package_item_t::get_bytes_read() const
+{
+    return f_bytes_read;
+}
+
 /** \brief Check whether a package is marked for installation.
  *
  * This function returns true if the current package type is set to
@@ -403,8 +575,7 @@ void wpkgar_install::package_item_t::copy_package_in_database()
     for(;;)
     {
         memfile::memory_file::file_info info;
-        memfile::memory_file data;
-        if(!temp.dir_next(info, &data))
+        if(!temp.dir_next(info, NULL))
         {
             break;
         }
@@ -428,6 +599,13 @@ void wpkgar_install::package_item_t::copy_package_in_database()
             continue;
         }
 
+        // the data.tar file is copied below, it may not be in the
+        // temporary directory
+        if(basename == "data.tar")
+        {
+            continue;
+        }
+
         if(basename == "md5sums")
         {
             // we want to keep a copy of the old md5sums in order
@@ -439,9 +617,25 @@ void wpkgar_install::package_item_t::copy_package_in_database()
             // if we're not upgrading the rename() fails too
             has_old_md5sums = destination.os_rename(old, false);
         }
+        memfile::memory_file data;
+        data.read_file(info.get_filename());
         data.write_file(destination);
     }
 
+    // the data.tar is generally kept in memory by the manager so we do
+    // not have to read it back from the temporary directory; we save
+    // it as a seekable zstd file (the index has the offset of each file)
+    // and share it with the other databases through the payload store
+    if(f_manager->has_control_file(f_filename, "data.tar"))
+    {
+        memfile::memory_file data;
+        std::string data_filename("data.tar");
+        f_manager->get_control_file(data, f_filename, data_filename, false);
+        memfile::memory_file compressed;
+        data.compress_seekable(compressed, WPKGAR_DATABASE_COMPRESSION_LEVEL);
+        wpkg_extract::extractor::write_stored_file(dir.append_child("data.tar"), compressed);
+    }
+
     memfile::memory_file wpkgar_file_out;
     wpkgar_file_out.create(memfile::memory_file::file_format_wpkg);
     wpkgar_file_out.set_package_path(dir);
@@ -487,6 +681,207 @@ void wpkgar_install::package_item_t::copy_package_in_database()
 }
 
 
+/** \brief Check whether a Files field describes the whole data.tar archive.
+ *
+ * Older versions of wpkg copied the Files field of the source control
+ * file as is, and it may be in the longlist format too. Such a field
+ * cannot be trusted to validate an installation since it may not list
+ * all the files of the package.
+ *
+ * The Files field generated by wpkg lists the parent directories of all
+ * its files and one regular file for each entry of the md5sums file,
+ * with the same md5sum. Other regular files are hard links and have no
+ * data. This function verifies all of that.
+ *
+ * \param[in] files  The files found in the Files field.
+ * \param[in] regular_files  The md5sum of the regular files of the Files
+ *                           field, the filenames without the leading slash.
+ *
+ * \return true if the Files field is what wpkg generates.
+ */
+bool wpkgar_install::package_item_t::is_data_files_complete(const file_info_list_t& files, const std::map<std::string, std::string>& regular_files) const
+{
+    std::set<std::string> directories;
+    for(file_info_list_t::const_iterator it(files.begin()); it != files.end(); ++it)
+    {
+        if(it->get_file_type() == memfile::memory_file::file_info::directory)
+        {
+            directories.insert(it->get_filename());
+        }
+    }
+    for(file_info_list_t::const_iterator it(files.begin()); it != files.end(); ++it)
+    {
+        // all the filenames start with a slash
+        const std::string& filename(it->get_filename());
+        const std::string::size_type pos(filename.find_last_of('/'));
+        if(pos > 0 && directories.find(filename.substr(0, pos)) == directories.end())
+        {
+            return false;
+        }
+    }
+
+    if(load_state_control_file == f_loaded)
+    {
+        // the fields come from a repository index, the md5sums file is
+        // only available in the control.tar archive of the package; a
+        // remote package cannot be partially read so we return false
+        // and the caller uses its data.tar archive instead
+        const std::string scheme(f_filename.path_scheme());
+        if(scheme != "file" && scheme != "smb")
+        {
+            return false;
+        }
+        const_cast<package_item_t *>(this)->load(true, true);
+    }
+    if(!f_manager->has_control_file(f_filename, "md5sums"))
+    {
+        return regular_files.empty();
+    }
+    memfile::memory_file md5sums_file;
+    std::string md5sums_filename("md5sums");
+    f_manager->get_control_file(md5sums_file, f_filename, md5sums_filename, false);
+    wpkg_util::md5sums_map_t md5sums;
+    try
+    {
+        wpkg_util::parse_md5sums(md5sums, md5sums_file);
+    }
+    catch(const wpkg_util::wpkg_util_exception&)
+    {
+        return false;
+    }
+    for(wpkg_util::md5sums_map_t::const_iterator it(md5sums.begin()); it != md5sums.end(); ++it)
+    {
+        wpkg_util::md5sums_map_t::const_iterator f(regular_files.find(it->first));
+        if(f == regular_files.end() || f->second != it->second)
+        {
+            return false;
+        }
+    }
+
+    // the other regular files are hard links which have no data
+    const std::string empty_md5sum(md5::md5sum().sum());
+    for(wpkg_util::md5sums_map_t::const_iterator it(regular_files.begin()); it != regular_files.end(); ++it)
+    {
+        if(md5sums.find(it->first) == md5sums.end() && it->second != empty_md5sum)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/** \brief Retrieve the list of files found in the data of this package.
+ *
+ * This function returns the list of files that this package installs
+ * on the target, with their type, mode, and size. The filenames start
+ * with a slash.
+ *
+ * Packages created by wpkg describe all their files in their Files field
+ * (in the longlist format) in which case the list is created from the
+ * control file alone and the data.tar archive does not get loaded. Older
+ * packages, or packages with a Files field that does not match their
+ * md5sums file (see is_data_files_complete()), are fully loaded and the
+ * list is created from their index.
+ *
+ * \param[out] files  The list of files to fill.
+ */
+void wpkgar_install::package_item_t::get_data_files(file_info_list_t& files) const
+{
+    files.clear();
+
+    const std::string files_field(wpkg_control::control_file::field_files_factory_t::canonicalized_name());
+    if(field_is_defined(files_field))
+    {
+        try
+        {
+            wpkg_control::file_list_t list(files_field);
+            list.set(get_field(files_field));
+            wpkg_util::md5sums_map_t regular_files;
+            for(wpkg_control::file_list_t::const_iterator it(list.begin()); it != list.end(); ++it)
+            {
+                const std::string& filename(it->get_filename());
+                if(it->get_format() != wpkg_control::file_item::format_longlist
+                || filename.empty() || filename[0] != '/')
+                {
+                    // not a Files field generated by wpkg
+                    files.clear();
+                    break;
+                }
+                memfile::memory_file::file_info info;
+                info.set_filename(filename);
+                switch(it->get_mode() & S_IFMT)
+                {
+                case S_IFDIR:
+                    info.set_file_type(memfile::memory_file::file_info::directory);
+                    break;
+
+                case S_IFCHR:
+                    info.set_file_type(memfile::memory_file::file_info::character_special);
+                    break;
+
+#ifndef MO_WINDOWS
+                case S_IFLNK:
+                    info.set_file_type(memfile::memory_file::file_info::symbolic_link);
+                    break;
+
+                case S_IFBLK:
+                    info.set_file_type(memfile::memory_file::file_info::block_special);
+                    break;
+
+                case S_IFIFO:
+                    info.set_file_type(memfile::memory_file::file_info::fifo);
+                    break;
+#endif
+
+                default:
+                    info.set_file_type(memfile::memory_file::file_info::regular_file);
+                    regular_files[filename.substr(1)] = it->get_checksum();
+                    break;
+
+                }
+                info.set_mode(it->get_mode() & 07777);
+                info.set_size(it->get_size());
+                files.push_back(info);
+            }
+            if(!files.empty()
+            && is_data_files_complete(files, regular_files))
+            {
+                return;
+            }
+            files.clear();
+        }
+        catch(const wpkg_control::wpkg_control_exception&)
+        {
+            // invalid Files field, use the package data instead
+            files.clear();
+        }
+    }
+
+    // make sure the data of the package is loaded
+    const_cast<package_item_t *>(this)->load(false);
+
+    memfile::memory_file *wpkgar_file;
+    f_manager->get_wpkgar_file(f_filename, wpkgar_file);
+    wpkgar_file->dir_rewind();
+    for(;;)
+    {
+        memfile::memory_file::file_info info;
+        if(!wpkgar_file->dir_next(info, NULL))
+        {
+            break;
+        }
+        const std::string& filename(info.get_filename());
+        if(!filename.empty() && filename[0] == '/')
+        {
+            // only keep filenames from the data archive
+            files.push_back(info);
+        }
+    }
+}
+
+
 
 
 
@@ -664,10 +1059,34 @@ wpkgar_install::wpkgar_install(wpkgar_manager *manager)
     //, f_field_names() -- auto-init
     //, f_read_essentials(false) -- auto-init
     //, f_install_source(false) -- auto-init
+    //, f_os_stat_cache() -- auto-init
+    //, f_prefetching_packages(false) -- auto-init
+    //, f_configure_jobs(0) -- auto-init
+    //, f_configure_queue() -- auto-init
+    //, f_fetch_jobs(0) -- auto-init
+    , f_package_cache_size(wpkgar_package_cache::DEFAULT_MAXIMUM_SIZE)
+    //, f_package_checksums() -- auto-init
+    //, f_cached_packages() -- auto-init
 {
 }
 
 
+/** \brief Clean up the installer.
+ *
+ * When unpack() stopped because of an error, the packages may still be
+ * read ahead in the background. The destructor stops that thread so it
+ * does not outlive the installation (i.e. a process which installs the
+ * same packages in several roots calls fork() afterward.)
+ */
+wpkgar_install::~wpkgar_install()
+{
+    if(f_prefetching_packages)
+    {
+        f_manager->prefetch_packages(wpkg_filename::filename_list_t());
+    }
+}
+
+
 void wpkgar_install::set_parameter(parameter_t flag, int value)
 {
     f_flags[flag] = value;
@@ -725,6 +1144,59 @@ void wpkgar_install::set_unpacking()
 }
 
 
+/** \brief Configure packages in parallel.
+ *
+ * By default the configure() function configures the package immediately.
+ * When the number of jobs is larger than 1, configure() only queues the
+ * package and the queued packages get configured by finish_configure().
+ * That function runs the postinst scripts of up to \p jobs packages at
+ * the same time as long as they do not depend on each other.
+ *
+ * The unpack() function calls finish_configure() before it returns
+ * WPKGAR_EOP or WPKGAR_ERROR. Pre-dependencies are not an issue since
+ * they have to be installed before the installation starts.
+ *
+ * \param[in] jobs  The maximum number of packages configured in parallel.
+ */
+void wpkgar_install::set_configure_jobs(int jobs)
+{
+    f_configure_jobs = jobs;
+}
+
+
+/** \brief Define the number of repositories read at the same time.
+ *
+ * When the installation needs the packages of the repositories, the
+ * index of each repository is read (or downloaded) and parsed. This
+ * is done for up to \p jobs repositories at the same time. By default
+ * 4 repositories are read in parallel.
+ *
+ * \param[in] jobs  The maximum number of repositories read in parallel.
+ */
+void wpkgar_install::set_fetch_jobs(int jobs)
+{
+    f_fetch_jobs = jobs;
+}
+
+
+/** \brief Define the maximum size of the package cache.
+ *
+ * Packages installed from remote repositories are downloaded in the
+ * package cache of the administration directory (core/cache) before
+ * the installation starts. The cache keeps up to \p size bytes of
+ * packages, the least recently used packages get removed first.
+ *
+ * When \p size is zero, the cache is not used and remote packages get
+ * downloaded when unpacked.
+ *
+ * \param[in] size  The maximum number of bytes kept in the cache.
+ */
+void wpkgar_install::set_package_cache_size(int64_t size)
+{
+    f_package_cache_size = size;
+}
+
+
 wpkgar_install::wpkgar_package_list_t::const_iterator wpkgar_install::find_package_item(const wpkg_filename::uri_filename& filename) const
 {
     for(wpkgar_package_list_t::size_type i(0); i < f_packages.size(); ++i)
@@ -829,6 +1301,17 @@ void wpkgar_install::add_package( const std::string& package, const bool force_r
                         const std::string full_path( entry.get_info().get_uri().full_path() );
                         package_item_t package_item( f_manager, full_path );
                         f_packages.push_back(package_item);
+
+                        // keep the index checksum to verify the download
+                        if( entry.field_is_defined("Package-md5sum") )
+                        {
+                            int64_t size(-1);
+                            if( entry.field_is_defined("Package-Size") )
+                            {
+                                size = strtoll(entry.get_field("Package-Size").c_str(), NULL, 10);
+                            }
+                            f_package_checksums[full_path] = std::make_pair(entry.get_field("Package-md5sum"), size);
+                        }
                     }
                 }
             }
@@ -844,6 +1327,31 @@ void wpkgar_install::add_package( const std::string& package, const bool force_r
 }
 
 
+/** \brief Add a package that may be used to satisfy dependencies.
+ *
+ * This function adds a .deb file to the list of packages available to
+ * satisfy the dependencies of the packages being installed, as if it
+ * had been found in a repository. It does not get installed unless
+ * one of the packages being installed depends on it.
+ *
+ * This is useful to install the packages selected by a previous
+ * validation (i.e. in another root with the same installed packages)
+ * without having to read the repositories again. The implicit packages
+ * of that validation are added with this function.
+ *
+ * \param[in] package  The path to a .deb file.
+ */
+void wpkgar_install::add_implicit_package(const std::string& package)
+{
+    const wpkg_filename::uri_filename pck(package);
+    if(find_package_item(pck) == f_packages.end())
+    {
+        package_item_t package_item(f_manager, pck, package_item_t::package_type_available);
+        f_packages.push_back(package_item);
+    }
+}
+
+
 const std::string& wpkgar_install::get_package_name(const int idx) const
 {
     return f_packages[idx].get_name();
@@ -2090,6 +2598,41 @@ void wpkgar_install::validate_predependencies()
 }
 
 
+/** \brief The results of reading one repository.
+ *
+ * The read_repositories() function checks which index files exist in
+ * local repositories (f_tar_index, f_binary_index, and f_create) before
+ * the worker threads start, so the workers do not stat() anything. The read_repository()
+ * function then fills one of these for each repository, possibly in
+ * a worker thread. The read_repositories() function finally adds the
+ * packages and logs the results in the order in which the repositories
+ * were specified.
+ */
+struct wpkgar_install::repository_job_t
+{
+    repository_job_t()
+        : f_tar_index(false)
+        , f_binary_index(false)
+        , f_binary(false)
+        , f_create(false)
+        , f_skipped(false)
+        , f_elapsed(0)
+    {
+    }
+
+    wpkg_filename::uri_filename                         f_repository;
+    bool                                                f_tar_index;
+    bool                                                f_binary_index;
+    bool                                                f_binary;
+    bool                                                f_create;
+    bool                                                f_skipped;
+    wpkgar_package_list_t                               f_packages;
+    std::vector<std::pair<std::string, std::string> >   f_rejected;
+    std::exception_ptr                                  f_error;
+    int64_t                                             f_elapsed;
+};
+
+
 void wpkgar_install::read_repositories()
 {
     // load the files once
@@ -2097,115 +2640,316 @@ void wpkgar_install::read_repositories()
     {
         f_repository_packages_loaded = true;
         const wpkg_filename::filename_list_t& repositories(f_manager->get_repositories());
-        for(wpkg_filename::filename_list_t::const_iterator it(repositories.begin()); it != repositories.end(); ++it)
+        std::vector<repository_job_t> jobs(repositories.size());
+        for(wpkg_filename::filename_list_t::size_type i(0); i < repositories.size(); ++i)
         {
-            f_manager->check_interrupt();
+            jobs[i].f_repository = repositories[i];
 
-            // repository must include an index, if not and the repository
-            // is a direct filename then we attempt to create the index now
-            wpkg_filename::uri_filename index_filename(it->append_child("index.tar.gz"));
-            memfile::memory_file index_file;
-            memfile::memory_file compressed;
+            // the file system is checked here, not in the workers
+            const wpkg_filename::uri_filename index_filename(repositories[i].append_child("index.tar.gz"));
             if(index_filename.is_direct())
             {
-                if(!index_filename.exists())
-                {
-                    wpkg_output::log("Creating index file, since it does not exist in repository '%1'.")
-                            .quoted_arg(*it)
-                        .debug(wpkg_output::debug_flags::debug_detail_config)
-                        .module(wpkg_output::module_validate_installation)
-                        .package(index_filename);
-
-                    // that's a direct filename but the index is missing,
-                    // create it on the spot
-                    wpkgar_repository repository(f_manager);
-                    // If the user wants a recursive repository index he will have to do it manually because --recursive is already
-                    // used for another purpose along the --install and I do not think that it is wise to do this here anyway
-                    //repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_recursive, get_parameter(wpkgar_install_recursive, false));
-                    repository.create_index(index_file);
-                    index_file.compress(compressed, memfile::memory_file::file_format_gz);
-                    compressed.write_file(index_filename);
-                }
-                else
-                {
-                    wpkg_output::log("Reading index file from repository '%1'.")
-                            .quoted_arg(*it)
-                        .debug(wpkg_output::debug_flags::debug_detail_config)
-                        .module(wpkg_output::module_validate_installation)
-                        .package(index_filename);
-
-                    // index exists, read it
-                    compressed.read_file(index_filename);
-                    compressed.decompress(index_file);
-                }
+                jobs[i].f_tar_index = index_filename.exists();
+                jobs[i].f_binary_index = wpkgar_binary_index::index_filename(index_filename).exists();
+                jobs[i].f_create = !jobs[i].f_tar_index && !jobs[i].f_binary_index;
             }
-            else
+        }
+
+        // read and parse the indexes with a pool of workers
+        int max_jobs(f_fetch_jobs == 0 ? 4 : static_cast<int>(f_fetch_jobs));
+        if(max_jobs > static_cast<int>(jobs.size()))
+        {
+            max_jobs = static_cast<int>(jobs.size());
+        }
+        if(max_jobs <= 1)
+        {
+            for(std::vector<repository_job_t>::iterator j(jobs.begin()); j != jobs.end(); ++j)
             {
-                // from remote URIs we cannot really expect the exists() call
-                // to work so we instead try to load the file directly; if it
-                // fails we just ignore that entry
-                try
-                {
-                    wpkg_output::log("Reading index file from remote repository '%1'.")
-                            .quoted_arg(*it)
-                        .debug(wpkg_output::debug_flags::debug_detail_config)
-                        .module(wpkg_output::module_validate_installation)
-                        .package(index_filename);
+                read_repository(*j);
+            }
+        }
+        else
+        {
+            std::atomic<size_t> next(0);
+            std::vector<std::thread> workers;
+            for(int i(0); i < max_jobs; ++i)
+            {
+                workers.push_back(std::thread([this, &jobs, &next]()
+                    {
+                        for(size_t idx(next++); idx < jobs.size(); idx = next++)
+                        {
+                            read_repository(jobs[idx]);
+                        }
+                    }));
+            }
+            for(std::vector<std::thread>::iterator w(workers.begin()); w != workers.end(); ++w)
+            {
+                w->join();
+            }
+        }
 
-                    compressed.read_file(index_filename);
-                    compressed.decompress(index_file);
-                }
-                catch(const memfile::memfile_exception&)
+        // add the packages in the order the repositories were specified
+        for(std::vector<repository_job_t>::iterator j(jobs.begin()); j != jobs.end(); ++j)
+        {
+            f_manager->check_interrupt();
+
+            if(j->f_error)
+            {
+                std::rethrow_exception(j->f_error);
+            }
+
+            wpkg_filename::uri_filename index_filename(j->f_repository.append_child("index.tar.gz"));
+            if(j->f_create)
+            {
+                wpkg_output::log("Creating index file, since it does not exist in repository '%1'.")
+                        .quoted_arg(j->f_repository)
+                    .debug(wpkg_output::debug_flags::debug_detail_config)
+                    .module(wpkg_output::module_validate_installation)
+                    .package(index_filename);
+
+                // that's a direct filename but the index is missing,
+                // create it on the spot
+                wpkgar_repository repository(f_manager);
+                // If the user wants a recursive repository index he will have to do it manually because --recursive is already
+                // used for another purpose along the --install and I do not think that it is wise to do this here anyway
+                //repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_recursive, get_parameter(wpkgar_install_recursive, false));
+                memfile::memory_file index_file;
+                memfile::memory_file compressed;
+                repository.create_index(index_file);
+                index_file.compress(compressed, memfile::memory_file::file_format_gz);
+                compressed.write_file(index_filename);
+                read_repository_index(*j, index_file);
+            }
+            else if(j->f_skipped)
+            {
+                wpkg_output::log("skip remote repository %1 as it does not seem to include an index.tar.gz file.")
+                        .quoted_arg(j->f_repository)
+                    .debug(wpkg_output::debug_flags::debug_detail_config)
+                    .module(wpkg_output::module_validate_installation)
+                    .package(index_filename);
+                continue;
+            }
+            else
+            {
+                if(j->f_binary)
                 {
-                    wpkg_output::log("skip remote repository %1 as it does not seem to include an index.tar.gz file.")
-                            .quoted_arg(*it)
-                        .debug(wpkg_output::debug_flags::debug_detail_config)
-                        .module(wpkg_output::module_validate_installation)
-                        .package(index_filename);
-                    continue;
+                    index_filename = wpkgar_binary_index::index_filename(index_filename);
                 }
+                wpkg_output::log(j->f_binary ? "Reading binary index file from repository '%1'."
+                               : index_filename.is_direct() ? "Reading index file from repository '%1'."
+                                                            : "Reading index file from remote repository '%1'.")
+                        .quoted_arg(j->f_repository)
+                    .debug(wpkg_output::debug_flags::debug_detail_config)
+                    .module(wpkg_output::module_validate_installation)
+                    .package(index_filename);
             }
 
-            // we keep a complete list of all the packages that have a valid filename
-            index_file.dir_rewind();
-            for(;;)
+            for(std::vector<std::pair<std::string, std::string> >::const_iterator r(j->f_rejected.begin()); r != j->f_rejected.end(); ++r)
             {
-                f_manager->check_interrupt();
+                // this is not an error, although in the end we may not
+                // find any package that satisfy this dependency...
+                wpkg_output::log("implicit package in file %1 does not have a valid architecture (%2) for this target machine (%3).")
+                        .quoted_arg(r->first)
+                        .arg(r->second)
+                        .arg(f_architecture)
+                    .debug(wpkg_output::debug_flags::debug_config)
+                    .module(wpkg_output::module_validate_installation)
+                    .package(r->first);
+            }
+
+            wpkg_output::log("repository %1 read in %2 ms (%3 packages).")
+                    .quoted_arg(j->f_repository)
+                    .arg(static_cast<long>(j->f_elapsed))
+                    .arg(static_cast<unsigned long>(j->f_packages.size()))
+                .debug(wpkg_output::debug_flags::debug_detail_config)
+                .module(wpkg_output::module_validate_installation);
+
+            f_packages.insert(f_packages.end(), j->f_packages.begin(), j->f_packages.end());
+        }
+    }
+}
 
-                memfile::memory_file::file_info info;
-                memfile::memory_file ctrl;
-                if(!index_file.dir_next(info, &ctrl))
-                {
-                    break;
-                }
-                std::string filename(info.get_filename());
-                // the filename in a repository index ends with .ctrl, we want to
-                // change that extension with .deb
-                if(filename.size() > 5 && filename.substr(filename.size() - 5) == ".ctrl")
-                {
-                    filename = filename.substr(0, filename.size() - 4) + "deb";
-                }
-                package_item_t package(f_manager, it->append_child(filename), package_item_t::package_type_available, ctrl);
 
-                // verify package architecture
-                const std::string arch(package.get_architecture());
-                if(arch != "all" && !wpkg_dependencies::dependencies::match_architectures(arch, f_architecture, get_parameter(wpkgar_install_force_vendor, false) != 0))
+/** \brief Read the index of one repository.
+ *
+ * This function reads the binary index or the tar index of the
+ * repository of \p job, downloading it if the repository is remote,
+ * and parses it. It does not log anything, it does not stat() any
+ * file, and it does not modify the install object so it can run in
+ * a worker thread. The results are saved in the job.
+ *
+ * A local repository without an index was marked with f_create by
+ * read_repositories() which creates its index once the workers are
+ * done. A remote repository without an index is marked with f_skipped.
+ *
+ * \param[in,out] job  The repository to read.
+ */
+void wpkgar_install::read_repository(repository_job_t& job) const
+{
+    const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+    try
+    {
+        // repository must include an index, if not and the repository
+        // is a direct filename then we attempt to create the index
+        const wpkg_filename::uri_filename index_filename(job.f_repository.append_child("index.tar.gz"));
+        memfile::memory_file index_file;
+        memfile::memory_file compressed;
+        std::shared_ptr<wpkgar_binary_index> index;
+        if(job.f_binary_index)
+        {
+            index.reset(new wpkgar_binary_index);
+            try
+            {
+                index->open(wpkgar_binary_index::index_filename(index_filename));
+                job.f_binary = !job.f_tar_index || binary_index_is_current(*index, index_filename);
+            }
+            catch(const wpkgar_exception&)
+            {
+                // an unusable binary index is ignored if we have the tar index
+                if(!job.f_tar_index)
                 {
-                    // this is not an error, although in the end we may not
-                    // find any package that satisfy this dependency...
-                    wpkg_output::log("implicit package in file %1 does not have a valid architecture (%2) for this target machine (%3).")
-                            .quoted_arg(filename)
-                            .arg(arch)
-                            .arg(f_architecture)
-                        .debug(wpkg_output::debug_flags::debug_config)
-                        .module(wpkg_output::module_validate_installation)
-                        .package(filename);
-                    continue;
+                    throw;
                 }
-
-                f_packages.push_back(package);
             }
         }
+        if(job.f_binary)
+        {
+            read_binary_index(job, index);
+        }
+        else if(index_filename.is_direct())
+        {
+            if(!job.f_create)
+            {
+                // index exists, read it
+                compressed.read_file(index_filename);
+                compressed.decompress(index_file);
+                read_repository_index(job, index_file);
+            }
+        }
+        else
+        {
+            // from remote URIs we cannot really expect the exists() call
+            // to work so we instead try to load the file directly; if it
+            // fails we just ignore that entry
+            try
+            {
+                compressed.read_file(index_filename);
+                compressed.decompress(index_file);
+            }
+            catch(const memfile::memfile_exception&)
+            {
+                job.f_skipped = true;
+            }
+            if(!job.f_skipped)
+            {
+                read_repository_index(job, index_file);
+            }
+        }
+    }
+    catch(...)
+    {
+        job.f_error = std::current_exception();
+    }
+    job.f_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+/** \brief Add the packages of a tar index to a repository job.
+ *
+ * Each control file of the index becomes a package item, unless its
+ * architecture does not match the target, in which case it is added
+ * to the list of rejected packages of the job.
+ *
+ * \param[in,out] job  The repository job.
+ * \param[in] index_file  The decompressed tar index.
+ */
+void wpkgar_install::read_repository_index(repository_job_t& job, memfile::memory_file& index_file) const
+{
+    // we keep a complete list of all the packages that have a valid filename
+    index_file.dir_rewind();
+    for(;;)
+    {
+        f_manager->check_interrupt();
+
+        memfile::memory_file::file_info info;
+        memfile::memory_file ctrl;
+        if(!index_file.dir_next(info, &ctrl))
+        {
+            break;
+        }
+        std::string filename(info.get_filename());
+        // the filename in a repository index ends with .ctrl, we want to
+        // change that extension with .deb
+        if(filename.size() > 5 && filename.substr(filename.size() - 5) == ".ctrl")
+        {
+            filename = filename.substr(0, filename.size() - 4) + "deb";
+        }
+        package_item_t package(f_manager, job.f_repository.append_child(filename), package_item_t::package_type_available, ctrl);
+
+        // verify package architecture
+        const std::string arch(package.get_architecture());
+        if(arch != "all" && !wpkg_dependencies::dependencies::match_architectures(arch, f_architecture, get_parameter(wpkgar_install_force_vendor, false) != 0))
+        {
+            job.f_rejected.push_back(std::make_pair(filename, arch));
+            continue;
+        }
+
+        job.f_packages.push_back(package);
+    }
+}
+
+
+/** \brief Check whether the binary index of a repository can be used.
+ *
+ * A local repository may include a binary index (index.wpkgidx) which
+ * can be used instead of its index.tar.gz file when it was created from
+ * that very tar index. The binary index saves the size, modification
+ * time, and inode of the tar index it was created from, so a tar index
+ * rewritten afterward is detected without reading it.
+ *
+ * \param[in] index  The opened binary index.
+ * \param[in] tar_index  The name of the tar index of that repository.
+ *
+ * \return true if the binary index is up to date.
+ */
+bool wpkgar_install::binary_index_is_current(const wpkgar_binary_index& index, const wpkg_filename::uri_filename& tar_index) const
+{
+    return index.is_current(tar_index);
+}
+
+
+/** \brief Read the binary index of a repository.
+ *
+ * The packages are added from the binary index, which must be current
+ * (see binary_index_is_current().) Their architecture is checked against
+ * the index directly and their control file is only extracted from the
+ * index when used (see package_item_t).
+ *
+ * \param[in,out] job  The repository job.
+ * \param[in] index  The opened binary index of that repository.
+ */
+void wpkgar_install::read_binary_index(repository_job_t& job, const std::shared_ptr<wpkgar_binary_index>& index) const
+{
+    const wpkgar_binary_index::entry_t max(index->size());
+    for(wpkgar_binary_index::entry_t idx(0); idx < max; ++idx)
+    {
+        f_manager->check_interrupt();
+
+        std::string filename(index->get_filename(idx));
+        if(filename.size() > 5 && filename.substr(filename.size() - 5) == ".ctrl")
+        {
+            filename = filename.substr(0, filename.size() - 4) + "deb";
+        }
+
+        // verify package architecture
+        const std::string arch(index->get_architecture(idx));
+        if(arch != "all" && !wpkg_dependencies::dependencies::match_architectures(arch, f_architecture, get_parameter(wpkgar_install_force_vendor, false) != 0))
+        {
+            job.f_rejected.push_back(std::make_pair(filename, arch));
+            continue;
+        }
+
+        job.f_packages.push_back(package_item_t(f_manager, job.f_repository.append_child(filename), package_item_t::package_type_available, index, idx));
     }
 }
 
@@ -4262,11 +5006,12 @@ class disk_list_t
 public:
     disk_list_t(wpkgar_manager *manager, wpkgar_install *install);
     void add_size(const std::string& path, int64_t size);
-    void compute_size_and_verify_overwrite(const wpkgar_install::wpkgar_package_list_t::size_type idx, const wpkgar_install::package_item_t& item, const wpkg_filename::uri_filename& root, memfile::memory_file *data, memfile::memory_file *upgrade, int factor);
+    void compute_size_and_verify_overwrite(const wpkgar_install::wpkgar_package_list_t::size_type idx, const wpkgar_install::package_item_t& item, const wpkg_filename::uri_filename& root, const wpkgar_install::package_item_t *upgrade, int factor);
     bool are_valid() const;
 
 private:
     typedef std::map<std::string, memfile::memory_file::file_info> filename_info_map_t;
+    typedef std::map<std::string, disk_t *> directory_disk_map_t;
 
     disk_t *find_disk(const std::string& path);
 
@@ -4275,6 +5020,7 @@ private:
     std::vector<disk_t>     f_disks;
     disk_t *                f_default_disk; // used in win32 only
     filename_info_map_t     f_filenames;
+    directory_disk_map_t    f_directory_disks;
 };
 
 
@@ -4284,6 +5030,7 @@ disk_list_t::disk_list_t(wpkgar_manager *manager, wpkgar_install *install)
       //f_disks() -- auto-init
       f_default_disk(NULL)
       //f_filenames() -- auto-init
+      //f_directory_disks() -- auto-init
 {
 #if defined(MO_WINDOWS) || defined(MO_CYGWIN)
     // limit ourselves to regular drives as local drives are all
@@ -4476,7 +5223,21 @@ disk_t *disk_list_t::find_disk(const std::string& path)
 
 void disk_list_t::add_size(const std::string& path, int64_t size)
 {
-    disk_t *d(find_disk(path));
+    // all the files of a directory are on the same disk so we search
+    // the list of disks once per directory
+    const std::string::size_type pos(path.find_last_of('/'));
+    const std::string dirname(pos == std::string::npos ? path : path.substr(0, pos + 1));
+    disk_t *d;
+    directory_disk_map_t::const_iterator it(f_directory_disks.find(dirname));
+    if(it == f_directory_disks.end())
+    {
+        d = find_disk(path);
+        f_directory_disks[dirname] = d;
+    }
+    else
+    {
+        d = it->second;
+    }
     if(d != NULL)
     {
         d->add_size(size);
@@ -4494,24 +5255,23 @@ void disk_list_t::add_size(const std::string& path, int64_t size)
 void disk_list_t::compute_size_and_verify_overwrite(const wpkgar_install::wpkgar_package_list_t::size_type idx,
                                                     const wpkgar_install::package_item_t& item,
                                                     const wpkg_filename::uri_filename& root,
-                                                    memfile::memory_file *data,
-                                                    memfile::memory_file *upgrade,
+                                                    const wpkgar_install::package_item_t *upgrade,
                                                     const int factor)
 {
     const wpkg_filename::uri_filename package_name(item.get_filename());
-    memfile::memory_file::file_info info;
+    wpkgar_install::package_item_t::file_info_list_t files;
 
     // if we have an upgrade package then we want to get all the filenames
     // first to avoid searching that upgrade package for every file we find
-    // in the new package being installed; we use that data file only to
+    // in the new package being installed; we use that list only to
     // determine whether an overwrite is normal or not
     std::map<std::string, memfile::memory_file::file_info> upgrade_files;
     if(upgrade != NULL)
     {
-        upgrade->dir_rewind();
-        while(upgrade->dir_next(info))
+        upgrade->get_data_files(files);
+        for(wpkgar_install::package_item_t::file_info_list_t::const_iterator it(files.begin()); it != files.end(); ++it)
         {
-            upgrade_files[info.get_filename()] = info;
+            upgrade_files[it->get_filename()] = *it;
         }
     }
 
@@ -4519,16 +5279,26 @@ void disk_list_t::compute_size_and_verify_overwrite(const wpkgar_install::wpkgar
     // wrong, but instead of hiding the warning...)
     wpkg_filename::uri_filename::file_stat s;
 
-    data->dir_rewind();
-    while(data->dir_next(info))
+    // the list of files comes from the Files field when available
+    // so the package data does not get loaded here
+    item.get_data_files(files);
+
+    // stat() all the files at once, directory by directory, the
+    // os_stat() calls below are then answered by the stat() cache
+    if(factor > 0)
     {
-        std::string path(info.get_filename());
-        if(path[0] != '/')
+        std::vector<wpkg_filename::uri_filename> targets;
+        targets.reserve(files.size());
+        for(wpkgar_install::package_item_t::file_info_list_t::const_iterator file(files.begin()); file != files.end(); ++file)
         {
-            // files that do not start with a slash are part of the database
-            // only so we ignore them here
-            continue;
+            targets.push_back(root.append_child(file->get_filename()));
         }
+        wpkg_filename::os_stat_cache::prefetch(targets);
+    }
+    for(wpkgar_install::package_item_t::file_info_list_t::iterator file(files.begin()); file != files.end(); ++file)
+    {
+        memfile::memory_file::file_info& info(*file);
+        const std::string path(info.get_filename());
         if(factor == 1)
         {
             filename_info_map_t::const_iterator it(f_filenames.find(path));
@@ -4829,28 +5599,12 @@ bool wpkgar_install::find_essential_file(std::string filename, const size_t skip
                 continue;
             }
 
-            // TODO: change this load and use the Files field instead
-            // make sure the package is loaded
-            f_manager->load_package(f_packages[idx].get_filename());
-
             // check all the files defined in the data archive
-            memfile::memory_file *wpkgar_file;
-            f_manager->get_wpkgar_file(f_packages[idx].get_filename(), wpkgar_file);
-
-            wpkgar_file->dir_rewind();
-            for(;;)
+            package_item_t::file_info_list_t files;
+            f_packages[idx].get_data_files(files);
+            for(package_item_t::file_info_list_t::const_iterator it(files.begin()); it != files.end(); ++it)
             {
-                memfile::memory_file::file_info info;
-                if(!wpkgar_file->dir_next(info, NULL))
-                {
-                    break;
-                }
-                std::string file(info.get_filename());
-                if(file[0] == '/')
-                {
-                    // only keep filenames from the data archive
-                    f_essential_files.push_back(file);
-                }
+                f_essential_files.push_back(it->get_filename());
             }
         }
     }
@@ -4922,6 +5676,140 @@ void wpkgar_install::validate_packager_version()
 
 
 
+/** \brief Download the remote packages to be installed.
+ *
+ * The explicit and implicit packages which come from an http repository
+ * are downloaded in the package cache, in parallel, before the
+ * validations that need their data. This function is called once at the
+ * start of the validation for the explicit packages and once the
+ * dependencies are known for the implicit packages.
+ *
+ * The packages already found in the cache are not downloaded again.
+ * Each file is verified against the Package-Size and Package-md5sum
+ * fields of the repository index and the package is then loaded from
+ * the cache instead of the repository. A package without a known
+ * md5sum cannot be verified so it always gets downloaded.
+ *
+ * \param[in] evict  Whether to remove the least recently used packages
+ *                   if the cache grew over its maximum size.
+ */
+void wpkgar_install::download_packages(bool evict)
+{
+    if(f_package_cache_size <= 0)
+    {
+        // no cache, packages get downloaded when loaded
+        return;
+    }
+
+    std::vector<wpkgar_package_list_t::size_type> items;
+    wpkgar_package_cache::download_list_t downloads;
+    for(wpkgar_package_list_t::size_type idx(0); idx < f_packages.size(); ++idx)
+    {
+        package_item_t& item(f_packages[idx]);
+        if((item.get_type() != package_item_t::package_type_explicit
+         && item.get_type() != package_item_t::package_type_implicit)
+        || item.is_fully_loaded())
+        {
+            continue;
+        }
+        const wpkg_filename::uri_filename& filename(item.get_filename());
+        if(filename.is_deb() || filename.path_scheme() != "http")
+        {
+            continue;
+        }
+        int64_t size(-1);
+        std::string md5sum;
+        if(item.has_index_control())
+        {
+            if(item.field_is_defined("Package-Size"))
+            {
+                size = strtoll(item.get_field("Package-Size").c_str(), NULL, 10);
+            }
+            if(item.field_is_defined("Package-md5sum"))
+            {
+                md5sum = item.get_field("Package-md5sum");
+            }
+        }
+        else
+        {
+            wpkgar_package_checksums_t::const_iterator checksum(f_package_checksums.find(filename.full_path()));
+            if(checksum != f_package_checksums.end())
+            {
+                md5sum = checksum->second.first;
+                size = checksum->second.second;
+            }
+        }
+        items.push_back(idx);
+        downloads.push_back(wpkgar_package_cache::download_t(filename, md5sum, size));
+    }
+
+    wpkgar_package_cache cache(f_manager->get_database_path().append_child("core/cache"));
+    cache.set_maximum_size(f_package_cache_size);
+    cache.set_jobs(f_fetch_jobs == 0 ? 4 : static_cast<int>(f_fetch_jobs));
+    cache.fetch(downloads);
+
+    for(wpkgar_package_cache::download_list_t::size_type i(0); i < downloads.size(); ++i)
+    {
+        const wpkgar_package_cache::download_t& d(downloads[i]);
+        switch(d.get_status())
+        {
+        case wpkgar_package_cache::download_t::status_cached:
+            wpkg_output::log("package %1 found in the package cache.")
+                    .quoted_arg(d.get_uri())
+                .debug(wpkg_output::debug_flags::debug_detail_config)
+                .module(wpkg_output::module_validate_installation)
+                .package(d.get_uri());
+            break;
+
+        case wpkgar_package_cache::download_t::status_resumed:
+            wpkg_output::log("download of package %1 resumed at byte %2.")
+                    .quoted_arg(d.get_uri())
+                    .arg(static_cast<long>(d.get_resumed_at()))
+                .debug(wpkg_output::debug_flags::debug_detail_config)
+                .module(wpkg_output::module_validate_installation)
+                .package(d.get_uri());
+            /*FALLTHROUGH*/
+        case wpkgar_package_cache::download_t::status_downloaded:
+            wpkg_output::log("package %1 downloaded (%2 bytes in %3 ms).")
+                    .quoted_arg(d.get_uri())
+                    .arg(static_cast<long>(d.get_downloaded()))
+                    .arg(static_cast<long>(d.get_elapsed()))
+                .debug(wpkg_output::debug_flags::debug_detail_config)
+                .module(wpkg_output::module_validate_installation)
+                .package(d.get_uri());
+            break;
+
+        default:
+            wpkg_output::log("package %1 could not be downloaded: %2")
+                    .quoted_arg(d.get_uri())
+                    .arg(d.get_error())
+                .level(wpkg_output::level_error)
+                .module(wpkg_output::module_validate_installation)
+                .package(d.get_uri())
+                .action("install-validation");
+            continue;
+
+        }
+        f_packages[items[i]].set_cached_filename(d.get_filename());
+        f_cached_packages.push_back(d.get_filename());
+    }
+
+    if(!evict)
+    {
+        return;
+    }
+    const int evicted(cache.evict(f_cached_packages));
+    if(evicted > 0)
+    {
+        wpkg_output::log("%1 packages removed from the package cache.")
+                .arg(evicted)
+            .debug(wpkg_output::debug_flags::debug_detail_config)
+            .module(wpkg_output::module_validate_installation);
+    }
+}
+
+
+
 /** \brief Ensure that enough space is available and no file gets overwritten.
  *
  * The installed size requires us to determine the list of drives
@@ -4972,7 +5860,7 @@ void wpkgar_install::validate_installed_size_and_overwrite()
     {
         ++idx;
         int factor(0);
-        memfile::memory_file *upgrade(NULL);
+        const package_item_t *upgrade(NULL);
         switch(outer_pkg.get_type())
         {
         case package_item_t::package_type_upgrade:
@@ -5002,11 +5890,7 @@ void wpkgar_install::validate_installed_size_and_overwrite()
                         {
                             f_manager->check_interrupt();
 
-                            // make sure the package is loaded
-                            // TODO: change this load and use the Files field instead
-                            f_manager->load_package(inner_pkg.get_filename());
-
-                            f_manager->get_wpkgar_file(inner_pkg.get_filename(), upgrade);
+                            upgrade = &inner_pkg;
                             if(outer_pkg.get_upgrade() != -1
                             || inner_pkg.get_upgrade() != -1)
                             {
@@ -5044,15 +5928,7 @@ void wpkgar_install::validate_installed_size_and_overwrite()
         {
             f_manager->check_interrupt();
 
-            // TODO: change this load and use the Files field instead
-            //       make sure the package is loaded
-            // (as far as I can tell this is really fast if the package
-            // was already loaded so we're certainly safe doing again.)
-            f_manager->load_package(outer_pkg.get_filename());
-
-            memfile::memory_file *data(0);
-            f_manager->get_wpkgar_file(outer_pkg.get_filename(), data);
-            disks.compute_size_and_verify_overwrite( idx, outer_pkg, root, data, upgrade, factor );
+            disks.compute_size_and_verify_overwrite( idx, outer_pkg, root, upgrade, factor );
         }
 #endif //!MO_DARWIN && !MO_SUNOS && !MO_FREEBSD
     }
@@ -5444,6 +6320,13 @@ bool wpkgar_install::validate()
     f_manager->load_package("core");
     f_architecture = f_manager->get_field("core", wpkg_control::control_file::field_architecture_factory_t::canonicalized_name());
 
+    // explicit packages from remote repositories get loaded by the
+    // first validations, download them all at once beforehand
+    wpkg_output::log("download explicit packages")
+        .debug(wpkg_output::debug_flags::debug_progress)
+        .module(wpkg_output::module_validate_installation);
+    download_packages(false);
+
     // some of the package names may be directory names, make sure we
     // know what's what and actually replace all the directory names
     // with their content so we don't have to know about those later
@@ -5552,6 +6435,16 @@ bool wpkgar_install::validate()
         .module(wpkg_output::module_validate_installation);
     validate_fields();
 
+    // the next validations read the data of the packages; fetch the
+    // implicit packages of remote repositories all at once beforehand
+    if(wpkg_output::get_output_error_count() == 0)
+    {
+        wpkg_output::log("download implicit packages")
+            .debug(wpkg_output::debug_flags::debug_progress)
+            .module(wpkg_output::module_validate_installation);
+        download_packages(true);
+    }
+
     // TODO:
     // avoid the overwrite test for now because it loads packages and if
     // we already had errors, it becomes more of a waste right now; remove
@@ -5607,6 +6500,7 @@ bool wpkgar_install::validate()
 wpkgar_install::install_info_t::install_info_t()
     //: f_name("") -- auto-init
     //, f_version("") -- auto-init
+    //, f_filename("") -- auto-init
     : f_install_type(install_type_undefined)
     //, f_is_upgrade(false) -- auto-init
 {
@@ -5625,6 +6519,16 @@ std::string   wpkgar_install::install_info_t::get_version() const
 }
 
 
+/** \brief The path to the .deb file of this package.
+ *
+ * \return The filename of the package being installed.
+ */
+std::string   wpkgar_install::install_info_t::get_filename() const
+{
+    return f_filename;
+}
+
+
 wpkgar_install::install_info_t::install_type_t wpkgar_install::install_info_t::get_install_type() const
 {
     return f_install_type;
@@ -5664,6 +6568,7 @@ wpkgar_install::install_info_list_t wpkgar_install::get_install_list()
                 install_info_t info;
                 info.f_name    = f_packages[idx].get_name();
                 info.f_version = f_packages[idx].get_version();
+                info.f_filename = f_packages[idx].get_filename().full_path();
 
                 switch( f_packages[idx].get_type() )
                 {
@@ -6122,12 +7027,35 @@ void wpkgar_install::set_status(package_item_t *item, package_item_t *upgrade, p
     }
 }
 
-void wpkgar_install::unpack_file(package_item_t *item, const wpkg_filename::uri_filename& destination, const memfile::memory_file::file_info& info)
+/** \brief Write one file or directory of a package on the target.
+ *
+ * This function writes the file \p data, or creates the directory if
+ * \p data is NULL, at \p destination and applies the file info to it.
+ *
+ * Failures to apply the file info are reported as warnings when the
+ * --force-file-info command line option was used.
+ *
+ * \param[in] item  The package being unpacked.
+ * \param[in] extract  The extractor used to write to the target.
+ * \param[in] destination  The full path to the file or directory.
+ * \param[in] info  The information about this file.
+ * \param[in] data  The file data, or NULL for a directory.
+ * \param[in] shareable  Whether the file may be linked to an identical file
+ *                       (see wpkg_extract::extractor::set_share_mode().)
+ */
+void wpkgar_install::unpack_file(package_item_t *item, wpkg_extract::extractor& extract, const wpkg_filename::uri_filename& destination, const memfile::memory_file::file_info& info, const memfile::memory_file *data, bool shareable)
 {
     int file_info_err(get_parameter(wpkgar_install_force_file_info, false) ? memfile::memory_file::file_info_return_errors : memfile::memory_file::file_info_throw);
 
-    // apply the file info
-    memfile::memory_file::info_to_disk_file(destination, info, file_info_err);
+    // write the file (or create the directory) and apply the file info
+    if(data == NULL)
+    {
+        extract.make_directory(destination, info, file_info_err);
+    }
+    else
+    {
+        extract.write_file(destination, *data, info, file_info_err, shareable);
+    }
 
     if(file_info_err & memfile::memory_file::file_info_permissions_error)
     {
@@ -6169,6 +7097,11 @@ void wpkgar_install::unpack_file(package_item_t *item, const wpkg_filename::uri_
  * are also setup in the status file. Finally, files that existed in the old
  * package but are not present in the new package get removed.
  *
+ * When upgrading with the --skip-unchanged-files option, regular files
+ * which md5sum, size, mode, and ownership are the same in both versions
+ * of the package, and which are still present on the target with that
+ * same size, are not backed up nor rewritten.
+ *
  * If the process fails, then the package stays in an Half-Installed status.
  *
  * \param[in] item  The package to unpack.
@@ -6178,6 +7111,10 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
 {
     f_original_status = wpkgar_manager::not_installed;
 
+    // the validation only loaded the control.tar archive of the package,
+    // the data.tar archive is required from here on
+    item->load(false);
+
     if(upgrade != NULL)
     {
         f_original_status = upgrade->get_original_status();
@@ -6208,12 +7145,48 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
     // function for details)
     wpkg_backup::wpkgar_backup backup(f_manager, item->get_name(), "install-unpack");
 
+    // the extractor keeps the directories open while we unpack this package
+    wpkg_extract::extractor extract;
+
     long count_files(0);
     long count_directories(0);
+    long count_unchanged(0);
+
+    // when upgrading, the index of the installed version gives us its
+    // list of files sorted by name along their md5sum; it is used to
+    // detect unchanged files and files that disappeared
+    typedef std::map<std::string, memfile::memory_file::file_info> installed_files_t;
+    installed_files_t installed_files;
+    std::vector<std::string> unpacked_files;
+    const bool skip_unchanged(upgrade != NULL && !f_reconfiguring_packages
+                            && get_parameter(wpkgar_install_skip_unchanged_files, false) != 0);
 
     // get the data archive of item (new package) and unpack it
     try
     {
+        if(upgrade != NULL)
+        {
+            memfile::memory_file *wpkgar_file;
+            f_manager->get_wpkgar_file(item->get_name(), wpkgar_file);
+            wpkgar_file->dir_rewind();
+            for(;;)
+            {
+                memfile::memory_file::file_info info;
+                if(!wpkgar_file->dir_next(info, NULL))
+                {
+                    break;
+                }
+                // data files are saved with a leading slash in the index
+                const std::string filename(info.get_filename());
+                if(!filename.empty() && filename[0] == '/')
+                {
+                    installed_files[filename] = info;
+                }
+            }
+        }
+
+        // save the status and the dates at once
+        wpkgar_status_transaction transaction(f_manager);
         if(upgrade != NULL)
         {
             set_status(item, upgrade, conf_install, "Upgrading");
@@ -6247,6 +7220,17 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
                 f_manager->set_field(item->get_name(), "X-Explicit", "No", true);
             }
         }
+        if(!f_reconfiguring_packages)
+        {
+            // when the data files were all verified against the md5sums
+            // file while loading the package, the digests saved in the
+            // index of the database can be trusted (see
+            // wpkgar_package::read_data()); the field is reset otherwise
+            // since an upgrade keeps the status of the previous version
+            const bool verified(f_manager->md5sums_verified(item->get_filename()));
+            f_manager->set_field(item->get_name(), "X-Md5sums-Verified", verified ? "Yes" : "No", true);
+        }
+        transaction.commit();
         {
             const wpkg_filename::uri_filename package_name(item->get_filename());
             memfile::memory_file data;
@@ -6292,6 +7276,10 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
                         throw std::runtime_error(msg);
                     }
                 }
+                // same transformation as in wpkgar_package::read_data()
+                const std::string index_filename(filename.length() >= 2 && filename[0] == '.' && filename[1] == '/'
+                                                    ? filename.substr(1) : "/" + filename);
+                unpacked_files.push_back(index_filename);
                 switch(info.get_file_type())
                 {
                 case memfile::memory_file::file_info::regular_file:
@@ -6303,13 +7291,45 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
                             // configuration files are renamed at this point
                             destination = destination.append_path(".wpkg-new");
                         }
+                        if(!is_config && skip_unchanged)
+                        {
+                            // if the file did not change between both
+                            // versions and it is still intact on the
+                            // target, there is nothing to write
+                            const installed_files_t::const_iterator it(installed_files.find(index_filename));
+                            if(it != installed_files.end()
+                            && it->second.get_size() == info.get_size()
+                            && it->second.get_mode() == info.get_mode()
+                            && it->second.get_user() == info.get_user()
+                            && it->second.get_group() == info.get_group())
+                            {
+                                md5::raw_md5sum sum;
+                                file.raw_md5sum(sum);
+                                wpkg_filename::uri_filename::file_stat s;
+                                if(sum == it->second.get_raw_md5sum()
+                                && destination.os_stat(s) == 0
+                                && s.is_reg()
+                                && s.get_size() == info.get_size())
+                                {
+                                    ++count_files;
+                                    ++count_unchanged;
+
+                                    wpkg_output::log("%1 unchanged...")
+                                            .quoted_arg(destination)
+                                        .debug(wpkg_output::debug_flags::debug_files)
+                                        .module(wpkg_output::module_unpack_package)
+                                        .package(package_name);
+                                    break;
+                                }
+                            }
+                        }
                         if(is_config || !f_reconfiguring_packages)
                         {
                             // do a backup no matter what
                             backup.backup(destination);
-                            // write that file on disk
-                            file.write_file(destination, true, true);
-                            unpack_file(item, destination, info);
+                            // write that file on disk; configuration files
+                            // are never shared since users edit them
+                            unpack_file(item, extract, destination, info, &file, !is_config);
                             ++count_files;
 
                             wpkg_output::log("%1 unpacked...")
@@ -6329,8 +7349,7 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
                         // do a backup no matter what
                         //backup.backup(destination); -- not implemented yet!
                         // create directory if it doesn't exist yet
-                        destination.os_mkdir_p();
-                        unpack_file(item, destination, info);
+                        unpack_file(item, extract, destination, info, NULL);
                         ++count_directories;
                     }
                     break;
@@ -6406,68 +7425,51 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
         }
 
         // if upgrading, now we want to delete files that "disappeared" from
-        // the old package
+        // the old package; both lists are sorted so we walk them in
+        // parallel and remove the files only present in the old list
         if(upgrade != NULL)
         {
             set_status(item, upgrade, conf_install, "Upgrading"); // could it be Removing?
             const wpkg_filename::uri_filename package_name(upgrade->get_filename());
-            memfile::memory_file data;
-            std::string data_filename("data.tar");
-            f_manager->get_control_file(data, item->get_name(), data_filename, false);
-            for(;;)
+            std::sort(unpacked_files.begin(), unpacked_files.end());
+            std::vector<std::string>::const_iterator n(unpacked_files.begin());
+            for(installed_files_t::const_iterator o(installed_files.begin()); o != installed_files.end(); ++o)
             {
-                // in this case we don't need the data
-                memfile::memory_file::file_info info;
-                if(!data.dir_next(info, NULL))
-                {
-                    break;
-                }
-                std::string filename(info.get_filename());
-                if(filename.empty())
+                const std::string& filename(o->first);
+                while(n != unpacked_files.end() && *n < filename)
                 {
-                    throw std::runtime_error("a filename in the data.tar archive file cannot be empty");
+                    ++n;
                 }
-                if(filename[0] == '/' || filename[0] == '\\')
+                if(n != unpacked_files.end() && *n == filename)
                 {
-                    throw std::runtime_error("a filename in the data.tar archive file cannot start with \"/\"");
+                    // still present in the new version
+                    continue;
                 }
-                // backup any regular file (we can restore anything else without the need of a full backup)
+                // remove any regular file (we can restore anything else without the need of a full backup)
                 // configuration files are silently skipped in the unpack process
-                if((info.get_file_type() == memfile::memory_file::file_info::regular_file
-                        || info.get_file_type() == memfile::memory_file::file_info::continuous)
+                if((o->second.get_file_type() == memfile::memory_file::file_info::regular_file
+                        || o->second.get_file_type() == memfile::memory_file::file_info::continuous)
                 && !f_manager->is_conffile(package_name, filename))
                 {
-                    const wpkg_filename::uri_filename destination(f_manager->get_inst_path().append_child(filename));
-                    // if saving a backup succeeds then we want to delete
-                    // the file on the target (i.e. it's not present in the
-                    // new version of the package)
-                    if(backup.backup(destination))
+                    const wpkg_filename::uri_filename destination(f_manager->get_inst_path().append_child(filename.substr(1)));
+                    // the file is not present in the new version of the
+                    // package so we delete it on the target; the backup
+                    // does that for us
+                    try
                     {
-                        // delete that file as we're upgrading
-                        try
-                        {
-                            if(!destination.os_unlink())
-                            {
-                                // the file did not exist, post a log, but ignore otherwise
-                                wpkg_output::log("file %1 could not be removed while upgrading because it did not exist.")
-                                        .quoted_arg(destination)
-                                    .debug(wpkg_output::debug_flags::debug_detail_files)
-                                    .module(wpkg_output::module_unpack_package)
-                                    .package(package_name);
-                            }
-                        }
-                        catch(const wpkg_filename::wpkg_filename_exception_io&)
-                        {
-                            // we capture the exception so we can continue
-                            // to process the installation but we generate
-                            // an error so in the end it fails
-                            wpkg_output::log("file %1 from the previous version of the package could not be deleted.")
-                                    .quoted_arg(destination)
-                                .level(wpkg_output::level_error)
-                                .module(wpkg_output::module_unpack_package)
-                                .package(item->get_name())
-                                .action("install-unpack");
-                        }
+                        backup.backup(destination);
+                    }
+                    catch(const wpkg_filename::wpkg_filename_exception_io&)
+                    {
+                        // we capture the exception so we can continue
+                        // to process the installation but we generate
+                        // an error so in the end it fails
+                        wpkg_output::log("file %1 from the previous version of the package could not be deleted.")
+                                .quoted_arg(destination)
+                            .level(wpkg_output::level_error)
+                            .module(wpkg_output::module_unpack_package)
+                            .package(item->get_name())
+                            .action("install-unpack");
                     }
                 }
             }
@@ -6494,6 +7496,7 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
         item->copy_package_in_database();
     }
 
+    wpkgar_status_transaction transaction(f_manager);
     set_status(item, upgrade, conf_install, "Unpacked");
 
     if(f_reconfiguring_packages)
@@ -6505,7 +7508,18 @@ bool wpkgar_install::do_unpack(package_item_t *item, package_item_t *upgrade)
         f_manager->set_field(item->get_name(), "X-Unpack-Date", wpkg_util::rfc2822_date(), true);
         f_manager->set_field(item->get_name(), "X-Installed-Files", count_files, true);
         f_manager->set_field(item->get_name(), "X-Created-Directories", count_directories, true);
+        if(skip_unchanged)
+        {
+            wpkg_output::log("%1 of the %2 files of package %3 were unchanged and not rewritten.")
+                    .arg(count_unchanged)
+                    .arg(count_files)
+                    .quoted_arg(item->get_name())
+                .debug(wpkg_output::debug_flags::debug_progress)
+                .module(wpkg_output::module_unpack_package)
+                .package(item->get_name());
+        }
     }
+    transaction.commit();
 
     // just delete all those backups but don't restore!
     backup.success();
@@ -6553,6 +7567,7 @@ bool wpkgar_install::pre_configure()
                 .module(wpkg_output::module_validate_installation);
 
             f_manager->track("deconfigure " + package_name, package_name);
+            f_manager->sync_tracker();
             if(!configure_package(&f_packages[idx]))
             {
                 f_manager->track("failed");
@@ -6647,6 +7662,31 @@ int wpkgar_install::unpack()
         throw std::logic_error("the manager must be locked before calling wpkgar_install::unpack()");
     }
 
+    if(!f_prefetching_packages)
+    {
+        // read and decompress the next packages in the background while
+        // we unpack the current one (local files only, like the data.tar
+        // load in package_item_t::load())
+        f_prefetching_packages = true;
+        wpkg_filename::filename_list_t filenames;
+        for( auto idx : f_sorted_packages )
+        {
+            const auto& package( f_packages[idx] );
+            if(!package.is_unpacked()
+            && (package.get_type() == package_item_t::package_type_explicit
+             || package.get_type() == package_item_t::package_type_implicit))
+            {
+                const wpkg_filename::uri_filename& filename(package.get_filename());
+                const std::string scheme(filename.path_scheme());
+                if(!filename.is_deb() && (scheme == "file" || scheme == "smb"))
+                {
+                    filenames.push_back(filename);
+                }
+            }
+        }
+        f_manager->prefetch_packages(filenames);
+    }
+
     for( auto idx : f_sorted_packages )
     {
         auto& package( f_packages[idx] );
@@ -6685,12 +7725,25 @@ int wpkgar_install::unpack()
                         // it was not installed yet, just purge the whole thing
                         f_manager->track("purge " + package_name, package_name);
                     }
+                    f_manager->sync_tracker();
+                    const int64_t load_bytes_read(package.get_bytes_read());
+                    const int64_t bytes_read(memfile::memory_file::get_bytes_read());
                     if(!do_unpack(&package, upgrade))
                     {
                         // an error occured, we cannot continue
+                        // (still configure what was unpacked so far)
                         // TBD: should we throw?
+                        finish_configure();
                         return WPKGAR_ERROR;
                     }
+                    package.add_bytes_read(memfile::memory_file::get_bytes_read() - bytes_read);
+                    wpkg_output::log("package %1 read %2 bytes while loading and %3 bytes while unpacking")
+                                .quoted_arg(package_name)
+                                .arg(load_bytes_read)
+                                .arg(package.get_bytes_read() - load_bytes_read)
+                        .debug(wpkg_output::debug_flags::debug_progress)
+                        .module(wpkg_output::module_unpack_package)
+                        .package(package_name);
                     return static_cast<int>(idx);
                 }
                 break;
@@ -6704,12 +7757,52 @@ int wpkgar_install::unpack()
     }
 
     // End of Packages
+    f_manager->prefetch_packages(wpkg_filename::filename_list_t());
+    f_prefetching_packages = false;
+    if(!finish_configure())
+    {
+        return WPKGAR_ERROR;
+    }
     return WPKGAR_EOP;
 }
 
 
 
 bool wpkgar_install::configure_package(package_item_t *item)
+{
+    // count errors that occur here
+    const int err(configure_files(item));
+
+    // new-postinst configure <new-version>
+    wpkgar_manager::script_parameters_t params;
+    params.push_back("configure");
+    params.push_back(item->get_version());
+    const bool postinst(f_manager->run_script(item->get_name(), wpkgar_manager::wpkgar_script_postinst, params));
+    bool hooks(false);
+    if(postinst)
+    {
+        // hooks-postinst configure <package-name> <new-version>
+        wpkgar_manager::script_parameters_t hooks_params;
+        hooks_params.push_back("configure");
+        hooks_params.push_back(item->get_name());
+        hooks_params.push_back(item->get_version());
+        hooks = f_manager->run_script("core", wpkgar_manager::wpkgar_script_postinst, hooks_params);
+    }
+
+    return configure_result(item, err, postinst, hooks);
+}
+
+
+/** \brief Mark the package half-configured and setup its conffiles.
+ *
+ * This function is the part of the configuration process run before
+ * the postinst script.
+ *
+ * \param[in] item  The package being configured.
+ *
+ * \return The number of errors that occurred.
+ */
+int wpkgar_install::configure_files(package_item_t *item)
 {
     // count errors that occur here
     int err(0);
@@ -6732,6 +7825,7 @@ bool wpkgar_install::configure_package(package_item_t *item)
     f_manager->set_field(item->get_name(), wpkg_control::control_file::field_xstatus_factory_t::canonicalized_name(), "Half-Configured", true);
 
     f_manager->track("deconfigure " + item->get_name(), item->get_name());
+    f_manager->sync_tracker();
 
     const wpkg_filename::uri_filename root(f_manager->get_inst_path());
     for(std::vector<std::string>::iterator it(files.begin());
@@ -6870,11 +7964,26 @@ bool wpkgar_install::configure_package(package_item_t *item)
         }
     }
 
-    // new-postinst configure <new-version>
-    wpkgar_manager::script_parameters_t params;
-    params.push_back("configure");
-    params.push_back(item->get_version());
-    if(!f_manager->run_script(item->get_name(), wpkgar_manager::wpkgar_script_postinst, params))
+    return err;
+}
+
+
+/** \brief Terminate the configuration of a package.
+ *
+ * This function reports the postinst script failures and marks the
+ * package as installed when no errors occurred. On errors the package
+ * remains half-configured.
+ *
+ * \param[in] item  The package being configured.
+ * \param[in] err  The number of errors that occurred so far.
+ * \param[in] postinst  Whether the postinst script succeeded.
+ * \param[in] hooks  Whether the postinst hooks succeeded.
+ *
+ * \return true if the package is now installed.
+ */
+bool wpkgar_install::configure_result(package_item_t *item, int err, bool postinst, bool hooks)
+{
+    if(!postinst)
     {
         // errors are reported but there is no unwind for configuration failures
         ++err;
@@ -6884,29 +7993,23 @@ bool wpkgar_install::configure_package(package_item_t *item)
             .package(item->get_name())
             .action("install-configure");
     }
-    else
+    else if(!hooks)
     {
-        // hooks-postinst configure <package-name> <new-version>
-        wpkgar_manager::script_parameters_t hooks_params;
-        hooks_params.push_back("configure");
-        hooks_params.push_back(item->get_name());
-        hooks_params.push_back(item->get_version());
-        if(!f_manager->run_script("core", wpkgar_manager::wpkgar_script_postinst, hooks_params))
-        {
-            ++err;
-            wpkg_output::log("a postinst global hook failed for package %1, the installation is canceled.")
-                    .quoted_arg(item->get_name())
-                .level(wpkg_output::level_error)
-                .module(wpkg_output::module_unpack_package)
-                .action("install-configure");
-        }
+        ++err;
+        wpkg_output::log("a postinst global hook failed for package %1, the installation is canceled.")
+                .quoted_arg(item->get_name())
+            .level(wpkg_output::level_error)
+            .module(wpkg_output::module_unpack_package)
+            .action("install-configure");
     }
 
     if(err == 0)
     {
         // mark the package as installed!
+        wpkgar_status_transaction transaction(f_manager);
         f_manager->set_field(item->get_name(), wpkg_control::control_file::field_xstatus_factory_t::canonicalized_name(), "Installed", true);
         f_manager->set_field(item->get_name(), "X-Configure-Date", wpkg_util::rfc2822_date(), true);
+        transaction.commit();
     }
 
     return err == 0;
@@ -6967,6 +8070,13 @@ bool wpkgar_install::configure(int idx)
 
     }
 
+    if(f_configure_jobs > 1)
+    {
+        // configured later, possibly in parallel, by finish_configure()
+        f_configure_queue.push_back(idx);
+        return true;
+    }
+
     wpkg_output::log("configuring %1")
             .quoted_arg(f_packages[idx].get_name())
         .debug(wpkg_output::debug_flags::debug_progress)
@@ -6976,6 +8086,299 @@ bool wpkgar_install::configure(int idx)
 }
 
 
+namespace
+{
+
+/** \brief One package configured by finish_configure().
+ *
+ * The commands and the output filename are setup before the thread
+ * starts. The thread only sets the results and the state.
+ */
+struct configure_job_t
+{
+    enum state_t
+    {
+        state_waiting,
+        state_running,
+        state_done,
+        state_configured,
+        state_failed,
+        state_skipped
+    };
+
+    configure_job_t()
+        : f_state(state_waiting)
+        , f_err(0)
+        , f_postinst(false)
+        , f_hooks(false)
+    {
+    }
+
+    ~configure_job_t()
+    {
+        if(f_thread.joinable())
+        {
+            f_thread.join();
+        }
+    }
+
+    state_t                                 f_state;
+    int                                     f_err;
+    bool                                    f_postinst;
+    bool                                    f_hooks;
+    std::vector<size_t>                     f_depends;
+    wpkgar::wpkgar_manager::script_commands_t   f_postinst_commands;
+    wpkgar::wpkgar_manager::script_commands_t   f_hooks_commands;
+    wpkg_filename::uri_filename             f_output;
+    std::thread                             f_thread;
+};
+
+
+void run_configure_job(configure_job_t *job, std::mutex *mutex, std::condition_variable *cond, size_t *completed)
+{
+    bool postinst(true);
+    for(wpkgar::wpkgar_manager::script_commands_t::const_iterator it(job->f_postinst_commands.begin());
+                                    postinst && it != job->f_postinst_commands.end(); ++it)
+    {
+        postinst = wpkgar::wpkgar_manager::run_script_command(*it, job->f_output) == 0;
+    }
+    bool hooks(postinst);
+    for(wpkgar::wpkgar_manager::script_commands_t::const_iterator it(job->f_hooks_commands.begin());
+                                    hooks && it != job->f_hooks_commands.end(); ++it)
+    {
+        hooks = wpkgar::wpkgar_manager::run_script_command(*it, job->f_output) == 0;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(*mutex);
+        job->f_postinst = postinst;
+        job->f_hooks = hooks;
+        job->f_state = configure_job_t::state_done;
+        ++*completed;
+    }
+    cond->notify_all();
+}
+
+} // no name namespace
+
+
+/** \brief Configure the packages queued by configure().
+ *
+ * When a number of configure jobs was defined with set_configure_jobs(),
+ * the configure() function only queues the packages. This function
+ * configures them, running the postinst scripts of several packages
+ * at the same time. A package is started only once all the queued
+ * packages it depends on (Depends and Pre-Depends) are configured.
+ *
+ * Everything except the scripts runs in the calling thread: the
+ * configuration files, the package status, and the output. The output
+ * of the scripts of each package is captured and printed once the
+ * package is done, in the order in which the packages were queued.
+ *
+ * Each package is marked "Half-Configured" right before its scripts
+ * start. When a package fails, no more packages get started, the
+ * packages already started are terminated normally and the packages
+ * that were not started remain unpacked.
+ *
+ * \return true if all the queued packages were configured.
+ */
+bool wpkgar_install::finish_configure()
+{
+    if(f_configure_queue.empty())
+    {
+        return true;
+    }
+    wpkgar_package_idxs_t queue;
+    queue.swap(f_configure_queue);
+    const size_t max(queue.size());
+
+    // the jobs are declared last so their threads get joined before
+    // the mutex and condition get destroyed
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t completed(0);
+    std::vector<configure_job_t> jobs(max);
+
+    // determine which queued packages each package depends on
+    std::map<std::string, size_t> positions;
+    for(size_t i(0); i < max; ++i)
+    {
+        positions[f_packages[queue[i]].get_name()] = i;
+    }
+    for(size_t i(0); i < max; ++i)
+    {
+        const package_item_t& item(f_packages[queue[i]]);
+        const std::string fields[] =
+        {
+            wpkg_control::control_file::field_depends_factory_t::canonicalized_name(),
+            wpkg_control::control_file::field_predepends_factory_t::canonicalized_name()
+        };
+        for(size_t f(0); f < sizeof(fields) / sizeof(fields[0]); ++f)
+        {
+            if(item.field_is_defined(fields[f]))
+            {
+                wpkg_dependencies::dependencies depends(item.get_field(fields[f]));
+                for(int d(0); d < depends.size(); ++d)
+                {
+                    std::map<std::string, size_t>::const_iterator p(positions.find(depends.get_dependency(d).f_name));
+                    if(p != positions.end() && p->second != i)
+                    {
+                        jobs[i].f_depends.push_back(p->second);
+                    }
+                }
+            }
+        }
+    }
+
+    const wpkg_filename::uri_filename output_dir(wpkg_filename::uri_filename::tmpdir("configure"));
+    const size_t max_jobs(f_configure_jobs);
+    size_t started(0);
+    size_t next(0);
+    bool failed(false);
+    while(next < max)
+    {
+        // start the packages which dependencies are all configured
+        size_t running;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = started - completed;
+        }
+        for(size_t i(next); i < max && !failed && running < max_jobs; ++i)
+        {
+            configure_job_t& job(jobs[i]);
+            if(job.f_state != configure_job_t::state_waiting)
+            {
+                continue;
+            }
+            bool ready(true);
+            for(std::vector<size_t>::const_iterator d(job.f_depends.begin()); d != job.f_depends.end(); ++d)
+            {
+                if(jobs[*d].f_state != configure_job_t::state_configured)
+                {
+                    ready = false;
+                    break;
+                }
+            }
+            if(!ready && (i != next || running != 0))
+            {
+                // wait for the dependencies, unless nothing else can
+                // run (i.e. circular dependencies) in which case we
+                // configure the packages in order
+                continue;
+            }
+
+            f_manager->check_interrupt();
+
+            package_item_t *item(&f_packages[queue[i]]);
+            wpkg_output::log("configuring %1")
+                    .quoted_arg(item->get_name())
+                .debug(wpkg_output::debug_flags::debug_progress)
+                .module(wpkg_output::module_validate_installation);
+
+            job.f_err = configure_files(item);
+
+            wpkgar_manager::script_parameters_t params;
+            params.push_back("configure");
+            params.push_back(item->get_version());
+            f_manager->get_script_commands(item->get_name(), wpkgar_manager::wpkgar_script_postinst, params, job.f_postinst_commands);
+            wpkgar_manager::script_parameters_t hooks_params;
+            hooks_params.push_back("configure");
+            hooks_params.push_back(item->get_name());
+            hooks_params.push_back(item->get_version());
+            f_manager->get_script_commands("core", wpkgar_manager::wpkgar_script_postinst, hooks_params, job.f_hooks_commands);
+            for(wpkgar_manager::script_commands_t::const_iterator it(job.f_postinst_commands.begin()); it != job.f_postinst_commands.end(); ++it)
+            {
+                wpkg_output::log("system(%1).")
+                        .quoted_arg(*it)
+                    .level(wpkg_output::level_info)
+                    .module(wpkg_output::module_run_script)
+                    .package(item->get_name())
+                    .action("execute-script");
+            }
+
+            job.f_output = output_dir.append_child(item->get_name() + ".output");
+            job.f_output.os_unlink();
+
+            job.f_state = configure_job_t::state_running;
+            ++started;
+            ++running;
+            job.f_thread = std::thread(run_configure_job, &job, &mutex, &cond, &completed);
+        }
+
+        // terminate the packages that are done, in order
+        size_t seen;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            seen = completed;
+        }
+        bool progress(false);
+        for(; next < max; ++next)
+        {
+            configure_job_t& job(jobs[next]);
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if(job.f_state == configure_job_t::state_running)
+                {
+                    break;
+                }
+            }
+            if(job.f_state == configure_job_t::state_waiting)
+            {
+                if(!failed)
+                {
+                    break;
+                }
+                // we do not start anything more after a failure
+                job.f_state = configure_job_t::state_skipped;
+                continue;
+            }
+            job.f_thread.join();
+            progress = true;
+
+            // the scripts may have modified any file
+            wpkg_filename::os_stat_cache::clear();
+
+            package_item_t *item(&f_packages[queue[next]]);
+            if(job.f_output.exists())
+            {
+                memfile::memory_file output;
+                output.read_file(job.f_output);
+                std::vector<char> buf(static_cast<size_t>(output.size()));
+                if(!buf.empty())
+                {
+                    output.read(&buf[0], 0, output.size());
+                    fflush(stdout);
+                    fwrite(&buf[0], 1, buf.size(), stdout);
+                    fflush(stdout);
+                }
+                job.f_output.os_unlink();
+            }
+            if(configure_result(item, job.f_err, job.f_postinst, job.f_hooks))
+            {
+                job.f_state = configure_job_t::state_configured;
+            }
+            else
+            {
+                job.f_state = configure_job_t::state_failed;
+                failed = true;
+            }
+        }
+
+        if(next < max && !progress)
+        {
+            // wait for one more package to be done
+            std::unique_lock<std::mutex> lock(mutex);
+            while(completed == seen && started != completed)
+            {
+                cond.wait(lock);
+            }
+        }
+    }
+
+    return !failed;
+}
+
+
 /** \brief Reconfigure a package.
  *
  * This function reconfigures a package which includes 3 steps:
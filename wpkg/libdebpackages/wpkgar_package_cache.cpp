@@ -0,0 +1,974 @@
+/*    wpkgar_package_cache.cpp -- implementation of the local package cache
+ *    Copyright (C) 2012-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+/** \file
+ * \brief Implementation of the local package cache.
+ *
+ * The cache is a directory with one .deb file per package, named after
+ * the file in the repository prefixed by a hash of its URI so packages
+ * with the same name found in different repositories do not collide.
+ * A package being downloaded is saved in a file with a ".part" extension
+ * and renamed once complete and verified.
+ * The download is done in blocks of RANGE_SIZE bytes with Range requests
+ * so a download that gets interrupted resumes where it stopped the next
+ * time the package is required. Packages smaller than that which come
+ * from the same server are requested in batches of pipelined requests.
+ *
+ * The modification time of the cached files is updated each time they
+ * get used so the least recently used files get evicted first when the
+ * cache grows over its maximum size.
+ */
+// WARNING: The wpkg_http.h (which includes tcp_client_server.h) MUST be
+//          first to avoid tons of errors under MS-Windows
+#include    "libdebpackages/wpkg_http.h"
+
+#include    "libdebpackages/wpkgar_package_cache.h"
+#include    "libdebpackages/wpkgar.h"
+#include    "libdebpackages/wpkg_stream.h"
+#include    "libdebpackages/memfile.h"
+#include    "libdebpackages/md5.h"
+
+#include    <algorithm>
+#include    <atomic>
+#include    <chrono>
+#include    <map>
+#include    <sstream>
+#include    <thread>
+#include    <stdlib.h>
+#include    <string.h>
+#if defined(MO_WINDOWS)
+#include    <sys/utime.h>
+#else
+#include    <utime.h>
+#endif
+
+
+namespace wpkgar
+{
+
+
+namespace
+{
+
+/** \brief Maximum number of redirects followed for one package.
+ *
+ * A repository which redirects more than this is considered broken.
+ */
+const int MAX_REDIRECTS = 5;
+
+
+/** \brief Mark a cached file as just used.
+ *
+ * The eviction removes the files with the oldest modification time
+ * first, so using a file sets its modification time to now.
+ *
+ * \param[in] filename  The file to touch.
+ */
+void touch(const wpkg_filename::uri_filename& filename)
+{
+#if defined(MO_WINDOWS)
+    _wutime(filename.os_filename().get_utf16().c_str(), NULL);
+#else
+    utime(filename.os_filename().get_utf8().c_str(), NULL);
+#endif
+    wpkg_filename::os_stat_cache::invalidate(filename);
+}
+
+
+/** \brief Convert a number to a string.
+ *
+ * \param[in] value  The number to convert.
+ *
+ * \return The number as a string.
+ */
+std::string to_string(int64_t value)
+{
+    std::stringstream s;
+    s << value;
+    return s.str();
+}
+
+
+/** \brief Get the port of an http URI.
+ *
+ * \param[in] uri  The URI of a package.
+ *
+ * \return The port of the URI or 80 if not specified.
+ */
+int uri_port(const wpkg_filename::uri_filename& uri)
+{
+    if(uri.get_port().empty())
+    {
+        return 80;
+    }
+    return atoi(uri.get_port().c_str());
+}
+
+
+/** \brief Create the GET request of a package.
+ *
+ * The credentials of the package URI, if any, are sent with the request
+ * even when the request is for the URI of a redirect.
+ *
+ * \param[in] uri  The URI to request.
+ * \param[in] package  The URI of the package as found in the index.
+ *
+ * \return The request.
+ */
+wpkg_http::request package_request(const wpkg_filename::uri_filename& uri, const wpkg_filename::uri_filename& package)
+{
+    wpkg_http::request request(uri.path_only());
+    if(!package.get_username().empty() && !package.get_password().empty())
+    {
+        std::string credentials(package.get_username() + ":" + package.get_password());
+        request.set_field("Authorization", "Basic " + memfile::memory_file::to_base64(credentials.c_str(), credentials.length()));
+    }
+    return request;
+}
+
+
+/** \brief Parse the Content-Range field of a partial reply.
+ *
+ * The field looks like "bytes <first>-<last>/<total>" where the total
+ * may be "*" when the server does not know the size of the file.
+ *
+ * \param[in] content_range  The Content-Range field.
+ * \param[out] first  The offset of the first byte of the reply.
+ * \param[out] last  The offset of the last byte of the reply.
+ * \param[out] total  The size of the file or -1 if unknown.
+ *
+ * \return true if the field is valid.
+ */
+bool parse_content_range(const std::string& content_range, int64_t& first, int64_t& last, int64_t& total)
+{
+    if(content_range.compare(0, 6, "bytes ") != 0)
+    {
+        return false;
+    }
+    const char *s(content_range.c_str() + 6);
+    char *end;
+    first = strtoll(s, &end, 10);
+    if(end == s || *end != '-' || first < 0)
+    {
+        return false;
+    }
+    s = end + 1;
+    last = strtoll(s, &end, 10);
+    if(end == s || *end != '/' || last < first)
+    {
+        return false;
+    }
+    s = end + 1;
+    if(strcmp(s, "*") == 0)
+    {
+        total = -1;
+        return true;
+    }
+    total = strtoll(s, &end, 10);
+    return end != s && *end == '\0' && total > last;
+}
+
+
+/** \brief Save the body of a reply in a partial file.
+ *
+ * The body is written to the file as it arrives so a package is never
+ * held in memory. A whole file (200) replaces the partial file. A partial
+ * content (206) gets appended to it once its Content-Range was checked
+ * against the size of the partial file and the size of the package.
+ * Data going beyond the expected size of the package or beyond the
+ * range announced by the server is an error, detected before it gets
+ * written.
+ */
+class part_output : public wpkg_http::body_output
+{
+public:
+    part_output(const wpkg_filename::uri_filename& part, const wpkg_filename::uri_filename& uri, const wpkg_http::response& response, int64_t have, int64_t size)
+        : f_part(part)
+        , f_uri(uri)
+        , f_response(response)
+        , f_have(have)
+        , f_size(size)
+        , f_end(-1)
+        , f_opened(false)
+        //, f_file() -- auto-init
+    {
+    }
+
+    virtual void write(const char *data, size_t size)
+    {
+        if(!f_opened)
+        {
+            open();
+        }
+        const int64_t end(f_have + static_cast<int64_t>(size));
+        if((f_size >= 0 && end > f_size) || (f_end >= 0 && end > f_end))
+        {
+            throw wpkgar_exception_io("HTTP reply goes beyond the end of \"" + f_uri.original_filename() + "\"");
+        }
+        if(f_file.write(data, size) != static_cast<wpkg_stream::fstream::size_type>(size))
+        {
+            throw wpkgar_exception_io("could not write \"" + f_part.original_filename() + "\"");
+        }
+        f_have = end;
+    }
+
+    void close()
+    {
+        f_file.close();
+    }
+
+    bool is_opened() const
+    {
+        return f_opened;
+    }
+
+    int64_t get_have() const
+    {
+        return f_have;
+    }
+
+    int64_t get_size() const
+    {
+        return f_size;
+    }
+
+private:
+    void open()
+    {
+        f_opened = true;
+        if(f_response.get_status() == 206)
+        {
+            const std::string content_range(f_response.get_field("Content-Range"));
+            int64_t first, last, total;
+            if(!parse_content_range(content_range, first, last, total)
+            || first != f_have
+            || (f_size >= 0 && total >= 0 && total != f_size))
+            {
+                throw wpkgar_exception_io("invalid Content-Range \"" + content_range + "\" for \"" + f_uri.original_filename() + "\"");
+            }
+            f_end = last + 1;
+            if(f_size < 0)
+            {
+                f_size = total;
+            }
+            if(!f_file.append(f_part))
+            {
+                throw wpkgar_exception_io("could not write \"" + f_part.original_filename() + "\"");
+            }
+        }
+        else
+        {
+            // any other successful reply is the whole file
+            f_have = 0;
+            if(!f_file.create(f_part))
+            {
+                throw wpkgar_exception_io("could not create \"" + f_part.original_filename() + "\"");
+            }
+        }
+    }
+
+    const wpkg_filename::uri_filename   f_part;
+    const wpkg_filename::uri_filename   f_uri;
+    const wpkg_http::response&          f_response;
+    int64_t                             f_have;
+    int64_t                             f_size;
+    int64_t                             f_end;
+    bool                                f_opened;
+    wpkg_stream::fstream                f_file;
+};
+
+
+/** \brief A file found in the cache directory.
+ *
+ * Used by evict() to sort the files from the least to the most
+ * recently used.
+ */
+struct cached_file_t
+{
+    wpkg_filename::uri_filename     f_filename;
+    time_t                          f_mtime;
+    int64_t                         f_size;
+
+    bool operator < (const cached_file_t& rhs) const
+    {
+        return f_mtime < rhs.f_mtime;
+    }
+};
+
+} // no name namespace
+
+
+
+/** \class wpkgar_package_cache::download_t
+ * \brief One package to fetch.
+ *
+ * The download object is created with the URI of the package and the
+ * Package-md5sum and Package-Size fields of the index, if known. Once
+ * fetch() returns, the status says whether the package is available in
+ * the cache and get_filename() returns the name of the cached file.
+ */
+
+
+/** \brief Initialize a package download.
+ *
+ * \param[in] uri  The URI of the .deb file in the repository.
+ * \param[in] md5sum  The expected md5sum or an empty string.
+ * \param[in] size  The expected size or -1.
+ */
+wpkgar_package_cache::download_t::download_t(const wpkg_filename::uri_filename& uri, const std::string& md5sum, int64_t size)
+    : f_uri(uri)
+    , f_md5sum(md5sum)
+    , f_size(size)
+    //, f_filename() -- auto-init
+    //, f_status(status_unknown) -- auto-init
+    //, f_resumed_at(0) -- auto-init
+    //, f_downloaded(0) -- auto-init
+    //, f_elapsed(0) -- auto-init
+    //, f_error("") -- auto-init
+{
+}
+
+
+const wpkg_filename::uri_filename& wpkgar_package_cache::download_t::get_uri() const
+{
+    return f_uri;
+}
+
+
+/** \brief The name of the package in the cache.
+ *
+ * \return The cached file, only valid when the status is not failed.
+ */
+const wpkg_filename::uri_filename& wpkgar_package_cache::download_t::get_filename() const
+{
+    return f_filename;
+}
+
+
+wpkgar_package_cache::download_t::status_t wpkgar_package_cache::download_t::get_status() const
+{
+    return f_status;
+}
+
+
+/** \brief The size of the partial file that got resumed.
+ *
+ * \return The number of bytes that were already downloaded by a
+ *         previous run when the status is status_resumed.
+ */
+int64_t wpkgar_package_cache::download_t::get_resumed_at() const
+{
+    return f_resumed_at;
+}
+
+
+/** \brief Number of bytes transferred from the repository.
+ *
+ * \return The number of bytes downloaded by fetch().
+ */
+int64_t wpkgar_package_cache::download_t::get_downloaded() const
+{
+    return f_downloaded;
+}
+
+
+/** \brief Time it took to fetch this package.
+ *
+ * \return The time in milliseconds.
+ */
+int64_t wpkgar_package_cache::download_t::get_elapsed() const
+{
+    return f_elapsed;
+}
+
+
+std::string wpkgar_package_cache::download_t::get_error() const
+{
+    return f_error;
+}
+
+
+
+/** \class wpkgar_package_cache
+ * \brief Manage the local cache of remote packages.
+ *
+ * The fetch() function makes sure that a list of packages is available
+ * in the cache, downloading the missing ones in parallel. The evict()
+ * function removes the least recently used packages once the cache is
+ * larger than its maximum size.
+ *
+ * None of these functions emit log messages since they run in worker
+ * threads. The caller logs the results found in the download objects.
+ */
+
+
+/** \brief Initialize the cache.
+ *
+ * \param[in] directory  The directory where the packages are saved.
+ */
+wpkgar_package_cache::wpkgar_package_cache(const wpkg_filename::uri_filename& directory)
+    : f_directory(directory)
+    , f_maximum_size(DEFAULT_MAXIMUM_SIZE)
+    , f_jobs(4)
+{
+}
+
+
+/** \brief Define the maximum size of the cache.
+ *
+ * \param[in] size  The maximum number of bytes used by the cache.
+ */
+void wpkgar_package_cache::set_maximum_size(int64_t size)
+{
+    f_maximum_size = size;
+}
+
+
+/** \brief Define the number of packages downloaded in parallel.
+ *
+ * \param[in] jobs  The maximum number of connections used at once.
+ */
+void wpkgar_package_cache::set_jobs(int jobs)
+{
+    f_jobs = jobs;
+}
+
+
+/** \brief Get the name of a package in the cache.
+ *
+ * The name of the package is prefixed with the first 16 digits of
+ * the md5sum of its full URI. Two repositories may offer different
+ * packages with the exact same filename and these must not share
+ * the same cached file.
+ *
+ * \param[in] uri  The URI of the package in the repository.
+ *
+ * \return The name of the corresponding file in the cache directory.
+ */
+wpkg_filename::uri_filename wpkgar_package_cache::get_filename(const wpkg_filename::uri_filename& uri) const
+{
+    const std::string full_path(uri.full_path());
+    md5::md5sum sum;
+    sum.push_back(reinterpret_cast<const uint8_t *>(full_path.c_str()), full_path.length());
+    return f_directory.append_child(sum.sum().substr(0, 16) + "_" + uri.segment(uri.segment_size() - 1));
+}
+
+
+/** \brief Make sure the packages are available in the cache.
+ *
+ * Each package already found in the cache is verified. The other
+ * packages are downloaded by up to f_jobs threads.
+ *
+ * Packages of at most RANGE_SIZE bytes coming from the same server are
+ * grouped in batches of up to wpkg_http::client::MAX_PIPELINE packages
+ * which get requested at once (see fetch_pipelined().)
+ *
+ * The names of the cached files are determined here, before any thread
+ * starts, and a package listed more than once is only fetched once. That
+ * way each thread works on its own files (the cached file and its
+ * ".part" file) and the threads only share the stat() cache which is
+ * protected by a mutex.
+ *
+ * The function does not throw on errors; instead the status of the
+ * failed downloads is set to status_failed with an error message.
+ *
+ * \param[in,out] downloads  The packages to fetch.
+ */
+void wpkgar_package_cache::fetch(download_list_t& downloads) const
+{
+    if(downloads.empty())
+    {
+        return;
+    }
+    f_directory.os_mkdir_p();
+
+    // the packages to fetch and, for each duplicate, the index of the
+    // download it is a duplicate of
+    std::vector<size_t> unique;
+    std::vector<size_t> duplicate_of(downloads.size(), downloads.size());
+    std::map<std::string, size_t> seen;
+    for(size_t idx(0); idx < downloads.size(); ++idx)
+    {
+        downloads[idx].f_filename = get_filename(downloads[idx].f_uri);
+        const std::string key(downloads[idx].f_filename.full_path());
+        std::map<std::string, size_t>::const_iterator it(seen.find(key));
+        if(it == seen.end())
+        {
+            seen[key] = idx;
+            unique.push_back(idx);
+        }
+        else
+        {
+            duplicate_of[idx] = it->second;
+        }
+    }
+
+    // small packages from the same server are fetched with pipelined
+    // requests, the other packages one by one
+    std::vector<std::vector<size_t> > items;
+    std::map<std::string, size_t> batches;
+    for(std::vector<size_t>::const_iterator it(unique.begin()); it != unique.end(); ++it)
+    {
+        const download_t& d(downloads[*it]);
+        if(d.f_uri.path_scheme() == "http"
+        && !d.f_md5sum.empty()
+        && d.f_size >= 0 && d.f_size <= RANGE_SIZE)
+        {
+            const std::string key(d.f_uri.get_domain() + ":" + d.f_uri.get_port());
+            std::map<std::string, size_t>::const_iterator b(batches.find(key));
+            if(b != batches.end() && items[b->second].size() < static_cast<size_t>(wpkg_http::client::MAX_PIPELINE))
+            {
+                items[b->second].push_back(*it);
+                continue;
+            }
+            batches[key] = items.size();
+        }
+        items.push_back(std::vector<size_t>(1, *it));
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+        for(size_t idx(next++); idx < items.size(); idx = next++)
+        {
+            if(items[idx].size() > 1)
+            {
+                fetch_pipelined(downloads, items[idx]);
+            }
+            else
+            {
+                fetch_package(downloads[items[idx][0]]);
+            }
+        }
+    };
+    const size_t max_jobs(std::min(static_cast<size_t>(std::max(static_cast<int32_t>(f_jobs), 1)), items.size()));
+    if(max_jobs <= 1)
+    {
+        worker();
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for(size_t i(0); i < max_jobs; ++i)
+        {
+            threads.push_back(std::thread(worker));
+        }
+        for(auto& t : threads)
+        {
+            t.join();
+        }
+    }
+
+    for(size_t idx(0); idx < downloads.size(); ++idx)
+    {
+        if(duplicate_of[idx] != downloads.size())
+        {
+            const download_t& d(downloads[duplicate_of[idx]]);
+            downloads[idx].f_status = d.f_status == download_t::status_failed ? download_t::status_failed : download_t::status_cached;
+            downloads[idx].f_error = d.f_error;
+        }
+    }
+}
+
+
+/** \brief Remove the least recently used files.
+ *
+ * When the files in the cache use more than the maximum size, the
+ * files with the oldest modification time are deleted until the cache
+ * fits. The files listed in \p keep are not deleted.
+ *
+ * \param[in] keep  The cached packages used by the current process.
+ *
+ * \return The number of files deleted.
+ */
+int wpkgar_package_cache::evict(const wpkg_filename::filename_list_t& keep) const
+{
+    if(!f_directory.is_dir())
+    {
+        return 0;
+    }
+
+    std::vector<cached_file_t> files;
+    int64_t total(0);
+    wpkg_filename::os_dir dir(f_directory);
+    wpkg_filename::uri_filename filename;
+    while(dir.read(filename))
+    {
+        wpkg_filename::uri_filename::file_stat s;
+        if(filename.os_stat(s) != 0 || !s.is_reg())
+        {
+            continue;
+        }
+        total += s.get_size();
+        bool kept(false);
+        for(wpkg_filename::filename_list_t::const_iterator it(keep.begin()); it != keep.end(); ++it)
+        {
+            if(it->full_path() == filename.full_path())
+            {
+                kept = true;
+                break;
+            }
+        }
+        if(!kept)
+        {
+            cached_file_t f;
+            f.f_filename = filename;
+            f.f_mtime = s.get_mtime();
+            f.f_size = s.get_size();
+            files.push_back(f);
+        }
+    }
+
+    int count(0);
+    std::sort(files.begin(), files.end());
+    for(std::vector<cached_file_t>::const_iterator it(files.begin()); it != files.end() && total > f_maximum_size; ++it)
+    {
+        if(it->f_filename.os_unlink())
+        {
+            total -= it->f_size;
+            ++count;
+        }
+    }
+    return count;
+}
+
+
+/** \brief Fetch one package.
+ *
+ * This function runs in a worker thread. The name of the cached file
+ * was already set by fetch().
+ *
+ * \param[in,out] download  The package to fetch.
+ */
+void wpkgar_package_cache::fetch_package(download_t& download) const
+{
+    const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+    try
+    {
+        const wpkg_filename::uri_filename part(download.f_filename.full_path() + ".part");
+        if(download.f_md5sum.empty())
+        {
+            // without an md5sum we cannot know whether the cached file
+            // or the partial file are from this very package
+            download.f_filename.os_unlink();
+            part.os_unlink();
+        }
+        else if(download.f_filename.exists())
+        {
+            if(verify(download.f_filename, download))
+            {
+                touch(download.f_filename);
+                download.f_status = download_t::status_cached;
+            }
+            else
+            {
+                // corrupt or the package changed in the repository
+                download.f_filename.os_unlink();
+            }
+        }
+        if(download.f_status != download_t::status_cached)
+        {
+            download_package(part, download);
+            if(!verify(part, download))
+            {
+                part.os_unlink();
+                throw wpkgar_exception_invalid("the size or md5sum of the downloaded package does not match the repository index");
+            }
+            if(!part.os_rename(download.f_filename))
+            {
+                throw wpkgar_exception_io("could not rename \"" + part.original_filename() + "\" to \"" + download.f_filename.original_filename() + "\"");
+            }
+        }
+    }
+    catch(const std::exception& e)
+    {
+        download.f_status = download_t::status_failed;
+        download.f_error = e.what();
+    }
+    download.f_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+/** \brief Fetch small packages from one server with pipelined requests.
+ *
+ * This function runs in a worker thread. The packages of \p batch all
+ * come from the same server and are small enough to be downloaded with
+ * a single request each. The ones which are neither cached nor partially
+ * downloaded are requested at once with wpkg_http::client::pipeline()
+ * and the replies are saved in their partial files as they arrive.
+ *
+ * Any other package, and any package which could not be downloaded that
+ * way (redirect, error, invalid md5sum, etc.), goes through
+ * fetch_package() which handles all the cases.
+ *
+ * \param[in,out] downloads  The packages being fetched.
+ * \param[in] batch  The indexes of the packages to fetch in \p downloads.
+ */
+void wpkgar_package_cache::fetch_pipelined(download_list_t& downloads, const std::vector<size_t>& batch) const
+{
+    const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+
+    std::vector<download_t *> pending;
+    std::vector<wpkg_http::request> requests;
+    for(std::vector<size_t>::const_iterator it(batch.begin()); it != batch.end(); ++it)
+    {
+        download_t& download(downloads[*it]);
+        const wpkg_filename::uri_filename part(download.f_filename.full_path() + ".part");
+        wpkg_filename::os_stat_cache::invalidate(part);
+        if(download.f_filename.exists() || part.exists())
+        {
+            fetch_package(download);
+            continue;
+        }
+        pending.push_back(&download);
+        requests.push_back(package_request(download.f_uri, download.f_uri));
+    }
+    if(pending.empty())
+    {
+        return;
+    }
+
+    std::vector<std::shared_ptr<part_output> > outputs;
+    std::vector<wpkg_http::response> results(pending.size());
+    for(size_t i(0); i < pending.size(); ++i)
+    {
+        outputs.push_back(std::shared_ptr<part_output>(new part_output(pending[i]->f_filename.full_path() + ".part", pending[i]->f_uri, results[i], 0, pending[i]->f_size)));
+        results[i].set_body_output(outputs[i].get());
+    }
+    try
+    {
+        const wpkg_filename::uri_filename& uri(pending[0]->f_uri);
+        wpkg_http::client::pipeline(uri.get_domain(), uri_port(uri), requests, results);
+    }
+    catch(const std::exception&)
+    {
+        // the packages not received are fetched one by one below
+    }
+    const int64_t elapsed(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+    for(size_t i(0); i < pending.size(); ++i)
+    {
+        download_t& download(*pending[i]);
+        const wpkg_filename::uri_filename part(download.f_filename.full_path() + ".part");
+        outputs[i]->close();
+        if(results[i].get_status() == 200
+        && verify(part, download)
+        && part.os_rename(download.f_filename))
+        {
+            download.f_status = download_t::status_downloaded;
+            download.f_downloaded = results[i].get_body_size();
+            download.f_elapsed = elapsed;
+        }
+        else
+        {
+            part.os_unlink();
+            fetch_package(download);
+        }
+    }
+}
+
+
+/** \brief Verify a file against the index fields.
+ *
+ * \param[in] filename  The file to verify.
+ * \param[in] download  The package with the expected size and md5sum.
+ *
+ * \return true if the size and md5sum match (when known.)
+ */
+bool wpkgar_package_cache::verify(const wpkg_filename::uri_filename& filename, const download_t& download) const
+{
+    // the file may have changed since it was last checked
+    wpkg_filename::uri_filename file(filename);
+    file.clear_cache();
+    wpkg_filename::os_stat_cache::invalidate(file);
+    wpkg_filename::uri_filename::file_stat s;
+    if(file.os_stat(s) != 0 || !s.is_reg())
+    {
+        return false;
+    }
+    if(download.f_size >= 0 && s.get_size() != download.f_size)
+    {
+        return false;
+    }
+    if(!download.f_md5sum.empty()
+    && memfile::memory_file::file_md5sum(file) != download.f_md5sum)
+    {
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief Download a package in a partial file.
+ *
+ * When the size of the package is known, the file is requested in
+ * blocks of RANGE_SIZE bytes and each block is appended to the partial
+ * file as it arrives. If the partial file already exists, the download
+ * resumes at its end. A server which does not support Range requests
+ * replies with the whole file which then replaces the partial file.
+ *
+ * The bodies are written to the partial file as they arrive (see
+ * part_output) and a reply which does not start where the partial file
+ * ends or goes beyond the size of the package is stopped before the
+ * extra data gets written.
+ *
+ * A partial reply which does not make the download progress is an
+ * error; otherwise a broken server could keep us looping forever.
+ *
+ * \param[in] part  The partial file.
+ * \param[in,out] download  The package being downloaded.
+ */
+void wpkgar_package_cache::download_package(const wpkg_filename::uri_filename& part, download_t& download) const
+{
+    wpkg_filename::uri_filename uri(download.f_uri);
+
+    int64_t have(0);
+    wpkg_filename::uri_filename::file_stat s;
+    wpkg_filename::os_stat_cache::invalidate(part);
+    if(part.os_stat(s) == 0 && s.is_reg())
+    {
+        have = s.get_size();
+        if(download.f_size >= 0 && have > download.f_size)
+        {
+            part.os_unlink();
+            have = 0;
+        }
+    }
+    if(have > 0)
+    {
+        download.f_resumed_at = have;
+        download.f_status = download_t::status_resumed;
+    }
+    else
+    {
+        download.f_status = download_t::status_downloaded;
+    }
+
+    int redirects(0);
+    bool restarted(false);
+    for(;;)
+    {
+        if(download.f_size >= 0 && have == download.f_size)
+        {
+            // complete
+            return;
+        }
+
+        if(uri.path_scheme() != "http")
+        {
+            throw wpkgar_exception_io("package \"" + uri.original_filename() + "\" does not use the http scheme");
+        }
+        wpkg_http::request request(package_request(uri, download.f_uri));
+        const bool ranged(have > 0 || download.f_size > RANGE_SIZE);
+        if(ranged)
+        {
+            std::string range("bytes=" + to_string(have) + "-");
+            if(download.f_size >= 0)
+            {
+                range += to_string(std::min(have + RANGE_SIZE, static_cast<int64_t>(download.f_size)) - 1);
+            }
+            request.set_field("Range", range);
+        }
+
+        // the body is saved in the partial file as it arrives
+        wpkg_http::response response;
+        part_output output(part, download.f_uri, response, have, download.f_size);
+        response.set_body_output(&output);
+        wpkg_http::client::get(uri.get_domain(), uri_port(uri), request, response);
+        output.close();
+        switch(response.get_status())
+        {
+        case 301: // Moved permanently
+        case 302: // Found
+        case 303: // See Other
+        case 307: // Temporary Redirect
+        case 308: // Permanent Redirect
+            ++redirects;
+            if(redirects > MAX_REDIRECTS || response.get_field("Location").empty())
+            {
+                throw wpkgar_exception_io("too many or invalid HTTP redirects for \"" + download.f_uri.original_filename() + "\"");
+            }
+            uri.set_filename(response.get_field("Location"));
+            break;
+
+        case 200: // OK -- the whole file
+            {
+                if(!output.is_opened())
+                {
+                    // an empty file
+                    wpkg_stream::fstream file;
+                    if(!file.create(part))
+                    {
+                        throw wpkgar_exception_io("could not create \"" + part.original_filename() + "\"");
+                    }
+                }
+                download.f_downloaded += response.get_body_size();
+                if(have > 0)
+                {
+                    // the server ignored our Range
+                    download.f_resumed_at = 0;
+                    download.f_status = download_t::status_downloaded;
+                }
+            }
+            return;
+
+        case 206: // Partial Content
+            // the Content-Range and the size were checked by the output
+            if(response.get_body_size() == 0)
+            {
+                throw wpkgar_exception_io("HTTP partial content is empty for \"" + download.f_uri.original_filename() + "\"");
+            }
+            have = output.get_have();
+            download.f_downloaded += response.get_body_size();
+            if(download.f_size < 0)
+            {
+                if(output.get_size() < 0)
+                {
+                    // the range was open ended, we got the rest of the file
+                    return;
+                }
+                download.f_size = output.get_size();
+            }
+            break;
+
+        case 416: // Range Not Satisfiable
+            if(have > 0 && !restarted)
+            {
+                // the file changed on the server, start over
+                restarted = true;
+                part.os_unlink();
+                have = 0;
+                download.f_resumed_at = 0;
+                download.f_status = download_t::status_downloaded;
+                break;
+            }
+            throw wpkgar_exception_io("HTTP range not satisfiable for \"" + download.f_uri.original_filename() + "\"");
+
+        default:
+            throw wpkgar_exception_io("HTTP response was " + to_string(response.get_status()) + " for \"" + download.f_uri.original_filename() + "\", expected 200 or 206");
+
+        }
+    }
+}
+
+
+}   // namespace wpkgar
+// vim: ts=4 sw=4 et
@@ -1520,6 +1520,7 @@ bool wpkgar_remove::remove_directory_if_empty(const std::string& package_name, c
 
     // delete that directory
     rmdir(fname.os_filename().get_os_string().c_str());
+    wpkg_filename::os_stat_cache::invalidate(fname);
 
     wpkg_output::log("%1 %2 removed...")
             .quoted_arg(fname)
@@ -1565,8 +1566,12 @@ bool wpkgar_remove::do_remove(package_item_t *item)
     // all the corresponding files
     try
     {
-        f_manager->set_field(item->get_name(), wpkg_control::control_file::field_xstatus_factory_t::canonicalized_name(), "Removing", true);
-        f_manager->set_field(item->get_name(), "X-Remove-Date", wpkg_util::rfc2822_date(), true);
+        {
+            wpkgar_status_transaction transaction(f_manager);
+            f_manager->set_field(item->get_name(), wpkg_control::control_file::field_xstatus_factory_t::canonicalized_name(), "Removing", true);
+            f_manager->set_field(item->get_name(), "X-Remove-Date", wpkg_util::rfc2822_date(), true);
+            transaction.commit();
+        }
 
         {
             std::set<wpkg_filename::uri_filename> directories;
@@ -1602,10 +1607,9 @@ bool wpkgar_remove::do_remove(package_item_t *item)
                     {
                         break;
                     }
-                    // do a backup no matter what
+                    // do a backup no matter what; this deletes the file
+                    // unless it did not exist
                     backup.backup(destination);
-                    // delete that file
-                    destination.os_unlink();
 
                     directories.insert(wpkg_filename::uri_filename(filename).dirname());
 
@@ -1710,8 +1714,12 @@ bool wpkgar_remove::do_remove(package_item_t *item)
     // the configuration files are still there, the rest is gone
     // (XXX what is the new status when starting from Half-Installed or Half-Configured?)
     const std::string final_status(item->get_original_status() == wpkgar_manager::unpacked || item->get_original_status() == wpkgar_manager::not_installed ? "Not-Installed" : "Config-Files");
-    f_manager->set_field(item->get_name(), wpkg_control::control_file::field_xstatus_factory_t::canonicalized_name(), final_status, true);
-    f_manager->set_field(item->get_name(), "X-Removed-Date", wpkg_util::rfc2822_date(), true);
+    {
+        wpkgar_status_transaction transaction(f_manager);
+        f_manager->set_field(item->get_name(), wpkg_control::control_file::field_xstatus_factory_t::canonicalized_name(), final_status, true);
+        f_manager->set_field(item->get_name(), "X-Removed-Date", wpkg_util::rfc2822_date(), true);
+        transaction.commit();
+    }
 
     // change the original so the deconfigure does the right thing!
     item->reset_original_status();
@@ -1802,6 +1810,7 @@ int wpkgar_remove::remove()
                     }
                     restore_cmd += ".deb";
                     f_manager->track(restore_cmd, package_name);
+                    f_manager->sync_tracker();
 
                     if(!do_remove(&f_packages[idx]))
                     {
@@ -2063,8 +2072,12 @@ bool wpkgar_remove::deconfigure_package(package_item_t *item)
         return false;
     }
 
-    f_manager->set_field(item->get_name(), wpkg_control::control_file::field_xstatus_factory_t::canonicalized_name(), "Half-Configured", true);
-    f_manager->set_field(item->get_name(), "X-Deconfigure-Date", wpkg_util::rfc2822_date(), true);
+    {
+        wpkgar_status_transaction transaction(f_manager);
+        f_manager->set_field(item->get_name(), wpkg_control::control_file::field_xstatus_factory_t::canonicalized_name(), "Half-Configured", true);
+        f_manager->set_field(item->get_name(), "X-Deconfigure-Date", wpkg_util::rfc2822_date(), true);
+        transaction.commit();
+    }
 
     // get the list of configuration files
     std::vector<std::string> files;
@@ -2212,6 +2225,7 @@ bool wpkgar_remove::deconfigure(int idx)
         // is "install" so we won't need this entry (which would
         // appear in the wrong order anyway!)
         f_manager->track("configure " + package_name, package_name);
+        f_manager->sync_tracker();
     }
 
     return deconfigure_package(&f_packages[idx]);
@@ -27,11 +27,20 @@
  * of the wpkg tool.
  */
 #include    "libdebpackages/wpkgar_repository.h"
+#include    "libdebpackages/wpkgar_binary_index.h"
 #include    "libdebpackages/debian_version.h"
 #include    "libdebpackages/wpkg_util.h"
 #include    <algorithm>
+#include    <atomic>
+#include    <chrono>
+#include    <condition_variable>
+#include    <deque>
+#include    <exception>
+#include    <set>
 #include    <sstream>
 #include    <iostream>
+#include    <mutex>
+#include    <thread>
 #include	<time.h>
 
 
@@ -223,6 +232,88 @@ std::string wpkgar_repository::package_item_t::get_cause_for_rejection() const
 
 
 
+namespace
+{
+
+/** \brief Encode a validator for the update.validators file.
+ *
+ * The fields of an update.validators line are separated by spaces and
+ * the HTTP validators (ETag and Last-Modified) may include spaces. This
+ * function escapes them and an empty value is saved as "-".
+ *
+ * \param[in] value  The value to encode.
+ *
+ * \return The value safe to save in the update.validators file.
+ */
+std::string encode_validator(const std::string& value)
+{
+    if(value.empty())
+    {
+        return "-";
+    }
+    std::string result;
+    for(std::string::const_iterator it(value.begin()); it != value.end(); ++it)
+    {
+        const unsigned char c(static_cast<unsigned char>(*it));
+        if(c <= ' ' || c >= 0x7F || c == '%' || c == ',' || (c == '-' && value.length() == 1))
+        {
+            char buf[4];
+            snprintf(buf, sizeof(buf), "%%%02X", c);
+            result += buf;
+        }
+        else
+        {
+            result += static_cast<char>(c);
+        }
+    }
+    return result;
+}
+
+
+/** \brief Decode a validator read from the update.validators file.
+ *
+ * This function reverses the encode_validator() function.
+ *
+ * \param[in] value  The encoded value.
+ *
+ * \return The decoded value.
+ */
+std::string decode_validator(const std::string& value)
+{
+    if(value == "-")
+    {
+        return "";
+    }
+    std::string result;
+    for(std::string::size_type i(0); i < value.length(); ++i)
+    {
+        if(value[i] == '%')
+        {
+            if(i + 2 >= value.length())
+            {
+                throw wpkgar_exception_invalid("invalid % sequence in an index entry validator");
+            }
+            char *end;
+            const std::string hex(value.substr(i + 1, 2));
+            const long c(strtol(hex.c_str(), &end, 16));
+            if(end == NULL || *end != '\0')
+            {
+                throw wpkgar_exception_invalid("invalid % sequence in an index entry validator");
+            }
+            result += static_cast<char>(c);
+            i += 2;
+        }
+        else
+        {
+            result += value[i];
+        }
+    }
+    return result;
+}
+
+} // no name namespace
+
+
 int32_t wpkgar_repository::update_entry_t::get_index() const
 {
     return f_index;
@@ -243,6 +334,40 @@ time_t wpkgar_repository::update_entry_t::get_time(update_entry_time_t t) const
     return f_times[t];
 }
 
+int64_t wpkgar_repository::update_entry_t::get_size() const
+{
+    return f_size;
+}
+
+std::string wpkgar_repository::update_entry_t::get_md5sum() const
+{
+    return f_md5sum;
+}
+
+/** \brief The md5sum of the repository index our copy corresponds to.
+ *
+ * When the index gets downloaded this is the md5sum of our copy. When
+ * our copy was patched with an index diff, it is the md5sum of the
+ * index of the repository, which differs from the md5sum of our copy
+ * since the tarball we recreated is not byte for byte the same.
+ *
+ * \return The md5sum of the index in the repository.
+ */
+std::string wpkgar_repository::update_entry_t::get_repository_md5sum() const
+{
+    return f_repository_md5sum;
+}
+
+std::string wpkgar_repository::update_entry_t::get_etag() const
+{
+    return f_etag;
+}
+
+std::string wpkgar_repository::update_entry_t::get_last_modified() const
+{
+    return f_last_modified;
+}
+
 void wpkgar_repository::update_entry_t::set_index(int index)
 {
     if(f_index != 0)
@@ -287,12 +412,38 @@ void wpkgar_repository::update_entry_t::update_time(time_t t)
     }
 }
 
+void wpkgar_repository::update_entry_t::set_size(int64_t size)
+{
+    f_size = size;
+}
+
+void wpkgar_repository::update_entry_t::set_md5sum(const std::string& md5sum)
+{
+    f_md5sum = md5sum;
+}
+
+void wpkgar_repository::update_entry_t::set_repository_md5sum(const std::string& md5sum)
+{
+    f_repository_md5sum = md5sum;
+}
+
+void wpkgar_repository::update_entry_t::set_etag(const std::string& etag)
+{
+    f_etag = etag;
+}
+
+void wpkgar_repository::update_entry_t::set_last_modified(const std::string& last_modified)
+{
+    f_last_modified = last_modified;
+}
+
 void wpkgar_repository::update_entry_t::from_string(const std::string& line)
 {
     update_entry_t index_entry;
     std::vector<std::string> v;
 
-    // first break the line in X number of strings (must be 4)
+    // first break the line in X number of strings (must be 4; a
+    // development version saved the validators here, making it 8)
     std::string::size_type p(0), q;
     for(;;)
     {
@@ -305,9 +456,9 @@ void wpkgar_repository::update_entry_t::from_string(const std::string& line)
         p = q + 1;
     }
     v.push_back(line.substr(p));
-    if(v.size() != 4)
+    if(v.size() != 4 && v.size() != 8)
     {
-        throw wpkgar_exception_invalid("an index entry line must include 4 entries");
+        throw wpkgar_exception_invalid("an index entry line must include 4 or 8 entries");
     }
 
     // read the index
@@ -375,6 +526,19 @@ void wpkgar_repository::update_entry_t::from_string(const std::string& line)
             throw wpkgar_exception_invalid("Unix time cannot be negative");
         }
     }
+
+    if(v.size() == 8)
+    {
+        f_size = static_cast<int64_t>(strtoll(v[4].c_str(), &end, 10));
+        if(end == NULL || *end != '\0' || f_size < 0)
+        {
+            throw wpkgar_exception_invalid("index size is not a valid number");
+        }
+        f_md5sum = decode_validator(v[5]);
+        f_repository_md5sum = f_md5sum;
+        f_etag = decode_validator(v[6]);
+        f_last_modified = decode_validator(v[7]);
+    }
 }
 
 std::string wpkgar_repository::update_entry_t::to_string() const
@@ -409,6 +573,80 @@ std::string wpkgar_repository::update_entry_t::to_string() const
     return output.str();
 }
 
+/** \brief Retrieve the index of an update.validators line.
+ *
+ * \param[in] line  A line as returned by validators_to_string().
+ *
+ * \return The index of the entry the line is for, or 0 if invalid.
+ */
+int32_t wpkgar_repository::update_entry_t::validators_index(const std::string& line)
+{
+    return static_cast<int32_t>(strtol(line.c_str(), NULL, 10));
+}
+
+/** \brief Load the validators of an entry.
+ *
+ * The validators are saved in the update.validators file, separate
+ * from the update.index file, so older versions of wpkg, which expect
+ * exactly 4 fields per update.index line, can still read it.
+ *
+ * A line has 6 fields: the index of the entry, the size and md5sum of
+ * our copy of the index, the md5sum of the index in the repository,
+ * and the ETag and Last-Modified of the last HTTP reply.
+ *
+ * \param[in] line  The line to parse.
+ */
+void wpkgar_repository::update_entry_t::validators_from_string(const std::string& line)
+{
+    std::vector<std::string> v;
+    std::string::size_type p(0), q;
+    for(;;)
+    {
+        q = line.find_first_of(' ', p);
+        if(q == std::string::npos)
+        {
+            break;
+        }
+        v.push_back(line.substr(p, q - p));
+        p = q + 1;
+    }
+    v.push_back(line.substr(p));
+    if(v.size() != 6)
+    {
+        throw wpkgar_exception_invalid("an index validators line must include 6 entries");
+    }
+    if(validators_index(v[0]) != f_index)
+    {
+        throw wpkgar_exception_invalid("index validators line used with the wrong entry");
+    }
+
+    char *end;
+    const int64_t size(static_cast<int64_t>(strtoll(v[1].c_str(), &end, 10)));
+    if(end == NULL || *end != '\0' || size < 0)
+    {
+        throw wpkgar_exception_invalid("index size is not a valid number");
+    }
+    f_size = size;
+    f_md5sum = decode_validator(v[2]);
+    f_repository_md5sum = decode_validator(v[3]);
+    f_etag = decode_validator(v[4]);
+    f_last_modified = decode_validator(v[5]);
+}
+
+std::string wpkgar_repository::update_entry_t::validators_to_string() const
+{
+    std::stringstream output;
+
+    output << f_index
+           << " " << f_size
+           << " " << encode_validator(f_md5sum)
+           << " " << encode_validator(f_repository_md5sum)
+           << " " << encode_validator(f_etag)
+           << " " << encode_validator(f_last_modified);
+
+    return output.str();
+}
+
 
 
 
@@ -420,6 +658,8 @@ wpkgar_repository::wpkgar_repository(wpkgar_manager *manager)
     //, f_repository() -- auto-init
     //, f_repository_packages_loaded(false) -- auto-init
     //, f_update_index() -- auto-init
+    //, f_installed_packages() -- auto-init
+    //, f_index_fingerprints() -- auto-init
 {
 }
 
@@ -441,6 +681,321 @@ int wpkgar_repository::get_parameter(parameter_t flag, int default_value) const
 }
 
 
+namespace
+{
+
+/** \brief One package to add to a repository index.
+ *
+ * The job is created while reading the repositories. The f_data memory
+ * file is already set when the repository is an archive; it is released
+ * as soon as the job ran. Otherwise the
+ * package gets read by run_index_job().
+ *
+ * The results (f_control, f_md5sum, f_size, f_error) are set by
+ * run_index_job() which may run in a worker thread.
+ */
+struct index_job_t
+{
+    index_job_t()
+        : f_size(0)
+    {
+    }
+
+    memfile::memory_file::file_info         f_info;
+    wpkg_filename::uri_filename             f_path;
+    std::string                             f_fingerprint;
+    std::string                             f_md5sum;
+    std::shared_ptr<memfile::memory_file>   f_data;
+    std::shared_ptr<memfile::memory_file>   f_control;
+    int64_t                                 f_size;
+    std::exception_ptr                      f_error;
+};
+
+
+/** \brief Extract the control file of one package.
+ *
+ * This function reads the package (only its control.tar when it is on
+ * disk), decompresses the control.tar and saves the control file in the
+ * job. It also computes the md5sum of the package when no .md5sum file
+ * was found.
+ *
+ * The function does not generate any log and only works on the job so
+ * several jobs can run in parallel. Errors are saved in the job and
+ * rethrown by create_index().
+ *
+ * \param[in,out] job  The package to work on.
+ */
+void run_index_job(index_job_t& job)
+{
+    try
+    {
+        bool partial(false);
+        if(!job.f_data)
+        {
+            // the index only needs the control.tar file
+            job.f_data.reset(new memfile::memory_file);
+            job.f_data->read_ar_file(job.f_info.get_filename(), "data.tar");
+            partial = true;
+        }
+        memfile::memory_file& data(*job.f_data);
+
+        data.dir_rewind();
+        for(;;)
+        {
+            memfile::memory_file::file_info ar_info;
+            memfile::memory_file control_tar;
+            if(!data.dir_next(ar_info, &control_tar))
+            {
+                break;
+            }
+            const wpkg_filename::uri_filename& ar_filename(ar_info.get_filename());
+            if(ar_info.get_file_type() == memfile::memory_file::file_info::regular_file
+            && ar_filename.basename() == "control")
+            {
+                if(control_tar.is_compressed())
+                {
+                    memfile::memory_file d;
+                    control_tar.copy(d);
+                    d.decompress(control_tar);
+                }
+                control_tar.dir_rewind();
+                for(;;)
+                {
+                    memfile::memory_file::file_info ctrl_info;
+                    std::shared_ptr<memfile::memory_file> control(new memfile::memory_file);
+                    if(!control_tar.dir_next(ctrl_info, control.get()))
+                    {
+                        break;
+                    }
+                    const wpkg_filename::uri_filename& ctrl_filename(ctrl_info.get_filename());
+                    if(ctrl_info.get_file_type() == memfile::memory_file::file_info::regular_file
+                    && ctrl_filename.basename() == "control")
+                    {
+                        if(job.f_md5sum.empty())
+                        {
+                            // without a .md5sum file we have to read
+                            // the whole package once
+                            job.f_md5sum = partial ? memfile::memory_file::file_md5sum(job.f_info.get_filename()) : data.md5sum();
+                        }
+                        job.f_size = partial ? job.f_info.get_size() : data.size();
+                        job.f_control = control;
+                        break;
+                    }
+                }
+                break; // this is all.
+            }
+        }
+    }
+    catch(...)
+    {
+        job.f_error = std::current_exception();
+    }
+
+    // release the package, only the control file is kept
+    job.f_data.reset();
+}
+
+
+/** \brief Run the index jobs while the repositories are being read.
+ *
+ * The jobs are added with add() as the repositories get read and the
+ * workers process them right away. The packages of an archive
+ * repository are extracted in memory (f_data) by the main thread so
+ * only a few of them get queued at a time: add() blocks until a worker
+ * is done with one of them. This way the memory used does not grow
+ * with the size of the repository.
+ *
+ * The jobs are saved in a deque so the references used by the workers
+ * remain valid while more jobs get added.
+ *
+ * With a single job, add() runs the job immediately.
+ */
+class index_job_pool
+{
+public:
+    index_job_pool(std::deque<index_job_t>& jobs, int max_jobs)
+        : f_jobs(jobs)
+        //, f_mutex() -- auto-init
+        //, f_condition() -- auto-init
+        //, f_workers() -- auto-init
+        , f_max_loaded(static_cast<size_t>(std::max(1, max_jobs)) * 2)
+        , f_next(0)
+        , f_loaded(0)
+        , f_done(false)
+    {
+        if(max_jobs > 1)
+        {
+            for(int i(0); i < max_jobs; ++i)
+            {
+                f_workers.push_back(std::thread(&index_job_pool::worker, this));
+            }
+        }
+    }
+
+    ~index_job_pool()
+    {
+        finish();
+    }
+
+    void add(const index_job_t& job)
+    {
+        if(f_workers.empty())
+        {
+            f_jobs.push_back(job);
+            run_index_job(f_jobs.back());
+            return;
+        }
+        std::unique_lock<std::mutex> lock(f_mutex);
+        if(job.f_data)
+        {
+            while(f_loaded >= f_max_loaded)
+            {
+                f_condition.wait(lock);
+            }
+            ++f_loaded;
+        }
+        f_jobs.push_back(job);
+        f_condition.notify_all();
+    }
+
+    void finish()
+    {
+        {
+            std::unique_lock<std::mutex> lock(f_mutex);
+            f_done = true;
+            f_condition.notify_all();
+        }
+        for(std::vector<std::thread>::iterator w(f_workers.begin()); w != f_workers.end(); ++w)
+        {
+            w->join();
+        }
+        f_workers.clear();
+    }
+
+private:
+    void worker()
+    {
+        for(;;)
+        {
+            index_job_t *job;
+            {
+                std::unique_lock<std::mutex> lock(f_mutex);
+                while(f_next >= f_jobs.size() && !f_done)
+                {
+                    f_condition.wait(lock);
+                }
+                if(f_next >= f_jobs.size())
+                {
+                    return;
+                }
+                job = &f_jobs[f_next];
+                ++f_next;
+            }
+            const bool loaded(job->f_data != nullptr);
+            run_index_job(*job);
+            if(loaded)
+            {
+                std::unique_lock<std::mutex> lock(f_mutex);
+                --f_loaded;
+                f_condition.notify_all();
+            }
+        }
+    }
+
+    std::deque<index_job_t>&        f_jobs;
+    std::mutex                      f_mutex;
+    std::condition_variable         f_condition;
+    std::vector<std::thread>        f_workers;
+    const size_t                    f_max_loaded;
+    size_t                          f_next;
+    size_t                          f_loaded;
+    bool                            f_done;
+};
+
+
+/** \brief Fingerprints of the packages of a repository index.
+ *
+ * The key is the name of the .ctrl file in the index. The value is the
+ * md5sum of the package and the fingerprint of the .deb file as
+ * returned by package_fingerprint().
+ */
+typedef std::map<std::string, std::pair<std::string, std::string> > index_fingerprints_t;
+
+
+/** \brief Compute the fingerprint of a package file.
+ *
+ * The fingerprint is the size, modification time and inode of the file.
+ * When it did not change, the file is viewed as unchanged and its entry
+ * in the previous index gets reused without opening the file.
+ *
+ * \param[in] filename  The name of the .deb file.
+ *
+ * \return The fingerprint or an empty string if stat() fails.
+ */
+std::string package_fingerprint(const wpkg_filename::uri_filename& filename)
+{
+    wpkg_filename::uri_filename::file_stat s;
+    if(filename.os_stat(s) != 0)
+    {
+        return "";
+    }
+    std::stringstream ss;
+    ss << s.get_size() << " " << s.get_mtime() << " " << s.get_mtime_nano() << " " << s.get_inode();
+    return ss.str();
+}
+
+
+/** \brief Load the fingerprints saved along a repository index.
+ *
+ * Each line has the md5sum of the package, its fingerprint (4 numbers)
+ * and the name of its .ctrl file. Invalid lines are ignored.
+ *
+ * \param[in] filename  The name of the fingerprints file.
+ * \param[out] fingerprints  The fingerprints read from the file.
+ */
+void load_index_fingerprints(const wpkg_filename::uri_filename& filename, index_fingerprints_t& fingerprints)
+{
+    if(!filename.exists())
+    {
+        return;
+    }
+    memfile::memory_file file;
+    file.read_file(filename);
+    int64_t offset(0);
+    std::string line;
+    while(file.read_line(offset, line))
+    {
+        std::istringstream in(line);
+        std::string md5sum, size, mtime, mtime_nano, inode, ctrl_name;
+        in >> md5sum >> size >> mtime >> mtime_nano >> inode;
+        std::getline(in, ctrl_name);
+        if(ctrl_name.length() > 1 && ctrl_name[0] == ' ')
+        {
+            fingerprints[ctrl_name.substr(1)] = std::make_pair(md5sum, size + " " + mtime + " " + mtime_nano + " " + inode);
+        }
+    }
+}
+
+
+/** \brief Format the fingerprints of a repository index.
+ *
+ * The output is what load_index_fingerprints() expects.
+ *
+ * \param[out] file  The file receiving the fingerprints.
+ * \param[in] fingerprints  The fingerprints to format.
+ */
+void format_index_fingerprints(memfile::memory_file& file, const index_fingerprints_t& fingerprints)
+{
+    file.create(memfile::memory_file::file_format_other);
+    for(index_fingerprints_t::const_iterator it(fingerprints.begin()); it != fingerprints.end(); ++it)
+    {
+        file.printf("%s %s %s\n", it->second.first.c_str(), it->second.second.c_str(), it->first.c_str());
+    }
+}
+
+} // no name namespace
+
+
 /** \brief Create an index of all the Debian packages.
  *
  * This function reads all the specified repository as specified by the
@@ -453,6 +1008,18 @@ int wpkgar_repository::get_parameter(parameter_t flag, int default_value) const
  * \li size -- the size of the control file
  * \li date -- from the Date field found in the control file
  *
+ * The packages are read by a pool of threads (see the
+ * wpkgar_repository_jobs parameter, by default one per processor.)
+ * The index is generated from their control files once they were all
+ * read so the result does not depend on the number of threads.
+ *
+ * When the wpkgar_repository_incremental parameter is set, the
+ * fingerprint (size, modification time and inode) of each package is
+ * kept so save_index_fingerprints() can save them once the new index
+ * was written. The next time, packages which fingerprint did not change
+ * reuse their entry of the previous index without being opened. Only
+ * new and modified packages get read.
+ *
  * \param[in] index_file  The file where the repository information is saved.
  */
 void wpkgar_repository::create_index(memfile::memory_file& index_file, const std::string* archive)
@@ -463,6 +1030,11 @@ void wpkgar_repository::create_index(memfile::memory_file& index_file, const std
     map_t map;
     std::map<std::string, std::string> map_hash_prev;
     map_t map_idx_prev;
+    const bool incremental(archive != NULL && get_parameter(wpkgar_repository_incremental, false) != 0);
+    index_fingerprints_t fingerprints_prev;
+    index_fingerprints_t fingerprints;
+    map_t map_ctrl_prev;
+    std::map<std::string, std::string> map_ctrl_hash_prev;
 
     if(archive)
     {
@@ -485,13 +1057,23 @@ void wpkgar_repository::create_index(memfile::memory_file& index_file, const std
                 package_name = package_name.substr(0, p);
                 map_hash_prev[package_name] = ctrl.get_field("Package-md5sum").c_str();
                 map_idx_prev[package_name] = *it;
+                if(incremental)
+                {
+                    map_ctrl_prev[it->f_info.get_filename()] = *it;
+                    map_ctrl_hash_prev[it->f_info.get_filename()] = map_hash_prev[package_name];
+                }
+            }
+            if(incremental)
+            {
+                load_index_fingerprints(*archive + ".fingerprints", fingerprints_prev);
             }
         }
     }
 
-    std::string index_date(wpkg_util::rfc2822_date());
-    index_file.create(memfile::memory_file::file_format_tar);
-    index_file.set_package_path(".");
+    // gather the list of packages to index; the packages are read and
+    // their md5sum computed by a pool of workers as they get found
+    std::deque<index_job_t> jobs;
+    index_job_pool pool(jobs, get_parameter(wpkgar_repository_jobs, static_cast<int>(std::thread::hardware_concurrency())));
     const wpkg_filename::filename_list_t& repositories(f_manager->get_repositories());
     for(wpkg_filename::filename_list_t::const_iterator it(repositories.begin());
                                                        it != repositories.end();
@@ -501,72 +1083,79 @@ void wpkgar_repository::create_index(memfile::memory_file& index_file, const std
         r.dir_rewind(*it, get_parameter(wpkgar_repository_recursive, false) != 0, get_parameter(wpkgar_repository_recursive_depth, 0));
         for(;;)
         {
-            wpkg_filename::uri_filename filename;
-            std::string md5sum;
-            memfile::memory_file::file_info info;
-            memfile::memory_file data;
-            wpkg_filename::uri_filename path;
+            index_job_t job;
+            memfile::memory_file::file_info& info(job.f_info);
             if(r.get_format() == memfile::memory_file::file_format_directory)
             {
                 if(!r.dir_next(info, NULL))
                 {
                     break;
                 }
-
-                filename = info.get_uri();
-                path = filename.remove_common_segments(*it).dirname(false);
-                wpkg_filename::uri_filename md5sum_filename(filename);
-                md5sum_filename.set_filename(md5sum_filename.original_filename() + ".md5sum");
-                if(md5sum_filename.exists())
-                {
-                    int64_t offset(0);
-                    memfile::memory_file md5sum_file;
-                    md5sum_file.read_file(md5sum_filename);
-                    md5sum_file.read_line(offset, md5sum);
-                }
-
-                switch(info.get_file_type())
-                {
-                case memfile::memory_file::file_info::regular_file:
-                case memfile::memory_file::file_info::continuous:
+            }
+            else
+            {
+                job.f_data.reset(new memfile::memory_file);
+                if(!r.dir_next(info, job.f_data.get()))
                 {
-                    std::string package_name(info.get_basename());
-                    std::string::size_type p = package_name.find_last_of('.');
-                    package_name = package_name.substr(0, p);
-                    if(map_hash_prev.find(package_name) != map_hash_prev.end())
-                    {
-                        if(md5sum == map_hash_prev[package_name])
-                        {
-                            const std::string ctrl_name(path.append_child(filename.basename() + ".ctrl").path_only());
-                            map[ctrl_name] = map_idx_prev[package_name];
-                            continue;
-                        }
-                    }
-                    data.read_file(info.get_filename());
-                    break;
-                }
-
-                default:
                     break;
                 }
             }
-            else
+
+            const wpkg_filename::uri_filename filename(info.get_uri());
+            job.f_path = filename.remove_common_segments(*it).dirname(false);
+            const std::string ctrl_name(job.f_path.append_child(filename.basename() + ".ctrl").path_only());
+
+            if(incremental
+            && !job.f_data
+            && info.get_file_type() == memfile::memory_file::file_info::regular_file
+            && filename.extension() == "deb")
             {
-                if(!r.dir_next(info, &data))
+                // reuse unchanged packages without opening them; the
+                // md5sum ties the fingerprint to the entry of the
+                // previous index
+                job.f_fingerprint = package_fingerprint(filename);
+                index_fingerprints_t::const_iterator f(fingerprints_prev.find(ctrl_name));
+                map_t::const_iterator e(map_ctrl_prev.find(ctrl_name));
+                if(!job.f_fingerprint.empty()
+                && f != fingerprints_prev.end()
+                && e != map_ctrl_prev.end()
+                && f->second.second == job.f_fingerprint
+                && f->second.first == map_ctrl_hash_prev[ctrl_name])
                 {
-                    break;
+                    map[ctrl_name] = e->second;
+                    fingerprints[ctrl_name] = f->second;
+                    continue;
                 }
+            }
 
-                filename = info.get_uri();
-                path = filename.remove_common_segments(*it).dirname(false);
-                wpkg_filename::uri_filename md5sum_filename(filename);
-                md5sum_filename.set_filename(md5sum_filename.original_filename() + ".md5sum");
-                if(md5sum_filename.exists())
+            wpkg_filename::uri_filename md5sum_filename(filename);
+            md5sum_filename.set_filename(md5sum_filename.original_filename() + ".md5sum");
+            if(md5sum_filename.exists())
+            {
+                int64_t offset(0);
+                memfile::memory_file md5sum_file;
+                md5sum_file.read_file(md5sum_filename);
+                md5sum_file.read_line(offset, job.f_md5sum);
+            }
+
+            if(!job.f_data
+            && (info.get_file_type() == memfile::memory_file::file_info::regular_file
+             || info.get_file_type() == memfile::memory_file::file_info::continuous))
+            {
+                std::string package_name(info.get_basename());
+                std::string::size_type p = package_name.find_last_of('.');
+                package_name = package_name.substr(0, p);
+                if(map_hash_prev.find(package_name) != map_hash_prev.end())
                 {
-                    int64_t offset(0);
-                    memfile::memory_file md5sum_file;
-                    md5sum_file.read_file(md5sum_filename);
-                    md5sum_file.read_line(offset, md5sum);
+                    if(job.f_md5sum == map_hash_prev[package_name])
+                    {
+                        map[ctrl_name] = map_idx_prev[package_name];
+                        if(!job.f_fingerprint.empty())
+                        {
+                            fingerprints[ctrl_name] = std::make_pair(job.f_md5sum, job.f_fingerprint);
+                        }
+                        continue;
+                    }
                 }
             }
 
@@ -606,91 +1195,76 @@ void wpkgar_repository::create_index(memfile::memory_file& index_file, const std
                 continue;
             }
 
-            data.dir_rewind();
-            for(;;)
+            pool.add(job);
+        }
+    }
+    pool.finish();
+
+    // finally generate the control files in the order the packages
+    // were found so the result does not depend on the number of jobs
+    std::string index_date(wpkg_util::rfc2822_date());
+    index_file.create(memfile::memory_file::file_format_tar);
+    index_file.set_package_path(".");
+    for(std::deque<index_job_t>::iterator j(jobs.begin()); j != jobs.end(); ++j)
+    {
+        if(j->f_error)
+        {
+            std::rethrow_exception(j->f_error);
+        }
+        if(!j->f_control)
+        {
+            // no control file in this package
+            continue;
+        }
+        const std::shared_ptr<memfile::memory_file>& control(j->f_control);
+        const memfile::memory_file::file_info& info(j->f_info);
+
+        // here we want to use a mix of the data found in info and control
+        wpkg_control::binary_control_file ctrl(std::shared_ptr<wpkg_control::control_file::control_file_state_t>(new wpkg_control::control_file::control_file_state_t));
+        ctrl.set_input_file(&*control);
+        ctrl.read();
+        ctrl.set_input_file(NULL);
+        memfile::memory_file::file_info idx_info;
+        const std::string ctrl_name(j->f_path.append_child(info.get_uri().basename() + ".ctrl").path_only());
+        wpkg_output::log("add package %1 to this repository index file.")
+                .quoted_arg(ctrl_name)
+            .module(wpkg_output::module_repository)
+            .action("repository-index");
+        idx_info.set_filename(ctrl_name);
+        idx_info.set_file_type(memfile::memory_file::file_info::regular_file);
+        idx_info.set_user("root");
+        idx_info.set_group("root");
+        idx_info.set_uid(0);
+        idx_info.set_gid(0);
+        idx_info.set_mode(0644);
+        idx_info.set_mtime(info.get_mtime());
+        if(ctrl.field_is_defined("Date"))
+        {
+            std::string date(ctrl.get_field("Date"));
+            // strptime() does not set all the fields (tm_isdst)
+            struct tm time_info;
+            memset(&time_info, 0, sizeof(time_info));
+            if(strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S %z", &time_info) != NULL)
             {
-                memfile::memory_file::file_info ar_info;
-                memfile::memory_file control_tar;
-                if(!data.dir_next(ar_info, &control_tar))
-                {
-                    break;
-                }
-                const wpkg_filename::uri_filename& ar_filename(ar_info.get_filename());
-                if(ar_info.get_file_type() == memfile::memory_file::file_info::regular_file
-                && ar_filename.basename() == "control")
-                {
-                    if(control_tar.is_compressed())
-                    {
-                        memfile::memory_file d;
-                        control_tar.copy(d);
-                        d.decompress(control_tar);
-                    }
-                    control_tar.dir_rewind();
-                    for(;;)
-                    {
-                        memfile::memory_file::file_info ctrl_info;
-                        std::shared_ptr<memfile::memory_file> control(new memfile::memory_file);
-                        if(!control_tar.dir_next(ctrl_info, control.get()))
-                        {
-                            break;
-                        }
-                        const wpkg_filename::uri_filename& ctrl_filename(ctrl_info.get_filename());
-                        if(ctrl_info.get_file_type() == memfile::memory_file::file_info::regular_file
-                        && ctrl_filename.basename() == "control")
-                        {
-                            // here we want to use a mix of the data found in
-                            // info, ar_info, and control.
-                            wpkg_control::binary_control_file ctrl(std::shared_ptr<wpkg_control::control_file::control_file_state_t>(new wpkg_control::control_file::control_file_state_t));
-                            ctrl.set_input_file(&*control);
-                            ctrl.read();
-                            ctrl.set_input_file(NULL);
-                            memfile::memory_file::file_info idx_info;
-                            const std::string ctrl_name(path.append_child(filename.basename() + ".ctrl").path_only());
-                            wpkg_output::log("add package %1 to this repository index file.")
-                                    .quoted_arg(ctrl_name)
-                                .module(wpkg_output::module_repository)
-                                .action("repository-index");
-                            idx_info.set_filename(ctrl_name);
-                            idx_info.set_file_type(memfile::memory_file::file_info::regular_file);
-                            idx_info.set_user("root");
-                            idx_info.set_group("root");
-                            idx_info.set_uid(0);
-                            idx_info.set_gid(0);
-                            idx_info.set_mode(0644);
-                            idx_info.set_mtime(info.get_mtime());
-                            if(ctrl.field_is_defined("Date"))
-                            {
-                                std::string date(ctrl.get_field("Date"));
-                                struct tm time_info;
-                                if(strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S %z", &time_info) != NULL)
-                                {
-                                    // unfortunately the tar format does not support time64_t
-                                    idx_info.set_mtime(mktime(&time_info));
-                                }
-                            }
-                            ctrl.set_field("Index-Date", index_date);
-
-                            if(md5sum.empty())
-                            {
-                                md5sum = data.md5sum();
-                            }
-
-                            ctrl.set_field("Package-md5sum", md5sum);
-                            ctrl.set_field("Package-Size", data.size());
-                            ctrl.write(*control, wpkg_field::field_file::WRITE_MODE_FIELD_ONLY);
-                            idx_info.set_size(control->size());
-                            index_entry e;
-                            e.f_info = idx_info;
-                            e.f_control = control;
-                            map[ctrl_name] = e;
-                            break;
-                        }
-                    }
-                    break; // this is all.
-                }
+                // unfortunately the tar format does not support time64_t
+                idx_info.set_mtime(mktime(&time_info));
             }
         }
+        ctrl.set_field("Index-Date", index_date);
+        ctrl.set_field("Package-md5sum", j->f_md5sum);
+        ctrl.set_field("Package-Size", j->f_size);
+        ctrl.write(*control, wpkg_field::field_file::WRITE_MODE_FIELD_ONLY);
+        idx_info.set_size(control->size());
+        index_entry e;
+        e.f_info = idx_info;
+        e.f_control = control;
+        map[ctrl_name] = e;
+        if(!j->f_fingerprint.empty())
+        {
+            fingerprints[ctrl_name] = std::make_pair(j->f_md5sum, j->f_fingerprint);
+        }
     }
+    format_index_fingerprints(f_index_fingerprints, fingerprints);
     wpkg_output::log("finalizing output file.")
         .module(wpkg_output::module_repository)
         .action("repository-index");
@@ -700,6 +1274,30 @@ void wpkgar_repository::create_index(memfile::memory_file& index_file, const std
     }
 }
 
+/** \brief Save the fingerprints of the last index.
+ *
+ * This function saves the fingerprints gathered by the last call to
+ * create_index() in a file named after the \p archive with
+ * ".fingerprints" appended. Call it once the index was saved in
+ * \p archive. Each fingerprint includes the md5sum of its package so
+ * fingerprints which do not match the index (i.e. if the process stops
+ * between the two saves) do not get used.
+ *
+ * The function does nothing unless the wpkgar_repository_incremental
+ * parameter is set.
+ *
+ * \param[in] archive  The name of the index file.
+ */
+void wpkgar_repository::save_index_fingerprints(const std::string& archive) const
+{
+    if(get_parameter(wpkgar_repository_incremental, false) == 0)
+    {
+        return;
+    }
+    f_index_fingerprints.write_file(archive + ".fingerprints");
+}
+
+
 /** \brief Read the specified file as a repository index file.
  *
  * This function expects the input to be a repository index as created
@@ -711,11 +1309,23 @@ void wpkgar_repository::create_index(memfile::memory_file& index_file, const std
  * The input \p file can be compressed. The function will automatically
  * decompress the data before reading the entries.
  *
+ * The input \p file can also be a binary index as created by
+ * wpkgar_binary_index::create(). In that case the entries are sorted by
+ * package name instead of filename.
+ *
  * \param[in] file  The file to load in the array of entries.
  * \param[out] entries  A vector that is filled with all the data found in this index file.
  */
 void wpkgar_repository::load_index(const memfile::memory_file& file, entry_vector_t& entries)
 {
+    if(wpkgar_binary_index::is_binary_index(file))
+    {
+        wpkgar_binary_index binary_index;
+        binary_index.load(file);
+        binary_index.get_entries(entries);
+        return;
+    }
+
     memfile::memory_file index_file;
     file.copy(index_file);
     if(index_file.is_compressed())
@@ -746,56 +1356,221 @@ void wpkgar_repository::load_index(const memfile::memory_file& file, entry_vecto
             ++pos;
         }
 
-        // all files must have .ctrl as their extension
-        const std::string::size_type dot(filename.find_last_of('.'));
-        if(dot == std::string::npos || dot < pos)
-        {
-            throw wpkgar_exception_invalid("an index filename must have a valid extension");
-        }
-        if(filename.substr(dot) != ".ctrl")
-        {
-            throw wpkgar_exception_invalid("all the files in an index must have the \".ctrl\" extension, \"" + filename.substr(dot) + "\" is not valid");
-        }
-        const std::string basename = filename.substr(pos, dot - pos);
+        // all files must have .ctrl as their extension
+        const std::string::size_type dot(filename.find_last_of('.'));
+        if(dot == std::string::npos || dot < pos)
+        {
+            throw wpkgar_exception_invalid("an index filename must have a valid extension");
+        }
+        if(filename.substr(dot) != ".ctrl")
+        {
+            throw wpkgar_exception_invalid("all the files in an index must have the \".ctrl\" extension, \"" + filename.substr(dot) + "\" is not valid");
+        }
+        const std::string basename = filename.substr(pos, dot - pos);
+
+        // we must at least have a package name and a version
+        const std::string::size_type p(basename.find_first_of('_'));
+        if(p == std::string::npos)
+        {
+            throw wpkgar_exception_invalid("an index filename must include at least one \"_\" character");
+        }
+        // verify the package name
+        const std::string package_name(basename.substr(0, p));
+        if(!wpkg_util::is_package_name(package_name))
+        {
+            throw wpkgar_exception_invalid("\"" + package_name + "\" is not a valid package name and thus this index filename cannot be valid");
+        }
+        const std::string::size_type q(basename.find_last_of('_'));
+        std::string version;
+        if(p != q)
+        {
+            // there is an architecture, verify that too!
+            std::string arch(basename.substr(q + 1));
+            if(!wpkg_dependencies::dependencies::is_architecture_valid(arch))
+            {
+                throw wpkgar_exception_invalid("\"" + arch + "\" is not a valid architecture and thus this index filename cannot be valid");
+            }
+            version = basename.substr(p + 1, q - p - 1);
+        }
+        else
+        {
+            version = basename.substr(p + 1);
+        }
+        char version_err[256];
+        if(!validate_debian_version(version.c_str(), version_err, sizeof(version_err)))
+        {
+            throw wpkgar_exception_invalid("\"" + version + "\" is an invalid version and thus this index filename cannot be valid");
+        }
+
+        index_entry e;
+        e.f_info = idx_info;
+        e.f_control = control;
+        entries.push_back(e);
+    }
+}
+
+
+namespace
+{
+
+/** \brief Remove the ".tar..." extensions of the name of an index.
+ *
+ * \param[in] tar_index  The name of the repository index.
+ *
+ * \return The name of the index without its ".tar..." extensions.
+ */
+std::string index_basename(const wpkg_filename::uri_filename& tar_index)
+{
+    std::string name(tar_index.original_filename());
+    const std::string::size_type slash(name.find_last_of('/'));
+    const std::string::size_type p(name.rfind(".tar"));
+    if(p != std::string::npos && (slash == std::string::npos || p > slash))
+    {
+        name = name.substr(0, p);
+    }
+    return name;
+}
+
+} // no name namespace
+
+
+/** \brief Compute the name of the diff file of an index.
+ *
+ * The index diff file is saved next to the index. Its name is the name
+ * of the index with the ".tar..." extensions replaced by ".diff.tar.gz".
+ * So the diff of "index.tar.gz" is "index.diff.tar.gz".
+ *
+ * \param[in] tar_index  The name of the repository index.
+ *
+ * \return The name of the corresponding index diff file.
+ */
+wpkg_filename::uri_filename wpkgar_repository::index_diff_filename(const wpkg_filename::uri_filename& tar_index)
+{
+    return wpkg_filename::uri_filename(index_basename(tar_index) + ".diff.tar.gz");
+}
+
+
+/** \brief Compute the name of the md5sum file of an index.
+ *
+ * The md5sum of the index, as saved on disk, is saved next to the index
+ * each time the index gets created. Its name is the name of the index
+ * with the ".tar..." extensions replaced by ".md5sum". So the md5sum of
+ * "index.tar.gz" is saved in "index.md5sum".
+ *
+ * An index diff file only gets applied when its To: field matches that
+ * md5sum so a diff left behind by an older index is never used.
+ *
+ * \param[in] tar_index  The name of the repository index.
+ *
+ * \return The name of the corresponding index md5sum file.
+ */
+wpkg_filename::uri_filename wpkgar_repository::index_md5sum_filename(const wpkg_filename::uri_filename& tar_index)
+{
+    return wpkg_filename::uri_filename(index_basename(tar_index) + ".md5sum");
+}
+
+
+namespace
+{
+
+/** \brief Retrieve the Package-md5sum field of an index control file.
+ *
+ * The Index-Date field of all the control files changes each time an
+ * index is created so the control files cannot be compared as is. The
+ * md5sum of the package tells us whether the package itself changed.
+ *
+ * \param[in] control  The control file as found in the index.
+ *
+ * \return The md5sum of the package, or an empty string.
+ */
+std::string control_package_md5sum(const memfile::memory_file& control)
+{
+    wpkg_control::binary_control_file ctrl(std::shared_ptr<wpkg_control::control_file::control_file_state_t>(new wpkg_control::control_file::control_file_state_t));
+    ctrl.set_input_file(&control);
+    ctrl.read();
+    ctrl.set_input_file(NULL);
+    if(!ctrl.field_is_defined("Package-md5sum"))
+    {
+        return "";
+    }
+    return ctrl.get_field("Package-md5sum");
+}
+
+} // no name namespace
+
+
+/** \brief Create the diff between two versions of an index.
+ *
+ * This function creates a tarball with an "index.diff" file followed by
+ * the control files of the packages that were added or modified between
+ * the \p previous and the \p current index. The "index.diff" file
+ * includes the md5sum of both indexes (From: and To:), the size of the
+ * current index (Size:) and one "Removed:" line per control file which
+ * is not part of the current index anymore.
+ *
+ * Clients which have the previous index apply the diff instead of
+ * downloading the whole index again (see update().)
+ *
+ * \param[in] previous  The previous index exactly as saved on disk.
+ * \param[in] current  The current index exactly as saved on disk.
+ * \param[out] diff  The resulting diff, an uncompressed tarball.
+ */
+void wpkgar_repository::create_index_diff(const memfile::memory_file& previous, const memfile::memory_file& current, memfile::memory_file& diff)
+{
+    entry_vector_t previous_entries;
+    entry_vector_t current_entries;
+    load_index(previous, previous_entries);
+    load_index(current, current_entries);
+
+    std::map<std::string, std::string> previous_md5sums;
+    for(entry_vector_t::const_iterator it(previous_entries.begin()); it != previous_entries.end(); ++it)
+    {
+        previous_md5sums[it->f_info.get_filename()] = control_package_md5sum(*it->f_control);
+    }
+
+    memfile::memory_file description;
+    description.create(memfile::memory_file::file_format_other);
+    description.printf("From: %s\n", previous.md5sum().c_str());
+    description.printf("To: %s\n", current.md5sum().c_str());
+    description.printf("Size: %lld\n", static_cast<long long>(current.size()));
 
-        // we must at least have a package name and a version
-        const std::string::size_type p(basename.find_first_of('_'));
-        if(p == std::string::npos)
-        {
-            throw wpkgar_exception_invalid("an index filename must include at least one \"_\" character");
-        }
-        // verify the package name
-        const std::string package_name(basename.substr(0, p));
-        if(!wpkg_util::is_package_name(package_name))
-        {
-            throw wpkgar_exception_invalid("\"" + package_name + "\" is not a valid package name and thus this index filename cannot be valid");
-        }
-        const std::string::size_type q(basename.find_last_of('_'));
-        std::string version;
-        if(p != q)
-        {
-            // there is an architecture, verify that too!
-            std::string arch(basename.substr(q + 1));
-            if(!wpkg_dependencies::dependencies::is_architecture_valid(arch))
-            {
-                throw wpkgar_exception_invalid("\"" + arch + "\" is not a valid architecture and thus this index filename cannot be valid");
-            }
-            version = basename.substr(p + 1, q - p - 1);
-        }
-        else
+    std::set<std::string> current_names;
+    entry_vector_t modified;
+    for(entry_vector_t::const_iterator it(current_entries.begin()); it != current_entries.end(); ++it)
+    {
+        const std::string name(it->f_info.get_filename());
+        current_names.insert(name);
+        std::map<std::string, std::string>::const_iterator p(previous_md5sums.find(name));
+        if(p == previous_md5sums.end() || p->second != control_package_md5sum(*it->f_control))
         {
-            version = basename.substr(p + 1);
+            modified.push_back(*it);
         }
-        char version_err[256];
-        if(!validate_debian_version(version.c_str(), version_err, sizeof(version_err)))
+    }
+    for(std::map<std::string, std::string>::const_iterator it(previous_md5sums.begin()); it != previous_md5sums.end(); ++it)
+    {
+        if(current_names.find(it->first) == current_names.end())
         {
-            throw wpkgar_exception_invalid("\"" + version + "\" is an invalid version and thus this index filename cannot be valid");
+            description.printf("Removed: %s\n", it->first.c_str());
         }
+    }
 
-        index_entry e;
-        e.f_info = idx_info;
-        e.f_control = control;
-        entries.push_back(e);
+    memfile::memory_file::file_info info;
+    info.set_filename("index.diff");
+    info.set_file_type(memfile::memory_file::file_info::regular_file);
+    info.set_user("root");
+    info.set_group("root");
+    info.set_uid(0);
+    info.set_gid(0);
+    info.set_mode(0644);
+    info.set_mtime(time(NULL));
+    info.set_size(description.size());
+
+    diff.create(memfile::memory_file::file_format_tar);
+    diff.set_package_path(".");
+    diff.append_file(info, description);
+    for(entry_vector_t::const_iterator it(modified.begin()); it != modified.end(); ++it)
+    {
+        diff.append_file(it->f_info, *it->f_control);
     }
 }
 
@@ -1009,6 +1784,282 @@ void wpkgar_repository::write_sources(memfile::memory_file& file, const source_v
     }
 }
 
+namespace
+{
+
+/** \brief One source to update.
+ *
+ * The jobs are prepared by update(), then run_update_job() downloads
+ * the index of each source, possibly in a worker thread, and finally
+ * update() saves the results in the update index in the order of the
+ * sources.list file.
+ */
+struct update_job_t
+{
+    enum result_t
+    {
+        result_failed,          // the index could not be retrieved
+        result_not_modified,    // the server said our index is current
+        result_unchanged,       // the index was downloaded but did not change
+        result_downloaded,      // a new index was downloaded
+        result_current,         // the index diff says our index is current
+        result_patched          // the index diff was applied to our index
+    };
+
+    update_job_t()
+        : f_entry_idx(0)
+        , f_result(result_failed)
+        , f_diff_files(0)
+        , f_elapsed(0)
+    {
+    }
+
+    wpkg_filename::uri_filename         f_uri;
+    size_t                              f_entry_idx;
+    wpkgar_repository::update_entry_t   f_entry;
+    wpkg_filename::uri_filename         f_local_index;
+    result_t                            f_result;
+    size_t                              f_diff_files;
+    std::string                         f_error;
+    int64_t                             f_elapsed;
+};
+
+
+/** \brief Update a local index with the diff of the repository.
+ *
+ * A repository may offer an index diff file (see create_index_diff())
+ * which lists the changes between the previous and the current index.
+ * When our local copy of the index is that previous index, the diff
+ * gets applied to it and the full index does not need to be downloaded.
+ * When our copy already is the current index, nothing needs to be done.
+ *
+ * The diff is only used when its To: field is the md5sum saved next to
+ * the index (see index_md5sum_filename()) since an index recreated
+ * without a diff may leave an older diff behind.
+ *
+ * In all other cases (no diff file, we are more than one version behind,
+ * the diff is stale, etc.) the function returns false and the caller
+ * sends its conditional request for the full index.
+ *
+ * \param[in,out] job  The job of the repository being updated.
+ *
+ * \return true if the local index is now current.
+ */
+bool update_index_from_diff(update_job_t& job)
+{
+    // a diff is only useful if we know which index we have
+    wpkgar_repository::update_entry_t& entry(job.f_entry);
+    if(entry.get_repository_md5sum().empty())
+    {
+        return false;
+    }
+
+    const wpkg_filename::uri_filename diff_filename(wpkgar_repository::index_diff_filename(job.f_uri.append_child("index.tar.gz")));
+    if(diff_filename.is_direct() && !diff_filename.exists())
+    {
+        return false;
+    }
+
+    memfile::memory_file diff;
+    try
+    {
+        memfile::memory_file compressed;
+        compressed.read_file(diff_filename);
+        compressed.decompress(diff);
+    }
+    catch(const std::runtime_error&)
+    {
+        // the repository does not offer an index diff file
+        return false;
+    }
+
+    // the first file is the description of the diff, the other files
+    // are the new or modified control files
+    std::string from, to;
+    std::set<std::string> names;
+    wpkgar_repository::entry_vector_t added;
+    diff.dir_rewind();
+    for(;;)
+    {
+        memfile::memory_file::file_info info;
+        std::shared_ptr<memfile::memory_file> data(new memfile::memory_file);
+        if(!diff.dir_next(info, data.get()))
+        {
+            break;
+        }
+        if(info.get_filename() == "index.diff")
+        {
+            int64_t offset(0);
+            std::string line;
+            while(data->read_line(offset, line))
+            {
+                if(line.compare(0, 6, "From: ") == 0)
+                {
+                    from = line.substr(6);
+                }
+                else if(line.compare(0, 4, "To: ") == 0)
+                {
+                    to = line.substr(4);
+                }
+                else if(line.compare(0, 9, "Removed: ") == 0)
+                {
+                    names.insert(line.substr(9));
+                }
+            }
+        }
+        else
+        {
+            names.insert(info.get_filename());
+            wpkgar_repository::index_entry e;
+            e.f_info = info;
+            e.f_control = data;
+            added.push_back(e);
+        }
+    }
+
+    // the diff must describe the index currently offered by the
+    // repository, otherwise it is stale
+    const wpkg_filename::uri_filename md5sum_filename(wpkgar_repository::index_md5sum_filename(job.f_uri.append_child("index.tar.gz")));
+    std::string current;
+    try
+    {
+        memfile::memory_file md5sum_file;
+        md5sum_file.read_file(md5sum_filename);
+        int64_t offset(0);
+        md5sum_file.read_line(offset, current);
+    }
+    catch(const std::runtime_error&)
+    {
+        // without the md5sum of the index the diff cannot be trusted
+        return false;
+    }
+    if(to.empty() || to != current)
+    {
+        return false;
+    }
+
+    if(to == entry.get_repository_md5sum())
+    {
+        // we already have the current index
+        job.f_result = update_job_t::result_current;
+        return true;
+    }
+    if(from != entry.get_repository_md5sum())
+    {
+        // the diff does not apply to our index
+        return false;
+    }
+
+    memfile::memory_file compressed;
+    memfile::memory_file index_file;
+    compressed.read_file(job.f_local_index);
+    compressed.decompress(index_file);
+
+    // the index files are sorted by name (see create_index()) and the
+    // result has to be too, so the entries get merged in a map
+    typedef std::map<std::string, wpkgar_repository::index_entry> merged_t;
+    merged_t merged;
+    index_file.dir_rewind();
+    for(;;)
+    {
+        wpkgar_repository::index_entry e;
+        e.f_control.reset(new memfile::memory_file);
+        if(!index_file.dir_next(e.f_info, e.f_control.get()))
+        {
+            break;
+        }
+        if(names.find(e.f_info.get_filename()) == names.end())
+        {
+            merged[e.f_info.get_filename()] = e;
+        }
+    }
+    for(wpkgar_repository::entry_vector_t::const_iterator it(added.begin()); it != added.end(); ++it)
+    {
+        merged[it->f_info.get_filename()] = *it;
+    }
+    memfile::memory_file updated;
+    updated.create(memfile::memory_file::file_format_tar);
+    updated.set_package_path(".");
+    for(merged_t::const_iterator it(merged.begin()); it != merged.end(); ++it)
+    {
+        updated.append_file(it->second.f_info, *it->second.f_control);
+    }
+    updated.end_archive();
+    updated.compress(compressed, memfile::memory_file::file_format_gz);
+    compressed.write_file(job.f_local_index, true);
+
+    // our index now is equivalent to the current index of the repository
+    // but it is not byte for byte the same so the size and md5sum are
+    // those of our copy; the HTTP validators were for a file we did not
+    // download so they cannot be used anymore
+    entry.set_size(compressed.size());
+    entry.set_md5sum(compressed.md5sum());
+    entry.set_repository_md5sum(to);
+    entry.set_etag("");
+    entry.set_last_modified("");
+
+    job.f_result = update_job_t::result_patched;
+    job.f_diff_files = names.size();
+    return true;
+}
+
+
+/** \brief Retrieve the index of one source.
+ *
+ * This function gets the index diff or the index of the source and
+ * saves it in the local index file of the job. It does not log
+ * anything and does not access the repository object so it can run
+ * in a worker thread. The results are saved in the job.
+ *
+ * \param[in,out] job  The job to run.
+ */
+void run_update_job(update_job_t& job)
+{
+    const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+    try
+    {
+        if(!update_index_from_diff(job))
+        {
+            memfile::memory_file index_file;
+            std::string etag(job.f_entry.get_etag());
+            std::string last_modified(job.f_entry.get_last_modified());
+            if(!index_file.read_file_if_modified(job.f_uri.append_child("index.tar.gz"), etag, last_modified))
+            {
+                job.f_result = update_job_t::result_not_modified;
+            }
+            else
+            {
+                // servers without validators send the file each time,
+                // only save it if it changed
+                const std::string md5sum(index_file.md5sum());
+                if(md5sum == job.f_entry.get_repository_md5sum())
+                {
+                    job.f_result = update_job_t::result_unchanged;
+                }
+                else
+                {
+                    index_file.write_file(job.f_local_index, true);
+                    job.f_entry.set_size(index_file.size());
+                    job.f_entry.set_md5sum(md5sum);
+                    job.f_entry.set_repository_md5sum(md5sum);
+                    job.f_result = update_job_t::result_downloaded;
+                }
+            }
+            job.f_entry.set_etag(etag);
+            job.f_entry.set_last_modified(last_modified);
+        }
+    }
+    catch(const std::runtime_error& e)
+    {
+        job.f_result = update_job_t::result_failed;
+        job.f_error = e.what();
+    }
+    job.f_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // no name namespace
+
+
 /** \brief Update the package indexes.
  *
  * This function reads the sources.list file defined in the core directory
@@ -1018,18 +2069,24 @@ void wpkgar_repository::write_sources(memfile::memory_file& file, const source_v
  *
  * The process maintains a file with information about each one of the
  * index. This is important since all the indexes have the exact same
- * filename in each repository.
+ * filename in each repository. That file also records the validators
+ * of each index (size, md5sum, ETag and Last-Modified) so an index
+ * that did not change is not downloaded again.
+ *
+ * The sources are retrieved in parallel (see the
+ * wpkgar_repository_fetch_jobs parameter, 4 by default.) The results
+ * are recorded and logged in the order of the sources.list file.
+ *
+ * Indexes of sources that were removed from the sources.list file are
+ * deleted.
  */
 void wpkgar_repository::update()
 {
-    // Blow away the core/indexes directory, since we need to rebuild these
-    // in case the sources.list file changed.
-    //
-    wpkg_filename::uri_filename indexes_dir(f_manager->get_database_path());
-    indexes_dir = indexes_dir.append_child("core/indexes");
-    indexes_dir.os_unlink_rf();
+    // load the results of the previous update, if any, so we can send
+    // conditional requests
+    load_index_list();
 
-    // Recreate the local index cache based on the sources.list (which might have changed).
+    // Update the local index cache based on the sources.list (which might have changed).
     //
     wpkg_filename::uri_filename name(f_manager->get_database_path());
     name = name.append_child("core/sources.list");
@@ -1037,6 +2094,7 @@ void wpkgar_repository::update()
     memfile::memory_file sources_file;
     sources_file.read_file(name);
     read_sources(sources_file, sources);
+    std::vector<wpkg_filename::uri_filename> uris;
     size_t max(sources.size());
     for(size_t i(0); i < max; ++i)
     {
@@ -1050,7 +2108,7 @@ void wpkgar_repository::update()
             if(count == 0)
             {
                 // if count is zero then distribution is the direct path
-                update_index(uri);
+                uris.push_back(uri);
             }
             else
             {
@@ -1059,104 +2117,258 @@ void wpkgar_repository::update()
                     std::string component(sources[i].get_component(j));
                     wpkg_filename::uri_filename full_uri(uri);
                     full_uri = full_uri.append_child(component);
-                    update_index(full_uri);
+                    uris.push_back(full_uri);
                 }
             }
         }
     }
-    save_index_list();
-}
 
-void wpkgar_repository::update_index(const wpkg_filename::uri_filename& uri)
-{
-    const wpkg_filename::uri_filename index_filename(uri.append_child("index.tar.gz"));
-    memfile::memory_file index_file;
-    time_t now(time(NULL));
-    update_entry_t::update_entry_status_t status(update_entry_t::status_unknown);
-    try
+    // prepare one job per source (a source listed twice is updated once)
+    std::vector<update_job_t> jobs;
+    std::set<std::string> found;
+    for(std::vector<wpkg_filename::uri_filename>::const_iterator it(uris.begin()); it != uris.end(); ++it)
     {
-        index_file.read_file(index_filename);
-        status = update_entry_t::status_ok;
+        if(!found.insert(it->full_path()).second)
+        {
+            continue;
+        }
+        update_job_t job;
+        job.f_uri = *it;
+        job.f_entry_idx = update_entry(*it);
+        job.f_entry = f_update_index[job.f_entry_idx];
 
-        wpkg_output::log("successfully updated index file from repository: %1.")
-                .quoted_arg(index_filename)
-            .module(wpkg_output::module_repository)
-            .action("repository-update");
+        wpkg_filename::uri_filename local_index(f_manager->get_database_path());
+        std::stringstream s;
+        s << job.f_entry.get_index();
+        job.f_local_index = local_index.append_child("core/indexes/update-" + s.str() + ".index.gz");
+
+        // the validators are worthless without the index they describe
+        // (an older version of wpkg may also have replaced the index
+        // without updating the validators)
+        wpkg_filename::uri_filename::file_stat s_index;
+        if(job.f_local_index.os_stat(s_index) != 0
+        || s_index.get_size() != job.f_entry.get_size())
+        {
+            job.f_entry.set_size(0);
+            job.f_entry.set_md5sum("");
+            job.f_entry.set_repository_md5sum("");
+            job.f_entry.set_etag("");
+            job.f_entry.set_last_modified("");
+        }
+
+        jobs.push_back(job);
     }
-    catch(const std::runtime_error&)
+
+    // retrieve the indexes with a pool of workers
+    int max_jobs(get_parameter(wpkgar_repository_fetch_jobs, 4));
+    if(max_jobs > static_cast<int>(jobs.size()))
+    {
+        max_jobs = static_cast<int>(jobs.size());
+    }
+    if(max_jobs <= 1)
+    {
+        for(std::vector<update_job_t>::iterator j(jobs.begin()); j != jobs.end(); ++j)
+        {
+            run_update_job(*j);
+        }
+    }
+    else
+    {
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        for(int i(0); i < max_jobs; ++i)
+        {
+            workers.push_back(std::thread([&jobs, &next]()
+                {
+                    for(size_t idx(next++); idx < jobs.size(); idx = next++)
+                    {
+                        run_update_job(jobs[idx]);
+                    }
+                }));
+        }
+        for(std::vector<std::thread>::iterator w(workers.begin()); w != workers.end(); ++w)
+        {
+            w->join();
+        }
+    }
+
+    // save the results in the order of the sources.list file
+    const time_t now(time(NULL));
+    for(std::vector<update_job_t>::const_iterator j(jobs.begin()); j != jobs.end(); ++j)
     {
-        status = update_entry_t::status_failed;
+        const wpkg_filename::uri_filename index_filename(j->f_uri.append_child("index.tar.gz"));
+        update_entry_t& entry(f_update_index[j->f_entry_idx]);
+        entry = j->f_entry;
+        if(j->f_result == update_job_t::result_failed)
+        {
+            entry.set_status(update_entry_t::status_failed);
+
+            wpkg_output::log("failed updating index file from repository: %1.")
+                    .quoted_arg(index_filename)
+                .level(wpkg_output::level_warning)
+                .module(wpkg_output::module_repository)
+                .action("repository-update");
+
+            wpkg_output::log("repository %1 failed after %2 ms: %3")
+                    .quoted_arg(j->f_uri)
+                    .arg(static_cast<long>(j->f_elapsed))
+                    .arg(j->f_error)
+                .debug(wpkg_output::debug_flags::debug_detail_files)
+                .module(wpkg_output::module_repository)
+                .action("repository-update");
+        }
+        else
+        {
+            entry.set_status(update_entry_t::status_ok);
 
-        wpkg_output::log("failed updating index file from repository: %1.")
-                .quoted_arg(index_filename)
-            .level(wpkg_output::level_warning)
-            .module(wpkg_output::module_repository)
-            .action("repository-update");
+            wpkg_output::log("successfully updated index file from repository: %1.")
+                    .quoted_arg(index_filename)
+                .module(wpkg_output::module_repository)
+                .action("repository-update");
+
+            std::string result;
+            switch(j->f_result)
+            {
+            case update_job_t::result_not_modified:
+                result = "was not modified";
+                break;
+
+            case update_job_t::result_unchanged:
+                result = "was downloaded but did not change";
+                break;
+
+            case update_job_t::result_current:
+                result = "is current according to the index diff";
+                break;
+
+            case update_job_t::result_patched:
+                {
+                    std::stringstream s;
+                    s << "was patched with the index diff (" << j->f_diff_files << " files replaced or removed)";
+                    result = s.str();
+                }
+                break;
+
+            default:
+                result = "was downloaded";
+                break;
+
+            }
+            wpkg_output::log("index of repository %1 %2 in %3 ms.")
+                    .quoted_arg(j->f_uri)
+                    .arg(result)
+                    .arg(static_cast<long>(j->f_elapsed))
+                .debug(wpkg_output::debug_flags::debug_detail_files)
+                .module(wpkg_output::module_repository)
+                .action("repository-update");
+        }
+        entry.update_time(now);
+    }
+
+    // Remove the indexes of sources that are not in the sources.list anymore.
+    //
+    wpkg_filename::uri_filename indexes_dir(f_manager->get_database_path());
+    indexes_dir = indexes_dir.append_child("core/indexes");
+    for(update_entry_vector_t::iterator it(f_update_index.begin()); it != f_update_index.end();)
+    {
+        if(found.find(it->get_uri()) == found.end())
+        {
+            std::stringstream s;
+            s << it->get_index();
+            indexes_dir.append_child("update-" + s.str() + ".index.gz").os_unlink();
+            it = f_update_index.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
     }
 
+    save_index_list();
+}
+
+
+/** \brief Find the update entry of a source.
+ *
+ * This function searches the update index for the entry of the
+ * specified source. If the source is new, a new entry is added.
+ *
+ * \param[in] uri  The URI of the source.
+ *
+ * \return The position of the entry in f_update_index.
+ */
+size_t wpkgar_repository::update_entry(const wpkg_filename::uri_filename& uri)
+{
     long max_index(0);
     size_t i(0), max(f_update_index.size());
-    int index(0);
     for(; i < max; ++i)
     {
         if(f_update_index[i].get_uri() == uri.full_path())
         {
             // found the entry
-            f_update_index[i].set_status(status);
-            f_update_index[i].update_time(now);
-            index = f_update_index[i].get_index();
-            break;
+            return i;
         }
         if(f_update_index[i].get_index() > max_index)
         {
             max_index = f_update_index[i].get_index();
         }
     }
-    if(i == max)
-    {
-        // no extra entry and we did not find this one, add it
-        update_entry_t entry;
-        index = max_index + 1;
-        entry.set_index(index);
-        entry.set_status(status);
-        entry.set_uri(uri.full_path());
-        entry.update_time(now);
-        f_update_index.push_back(entry);
-    }
-    if(status == update_entry_t::status_ok)
-    {
-        // on success save the file we just loaded
-        wpkg_filename::uri_filename name(f_manager->get_database_path());
-        std::stringstream s;
-        s << index;
-        name = name.append_child("core/indexes/update-" + s.str() + ".index.gz");
-        index_file.write_file(name, true);
-    }
+
+    // we did not find this one, add it
+    update_entry_t entry;
+    entry.set_index(max_index + 1);
+    entry.set_uri(uri.full_path());
+    f_update_index.push_back(entry);
+    return max;
 }
 
+
 const wpkgar_repository::update_entry_vector_t *wpkgar_repository::load_index_list()
 {
     f_update_index.clear();
     wpkg_filename::uri_filename name(f_manager->get_database_path());
     name = name.append_child("core/update.index");
-    if(name.exists())
+    if(!name.exists())
     {
-        memfile::memory_file update_file;
-        update_file.read_file(name);
-        int64_t offset(0);
-        std::string line;
-        for(;;)
+        return NULL;
+    }
+
+    memfile::memory_file update_file;
+    update_file.read_file(name);
+    int64_t offset(0);
+    std::string line;
+    while(update_file.read_line(offset, line))
+    {
+        update_entry_t update_entry;
+        update_entry.from_string(line);
+        f_update_index.push_back(update_entry);
+    }
+
+    // the validators are optional; a version of wpkg which does not
+    // know about them may have updated the indexes since, in which
+    // case the sizes do not match and the validators get ignored
+    wpkg_filename::uri_filename validators_name(f_manager->get_database_path());
+    validators_name = validators_name.append_child("core/update.validators");
+    if(validators_name.exists())
+    {
+        memfile::memory_file validators_file;
+        validators_file.read_file(validators_name);
+        offset = 0;
+        while(validators_file.read_line(offset, line))
         {
-            if(!update_file.read_line(offset, line))
+            const int32_t index(update_entry_t::validators_index(line));
+            for(update_entry_vector_t::iterator it(f_update_index.begin()); it != f_update_index.end(); ++it)
             {
-                return &f_update_index;
+                if(it->get_index() == index)
+                {
+                    it->validators_from_string(line);
+                    break;
+                }
             }
-            update_entry_t update_entry;
-            update_entry.from_string(line);
-            f_update_index.push_back(update_entry);
         }
     }
-    return NULL;
+
+    return &f_update_index;
 }
 
 void wpkgar_repository::save_index_list() const
@@ -1165,11 +2377,17 @@ void wpkgar_repository::save_index_list() const
     name = name.append_child("core/update.index");
     memfile::memory_file update_file;
     update_file.create(memfile::memory_file::file_format_other);
+    wpkg_filename::uri_filename validators_name(f_manager->get_database_path());
+    validators_name = validators_name.append_child("core/update.validators");
+    memfile::memory_file validators_file;
+    validators_file.create(memfile::memory_file::file_format_other);
     for(update_entry_vector_t::const_iterator it(f_update_index.begin()); it != f_update_index.end(); ++it)
     {
         update_file.printf("%s\n", it->to_string().c_str());
+        validators_file.printf("%s\n", it->validators_to_string().c_str());
     }
     update_file.write_file(name);
+    validators_file.write_file(validators_name);
 }
 
 
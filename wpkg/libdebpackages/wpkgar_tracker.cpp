@@ -51,11 +51,19 @@ namespace wpkgar
  * rollback what is being done to the database such as removing installed
  * software or configuring packages that get deconfigured.
  *
- * The tracker saves all the steps in a file. Note that it opens and
- * closes the file each time to make sure that the data is saved on
- * disk and not just in a memory buffer. This makes the tracker a little
- * slower than it could be, but a lot safer as it will be able to revert
- * the work even if a crash occurs.
+ * The tracker saves all the steps in a file. The track() function only
+ * buffers the steps; they get written and synchronized to disk (group
+ * commit) when sync() gets called, which the package processes do right
+ * before they apply the action that a step reverts. That way the journal
+ * is always on disk before the target gets modified and the tracker is
+ * able to revert the work even if a crash occurs, without having to
+ * re-open the file for each step. The file remains open until rollback()
+ * gets called.
+ *
+ * The package processes track and sync from the thread that owns the
+ * manager (the configure jobs only run scripts in their threads.) The
+ * buffer of pending steps is still protected by a mutex so a tracker
+ * can safely be shared between threads.
  */
 
 
@@ -80,7 +88,12 @@ namespace wpkgar
  */
 wpkgar_tracker::wpkgar_tracker(wpkgar_manager *manager, const wpkg_filename::uri_filename& filename)
     : f_manager(manager)
+    //, f_keep_file(false) -- auto-init
+    //, f_committed(false) -- auto-init
     , f_filename(filename)
+    //, f_file() -- auto-init
+    //, f_pending("") -- auto-init
+    //, f_mutex() -- auto-init
 {
     if(f_filename.empty())
     {
@@ -184,18 +197,16 @@ void wpkgar_tracker::keep_file(bool keep)
  * instruction which when executed will under the work of the pre_configure()
  * function.
  *
+ * The instruction is only buffered. It gets saved in the journal by the
+ * next call to sync().
+ *
  * \important
- * The track() function must be called before applying a function so
- * that way we can make sure that it is available in the journal in the
- * event an error occurs. The last instruction in the journal may not get
- * executed when rolling back since the package may already be in that
+ * The track() and sync() functions must be called before applying a
+ * function so that way we can make sure that it is available in the journal
+ * in the event an error occurs. The last instruction in the journal may not
+ * get executed when rolling back since the package may already be in that
  * state.
  *
- * \exception wpkgar_exception_io
- * The I/O exception is thrown if something goes wrong while handling the
- * file. Note that we re-open, write to, and then close the file each time.
- * We do that to get what is called a \em journal.
- *
  * \param[in] command  The tracking instruction and parameters.
  * \param[in] package_name  The name of the package concerned if available.
  */
@@ -203,29 +214,57 @@ void wpkgar_tracker::track(const std::string& command, const std::string& packag
 {
     wpkgar_tracker_interface::track(command, package_name);
 
-    // Note: We reopen the file each time on purpose to make sure that the
-    //       information gets saved BEFORE we apply the (opposite) action.
-    //       This is important to ensure that the journal is up to date.
-    wpkg_stream::fstream file;
-    file.append(f_filename);
-    if(!file.good())
-    {
-        throw wpkgar_exception_io("opening the tracking file \"" + f_filename.original_filename() + "\" failed");
-    }
+    std::lock_guard<std::mutex> lock(f_mutex);
 
-    // write the command
-    file.write(command.c_str(), command.length());
+    f_pending += command;
 
     // add a new line if there was none in command
     if(command.length() > 0 && command[command.length() - 1] != '\n')
     {
-        file.write("\n", 1);
+        f_pending += "\n";
+    }
+}
+
+
+/** \brief Save the tracked instructions in the journal.
+ *
+ * This function writes all the instructions tracked since the last call
+ * to the journal and then waits for the data to be on disk (i.e.
+ * fdatasync().) It must be called before applying the action that the
+ * last tracked instruction reverts so the journal is up to date even if
+ * a crash occurs.
+ *
+ * All the instructions tracked in between two calls get written at once,
+ * and the journal file is kept open between calls.
+ *
+ * \exception wpkgar_exception_io
+ * The I/O exception is thrown if something goes wrong while handling the
+ * file.
+ */
+void wpkgar_tracker::sync()
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+
+    if(f_pending.empty())
+    {
+        return;
     }
 
-    if(!file.good())
+    if(!f_file.good())
+    {
+        if(!f_file.append(f_filename))
+        {
+            throw wpkgar_exception_io("opening the tracking file \"" + f_filename.original_filename() + "\" failed");
+        }
+    }
+
+    if(f_file.write(f_pending.c_str(), f_pending.length()) != static_cast<wpkg_stream::fstream::size_type>(f_pending.length())
+    || !f_file.flush())
     {
         throw wpkgar_exception_io("writing to the tracking file \"" + f_filename.original_filename() + "\" failed");
     }
+
+    f_pending.clear();
 }
 
 
@@ -615,6 +654,24 @@ void wpkgar_command::run_unpack()
  */
 void wpkgar_tracker::rollback()
 {
+    // save the instructions not yet in the journal and close it
+    try
+    {
+        sync();
+    }
+    catch(const wpkgar_exception_io& e)
+    {
+        // the instructions not yet saved were tracked for actions that
+        // did not start yet so we can still rollback what is on disk
+        wpkg_output::log("tracker:%1: could not save the last tracked instructions -- %2")
+                .arg(f_filename)
+                .arg(e.what())
+            .level(wpkg_output::level_error)
+            .module(wpkg_output::module_track)
+            .action("rollback");
+    }
+    f_file.close();
+
     // user called commit() at least once
     if(!f_committed)
     {
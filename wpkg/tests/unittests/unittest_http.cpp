@@ -0,0 +1,989 @@
+/*    unittest_http.cpp
+ *    Copyright (C) 2013-2015  Made to Order Software Corporation
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *    Authors
+ *    Alexis Wilke   alexis@m2osw.com
+ */
+
+#include "unittest_main.h"
+#include "libdebpackages/wpkg_http.h"
+#include "libdebpackages/wpkg_stream.h"
+#include "libdebpackages/wpkgar_package_cache.h"
+#include "libdebpackages/memfile.h"
+
+#include <atomic>
+#include <sstream>
+#include <thread>
+#include <string.h>
+#include <catch.hpp>
+#if !defined(MO_WINDOWS)
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+
+namespace
+{
+    void close_socket(tcp_client_server::socket_t s)
+    {
+#if defined(MO_WINDOWS)
+        closesocket(s);
+#else
+        close(s);
+#endif
+    }
+
+    /** \brief A minimal HTTP server used to test the client.
+     *
+     * The server handles one connection at a time and replies to the
+     * requests it receives on it until the client closes the connection.
+     * The path of the request defines the reply:
+     *
+     * \li /length/\<n> -- a body of n bytes with a Content-Length
+     * \li /chunked -- a body sent with the chunked transfer encoding
+     * \li /close -- an HTTP/1.0 reply which ends when the connection closes
+     * \li /empty206 -- a partial content reply without any content
+     * \li /range206 -- a partial content reply for bytes 5 to 9 of 10
+     * \li /last -- a reply with "Connection: close"
+     * \li /stop -- like /last and the server stops
+     *
+     * The server listens on a port chosen by the system, see get_port().
+     */
+    class test_server
+    {
+    public:
+        test_server()
+            : f_server("127.0.0.1", 0, 5, true)
+            , f_connections(0)
+            , f_requests(0)
+            , f_thread(&test_server::run, this)
+        {
+        }
+
+        ~test_server()
+        {
+            wpkg_http::client::close_idle_connections();
+            wpkg_http::request r("/stop");
+            wpkg_http::response result;
+            wpkg_http::client::get("127.0.0.1", get_port(), r, result);
+            f_thread.join();
+        }
+
+        int get_port() const
+        {
+            return f_server.get_port();
+        }
+
+        int connections() const
+        {
+            return f_connections;
+        }
+
+        int requests() const
+        {
+            return f_requests;
+        }
+
+    private:
+        void run()
+        {
+            for(;;)
+            {
+                tcp_client_server::socket_t s(f_server.accept());
+                if(s < 0)
+                {
+                    return;
+                }
+                ++f_connections;
+                const bool stop(serve(s));
+                // lingering close: pipelined requests we did not read
+                // must not make the system reset the connection
+#if defined(MO_WINDOWS)
+                shutdown(s, SD_SEND);
+#else
+                shutdown(s, SHUT_WR);
+#endif
+                char buf[1024];
+                while(::recv(s, buf, sizeof(buf), 0) > 0)
+                {
+                }
+                close_socket(s);
+                if(stop)
+                {
+                    return;
+                }
+            }
+        }
+
+        bool serve(tcp_client_server::socket_t s)
+        {
+            std::string input;
+            for(;;)
+            {
+                std::string::size_type end(input.find("\r\n\r\n"));
+                while(end == std::string::npos)
+                {
+                    char buf[1024];
+                    const int sz(static_cast<int>(::recv(s, buf, sizeof(buf), 0)));
+                    if(sz <= 0)
+                    {
+                        return false;
+                    }
+                    input.append(buf, sz);
+                    end = input.find("\r\n\r\n");
+                }
+                const std::string header(input.substr(0, end));
+                input.erase(0, end + 4);
+                ++f_requests;
+
+                const std::string::size_type sp1(header.find(' '));
+                const std::string::size_type sp2(header.find(' ', sp1 + 1));
+                const std::string path(header.substr(sp1 + 1, sp2 - sp1 - 1));
+
+                std::stringstream reply;
+                bool last(false);
+                bool stop(false);
+                if(path.compare(0, 8, "/length/") == 0)
+                {
+                    const int size(atoi(path.c_str() + 8));
+                    reply << "HTTP/1.1 200 OK\r\nContent-Length: " << size << "\r\n\r\n";
+                    for(int i(0); i < size; ++i)
+                    {
+                        reply << static_cast<char>('a' + i % 26);
+                    }
+                }
+                else if(path == "/chunked")
+                {
+                    reply << "HTTP/1.1 200 OK\r\n"
+                             "Transfer-Encoding: chunked\r\n"
+                             "\r\n"
+                             "7;name=value\r\nHello, \r\n"
+                             "6\r\nWorld!\r\n"
+                             "0\r\n"
+                             "X-Trailer: ignored\r\n"
+                             "\r\n";
+                }
+                else if(path == "/empty206")
+                {
+                    reply << "HTTP/1.1 206 Partial Content\r\n"
+                             "Content-Range: bytes 0-9/10\r\n"
+                             "Content-Length: 0\r\n"
+                             "\r\n";
+                }
+                else if(path == "/range206")
+                {
+                    reply << "HTTP/1.1 206 Partial Content\r\n"
+                             "Content-Range: bytes 5-9/10\r\n"
+                             "Content-Length: 5\r\n"
+                             "\r\n"
+                             "fghij";
+                }
+                else if(path == "/close")
+                {
+                    reply << "HTTP/1.0 200 OK\r\n\r\nuntil the end";
+                    last = true;
+                }
+                else
+                {
+                    reply << "HTTP/1.1 200 OK\r\nContent-Length: 4\r\nConnection: close\r\n\r\nlast";
+                    last = true;
+                    stop = path == "/stop";
+                }
+                const std::string data(reply.str());
+                if(::send(s, data.c_str(), static_cast<int>(data.length()), 0) != static_cast<int>(data.length()))
+                {
+                    return false;
+                }
+                if(last)
+                {
+                    return stop;
+                }
+            }
+        }
+
+        tcp_client_server::tcp_server   f_server;
+        std::atomic<int>                f_connections;
+        std::atomic<int>                f_requests;
+        std::thread                     f_thread;
+    };
+
+    /** \brief Run a wpkg_http::server in a thread.
+     *
+     * The server gets stopped when the object goes out of scope, even
+     * if a test fails.
+     */
+    class server_thread
+    {
+    public:
+        server_thread(const wpkg_filename::uri_filename& root)
+            : f_server(root, "127.0.0.1", 0)
+        {
+            f_server.set_threads(2);
+            f_thread = std::thread(&wpkg_http::server::run, &f_server);
+        }
+
+        ~server_thread()
+        {
+            wpkg_http::client::close_idle_connections();
+            f_server.stop();
+            f_thread.join();
+        }
+
+        int get_port() const
+        {
+            return f_server.get_port();
+        }
+
+    private:
+        wpkg_http::server               f_server;
+        std::thread                     f_thread;
+    };
+}
+
+
+CATCH_TEST_CASE("HttpUnitTests::request","HttpUnitTests")
+{
+    wpkg_http::request r("/repository/index.tar.gz");
+    r.set_field("If-None-Match", "\"abc\"");
+    r.set_field("if-none-match", "\"xyz\"");
+    CATCH_REQUIRE(r.get_method() == "GET");
+    CATCH_REQUIRE(r.to_string("example.com", 80) == "GET /repository/index.tar.gz HTTP/1.1\r\nHost: example.com\r\nIf-None-Match: \"xyz\"\r\n\r\n");
+    CATCH_REQUIRE(r.to_string("example.com", 8080) == "GET /repository/index.tar.gz HTTP/1.1\r\nHost: example.com:8080\r\nIf-None-Match: \"xyz\"\r\n\r\n");
+}
+
+
+CATCH_TEST_CASE("HttpUnitTests::keep_alive","HttpUnitTests")
+{
+    wpkg_http::client::close_idle_connections();
+    test_server server;
+
+    // many requests of various sizes all go through one connection
+    for(int size(0); size < 200000; size += 12345)
+    {
+        std::stringstream path;
+        path << "/length/" << size;
+        wpkg_http::request r(path.str());
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        CATCH_REQUIRE(result.get_field("content-length") == path.str().substr(8));
+        CATCH_REQUIRE(result.get_body().length() == static_cast<size_t>(size));
+        for(int i(0); i < size; i += 997)
+        {
+            CATCH_REQUIRE(result.get_body()[i] == static_cast<char>('a' + i % 26));
+        }
+    }
+    CATCH_REQUIRE(server.connections() == 1);
+
+    // chunked transfer encoding, the connection is still kept alive
+    {
+        wpkg_http::request r("/chunked");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        CATCH_REQUIRE(result.get_body() == "Hello, World!");
+    }
+    CATCH_REQUIRE(server.connections() == 1);
+
+    // an HTTP/1.0 reply without a Content-Length ends with the connection
+    {
+        wpkg_http::request r("/close");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        CATCH_REQUIRE(result.get_body() == "until the end");
+    }
+    {
+        wpkg_http::request r("/length/3");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_body() == "abc");
+    }
+    CATCH_REQUIRE(server.connections() == 2);
+}
+
+
+CATCH_TEST_CASE("HttpUnitTests::pipeline","HttpUnitTests")
+{
+    wpkg_http::client::close_idle_connections();
+    test_server server;
+
+    // the replies of pipelined requests are read back to back from the
+    // connection buffer
+    wpkg_http::connection c("127.0.0.1", server.get_port());
+    for(int i(0); i < 20; ++i)
+    {
+        std::stringstream path;
+        if(i == 10)
+        {
+            path << "/chunked";
+        }
+        else
+        {
+            path << "/length/" << i * 100;
+        }
+        c.send(wpkg_http::request(path.str()));
+    }
+    for(int i(0); i < 20; ++i)
+    {
+        wpkg_http::response result;
+        c.receive(result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        CATCH_REQUIRE(c.is_reusable());
+        if(i == 10)
+        {
+            CATCH_REQUIRE(result.get_body() == "Hello, World!");
+        }
+        else
+        {
+            CATCH_REQUIRE(result.get_body().length() == static_cast<size_t>(i * 100));
+        }
+    }
+    CATCH_REQUIRE(c.get_responses() == 20);
+
+    // the server closes the connection after "/last" so the requests
+    // that follow are lost
+    c.send(wpkg_http::request("/last"));
+    c.send(wpkg_http::request("/length/10"));
+    {
+        wpkg_http::response result;
+        c.receive(result);
+        CATCH_REQUIRE(result.get_body() == "last");
+        CATCH_REQUIRE(!c.is_reusable());
+    }
+    {
+        wpkg_http::response result;
+        CATCH_REQUIRE_THROWS_AS(c.receive(result), wpkg_http::wpkg_http_exception_closed);
+    }
+    CATCH_REQUIRE(server.connections() == 1);
+}
+
+
+CATCH_TEST_CASE("HttpUnitTests::client_pipeline","HttpUnitTests")
+{
+    wpkg_http::client::close_idle_connections();
+    test_server server;
+
+    // the server closes the connection after "/last" so the requests
+    // that follow have to be sent again on a new connection
+    std::vector<wpkg_http::request> requests;
+    for(int i(0); i < 20; ++i)
+    {
+        std::stringstream path;
+        if(i == 5)
+        {
+            path << "/last";
+        }
+        else if(i == 10)
+        {
+            path << "/chunked";
+        }
+        else
+        {
+            path << "/length/" << i * 100;
+        }
+        requests.push_back(wpkg_http::request(path.str()));
+    }
+    std::vector<wpkg_http::response> results;
+    wpkg_http::client::pipeline("127.0.0.1", server.get_port(), requests, results);
+    CATCH_REQUIRE(results.size() == requests.size());
+    for(size_t i(0); i < results.size(); ++i)
+    {
+        CATCH_REQUIRE(results[i].get_status() == 200);
+        if(i == 5)
+        {
+            CATCH_REQUIRE(results[i].get_body() == "last");
+        }
+        else if(i == 10)
+        {
+            CATCH_REQUIRE(results[i].get_body() == "Hello, World!");
+        }
+        else
+        {
+            CATCH_REQUIRE(results[i].get_body().length() == i * 100);
+        }
+    }
+    CATCH_REQUIRE(server.connections() == 2);
+}
+
+
+namespace
+{
+    // save the body of a response in a string, one buffer at a time
+    class string_output : public wpkg_http::body_output
+    {
+    public:
+        string_output()
+            : f_writes(0)
+        {
+        }
+
+        virtual void write(const char *data, size_t size)
+        {
+            f_data.append(data, size);
+            ++f_writes;
+        }
+
+        std::string     f_data;
+        int             f_writes;
+    };
+}
+
+
+CATCH_TEST_CASE("HttpUnitTests::body_output","HttpUnitTests")
+{
+    wpkg_http::client::close_idle_connections();
+    test_server server;
+
+    // a large body gets written in several buffers instead of being
+    // saved in the response
+    {
+        string_output output;
+        wpkg_http::request r("/length/200000");
+        wpkg_http::response result;
+        result.set_body_output(&output);
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        CATCH_REQUIRE(result.get_body().empty());
+        CATCH_REQUIRE(result.get_body_size() == 200000);
+        CATCH_REQUIRE(output.f_data.length() == 200000);
+        CATCH_REQUIRE(output.f_writes > 1);
+        for(int i(0); i < 200000; i += 997)
+        {
+            CATCH_REQUIRE(output.f_data[i] == static_cast<char>('a' + i % 26));
+        }
+    }
+
+    // chunked and until close bodies too
+    {
+        string_output output;
+        wpkg_http::request r("/chunked");
+        wpkg_http::response result;
+        result.set_body_output(&output);
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_body().empty());
+        CATCH_REQUIRE(result.get_body_size() == 13);
+        CATCH_REQUIRE(output.f_data == "Hello, World!");
+    }
+    {
+        string_output output;
+        wpkg_http::request r("/close");
+        wpkg_http::response result;
+        result.set_body_output(&output);
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_body().empty());
+        CATCH_REQUIRE(output.f_data == "until the end");
+    }
+
+    // memory files read over HTTP get the body streamed in their buffer
+    {
+        std::stringstream uri;
+        uri << "http://127.0.0.1:" << server.get_port() << "/length/150000";
+        memfile::memory_file file;
+        const int64_t bytes_read(memfile::memory_file::get_bytes_read());
+        file.read_file(wpkg_filename::uri_filename(uri.str()));
+        CATCH_REQUIRE(file.size() == 150000);
+        CATCH_REQUIRE(memfile::memory_file::get_bytes_read() - bytes_read == 150000);
+        char buf[26];
+        CATCH_REQUIRE(file.read(buf, 149974, 26) == 26);
+        for(int i(0); i < 26; ++i)
+        {
+            CATCH_REQUIRE(buf[i] == static_cast<char>('a' + (149974 + i) % 26));
+        }
+    }
+}
+
+
+CATCH_TEST_CASE("HttpUnitTests::server","HttpUnitTests")
+{
+    if(unittest::tmp_dir.empty())
+    {
+        fprintf(stderr, "\nerror:unittest_http: a temporary directory is required to run the server unit tests.\n");
+        throw std::runtime_error("--tmp <directory> missing");
+    }
+
+    // a file to serve
+    const wpkg_filename::uri_filename root(unittest::tmp_dir + "/http_server");
+    root.append_child("repository").os_mkdir_p();
+    std::string data;
+    for(int i(0); i < 100000; ++i)
+    {
+        data += static_cast<char>('a' + i % 26);
+    }
+    {
+        wpkg_stream::fstream file;
+        CATCH_REQUIRE(file.create(root.append_child("repository/file.deb")));
+        CATCH_REQUIRE(file.write(data.c_str(), data.length()) == static_cast<wpkg_stream::fstream::size_type>(data.length()));
+    }
+
+    wpkg_http::client::close_idle_connections();
+    server_thread server(root);
+
+    // the whole file; wpkg clients add "." segments to the paths
+    std::string etag;
+    std::string last_modified;
+    {
+        wpkg_http::request r("/repository/./file.deb");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        CATCH_REQUIRE(result.get_body() == data);
+        CATCH_REQUIRE(result.get_field("accept-ranges") == "bytes");
+        etag = result.get_field("etag");
+        last_modified = result.get_field("last-modified");
+        CATCH_REQUIRE(!etag.empty());
+        CATCH_REQUIRE(!last_modified.empty());
+    }
+
+    // HEAD has no body
+    {
+        wpkg_http::request r("/repository/file.deb", "HEAD");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        CATCH_REQUIRE(result.get_field("content-length") == "100000");
+        CATCH_REQUIRE(result.get_body().empty());
+    }
+
+    // ranges
+    {
+        wpkg_http::request r("/repository/file.deb");
+        r.set_field("Range", "bytes=1000-1099");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 206);
+        CATCH_REQUIRE(result.get_field("content-range") == "bytes 1000-1099/100000");
+        CATCH_REQUIRE(result.get_body() == data.substr(1000, 100));
+    }
+    {
+        wpkg_http::request r("/repository/file.deb");
+        r.set_field("Range", "bytes=99990-");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 206);
+        CATCH_REQUIRE(result.get_body() == data.substr(99990));
+    }
+    {
+        wpkg_http::request r("/repository/file.deb");
+        r.set_field("Range", "bytes=-7");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 206);
+        CATCH_REQUIRE(result.get_body() == data.substr(100000 - 7));
+    }
+    {
+        wpkg_http::request r("/repository/file.deb");
+        r.set_field("Range", "bytes=100000-");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 416);
+        CATCH_REQUIRE(result.get_field("content-range") == "bytes */100000");
+    }
+    {
+        // the file changed, the whole file is sent
+        wpkg_http::request r("/repository/file.deb");
+        r.set_field("Range", "bytes=10-19");
+        r.set_field("If-Range", "\"other\"");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        CATCH_REQUIRE(result.get_body().length() == data.length());
+    }
+
+    // conditional requests
+    {
+        wpkg_http::request r("/repository/file.deb");
+        r.set_field("If-None-Match", etag);
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 304);
+        CATCH_REQUIRE(result.get_body().empty());
+    }
+    {
+        wpkg_http::request r("/repository/file.deb");
+        r.set_field("If-Modified-Since", last_modified);
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 304);
+    }
+    {
+        wpkg_http::request r("/repository/file.deb");
+        r.set_field("If-Modified-Since", "Thu, 01 Jan 1970 00:00:00 GMT");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+    }
+
+    // errors
+    {
+        wpkg_http::request r("/repository/missing.deb");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 404);
+    }
+    {
+        wpkg_http::request r("/repository/../../etc/passwd");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 400);
+    }
+    {
+        wpkg_http::request r("/repository/%2E%2E/%2E%2E/etc/passwd");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 400);
+    }
+    {
+        wpkg_http::request r("/repository/file.deb", "DELETE");
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+        CATCH_REQUIRE(result.get_status() == 405);
+    }
+
+    // a request body is skipped, the request that follows is answered
+    {
+        tcp_client_server::tcp_client c("127.0.0.1", server.get_port());
+        // the body arrives with the next request in a separate packet
+        const std::string header(
+                "GET /repository/file.deb HTTP/1.1\r\n"
+                "Host: 127.0.0.1\r\n"
+                "Range: bytes=0-9\r\n"
+                "Content-Length: 5\r\n"
+                "\r\n");
+        CATCH_REQUIRE(c.write(header.c_str(), header.length()) == static_cast<int>(header.length()));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const std::string body_and_request(
+                "12345"
+                "GET /repository/file.deb HTTP/1.1\r\n"
+                "Host: 127.0.0.1\r\n"
+                "Range: bytes=10-19\r\n"
+                "Connection: close\r\n"
+                "\r\n");
+        CATCH_REQUIRE(c.write(body_and_request.c_str(), body_and_request.length()) == static_cast<int>(body_and_request.length()));
+        std::string replies;
+        for(;;)
+        {
+            char buf[1024];
+            const int sz(c.read(buf, sizeof(buf)));
+            if(sz <= 0)
+            {
+                break;
+            }
+            replies.append(buf, sz);
+        }
+        const std::string::size_type first(replies.find("\r\n\r\n"));
+        CATCH_REQUIRE(first != std::string::npos);
+        CATCH_REQUIRE(replies.compare(0, 21, "HTTP/1.1 206 Partial ") == 0);
+        CATCH_REQUIRE(replies.substr(first + 4, 10) == data.substr(0, 10));
+        const std::string::size_type second(replies.find("HTTP/1.1 206 ", first));
+        CATCH_REQUIRE(second == first + 4 + 10);
+        CATCH_REQUIRE(replies.substr(replies.length() - 10) == data.substr(10, 10));
+    }
+
+    // pipelined requests on a kept alive connection
+    {
+        wpkg_http::connection c("127.0.0.1", server.get_port());
+        for(int i(0); i < 20; ++i)
+        {
+            wpkg_http::request r("/repository/file.deb");
+            std::stringstream range;
+            range << "bytes=" << i * 1000 << "-" << i * 1000 + 999;
+            r.set_field("Range", range.str());
+            c.send(r);
+        }
+        for(int i(0); i < 20; ++i)
+        {
+            wpkg_http::response result;
+            c.receive(result);
+            CATCH_REQUIRE(result.get_status() == 206);
+            CATCH_REQUIRE(result.get_body() == data.substr(i * 1000, 1000));
+            CATCH_REQUIRE(c.is_reusable());
+        }
+    }
+}
+
+
+CATCH_TEST_CASE("HttpUnitTests::package_cache","HttpUnitTests")
+{
+    if(unittest::tmp_dir.empty())
+    {
+        fprintf(stderr, "\nerror:unittest_http: a temporary directory is required to run the package cache unit tests.\n");
+        throw std::runtime_error("--tmp <directory> missing");
+    }
+
+    // a package large enough to be downloaded in several blocks
+    const wpkg_filename::uri_filename root(unittest::tmp_dir + "/http_cache");
+    root.append_child("repository").os_mkdir_p();
+    std::string data;
+    const int64_t size(wpkgar::wpkgar_package_cache::RANGE_SIZE * 2 + 1234);
+    for(int64_t i(0); i < size; ++i)
+    {
+        data += static_cast<char>(i * 7 + i / 251);
+    }
+    const wpkg_filename::uri_filename package(root.append_child("repository/cached_1.0_all.deb"));
+    {
+        wpkg_stream::fstream file;
+        CATCH_REQUIRE(file.create(package));
+        CATCH_REQUIRE(file.write(data.c_str(), data.length()) == static_cast<wpkg_stream::fstream::size_type>(data.length()));
+    }
+    const std::string md5sum(memfile::memory_file::file_md5sum(package));
+
+    wpkg_http::client::close_idle_connections();
+    server_thread server(root);
+
+    std::stringstream uri_str;
+    uri_str << "http://127.0.0.1:" << server.get_port() << "/repository/cached_1.0_all.deb";
+    const wpkg_filename::uri_filename uri(uri_str.str());
+    const wpkg_filename::uri_filename cache_dir(root.append_child("cache"));
+    wpkgar::wpkgar_package_cache cache(cache_dir);
+    const wpkg_filename::uri_filename cached(cache.get_filename(uri));
+    const wpkg_filename::uri_filename part(cached.full_path() + ".part");
+
+    // the same filename in another repository is a different file
+    {
+        std::stringstream other;
+        other << "http://127.0.0.1:" << server.get_port() << "/other/cached_1.0_all.deb";
+        CATCH_REQUIRE(cache.get_filename(wpkg_filename::uri_filename(other.str())).full_path() != cached.full_path());
+        CATCH_REQUIRE(cached.basename() != "cached_1.0_all");
+    }
+
+    // first download, in blocks
+    {
+        wpkgar::wpkgar_package_cache::download_list_t downloads;
+        downloads.push_back(wpkgar::wpkgar_package_cache::download_t(uri, md5sum, size));
+        // the same package twice is only downloaded once
+        downloads.push_back(wpkgar::wpkgar_package_cache::download_t(uri, md5sum, size));
+        cache.fetch(downloads);
+        CATCH_REQUIRE(downloads[0].get_status() == wpkgar::wpkgar_package_cache::download_t::status_downloaded);
+        CATCH_REQUIRE(downloads[0].get_downloaded() == size);
+        CATCH_REQUIRE(downloads[0].get_filename().full_path() == cached.full_path());
+        CATCH_REQUIRE(downloads[1].get_status() == wpkgar::wpkgar_package_cache::download_t::status_cached);
+        CATCH_REQUIRE(downloads[1].get_downloaded() == 0);
+        CATCH_REQUIRE(memfile::memory_file::file_md5sum(cached) == md5sum);
+        CATCH_REQUIRE(!part.exists());
+    }
+
+    // already in the cache
+    {
+        wpkgar::wpkgar_package_cache::download_list_t downloads;
+        downloads.push_back(wpkgar::wpkgar_package_cache::download_t(uri, md5sum, size));
+        cache.fetch(downloads);
+        CATCH_REQUIRE(downloads[0].get_status() == wpkgar::wpkgar_package_cache::download_t::status_cached);
+        CATCH_REQUIRE(downloads[0].get_downloaded() == 0);
+    }
+
+    // resume from a partial file
+    {
+        CATCH_REQUIRE(cached.os_unlink());
+        const int64_t have(wpkgar::wpkgar_package_cache::RANGE_SIZE + 100);
+        {
+            wpkg_stream::fstream file;
+            CATCH_REQUIRE(file.create(part));
+            CATCH_REQUIRE(file.write(data.c_str(), have) == static_cast<wpkg_stream::fstream::size_type>(have));
+        }
+        wpkgar::wpkgar_package_cache::download_list_t downloads;
+        downloads.push_back(wpkgar::wpkgar_package_cache::download_t(uri, md5sum, size));
+        cache.fetch(downloads);
+        CATCH_REQUIRE(downloads[0].get_status() == wpkgar::wpkgar_package_cache::download_t::status_resumed);
+        CATCH_REQUIRE(downloads[0].get_resumed_at() == have);
+        CATCH_REQUIRE(downloads[0].get_downloaded() == size - have);
+        CATCH_REQUIRE(memfile::memory_file::file_md5sum(cached) == md5sum);
+        CATCH_REQUIRE(!part.exists());
+    }
+
+    // an invalid md5sum gets the package rejected
+    {
+        CATCH_REQUIRE(cached.os_unlink());
+        wpkgar::wpkgar_package_cache::download_list_t downloads;
+        downloads.push_back(wpkgar::wpkgar_package_cache::download_t(uri, "0123456789abcdef0123456789abcdef", size));
+        cache.fetch(downloads);
+        CATCH_REQUIRE(downloads[0].get_status() == wpkgar::wpkgar_package_cache::download_t::status_failed);
+        CATCH_REQUIRE(!downloads[0].get_error().empty());
+        CATCH_REQUIRE(!cached.exists());
+        CATCH_REQUIRE(!part.exists());
+    }
+
+    {
+        test_server range_less_server;
+
+        // a server which ignores the Range field sends the whole file
+        // which replaces the partial file
+        {
+            std::string length_data;
+            for(int i(0); i < 5000; ++i)
+            {
+                length_data += static_cast<char>('a' + i % 26);
+            }
+            const wpkg_filename::uri_filename length_file(root.append_child("length.deb"));
+            {
+                wpkg_stream::fstream file;
+                CATCH_REQUIRE(file.create(length_file));
+                CATCH_REQUIRE(file.write(length_data.c_str(), length_data.length()) == static_cast<wpkg_stream::fstream::size_type>(length_data.length()));
+            }
+            std::stringstream length_uri_str;
+            length_uri_str << "http://127.0.0.1:" << range_less_server.get_port() << "/length/5000";
+            const wpkg_filename::uri_filename length_uri(length_uri_str.str());
+            const wpkg_filename::uri_filename length_part(cache.get_filename(length_uri).full_path() + ".part");
+            {
+                // a partial file which does not even match the beginning
+                wpkg_stream::fstream file;
+                CATCH_REQUIRE(file.create(length_part));
+                CATCH_REQUIRE(file.write("0123456789", 10) == 10);
+            }
+            wpkgar::wpkgar_package_cache::download_list_t downloads;
+            downloads.push_back(wpkgar::wpkgar_package_cache::download_t(length_uri, memfile::memory_file::file_md5sum(length_file), 5000));
+            cache.fetch(downloads);
+            CATCH_REQUIRE(downloads[0].get_status() == wpkgar::wpkgar_package_cache::download_t::status_downloaded);
+            CATCH_REQUIRE(downloads[0].get_resumed_at() == 0);
+            CATCH_REQUIRE(downloads[0].get_downloaded() == 5000);
+            CATCH_REQUIRE(memfile::memory_file::file_md5sum(downloads[0].get_filename()) == memfile::memory_file::file_md5sum(length_file));
+        }
+
+        // small packages from the same server are requested at once; the
+        // one with an invalid md5sum is requested again on its own before
+        // it gets rejected
+        {
+            wpkgar::wpkgar_package_cache::download_list_t downloads;
+            std::vector<std::string> md5sums;
+            for(int i(1); i <= 6; ++i)
+            {
+                std::string small_data;
+                for(int j(0); j < i * 100; ++j)
+                {
+                    small_data += static_cast<char>('a' + j % 26);
+                }
+                memfile::memory_file small;
+                small.create(memfile::memory_file::file_format_other);
+                small.write(small_data.c_str(), 0, static_cast<int64_t>(small_data.length()));
+                md5sums.push_back(small.md5sum());
+                std::stringstream small_uri;
+                small_uri << "http://127.0.0.1:" << range_less_server.get_port() << "/length/" << i * 100;
+                downloads.push_back(wpkgar::wpkgar_package_cache::download_t(wpkg_filename::uri_filename(small_uri.str()), i == 6 ? "0123456789abcdef0123456789abcdef" : small.md5sum(), i * 100));
+            }
+            const int requests(range_less_server.requests());
+            cache.fetch(downloads);
+            for(int i(0); i < 5; ++i)
+            {
+                CATCH_REQUIRE(downloads[i].get_status() == wpkgar::wpkgar_package_cache::download_t::status_downloaded);
+                CATCH_REQUIRE(downloads[i].get_downloaded() == (i + 1) * 100);
+                CATCH_REQUIRE(memfile::memory_file::file_md5sum(downloads[i].get_filename()) == md5sums[i]);
+                CATCH_REQUIRE(!wpkg_filename::uri_filename(downloads[i].get_filename().full_path() + ".part").exists());
+            }
+            CATCH_REQUIRE(downloads[5].get_status() == wpkgar::wpkgar_package_cache::download_t::status_failed);
+            CATCH_REQUIRE(!downloads[5].get_filename().exists());
+            CATCH_REQUIRE(range_less_server.requests() == requests + 7);
+        }
+
+        // the reply is checked before it gets written: a reply which goes
+        // beyond the size of the package or does not start at the end of
+        // the partial file is not saved
+        {
+            std::stringstream long_uri_str;
+            long_uri_str << "http://127.0.0.1:" << range_less_server.get_port() << "/length/200";
+            wpkgar::wpkgar_package_cache::download_list_t downloads;
+            downloads.push_back(wpkgar::wpkgar_package_cache::download_t(wpkg_filename::uri_filename(long_uri_str.str()), "0123456789abcdef0123456789abcdef", 100));
+            cache.fetch(downloads);
+            CATCH_REQUIRE(downloads[0].get_status() == wpkgar::wpkgar_package_cache::download_t::status_failed);
+            CATCH_REQUIRE(downloads[0].get_error().find("beyond the end") != std::string::npos);
+            const wpkg_filename::uri_filename long_part(downloads[0].get_filename().full_path() + ".part");
+            wpkg_filename::uri_filename::file_stat st;
+            CATCH_REQUIRE((wpkg_filename::uri_filename(long_part.full_path()).os_stat(st) != 0 || st.get_size() <= 100));
+        }
+        {
+            std::stringstream range_uri_str;
+            range_uri_str << "http://127.0.0.1:" << range_less_server.get_port() << "/range206";
+            wpkgar::wpkgar_package_cache::download_list_t downloads;
+            downloads.push_back(wpkgar::wpkgar_package_cache::download_t(wpkg_filename::uri_filename(range_uri_str.str()), "0123456789abcdef0123456789abcdef", 10));
+            const wpkg_filename::uri_filename range_part(cache.get_filename(downloads[0].get_uri()).full_path() + ".part");
+            {
+                // we have 2 bytes, the server sends bytes 5 to 9
+                wpkg_stream::fstream file;
+                CATCH_REQUIRE(file.create(range_part));
+                CATCH_REQUIRE(file.write("ab", 2) == 2);
+            }
+            cache.fetch(downloads);
+            CATCH_REQUIRE(downloads[0].get_status() == wpkgar::wpkgar_package_cache::download_t::status_failed);
+            CATCH_REQUIRE(downloads[0].get_error().find("invalid Content-Range") != std::string::npos);
+            wpkg_filename::uri_filename::file_stat st;
+            CATCH_REQUIRE(wpkg_filename::uri_filename(range_part.full_path()).os_stat(st) == 0);
+            CATCH_REQUIRE(st.get_size() == 2);
+        }
+
+        // a partial reply without content fails instead of looping
+        {
+            std::stringstream empty_uri_str;
+            empty_uri_str << "http://127.0.0.1:" << range_less_server.get_port() << "/empty206";
+            wpkgar::wpkgar_package_cache::download_list_t downloads;
+            downloads.push_back(wpkgar::wpkgar_package_cache::download_t(wpkg_filename::uri_filename(empty_uri_str.str()), "0123456789abcdef0123456789abcdef", 10));
+            const wpkg_filename::uri_filename empty_part(cache.get_filename(downloads[0].get_uri()).full_path() + ".part");
+            {
+                // resume so a Range gets sent
+                wpkg_stream::fstream file;
+                CATCH_REQUIRE(file.create(empty_part));
+            }
+            cache.fetch(downloads);
+            CATCH_REQUIRE(downloads[0].get_status() == wpkgar::wpkgar_package_cache::download_t::status_failed);
+        }
+    }
+
+#if !defined(MO_WINDOWS)
+    // the least recently used files get evicted first
+    {
+        const wpkg_filename::uri_filename lru(root.append_child("lru"));
+        lru.os_mkdir_p();
+        wpkgar::wpkgar_package_cache lru_cache(lru);
+        lru_cache.set_maximum_size(250);
+        const char *names[] = { "newest.deb", "oldest.deb", "middle.deb" };
+        const time_t times[] = { 3000000, 1000000, 2000000 };
+        for(int i(0); i < 3; ++i)
+        {
+            const wpkg_filename::uri_filename f(lru.append_child(names[i]));
+            {
+                wpkg_stream::fstream file;
+                CATCH_REQUIRE(file.create(f));
+                CATCH_REQUIRE(file.write(data.c_str(), 100) == 100);
+            }
+            struct utimbuf t;
+            t.actime = times[i];
+            t.modtime = times[i];
+            CATCH_REQUIRE(utime(f.os_filename().get_utf8().c_str(), &t) == 0);
+            wpkg_filename::os_stat_cache::invalidate(f);
+        }
+
+        // the oldest is in use, the next one goes
+        wpkg_filename::filename_list_t keep;
+        keep.push_back(lru.append_child("oldest.deb"));
+        CATCH_REQUIRE(lru_cache.evict(keep) == 1);
+        CATCH_REQUIRE(lru.append_child("oldest.deb").exists());
+        CATCH_REQUIRE(!lru.append_child("middle.deb").exists());
+        CATCH_REQUIRE(lru.append_child("newest.deb").exists());
+
+        // now we fit
+        CATCH_REQUIRE(lru_cache.evict(keep) == 0);
+
+        // without a keep list the oldest goes
+        lru_cache.set_maximum_size(150);
+        CATCH_REQUIRE(lru_cache.evict(wpkg_filename::filename_list_t()) == 1);
+        CATCH_REQUIRE(!lru.append_child("oldest.deb").exists());
+        CATCH_REQUIRE(lru.append_child("newest.deb").exists());
+    }
+#endif
+}
+
+
+// vim: ts=4 sw=4 et
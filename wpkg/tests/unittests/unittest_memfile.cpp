@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <time.h>
+#include <vector>
 #include <catch.hpp>
 
 
@@ -128,5 +129,50 @@ CATCH_TEST_CASE("MemfileUnitTests::compression9","MemfileUnitTests")
     compression(9);
 }
 
+CATCH_TEST_CASE("MemfileUnitTests::seekable","MemfileUnitTests")
+{
+    memfile::memory_file i;         // input
+    memfile::memory_file z;         // compressed
+    memfile::memory_file t;         // test version (must be == to input)
+
+    // use more than one frame (frames are 1Mb)
+    const int size = 2500 * 1024 + 17;
+    std::vector<char> buf(size);
+    for(int pos = 0; pos < size; ++pos)
+    {
+        buf[pos] = rand() & 0x0F;
+    }
+    i.create(memfile::memory_file::file_format_other);
+    CATCH_REQUIRE( i.write(&buf[0], 0, size) == size );
+    i.compress_seekable(z, 3);
+    CATCH_REQUIRE( z.get_format() == memfile::memory_file::file_format_zst );
+    CATCH_REQUIRE( z.is_seekable() );
+
+    // a seekable file is a valid zstd file
+    z.decompress(t);
+    CATCH_REQUIRE( t.size() == size );
+    std::vector<char> tst(size);
+    CATCH_REQUIRE( t.read(&tst[0], 0, size) == size );
+    CATCH_REQUIRE( memcmp(&buf[0], &tst[0], size) == 0 );
+
+    // read ranges, including ranges crossing frames
+    for(int count = 0; count < 50; ++count)
+    {
+        const int offset = rand() % size;
+        const int length = rand() % (size - offset + 1);
+        z.decompress_range(t, offset, length);
+        CATCH_REQUIRE( t.size() == length );
+        if(length > 0)
+        {
+            CATCH_REQUIRE( t.read(&tst[0], 0, length) == length );
+            CATCH_REQUIRE( memcmp(&buf[offset], &tst[0], length) == 0 );
+        }
+    }
+
+    // a regular zstd file is not seekable
+    i.compress(z, memfile::memory_file::file_format_zst, 3);
+    CATCH_REQUIRE( !z.is_seekable() );
+}
+
 
 // vim: ts=4 sw=4 et
@@ -22,12 +22,27 @@
 #include "unittest_main.h"
 #include "libdebpackages/debian_packages.h"
 #include "libdebpackages/wpkg_control.h"
+#include "libdebpackages/wpkgar.h"
+#include "libdebpackages/wpkgar_binary_index.h"
+#include "libdebpackages/wpkgar_contents_index.h"
+#include "libdebpackages/wpkgar_install.h"
+#include "libdebpackages/wpkgar_tracker.h"
 #include "libdebpackages/wpkg_architecture.h"
 #include "libdebpackages/wpkg_util.h"
+#include "libdebpackages/wpkg_extract.h"
+#include "libdebpackages/wpkg_http.h"
 
+#include <algorithm>
 #include <iostream>
 #include <cstring>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
+#if !defined(MO_WINDOWS)
+#   include <signal.h>
+#   include <unistd.h>
+#   include <utime.h>
+#endif
 
 #include <catch.hpp>
 
@@ -55,6 +70,125 @@ namespace
         private:
         std::string f_backup;
     };
+
+    // keep all the messages, including the debug messages
+    class capture_output : public wpkg_output::output
+    {
+    public:
+        capture_output()
+            : f_previous(wpkg_output::get_output())
+        {
+            wpkg_output::set_output(this);
+        }
+
+        ~capture_output()
+        {
+            wpkg_output::set_output(f_previous);
+        }
+
+        const std::string& get_messages() const
+        {
+            return f_messages;
+        }
+
+    protected:
+        virtual void log_message(const wpkg_output::message_t& msg) const
+        {
+            f_messages += msg.get_full_message(true) + "\n";
+        }
+
+    private:
+        wpkg_output::output *   f_previous;
+        mutable std::string     f_messages;
+    };
+
+#if !defined(MO_WINDOWS)
+    /** \brief Run "wpkg --serve-repository" in the background.
+     *
+     * The server listens on a port picked by the system which gets
+     * retrieved from its log. It gets interrupted when the object
+     * goes out of scope, even if a test fails.
+     */
+    class server_process
+    {
+    public:
+        server_process(const wpkg_filename::uri_filename& root, const std::string& options)
+            : f_log(wpkg_filename::uri_filename(unittest::tmp_dir).append_child("server.log"))
+            , f_pid(0)
+            , f_port(0)
+        {
+            const wpkg_filename::uri_filename pid_filename(wpkg_filename::uri_filename(unittest::tmp_dir).append_child("server.pid"));
+            std::string cmd(unittest::wpkg_tool + " --verbose --serve-repository " + wpkg_util::make_safe_console_string(root.path_only())
+                    + " --listen 127.0.0.1:0 " + options
+                    + " >" + wpkg_util::make_safe_console_string(f_log.path_only()) + " 2>&1 & echo $! >" + wpkg_util::make_safe_console_string(pid_filename.path_only()));
+            printf("Serve Repository Command: \"%s\"\n", cmd.c_str());
+            fflush(stdout);
+            CATCH_REQUIRE(system(cmd.c_str()) == 0);
+            memfile::memory_file pid;
+            pid.read_file(pid_filename);
+            std::string line;
+            int64_t offset(0);
+            CATCH_REQUIRE(pid.read_line(offset, line));
+            f_pid = atoi(line.c_str());
+            CATCH_REQUIRE(f_pid > 0);
+
+            // wait for the server to tell us which port it uses
+            for(int i(0); i < 100 && f_port == 0; ++i)
+            {
+                usleep(100000);
+                const std::string messages(log());
+                const std::string::size_type pos(messages.find(" on 127.0.0.1:"));
+                if(pos != std::string::npos)
+                {
+                    f_port = atoi(messages.c_str() + pos + 14);
+                }
+            }
+            CATCH_REQUIRE(f_port > 0);
+        }
+
+        ~server_process()
+        {
+            wpkg_http::client::close_idle_connections();
+            if(f_pid > 0)
+            {
+                kill(f_pid, SIGINT);
+                // give it a moment to stop so the next test can remove
+                // the temporary directory
+                for(int i(0); i < 50 && kill(f_pid, 0) == 0; ++i)
+                {
+                    usleep(100000);
+                }
+            }
+        }
+
+        int get_port() const
+        {
+            return f_port;
+        }
+
+        std::string log() const
+        {
+            std::string result;
+            if(f_log.exists())
+            {
+                memfile::memory_file log_file;
+                log_file.read_file(f_log);
+                std::string line;
+                int64_t offset(0);
+                while(log_file.read_line(offset, line))
+                {
+                    result += line + "\n";
+                }
+            }
+            return result;
+        }
+
+    private:
+        const wpkg_filename::uri_filename   f_log;
+        pid_t                               f_pid;
+        int                                 f_port;
+    };
+#endif
 }
 // namespace
 
@@ -918,6 +1052,446 @@ public:
         verify_purged_files("t1", ctrl);
     }
 
+    void install_roots()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/etc/t1.conf 0123456789abcdef0123456789abcdef\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        // the "target" root is created by install_package(), we create
+        // two more roots here
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        wpkg_filename::uri_filename core_ctrl_filename(repository.append_child("core.ctrl"));
+        memfile::memory_file core_ctrl;
+        core_ctrl.create(memfile::memory_file::file_format_other);
+        core_ctrl.printf("Architecture: %s\nMaintainer: Alexis Wilke <alexis@m2osw.com>\n", debian_packages_architecture());
+        core_ctrl.write_file(core_ctrl_filename);
+        std::string roots("--roots " + wpkg_util::make_safe_console_string(target_path.path_only()));
+        const char *other_roots[] = { "target2", "target3" };
+        for(size_t i(0); i < sizeof(other_roots) / sizeof(other_roots[0]); ++i)
+        {
+            wpkg_filename::uri_filename other_path(root.append_child(other_roots[i]));
+            other_path.os_mkdir_p();
+            std::string core_cmd(unittest::wpkg_tool + " --root " + wpkg_util::make_safe_console_string(other_path.path_only())
+                    + " --create-admindir " + wpkg_util::make_safe_console_string(core_ctrl_filename.path_only()));
+            printf("Create AdminDir Command: \"%s\"\n", core_cmd.c_str());
+            fflush(stdout);
+            CATCH_REQUIRE(system(core_cmd.c_str()) == 0);
+            roots += " --roots " + wpkg_util::make_safe_console_string(other_path.path_only());
+        }
+
+        ctrl->set_variable("INSTALL_NOROOT", "Yes");
+        ctrl->set_variable("INSTALL_PREOPTIONS", roots + " --share-files hardlink");
+        install_package("t1", ctrl);
+        verify_installed_files("t1");
+        for(size_t i(0); i < sizeof(other_roots) / sizeof(other_roots[0]); ++i)
+        {
+            wpkg_filename::uri_filename other_path(root.append_child(other_roots[i]));
+            CATCH_REQUIRE(other_path.append_child("etc/t1.conf").exists());
+            CATCH_REQUIRE(other_path.append_child("usr/bin/t1").exists());
+            CATCH_REQUIRE(other_path.append_child("usr/share/doc/t1/copyright").exists());
+            CATCH_REQUIRE(other_path.append_child("var/lib/wpkg/t1/control").exists());
+        }
+
+        // the roots do not share their files once t1 is removed from one of them
+        remove_package("t1", ctrl);
+        verify_removed_files("t1", ctrl);
+        CATCH_REQUIRE(root.append_child("target2/usr/bin/t1").exists());
+        CATCH_REQUIRE(root.append_child("target3/usr/bin/t1").exists());
+    }
+
+    void extractor_output()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        // the extractor must give the exact same result as the
+        // path based write_file() + info_to_disk_file() it replaces
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        const wpkg_filename::uri_filename extracted(root.append_child("extracted"));
+        const wpkg_filename::uri_filename written(root.append_child("written"));
+
+        // a file large enough to use several memory file blocks
+        memfile::memory_file large;
+        large.create(memfile::memory_file::file_format_other);
+        for(int i(0); i < 20000; ++i)
+        {
+            large.printf("line %d of the large file\n", i);
+        }
+        memfile::memory_file empty;
+        empty.create(memfile::memory_file::file_format_other);
+        memfile::memory_file small;
+        small.create(memfile::memory_file::file_format_other);
+        small.printf("read-only file\n");
+
+        struct entry_t
+        {
+            const char *                    f_filename;
+            int                             f_mode;
+            const memfile::memory_file *    f_data;
+        };
+        const entry_t entries[] =
+        {
+            { "usr/share/doc/t1",           0750, NULL },
+            { "usr/share/doc/t1/large.txt", 0755, &large },
+            { "usr/share/doc/t1/empty.txt", 0600, &empty },
+            { "etc/t1/read-only.conf",      0444, &small },
+            // overwrite a read-only file
+            { "etc/t1/read-only.conf",      0444, &small }
+        };
+
+        wpkg_extract::extractor extract;
+        for(size_t i(0); i < sizeof(entries) / sizeof(entries[0]); ++i)
+        {
+            memfile::memory_file::file_info info;
+            info.set_filename(entries[i].f_filename);
+            info.set_file_type(entries[i].f_data == NULL
+                        ? memfile::memory_file::file_info::directory
+                        : memfile::memory_file::file_info::regular_file);
+            info.set_mode(entries[i].f_mode);
+            info.set_mtime(1234567890 + static_cast<time_t>(i));
+
+            int extract_err(memfile::memory_file::file_info_return_errors);
+            int write_err(memfile::memory_file::file_info_return_errors);
+            const wpkg_filename::uri_filename extract_destination(extracted.append_child(entries[i].f_filename));
+            const wpkg_filename::uri_filename write_destination(written.append_child(entries[i].f_filename));
+            if(entries[i].f_data == NULL)
+            {
+                extract.make_directory(extract_destination, info, extract_err);
+                write_destination.os_mkdir_p();
+            }
+            else
+            {
+                extract.write_file(extract_destination, *entries[i].f_data, info, extract_err);
+                entries[i].f_data->write_file(write_destination, true, true);
+            }
+            memfile::memory_file::info_to_disk_file(write_destination, info, write_err);
+            CATCH_REQUIRE(extract_err == write_err);
+        }
+        extract.close();
+
+        for(size_t i(0); i < sizeof(entries) / sizeof(entries[0]); ++i)
+        {
+            const wpkg_filename::uri_filename extract_destination(extracted.append_child(entries[i].f_filename));
+            const wpkg_filename::uri_filename write_destination(written.append_child(entries[i].f_filename));
+            memfile::memory_file::file_info extract_info;
+            memfile::memory_file::disk_file_to_info(extract_destination, extract_info);
+            memfile::memory_file::file_info write_info;
+            memfile::memory_file::disk_file_to_info(write_destination, write_info);
+            CATCH_REQUIRE(extract_info.get_file_type() == write_info.get_file_type());
+            CATCH_REQUIRE(extract_info.get_mode() == write_info.get_mode());
+            CATCH_REQUIRE((extract_info.get_mode() & 07777) == entries[i].f_mode);
+            CATCH_REQUIRE(extract_info.get_size() == write_info.get_size());
+            CATCH_REQUIRE(extract_info.get_mtime() == write_info.get_mtime());
+            CATCH_REQUIRE(extract_info.get_uid() == write_info.get_uid());
+            CATCH_REQUIRE(extract_info.get_gid() == write_info.get_gid());
+            if(entries[i].f_data != NULL)
+            {
+                memfile::memory_file extract_data;
+                extract_data.read_file(extract_destination);
+                memfile::memory_file write_data;
+                write_data.read_file(write_destination);
+                CATCH_REQUIRE(extract_data.compare(write_data) == 0);
+                CATCH_REQUIRE(extract_data.compare(*entries[i].f_data) == 0);
+            }
+        }
+    }
+
+    void payload_store()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Conffiles", "\n"
+                "/etc/t1.conf 0123456789abcdef0123456789abcdef"
+                );
+        ctrl->set_field("Files", "conffiles\n"
+                "/etc/t1.conf 0123456789abcdef0123456789abcdef\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+        // Conffiles -- the create_package deletes this field
+        ctrl->set_field("Conffiles", "\n"
+                "etc/t1.conf 0123456789abcdef0123456789abcdef"
+                );
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename store(root.append_child("store"));
+        ctrl->set_variable("INSTALL_PREOPTIONS", "--payload-store " + wpkg_util::make_safe_console_string(store.path_only()));
+        install_package("t1", ctrl);
+        verify_installed_files("t1");
+
+        // the files (but not the configuration files) are in the store
+        CATCH_REQUIRE(store.append_child("objects").is_dir());
+        wpkg_filename::uri_filename::file_stat s;
+        CATCH_REQUIRE(root.append_child("target/usr/bin/t1").os_stat(s) == 0);
+        CATCH_REQUIRE(s.get_nlink() == 2);
+        CATCH_REQUIRE(root.append_child("target/etc/t1.conf").os_stat(s) == 0);
+        CATCH_REQUIRE(s.get_nlink() == 1);
+
+        // the objects are still in use so nothing gets collected
+        std::string cmd(unittest::wpkg_tool + " --collect-payload-store " + wpkg_util::make_safe_console_string(store.path_only()));
+        printf("Collect Command: \"%s\"\n", cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system(cmd.c_str()) == 0);
+        CATCH_REQUIRE(root.append_child("target/usr/bin/t1").os_stat(s) == 0);
+        CATCH_REQUIRE(s.get_nlink() == 2);
+
+        // once removed, the object of /usr/bin/t1 gets collected
+        remove_package("t1", ctrl);
+        verify_removed_files("t1", ctrl);
+        CATCH_REQUIRE(system(cmd.c_str()) == 0);
+        int64_t count(0);
+        int64_t size(0);
+        wpkg_extract::extractor::collect_payload_store(store, count, size);
+        CATCH_REQUIRE(count == 0);
+    }
+
+    void configure_jobs()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+
+        // t1 and t3 are independent, t2 depends on t1 so its postinst
+        // must not run before the postinst of t1 is done
+        const char *names[] = { "t1", "t2", "t3" };
+        std::shared_ptr<wpkg_control::control_file> ctrls[3];
+        for(size_t i(0); i < sizeof(names) / sizeof(names[0]); ++i)
+        {
+            const std::string name(names[i]);
+            ctrls[i] = get_new_control_file(__FUNCTION__);
+            ctrls[i]->set_field("Files", "conffiles\n"
+                    "/usr/bin/" + name + " 0123456789abcdef0123456789abcdef\n"
+                    );
+            if(name == "t2")
+            {
+                ctrls[i]->set_field("Depends", "t1");
+            }
+
+            wpkg_filename::uri_filename wpkg_path(root.append_child(name + "/WPKG"));
+            memfile::memory_file postinst;
+            postinst.create(memfile::memory_file::file_format_other);
+            postinst.printf(
+                    "#!/bin/sh -e\n"
+                    "echo \"postinst: %s called with: [$*]\"\n"
+                    "%s"
+                    "sleep 1\n"
+                    "echo \"post-inst %s\" > %s-postinst.txt\n",
+                    name.c_str(),
+                    name == "t2" ? "test -f t1-postinst.txt\n" : "",
+                    name.c_str(), name.c_str());
+            postinst.write_file(wpkg_path.append_child("postinst"), true);
+            create_package(name, ctrls[i], false);
+        }
+
+        // t1 gets installed implicitly from the repository
+        ctrls[1]->set_variable("INSTALL_PREOPTIONS", "--configure-jobs 3 --repository " + wpkg_util::make_safe_console_string(repository.path_only()));
+        ctrls[1]->set_variable("INSTALL_POSTOPTIONS", wpkg_util::make_safe_console_string(repository.append_child("t3_" + ctrls[2]->get_field("Version") + "_" + ctrls[2]->get_field("Architecture") + ".deb").path_only()));
+        install_package("t2", ctrls[1]);
+        for(size_t i(0); i < sizeof(names) / sizeof(names[0]); ++i)
+        {
+            const std::string name(names[i]);
+            verify_installed_files(name);
+            CATCH_REQUIRE(target_path.append_child(name + "-postinst.txt").exists());
+        }
+    }
+
+    void verified_md5sums()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/etc/t1.conf 0123456789abcdef0123456789abcdef\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        install_package("t1", ctrl);
+        verify_installed_files("t1");
+
+        // the md5sums were verified while unpacking
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        memfile::memory_file status;
+        status.read_file(target_path.append_child("var/lib/wpkg/t1/wpkg-status"));
+        std::string status_data;
+        status_data.resize(static_cast<size_t>(status.size()));
+        status.read(&status_data[0], 0, status.size());
+        CATCH_REQUIRE(status_data.find("X-Md5sums-Verified: Yes") != std::string::npos);
+
+        std::string cmd(unittest::wpkg_tool);
+        cmd += " --root " + wpkg_util::make_safe_console_string(target_path.path_only());
+        cmd += " --audit";
+        printf("Audit Command: \"%s\"\n", cmd.c_str());
+        fflush(stdout);
+        int r(system(cmd.c_str()));
+        printf("  Audit result = %d (expected 0)\n", WEXITSTATUS(r));
+        CATCH_REQUIRE(WEXITSTATUS(r) == 0);
+
+        // the audit still detects modified files
+        memfile::memory_file modified;
+        modified.create(memfile::memory_file::file_format_other);
+        modified.printf("modified /usr/bin/t1\n");
+        modified.write_file(target_path.append_child("usr/bin/t1"));
+        r = system(cmd.c_str());
+        printf("  Audit result = %d (expected 1)\n", WEXITSTATUS(r));
+        CATCH_REQUIRE(WEXITSTATUS(r) == 1);
+    }
+
+    /** \brief Rewrite the data.tar, md5sums, or control file of a package.
+     *
+     * This function changes the contents of \p corrupt_file in the
+     * data.tar archive of \p deb without updating the md5sums file,
+     * removes \p unlisted_file from the md5sums file, and removes
+     * \p hidden_file from the Files field of the control file. Any name
+     * may be empty. The names are data file names without the leading
+     * slash.
+     */
+    void tamper_package(const wpkg_filename::uri_filename& deb, const std::string& corrupt_file, const std::string& unlisted_file, const std::string& hidden_file = "")
+    {
+        memfile::memory_file package;
+        package.read_file(deb);
+        memfile::memory_file result;
+        result.create(memfile::memory_file::file_format_ar);
+        package.dir_rewind();
+        for(;;)
+        {
+            memfile::memory_file::file_info info;
+            memfile::memory_file member;
+            if(!package.dir_next(info, &member))
+            {
+                break;
+            }
+            const bool is_data(info.get_filename().substr(0, 8) == "data.tar");
+            if(is_data || info.get_filename().substr(0, 11) == "control.tar")
+            {
+                const memfile::memory_file::file_format_t format(member.get_format());
+                memfile::memory_file tar;
+                member.decompress(tar);
+                memfile::memory_file new_tar;
+                new_tar.create(memfile::memory_file::file_format_tar);
+                tar.dir_rewind();
+                for(;;)
+                {
+                    memfile::memory_file::file_info file_info;
+                    memfile::memory_file file;
+                    if(!tar.dir_next(file_info, &file))
+                    {
+                        break;
+                    }
+                    std::string filename(file_info.get_filename());
+                    if(filename.compare(0, 2, "./") == 0)
+                    {
+                        filename.erase(0, 2);
+                    }
+                    if(is_data && filename == corrupt_file)
+                    {
+                        file.create(memfile::memory_file::file_format_other);
+                        file.printf("corrupted %s\n", filename.c_str());
+                    }
+                    else if(!is_data && filename == "md5sums" && !unlisted_file.empty())
+                    {
+                        std::string md5sums;
+                        std::string line;
+                        int64_t offset(0);
+                        while(file.read_line(offset, line))
+                        {
+                            // lines are "<md5sum> *<filename>"
+                            if(line.find("*" + unlisted_file) == std::string::npos)
+                            {
+                                md5sums += line + "\n";
+                            }
+                        }
+                        file.create(memfile::memory_file::file_format_other);
+                        file.write(md5sums.c_str(), 0, static_cast<int64_t>(md5sums.length()));
+                    }
+                    else if(!is_data && filename == "control" && !hidden_file.empty())
+                    {
+                        std::string control;
+                        std::string line;
+                        int64_t offset(0);
+                        while(file.read_line(offset, line))
+                        {
+                            // the Files field continuation lines end with
+                            // " /<filename>"
+                            const std::string suffix(" /" + hidden_file);
+                            if(line.empty() || line[0] != ' '
+                            || line.length() < suffix.length()
+                            || line.compare(line.length() - suffix.length(), suffix.length(), suffix) != 0)
+                            {
+                                control += line + "\n";
+                            }
+                        }
+                        file.create(memfile::memory_file::file_format_other);
+                        file.write(control.c_str(), 0, static_cast<int64_t>(control.length()));
+                    }
+                    file_info.set_size(file.size());
+                    new_tar.append_file(file_info, file);
+                }
+                new_tar.end_archive();
+                new_tar.compress(member, format);
+            }
+            info.set_size(member.size());
+            result.append_file(info, member);
+        }
+        result.write_file(deb);
+    }
+
+    void corrupted_package()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+        const wpkg_filename::uri_filename deb(repository.append_child("t1_" + ctrl->get_field("Version") + "_" + ctrl->get_field("Architecture") + ".deb"));
+
+        // a data file that does not match its md5sums entry prevents the
+        // installation before anything gets unpacked
+        tamper_package(deb, "usr/bin/t1", "");
+        install_package("t1", ctrl, 1);
+        CATCH_REQUIRE(!target_path.append_child("usr/bin/t1").exists());
+        CATCH_REQUIRE(!target_path.append_child("usr/share/doc/t1/copyright").exists());
+        CATCH_REQUIRE(!target_path.append_child("var/lib/wpkg/t1/wpkg-status").exists());
+
+        // a data file that is not listed in md5sums is installed but the
+        // package is not marked as verified
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+        tamper_package(deb, "", "usr/bin/t1");
+        install_package("t1", ctrl);
+        CATCH_REQUIRE(target_path.append_child("usr/bin/t1").exists());
+        memfile::memory_file status;
+        status.read_file(target_path.append_child("var/lib/wpkg/t1/wpkg-status"));
+        std::string status_data;
+        status_data.resize(static_cast<size_t>(status.size()));
+        status.read(&status_data[0], 0, status.size());
+        CATCH_REQUIRE(status_data.find("X-Md5sums-Verified: No") != std::string::npos);
+    }
+
     void upgrade_package()
     {
         // IMPORTANT: remember that all files are deleted between tests
@@ -943,31 +1517,1380 @@ public:
                 );
         create_package("t1", ctrl);
 
-        install_package("t1", ctrl);        // --install ("upgrade")
-        verify_installed_files("t1");
+        install_package("t1", ctrl);        // --install ("upgrade")
+        verify_installed_files("t1");
+
+        // make sure that /usr/bin/t1 was removed
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        CATCH_REQUIRE(!target_path.append_child("usr/bin/t1").exists());
+
+        root.append_child("t1").os_rename(root.append_child("t1-save"));
+
+        // now test a downgrade
+        ctrl->set_field("Version", "0.9");
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/info..save 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        install_package("t1", ctrl, 1);        // --install ("upgrade")
+
+        // restore the original t1 so we can verify that its files weren't modified
+        root.append_child("t1").os_unlink_rf();
+        root.append_child("t1-save").os_rename(root.append_child("t1"));
+        verify_installed_files("t1");
+    }
+
+    void upgrade_unchanged_files()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/etc/t1.conf 0123456789abcdef0123456789abcdef\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/index.html 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        install_package("t1", ctrl);        // --install
+        verify_installed_files("t1");
+
+        // keep the other files as they are, change index.html, replace
+        // /usr/bin/t1 with /usr/bin/t1-new
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        const wpkg_filename::uri_filename copyright(target_path.append_child("usr/share/doc/t1/copyright"));
+        const wpkg_filename::uri_filename index_html(target_path.append_child("usr/share/doc/t1/index.html"));
+        wpkg_filename::uri_filename::file_stat copyright_before;
+        CATCH_REQUIRE(copyright.os_stat(copyright_before) == 0);
+        wpkg_filename::uri_filename::file_stat index_html_before;
+        CATCH_REQUIRE(index_html.os_stat(index_html_before) == 0);
+        root.append_child("t1/usr/bin/t1").os_unlink();
+        ctrl->set_field("Version", "1.1");
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1-new 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/index.html 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl, false);
+
+        ctrl->set_variable("INSTALL_PREOPTIONS", "--skip-unchanged-files");
+        install_package("t1", ctrl);        // --install ("upgrade")
+        verify_installed_files("t1");
+
+        // make sure that /usr/bin/t1 was removed
+        CATCH_REQUIRE(!target_path.append_child("usr/bin/t1").exists());
+
+        // the unchanged file was not written again, the changed file was
+        // (the backup keeps the old file until the end of the unpack so
+        // the new file cannot reuse its inode); use new filename objects
+        // since a uri_filename caches its stat() results
+        wpkg_filename::uri_filename::file_stat copyright_after;
+        CATCH_REQUIRE(wpkg_filename::uri_filename(copyright.full_path()).os_stat(copyright_after) == 0);
+        CATCH_REQUIRE(copyright_after.get_mtime() == copyright_before.get_mtime());
+        CATCH_REQUIRE(copyright_after.get_mtime_nano() == copyright_before.get_mtime_nano());
+        wpkg_filename::uri_filename::file_stat index_html_after;
+        CATCH_REQUIRE(wpkg_filename::uri_filename(index_html.full_path()).os_stat(index_html_after) == 0);
+#if !defined(MO_WINDOWS)
+        CATCH_REQUIRE(copyright_after.get_inode() == copyright_before.get_inode());
+        CATCH_REQUIRE(index_html_after.get_inode() != index_html_before.get_inode());
+#endif
+    }
+
+    void backup_rollback()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/index.html 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        install_package("t1", ctrl);        // --install
+        verify_installed_files("t1");
+
+        const char *installed[] =
+        {
+            "usr/bin/t1",
+            "usr/share/doc/t1/copyright",
+            "usr/share/doc/t1/index.html"
+        };
+        std::map<std::string, std::string> md5sums;
+        for(size_t i(0); i < sizeof(installed) / sizeof(installed[0]); ++i)
+        {
+            memfile::memory_file file;
+            file.read_file(target_path.append_child(installed[i]));
+            md5sums[installed[i]] = file.md5sum();
+        }
+
+        // the upgrade fails when it tries to delete index.html, which is
+        // not part of the new version, because a directory is now in its
+        // place; the files unpacked before that have to be restored from
+        // the backup files they were renamed to and /usr/bin/t1-new has
+        // to be deleted
+        const wpkg_filename::uri_filename index_html(target_path.append_child("usr/share/doc/t1/index.html"));
+        index_html.os_unlink();
+        index_html.append_child("keep").os_mkdir_p();
+        md5sums.erase("usr/share/doc/t1/index.html");
+        ctrl->set_field("Version", "1.1");
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/bin/t1-new 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+        install_package("t1", ctrl, 1);     // --install ("upgrade")
+
+        for(std::map<std::string, std::string>::const_iterator it(md5sums.begin()); it != md5sums.end(); ++it)
+        {
+            memfile::memory_file file;
+            file.read_file(target_path.append_child(it->first));
+            CATCH_REQUIRE(file.md5sum() == it->second);
+        }
+        CATCH_REQUIRE(!target_path.append_child("usr/bin/t1-new").exists());
+
+        // the remove fails on index.html for the same reason; the files
+        // deleted before that get restored
+        remove_package("t1", ctrl, 1);      // --remove
+
+        for(std::map<std::string, std::string>::const_iterator it(md5sums.begin()); it != md5sums.end(); ++it)
+        {
+            memfile::memory_file file;
+            file.read_file(target_path.append_child(it->first));
+            CATCH_REQUIRE(file.md5sum() == it->second);
+        }
+
+        // no backup file is left behind
+        CATCH_REQUIRE(!target_path.append_child("var/lib/wpkg/tmp/backup/file1.bak").exists());
+    }
+
+    void read_package_once()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        wpkg_filename::uri_filename t1(repository.append_child("t1_" + ctrl->get_field("Version") + "_" + ctrl->get_field("Architecture") + ".deb"));
+        wpkg_filename::uri_filename::file_stat st;
+        CATCH_REQUIRE(t1.os_stat(st) == 0);
+        const int64_t deb_size(st.get_size());
+
+        // the control fields only require the start of the package
+        wpkgar::wpkgar_manager manager;
+        const int64_t start(memfile::memory_file::get_bytes_read());
+        manager.load_package(t1, false, true);
+        const int64_t control_read(memfile::memory_file::get_bytes_read() - start);
+        CATCH_REQUIRE(control_read > 0);
+        CATCH_REQUIRE(control_read < deb_size);
+
+        // loading the data reads the whole package exactly once
+        manager.load_package(t1);
+        const int64_t loaded(memfile::memory_file::get_bytes_read());
+        CATCH_REQUIRE(loaded - start - control_read == deb_size);
+
+        // the data.tar is kept in memory, reading the data files or
+        // loading the package again does not read the .deb again
+        memfile::memory_file data;
+        manager.get_data_file(data, t1, "/usr/bin/t1");
+        wpkg_control::file_list_t files(ctrl->get_files("Files"));
+        for(wpkg_control::file_list_t::const_iterator it(files.begin()); it != files.end(); ++it)
+        {
+            if(it->get_filename() == "/usr/bin/t1")
+            {
+                CATCH_REQUIRE(data.md5sum() == it->get_checksum());
+            }
+        }
+        manager.load_package(t1);
+        CATCH_REQUIRE(memfile::memory_file::get_bytes_read() == loaded);
+    }
+
+    void status_transaction()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+        install_package("t1", ctrl);
+        verify_installed_files("t1");
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        const wpkg_filename::uri_filename status_filename(target_path.append_child("var/lib/wpkg/t1/wpkg-status"));
+
+        wpkgar::wpkgar_manager manager;
+        manager.set_root_path(target_path);
+        manager.set_database_path("var/lib/wpkg");
+        wpkgar::wpkgar_lock lock_wpkg(&manager, "Installing");
+        manager.load_package("t1");
+
+        // without a transaction each field gets saved on its own
+        int64_t start(memfile::memory_file::get_bytes_written());
+        manager.set_field("t1", "X-Test-First", "1", true);
+        manager.set_field("t1", "X-Test-Second", "2", true);
+        manager.set_field("t1", "X-Test-Third", 3, true);
+        wpkg_filename::uri_filename::file_stat st;
+        CATCH_REQUIRE(wpkg_filename::uri_filename(status_filename.full_path()).os_stat(st) == 0);
+        CATCH_REQUIRE(memfile::memory_file::get_bytes_written() - start > st.get_size());
+
+        // within a (nested) transaction the status file gets written once
+        // on the outer most commit
+        start = memfile::memory_file::get_bytes_written();
+        {
+            wpkgar::wpkgar_status_transaction transaction(&manager);
+            manager.set_field("t1", "X-Test-First", "one", true);
+            {
+                wpkgar::wpkgar_status_transaction inner_transaction(&manager);
+                manager.set_field("t1", "X-Test-Second", "two", true);
+                inner_transaction.commit();
+            }
+            manager.set_field("t1", "X-Test-Third", "three", true);
+            CATCH_REQUIRE(memfile::memory_file::get_bytes_written() == start);
+            transaction.commit();
+        }
+        CATCH_REQUIRE(wpkg_filename::uri_filename(status_filename.full_path()).os_stat(st) == 0);
+        CATCH_REQUIRE(memfile::memory_file::get_bytes_written() - start == st.get_size());
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(status_filename.full_path() + ".wpkg-new").exists());
+
+        // the status file has all the fields
+        memfile::memory_file status;
+        status.read_file(status_filename);
+        std::string fields;
+        int64_t offset(0);
+        std::string line;
+        while(status.read_line(offset, line))
+        {
+            fields += line + "\n";
+        }
+        CATCH_REQUIRE(fields.find("X-Test-First: one\n") != std::string::npos);
+        CATCH_REQUIRE(fields.find("X-Test-Second: two\n") != std::string::npos);
+        CATCH_REQUIRE(fields.find("X-Test-Third: three\n") != std::string::npos);
+        CATCH_REQUIRE(fields.find("X-Status: Installed\n") != std::string::npos);
+
+        // an unbalanced commit is an error
+        CATCH_REQUIRE_THROWS_AS(manager.commit_status_transaction(), wpkgar::wpkgar_exception_invalid);
+    }
+
+    void tracking_journal()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        const wpkg_filename::uri_filename journal(root.append_child("journal.txt"));
+        root.os_mkdir_p();
+
+        wpkgar::wpkgar_manager manager;
+        std::shared_ptr<wpkgar::wpkgar_tracker> tracker(new wpkgar::wpkgar_tracker(&manager, journal));
+        tracker->keep_file(true);
+        manager.set_tracker(tracker);
+
+        // the tracked instructions only reach the journal on sync
+        manager.track("# tracking test");
+        manager.track("purge t1", "t1");
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(journal.full_path()).exists());
+        manager.sync_tracker();
+        CATCH_REQUIRE(read_journal(journal) == "# tracking test\npurge t1\n");
+
+        // a sync without new instructions does not change the journal
+        manager.sync_tracker();
+        CATCH_REQUIRE(read_journal(journal) == "# tracking test\npurge t1\n");
+
+        // new instructions get appended in order
+        manager.track("deconfigure t1\n", "t1");
+        manager.track("purge t2", "t2");
+        CATCH_REQUIRE(read_journal(journal) == "# tracking test\npurge t1\n");
+        manager.sync_tracker();
+        const std::string synced("# tracking test\npurge t1\ndeconfigure t1\npurge t2\n");
+        CATCH_REQUIRE(read_journal(journal) == synced);
+
+        // instructions tracked by several threads do not get mixed up
+        std::vector<std::thread> threads;
+        for(int t(0); t < 4; ++t)
+        {
+            threads.push_back(std::thread([&manager, t]()
+                {
+                    for(int i(0); i < 100; ++i)
+                    {
+                        const std::string name("t" + std::to_string(t) + "-" + std::to_string(i));
+                        manager.track("purge " + name, name);
+                    }
+                }));
+        }
+        for(std::vector<std::thread>::iterator it(threads.begin()); it != threads.end(); ++it)
+        {
+            it->join();
+        }
+        manager.sync_tracker();
+        const std::string content(read_journal(journal));
+        CATCH_REQUIRE(content.compare(0, synced.length(), synced) == 0);
+        std::map<std::string, int> counts;
+        std::string::size_type start(synced.length());
+        for(std::string::size_type end(content.find('\n', start)); end != std::string::npos; start = end + 1, end = content.find('\n', start))
+        {
+            ++counts[content.substr(start, end - start)];
+        }
+        CATCH_REQUIRE(start == content.length());
+        CATCH_REQUIRE(counts.size() == 400);
+        for(std::map<std::string, int>::const_iterator it(counts.begin()); it != counts.end(); ++it)
+        {
+            CATCH_REQUIRE(it->first.compare(0, 7, "purge t") == 0);
+            CATCH_REQUIRE(it->second == 1);
+        }
+
+        // instructions not yet synchronized get saved on rollback
+        manager.track("# last comment");
+        tracker->commit();
+        manager.set_tracker(std::shared_ptr<wpkgar::wpkgar_tracker_interface>());
+        tracker.reset();
+        CATCH_REQUIRE(read_journal(journal) == content + "# last comment\n");
+    }
+
+    static std::string read_journal(const wpkg_filename::uri_filename& journal)
+    {
+        memfile::memory_file file;
+        file.read_file(journal);
+        std::string result;
+        int64_t offset(0);
+        std::string line;
+        while(file.read_line(offset, line))
+        {
+            result += line + "\n";
+        }
+        return result;
+    }
+
+    void prefetched_packages()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+
+        const char *names[] = { "t1", "t2", "t3" };
+        const size_t max(sizeof(names) / sizeof(names[0]));
+        std::shared_ptr<wpkg_control::control_file> ctrls[max];
+        wpkg_filename::filename_list_t debs;
+        for(size_t i(0); i < max; ++i)
+        {
+            const std::string name(names[i]);
+            ctrls[i] = get_new_control_file(__FUNCTION__);
+            ctrls[i]->set_field("Files", "conffiles\n"
+                    "/usr/bin/" + name + " 0123456789abcdef0123456789abcdef\n"
+                    "/usr/share/doc/" + name + "/copyright 0123456789abcdef0123456789abcdef\n"
+                    "/usr/share/doc/" + name + "/index.html 0123456789abcdef0123456789abcdef\n"
+                    );
+            create_package(name, ctrls[i]);
+            debs.push_back(repository.append_child(name + "_" + ctrls[i]->get_field("Version") + "_" + ctrls[i]->get_field("Architecture") + ".deb"));
+        }
+
+        // load the packages through the prefetcher (which is global so
+        // we load them all before loading them again without it)
+        wpkgar::wpkgar_manager prefetched;
+        prefetched.prefetch_packages(debs);
+        int64_t deb_sizes(0);
+        const int64_t bytes_read(memfile::memory_file::get_bytes_read());
+        for(size_t i(0); i < max; ++i)
+        {
+            wpkg_filename::uri_filename::file_stat st;
+            CATCH_REQUIRE(debs[i].os_stat(st) == 0);
+            deb_sizes += st.get_size();
+            prefetched.load_package(debs[i]);
+        }
+        prefetched.prefetch_packages(wpkg_filename::filename_list_t());
+
+        // the prefetcher read (at least some of) the .deb files instead
+        // of load_package()
+        CATCH_REQUIRE(memfile::memory_file::get_bytes_read() - bytes_read < deb_sizes);
+
+        // the packages loaded from the prefetcher are identical to the
+        // packages read and decompressed by load_package()
+        wpkgar::wpkgar_manager loaded;
+        for(size_t i(0); i < max; ++i)
+        {
+            const int64_t load_bytes_read(memfile::memory_file::get_bytes_read());
+            loaded.load_package(debs[i]);
+            wpkg_filename::uri_filename::file_stat st;
+            CATCH_REQUIRE(debs[i].os_stat(st) == 0);
+            CATCH_REQUIRE(memfile::memory_file::get_bytes_read() - load_bytes_read == st.get_size());
+
+            CATCH_REQUIRE(loaded.get_field(debs[i], "Package") == prefetched.get_field(debs[i], "Package"));
+            CATCH_REQUIRE(loaded.get_field(debs[i], "Files") == prefetched.get_field(debs[i], "Files"));
+
+            // same archive members with the same md5sums
+            memfile::memory_file *loaded_wpkgar(nullptr);
+            loaded.get_wpkgar_file(debs[i], loaded_wpkgar);
+            memfile::memory_file *prefetched_wpkgar(nullptr);
+            prefetched.get_wpkgar_file(debs[i], prefetched_wpkgar);
+            loaded_wpkgar->dir_rewind();
+            prefetched_wpkgar->dir_rewind();
+            for(;;)
+            {
+                memfile::memory_file::file_info loaded_info;
+                memfile::memory_file::file_info prefetched_info;
+                const bool has_loaded(loaded_wpkgar->dir_next(loaded_info));
+                CATCH_REQUIRE(prefetched_wpkgar->dir_next(prefetched_info) == has_loaded);
+                if(!has_loaded)
+                {
+                    break;
+                }
+                CATCH_REQUIRE(loaded_info.get_filename() == prefetched_info.get_filename());
+                CATCH_REQUIRE(loaded_info.get_size() == prefetched_info.get_size());
+                CATCH_REQUIRE(loaded_info.get_raw_md5sum() == prefetched_info.get_raw_md5sum());
+            }
+
+            // same data files
+            wpkg_control::file_list_t files(ctrls[i]->get_files("Files"));
+            for(wpkg_control::file_list_t::const_iterator it(files.begin()); it != files.end(); ++it)
+            {
+                memfile::memory_file loaded_data;
+                loaded.get_data_file(loaded_data, debs[i], it->get_filename());
+                memfile::memory_file prefetched_data;
+                prefetched.get_data_file(prefetched_data, debs[i], it->get_filename());
+                CATCH_REQUIRE(loaded_data.compare(prefetched_data) == 0);
+                CATCH_REQUIRE(prefetched_data.md5sum() == it->get_checksum());
+            }
+        }
+
+        // and an installation (which prefetches) gives the expected files
+        ctrls[0]->set_variable("INSTALL_POSTOPTIONS",
+                      wpkg_util::make_safe_console_string(debs[1].path_only())
+                + " " + wpkg_util::make_safe_console_string(debs[2].path_only()));
+        install_package("t1", ctrls[0]);
+        for(size_t i(0); i < max; ++i)
+        {
+            verify_installed_files(names[i]);
+        }
+    }
+
+    void read_package_head()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/index.html 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        wpkg_filename::uri_filename t1(repository.append_child("t1_" + ctrl->get_field("Version") + "_" + ctrl->get_field("Architecture") + ".deb"));
+        wpkg_filename::uri_filename::file_stat st;
+        CATCH_REQUIRE(t1.os_stat(st) == 0);
+
+        memfile::memory_file full;
+        full.read_file(t1);
+        CATCH_REQUIRE(full.size() == st.get_size());
+
+        // the md5sum is computed without loading the file
+        int64_t start(memfile::memory_file::get_bytes_read());
+        CATCH_REQUIRE(memfile::memory_file::file_md5sum(t1) == full.md5sum());
+        CATCH_REQUIRE(memfile::memory_file::get_bytes_read() - start == st.get_size());
+
+        // stopping at the data.tar member only reads the start of the
+        // package, and that start is identical to the full package
+        start = memfile::memory_file::get_bytes_read();
+        memfile::memory_file head;
+        head.read_ar_file(t1, "data.tar");
+        CATCH_REQUIRE(memfile::memory_file::get_bytes_read() - start == head.size());
+        CATCH_REQUIRE(head.get_format() == memfile::memory_file::file_format_ar);
+        CATCH_REQUIRE(head.size() < full.size());
+        std::vector<char> head_data(static_cast<size_t>(head.size()));
+        std::vector<char> full_data(static_cast<size_t>(head.size()));
+        CATCH_REQUIRE(head.read(&head_data[0], 0, head.size()) == head.size());
+        CATCH_REQUIRE(full.read(&full_data[0], 0, head.size()) == head.size());
+        CATCH_REQUIRE(head_data == full_data);
+
+        // the members are the same, minus data.tar
+        std::vector<std::string> head_members;
+        head.dir_rewind();
+        for(;;)
+        {
+            memfile::memory_file::file_info info;
+            memfile::memory_file data;
+            if(!head.dir_next(info, &data))
+            {
+                break;
+            }
+            head_members.push_back(info.get_filename());
+            CATCH_REQUIRE(data.size() == info.get_size());
+        }
+        std::vector<std::string> full_members;
+        full.dir_rewind();
+        for(;;)
+        {
+            memfile::memory_file::file_info info;
+            if(!full.dir_next(info))
+            {
+                break;
+            }
+            full_members.push_back(info.get_filename());
+        }
+        CATCH_REQUIRE(head_members.size() == 2);
+        CATCH_REQUIRE(head_members[0] == "debian-binary");
+        CATCH_REQUIRE(head_members[1].substr(0, 11) == "control.tar");
+        CATCH_REQUIRE(full_members.size() == 3);
+        CATCH_REQUIRE(full_members[0] == head_members[0]);
+        CATCH_REQUIRE(full_members[1] == head_members[1]);
+        CATCH_REQUIRE(full_members[2].substr(0, 8) == "data.tar");
+
+        // a prefix matching no member reads the whole package
+        memfile::memory_file all;
+        all.read_ar_file(t1, "no-such-member");
+        CATCH_REQUIRE(all.compare(full) == 0);
+
+        // a file which is not an ar archive gets read in full
+        wpkg_filename::uri_filename copyright(root.append_child("t1/usr/share/doc/t1/copyright"));
+        memfile::memory_file text;
+        text.read_file(copyright);
+        memfile::memory_file not_ar;
+        not_ar.read_ar_file(copyright, "data.tar");
+        CATCH_REQUIRE(not_ar.compare(text) == 0);
+        CATCH_REQUIRE(memfile::memory_file::file_md5sum(copyright) == text.md5sum());
+    }
+
+    void files_field()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/etc/t1.conf 0123456789abcdef0123456789abcdef\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        // the Files field of the package lists all the files of its
+        // data.tar archive, including directories, in the longlist format
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        wpkg_filename::uri_filename t1(repository.append_child("t1_" + ctrl->get_field("Version") + "_" + ctrl->get_field("Architecture") + ".deb"));
+        wpkgar::wpkgar_manager manager;
+        manager.load_package(t1, false, true);
+        CATCH_REQUIRE(manager.field_is_defined(t1, "Files"));
+        wpkg_control::file_list_t package_files("Files");
+        package_files.set(manager.get_field(t1, "Files"));
+
+        wpkg_control::file_list_t files(ctrl->get_files("Files"));
+        for(wpkg_control::file_list_t::const_iterator it(files.begin()); it != files.end(); ++it)
+        {
+            bool found(false);
+            for(wpkg_control::file_list_t::const_iterator p(package_files.begin()); p != package_files.end(); ++p)
+            {
+                CATCH_REQUIRE(p->get_format() == wpkg_control::file_item::format_longlist);
+                if(p->get_filename() == it->get_filename())
+                {
+                    // the Files field of ctrl does not keep the sizes,
+                    // check against the files the package was built from
+                    wpkg_filename::uri_filename::file_stat st;
+                    CATCH_REQUIRE(root.append_child("t1" + it->get_filename()).os_stat(st) == 0);
+                    CATCH_REQUIRE((p->get_mode() & S_IFMT) == S_IFREG);
+                    CATCH_REQUIRE(p->get_size() == st.get_size());
+                    CATCH_REQUIRE(p->get_checksum() == it->get_checksum());
+                    found = true;
+                }
+                else if(p->get_filename() == "/usr/bin")
+                {
+                    CATCH_REQUIRE((p->get_mode() & S_IFMT) == S_IFDIR);
+                }
+            }
+            CATCH_REQUIRE(found);
+        }
+
+        // and the installation gets validated from that field
+        install_package("t1", ctrl);
+        verify_installed_files("t1");
+    }
+
+    void legacy_files_field()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+
+        std::shared_ptr<wpkg_control::control_file> ctrl_t0(get_new_control_file(__FUNCTION__));
+        ctrl_t0->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t0/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t0", ctrl_t0);
+        install_package("t0", ctrl_t0);
+        memfile::memory_file t0_data;
+        t0_data.read_file(target_path.append_child("usr/bin/t1"));
+
+        // t1 also has /usr/bin/t1 but its Files field does not say so, as
+        // a Files field written by hand in an older package would; the
+        // installation must read data.tar and detect the overwrite
+        std::shared_ptr<wpkg_control::control_file> ctrl_t1(get_new_control_file(__FUNCTION__));
+        ctrl_t1->set_field("Files", "conffiles\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl_t1);
+        const wpkg_filename::uri_filename deb(repository.append_child("t1_" + ctrl_t1->get_field("Version") + "_" + ctrl_t1->get_field("Architecture") + ".deb"));
+        tamper_package(deb, "", "", "usr/bin/t1");
+        wpkgar::wpkgar_manager manager;
+        manager.load_package(deb, false, true);
+        CATCH_REQUIRE(manager.get_field(deb, "Files").find(" /usr/bin/t1") == std::string::npos);
+        CATCH_REQUIRE(manager.get_field(deb, "Files").find(" /usr/share/doc/t1/copyright") != std::string::npos);
+
+        install_package("t1", ctrl_t1, 1);
+        memfile::memory_file file;
+        file.read_file(target_path.append_child("usr/bin/t1"));
+        CATCH_REQUIRE(file.md5sum() == t0_data.md5sum());
+        CATCH_REQUIRE(!target_path.append_child("usr/share/doc/t1/copyright").exists());
+    }
+
+    void contents_index()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+        ctrl->set_field("Files", "conffiles\n"
+                "/etc/t1.conf 0123456789abcdef0123456789abcdef\n"
+                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl);
+
+        ctrl = get_new_control_file(__FUNCTION__);
+        ctrl->set_field("Files", "conffiles\n"
+                "/etc/t2.conf 0123456789abcdef0123456789abcdef\n"
+                "/usr/bin/t2 0123456789abcdef0123456789abcdef\n"
+                "/usr/share/doc/t2/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t2", ctrl);
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        std::string cmd(unittest::wpkg_tool);
+        cmd += " --create-index " + wpkg_util::make_safe_console_string(repository.full_path()) + "/index.tar.gz --repository " + wpkg_util::make_safe_console_string(repository.full_path()) + " --contents-index";
+        printf("Create packages index: \"%s\"\n", cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system(cmd.c_str()) == 0);
+
+        memfile::memory_file file;
+        file.read_file(repository.append_child("index.contents.gz"));
+        wpkgar::wpkgar_contents_index contents;
+        contents.load(file);
+
+        // directories are not listed
+        CATCH_REQUIRE(contents.size() == 6);
+
+        const std::string t2("t2_" + ctrl->get_field("Version") + "_" + ctrl->get_field("Architecture"));
+        wpkgar::wpkgar_contents_index::match_list_t matches;
+        contents.find("/usr/bin/t2", matches);
+        CATCH_REQUIRE(matches.size() == 1);
+        CATCH_REQUIRE(matches[0].get_path() == "/usr/bin/t2");
+        CATCH_REQUIRE(matches[0].get_package() == t2);
+
+        // a pattern without a slash is matched against the basename only
+        contents.find("copyright", matches);
+        CATCH_REQUIRE(matches.size() == 2);
+        contents.find("t*.conf", matches);
+        CATCH_REQUIRE(matches.size() == 2);
+        contents.find("usr/bin/t?", matches);
+        CATCH_REQUIRE(matches.size() == 2);
+        contents.find("/usr/share/doc/*", matches);
+        CATCH_REQUIRE(matches.size() == 2);
+        contents.find("/usr/bin", matches);
+        CATCH_REQUIRE(matches.empty());
+        contents.find("t3", matches);
+        CATCH_REQUIRE(matches.empty());
+    }
+
+    /** \brief Validate an installation in process.
+     *
+     * This function runs the validation of the installation of \p package
+     * in the target directory using the specified repositories to satisfy
+     * its dependencies and returns the list of packages that would be
+     * installed, one per line, sorted.
+     *
+     * \param[in] package  The .deb file of the package to install.
+     * \param[in] repositories  The repositories to search.
+     * \param[in] fetch_jobs  The number of repositories read in parallel.
+     * \param[out] messages  If not NULL, receives all the messages.
+     *
+     * \return The packages with their version and filename.
+     */
+    std::string validate_install_list(const wpkg_filename::uri_filename& package, const wpkg_filename::filename_list_t& repositories, int fetch_jobs, std::string *messages = nullptr)
+    {
+        capture_output output;
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+
+        wpkgar::wpkgar_manager manager;
+        manager.set_root_path(target_path);
+        manager.set_database_path("var/lib/wpkg");
+        for(wpkg_filename::filename_list_t::const_iterator it(repositories.begin()); it != repositories.end(); ++it)
+        {
+            manager.add_repository(*it);
+        }
+        wpkgar::wpkgar_lock lock_wpkg(&manager, "Installing");
+        wpkgar::wpkgar_install pkg_install(&manager);
+        pkg_install.set_installing();
+        pkg_install.set_fetch_jobs(fetch_jobs);
+        pkg_install.add_package(package.full_path());
+        CATCH_REQUIRE(pkg_install.validate());
+
+        std::vector<std::string> lines;
+        wpkgar::wpkgar_install::install_info_list_t list(pkg_install.get_install_list());
+        for(wpkgar::wpkgar_install::install_info_list_t::const_iterator it(list.begin()); it != list.end(); ++it)
+        {
+            lines.push_back(it->get_name() + " " + it->get_version() + " " + it->get_filename());
+        }
+        std::sort(lines.begin(), lines.end());
+        std::string result;
+        for(std::vector<std::string>::const_iterator it(lines.begin()); it != lines.end(); ++it)
+        {
+            result += *it + "\n";
+        }
+        if(messages != nullptr)
+        {
+            *messages = output.get_messages();
+        }
+        return result;
+    }
+
+    void binary_index_current()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        wpkg_filename::filename_list_t repositories;
+        repositories.push_back(repository);
+
+        std::shared_ptr<wpkg_control::control_file> ctrl_t1(get_new_control_file(__FUNCTION__));
+        ctrl_t1->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl_t1);
+
+        std::shared_ptr<wpkg_control::control_file> ctrl_t2(get_new_control_file(__FUNCTION__));
+        ctrl_t2->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t2/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        ctrl_t2->set_field("Depends", "t1");
+        create_package("t2", ctrl_t2);
+
+        const wpkg_filename::uri_filename tar_index(repository.append_child("index.tar.gz"));
+        const wpkg_filename::uri_filename binary_index(repository.append_child("index.wpkgidx"));
+        std::string cmd(unittest::wpkg_tool);
+        cmd += " --create-index " + wpkg_util::make_safe_console_string(tar_index.path_only()) + " --repository " + wpkg_util::make_safe_console_string(repository.path_only());
+        printf("Create packages index: \"%s\"\n", cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system((cmd + " --binary-index").c_str()) == 0);
+
+        // the binary index is tied to the tar index
+        {
+            wpkgar::wpkgar_binary_index index;
+            index.open(binary_index);
+            CATCH_REQUIRE(index.is_current(tar_index));
+        }
+
+        // the target
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        target_path.os_mkdir_p();
+        wpkg_filename::uri_filename core_ctrl_filename(root.append_child("core.ctrl"));
+        memfile::memory_file core_ctrl;
+        core_ctrl.create(memfile::memory_file::file_format_other);
+        core_ctrl.printf("Architecture: %s\n", debian_packages_architecture());
+        core_ctrl.printf("Maintainer: Alexis Wilke <alexis@m2osw.com>\n");
+        core_ctrl.write_file(core_ctrl_filename);
+        std::string core_cmd(unittest::wpkg_tool + " --root " + wpkg_util::make_safe_console_string(target_path.path_only())
+                + " --create-admindir " + wpkg_util::make_safe_console_string(core_ctrl_filename.path_only()));
+        printf("Create AdminDir Command: \"%s\"\n", core_cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system(core_cmd.c_str()) == 0);
+
+        // the binary index gets used
+        const wpkg_filename::uri_filename t2(repository.append_child("t2_" + ctrl_t2->get_field("Version") + "_" + ctrl_t2->get_field("Architecture") + ".deb"));
+        std::string messages;
+        const std::string binary_list(validate_install_list(t2, repositories, 1, &messages));
+        CATCH_REQUIRE(messages.find("Reading binary index file from repository") != std::string::npos);
+        CATCH_REQUIRE(binary_list.find("t1 1.0 ") != std::string::npos);
+
+        // a new version of t1 is only added to the tar index and the tar
+        // index gets the same modification time as the binary index; the
+        // stale binary index must be ignored
+        wpkg_filename::uri_filename::file_stat binary_stat;
+        CATCH_REQUIRE(binary_index.os_stat(binary_stat) == 0);
+        ctrl_t1->set_field("Version", "1.1");
+        create_package("t1", ctrl_t1);
+        CATCH_REQUIRE(system(cmd.c_str()) == 0);
+#if !defined(MO_WINDOWS)
+        struct utimbuf times;
+        times.actime = binary_stat.get_mtime();
+        times.modtime = binary_stat.get_mtime();
+        CATCH_REQUIRE(utime(tar_index.os_filename().get_utf8().c_str(), &times) == 0);
+#endif
+        {
+            wpkgar::wpkgar_binary_index index;
+            index.open(binary_index);
+            CATCH_REQUIRE(!index.is_current(tar_index));
+        }
+        const std::string tar_list(validate_install_list(t2, repositories, 1, &messages));
+        CATCH_REQUIRE(messages.find("Reading binary index file from repository") == std::string::npos);
+        CATCH_REQUIRE(messages.find("Reading index file from repository") != std::string::npos);
+        CATCH_REQUIRE(tar_list.find("t1 1.1 ") != std::string::npos);
+
+        // once recreated, the binary index is used again
+        CATCH_REQUIRE(system((cmd + " --binary-index").c_str()) == 0);
+        CATCH_REQUIRE(validate_install_list(t2, repositories, 1, &messages) == tar_list);
+        CATCH_REQUIRE(messages.find("Reading binary index file from repository") != std::string::npos);
+    }
+
+#if !defined(MO_WINDOWS)
+    std::string fetch_index(int port, const std::string& path, std::string& etag)
+    {
+        wpkg_http::request r(path);
+        wpkg_http::response result;
+        wpkg_http::client::get("127.0.0.1", port, r, result);
+        CATCH_REQUIRE(result.get_status() == 200);
+        etag = result.get_field("etag");
+
+        // list the packages found in that index
+        wpkg_filename::uri_filename index_filename(wpkg_filename::uri_filename(unittest::tmp_dir).append_child("fetched.tar.gz"));
+        memfile::memory_file body;
+        body.create(memfile::memory_file::file_format_other);
+        body.write(result.get_body().c_str(), 0, static_cast<int64_t>(result.get_body().length()));
+        body.write_file(index_filename);
+        memfile::memory_file package_index;
+        package_index.read_file(index_filename);
+        wpkgar::wpkgar_manager manager;
+        wpkgar::wpkgar_repository repository(&manager);
+        wpkgar::wpkgar_repository::entry_vector_t entries;
+        repository.load_index(package_index, entries);
+        std::vector<std::string> names;
+        for(wpkgar::wpkgar_repository::entry_vector_t::const_iterator it(entries.begin()); it != entries.end(); ++it)
+        {
+            names.push_back(it->f_info.get_filename());
+        }
+        std::sort(names.begin(), names.end());
+        std::string list;
+        for(std::vector<std::string>::const_iterator it(names.begin()); it != names.end(); ++it)
+        {
+            list += *it + "\n";
+        }
+        return list;
+    }
+#endif
+
+    void serve_regenerate_index()
+    {
+#if !defined(MO_WINDOWS)
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+
+        std::shared_ptr<wpkg_control::control_file> ctrl_t1(get_new_control_file(__FUNCTION__));
+        ctrl_t1->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl_t1);
+
+        server_process server(repository, "--regenerate-index");
+
+        // the index gets created on the first request
+        std::string etag1;
+        const std::string list1(fetch_index(server.get_port(), "/index.tar.gz", etag1));
+        CATCH_REQUIRE(list1.find("t1_") != std::string::npos);
+        CATCH_REQUIRE(list1.find("t2_") == std::string::npos);
+        CATCH_REQUIRE(repository.append_child("index.tar.gz").exists());
+
+        // nothing changed, the same index is served
+        std::string etag2;
+        CATCH_REQUIRE(fetch_index(server.get_port(), "/index.tar.gz", etag2) == list1);
+        CATCH_REQUIRE(etag2 == etag1);
+
+        // a new package gets added, the index is regenerated right away
+        // (i.e. within the same second) and it gets a new ETag
+        std::shared_ptr<wpkg_control::control_file> ctrl_t2(get_new_control_file(__FUNCTION__));
+        ctrl_t2->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t2/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        ctrl_t2->set_field("Depends", "t1");
+        create_package("t2", ctrl_t2);
+        std::string etag3;
+        const std::string list3(fetch_index(server.get_port(), "/./index.tar.gz", etag3));
+        CATCH_REQUIRE(list3.find("t1_") != std::string::npos);
+        CATCH_REQUIRE(list3.find("t2_") != std::string::npos);
+        CATCH_REQUIRE(etag3 != etag1);
+
+        // other files do not trigger a regeneration
+        {
+            wpkg_http::request r("/t2_" + ctrl_t2->get_field("Version") + "_" + ctrl_t2->get_field("Architecture") + ".deb", "HEAD");
+            wpkg_http::response result;
+            wpkg_http::client::get("127.0.0.1", server.get_port(), r, result);
+            CATCH_REQUIRE(result.get_status() == 200);
+        }
+        const std::string log(server.log());
+        std::string::size_type count(0);
+        for(std::string::size_type pos(log.find("regenerated index")); pos != std::string::npos; pos = log.find("regenerated index", pos + 1))
+        {
+            ++count;
+        }
+        CATCH_REQUIRE(count == 2);
+#endif
+    }
+
+    std::string::size_type count_occurrences(const std::string& str, const std::string& what)
+    {
+        std::string::size_type count(0);
+        for(std::string::size_type pos(str.find(what)); pos != std::string::npos; pos = str.find(what, pos + 1))
+        {
+            ++count;
+        }
+        return count;
+    }
+
+#if !defined(MO_WINDOWS)
+    std::string index_entries(const wpkg_filename::uri_filename& index_filename)
+    {
+        memfile::memory_file package_index;
+        package_index.read_file(index_filename);
+        wpkgar::wpkgar_manager manager;
+        wpkgar::wpkgar_repository repository(&manager);
+        wpkgar::wpkgar_repository::entry_vector_t entries;
+        repository.load_index(package_index, entries);
+        std::string result;
+        for(wpkgar::wpkgar_repository::entry_vector_t::const_iterator it(entries.begin()); it != entries.end(); ++it)
+        {
+            result += it->f_info.get_filename() + ":" + it->f_control->md5sum() + "\n";
+        }
+        return result;
+    }
+#endif
+
+    /** \brief Dump an index with everything but its Index-Date fields.
+     *
+     * The Index-Date field is the time when the index was created so two
+     * indexes of the same packages only differ by that field.
+     */
+    std::string index_dump(const wpkg_filename::uri_filename& index_filename)
+    {
+        memfile::memory_file package_index;
+        package_index.read_file(index_filename);
+        wpkgar::wpkgar_manager manager;
+        wpkgar::wpkgar_repository repository(&manager);
+        wpkgar::wpkgar_repository::entry_vector_t entries;
+        repository.load_index(package_index, entries);
+        std::stringstream result;
+        for(wpkgar::wpkgar_repository::entry_vector_t::const_iterator it(entries.begin()); it != entries.end(); ++it)
+        {
+            result << it->f_info.get_filename() << " " << it->f_info.get_mtime() << "\n";
+            std::string line;
+            int64_t offset(0);
+            while(it->f_control->read_line(offset, line))
+            {
+                if(line.compare(0, 11, "Index-Date:") != 0)
+                {
+                    result << line << "\n";
+                }
+            }
+        }
+        return result.str();
+    }
+
+    void index_jobs()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+
+        // enough packages to keep all the workers busy
+        for(int i(1); i <= 12; ++i)
+        {
+            std::stringstream name;
+            name << "t" << i;
+            std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+            ctrl->set_field("Files", "conffiles\n"
+                    "/usr/share/doc/" + name.str() + "/copyright 0123456789abcdef0123456789abcdef\n"
+                    );
+            create_package(name.str(), ctrl);
+        }
+
+        // the indexes are created outside of the repository
+        const wpkg_filename::uri_filename index1(root.append_child("index1.tar.gz"));
+        const wpkg_filename::uri_filename index4(root.append_child("index4.tar.gz"));
+        const std::string cmd(unittest::wpkg_tool + " --repository " + wpkg_util::make_safe_console_string(repository.path_only()));
+        printf("Create packages indexes: \"%s\"\n", cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system((cmd + " --create-index " + wpkg_util::make_safe_console_string(index1.path_only()) + " --index-jobs 1").c_str()) == 0);
+        CATCH_REQUIRE(system((cmd + " --create-index " + wpkg_util::make_safe_console_string(index4.path_only()) + " --index-jobs 4").c_str()) == 0);
+
+        // both indexes are the same except for their Index-Date
+        const std::string dump(index_dump(index1));
+        CATCH_REQUIRE(dump == index_dump(index4));
+        CATCH_REQUIRE(count_occurrences(dump, "Package-md5sum:") == 12);
+        for(int i(1); i <= 12; ++i)
+        {
+            std::stringstream name;
+            name << "t" << i << "_";
+            CATCH_REQUIRE(dump.find(name.str()) != std::string::npos);
+        }
+    }
+
+    void incremental_index()
+    {
+#if !defined(MO_WINDOWS)
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        const wpkg_filename::uri_filename index(root.append_child("index.tar.gz"));
+
+        std::shared_ptr<wpkg_control::control_file> ctrl_t1(get_new_control_file(__FUNCTION__));
+        ctrl_t1->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl_t1);
+        std::shared_ptr<wpkg_control::control_file> ctrl_t2(get_new_control_file(__FUNCTION__));
+        ctrl_t2->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t2/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t2", ctrl_t2);
+        const wpkg_filename::uri_filename t1(repository.append_child("t1_" + ctrl_t1->get_field("Version") + "_" + ctrl_t1->get_field("Architecture") + ".deb"));
+        const wpkg_filename::uri_filename t2(repository.append_child("t2_" + ctrl_t2->get_field("Version") + "_" + ctrl_t2->get_field("Architecture") + ".deb"));
+
+        // without the .md5sum files the packages have to be read to be
+        // indexed; t1 gets a fixed modification time so it can be restored
+        wpkg_filename::uri_filename(t1.full_path() + ".md5sum").os_unlink();
+        wpkg_filename::uri_filename(t2.full_path() + ".md5sum").os_unlink();
+        struct utimbuf times;
+        times.actime = 1000000000;
+        times.modtime = 1000000000;
+        CATCH_REQUIRE(utime(t1.os_filename().get_utf8().c_str(), &times) == 0);
+        memfile::memory_file t1_data;
+        t1_data.read_file(t1);
+        const std::string t1_md5sum(t1_data.md5sum());
+        memfile::memory_file t2_data;
+        t2_data.read_file(t2);
+        const std::string t2_md5sum(t2_data.md5sum());
+
+        const std::string cmd(unittest::wpkg_tool + " --create-index " + wpkg_util::make_safe_console_string(index.path_only())
+                            + " --repository " + wpkg_util::make_safe_console_string(repository.path_only()) + " --incremental");
+        printf("Create incremental index: \"%s\"\n", cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system(cmd.c_str()) == 0);
+        CATCH_REQUIRE(wpkg_filename::uri_filename(index.full_path() + ".fingerprints").exists());
+        const std::string dump1(index_dump(index));
+        CATCH_REQUIRE(dump1.find("Package-md5sum: " + t1_md5sum) != std::string::npos);
+        CATCH_REQUIRE(dump1.find("Package-md5sum: " + t2_md5sum) != std::string::npos);
+
+        // change one byte of t1 in place, keeping its size, inode and
+        // modification time: its entry gets reused without reading it so
+        // the index keeps the old md5sum
+        char c;
+        t1_data.read(&c, t1_data.size() - 1, 1);
+        c ^= 1;
+        t1_data.write(&c, t1_data.size() - 1, 1);
+        t1_data.write_file(t1);
+        CATCH_REQUIRE(utime(t1.os_filename().get_utf8().c_str(), &times) == 0);
+        CATCH_REQUIRE(t1_data.md5sum() != t1_md5sum);
+
+        // t2 gets modified so it has to be read again
+        tamper_package(t2, "usr/share/doc/t2/copyright", "");
+        t2_data.read_file(t2);
+        CATCH_REQUIRE(t2_data.md5sum() != t2_md5sum);
+
+        CATCH_REQUIRE(system(cmd.c_str()) == 0);
+        const std::string dump2(index_dump(index));
+        CATCH_REQUIRE(dump2.find("Package-md5sum: " + t1_md5sum) != std::string::npos);
+        CATCH_REQUIRE(dump2.find("Package-md5sum: " + t1_data.md5sum()) == std::string::npos);
+        CATCH_REQUIRE(dump2.find("Package-md5sum: " + t2_md5sum) == std::string::npos);
+        CATCH_REQUIRE(dump2.find("Package-md5sum: " + t2_data.md5sum()) != std::string::npos);
+
+        // without the fingerprints, t1 is read again
+        wpkg_filename::uri_filename(index.full_path() + ".fingerprints").os_unlink();
+        CATCH_REQUIRE(system(cmd.c_str()) == 0);
+        const std::string dump3(index_dump(index));
+        CATCH_REQUIRE(dump3.find("Package-md5sum: " + t1_data.md5sum()) != std::string::npos);
+#endif
+    }
+
+    void update_index_diff()
+    {
+#if !defined(MO_WINDOWS)
+        // IMPORTANT: remember that all files are deleted between tests
+
+        wpkg_filename::uri_filename root(unittest::tmp_dir);
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        const wpkg_filename::uri_filename index(repository.append_child("index.tar.gz"));
+
+        std::shared_ptr<wpkg_control::control_file> ctrl_t1(get_new_control_file(__FUNCTION__));
+        ctrl_t1->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t1", ctrl_t1);
+        std::shared_ptr<wpkg_control::control_file> ctrl_t3(get_new_control_file(__FUNCTION__));
+        ctrl_t3->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t3/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t3", ctrl_t3);
+        std::shared_ptr<wpkg_control::control_file> ctrl_t4(get_new_control_file(__FUNCTION__));
+        ctrl_t4->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t4/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t4", ctrl_t4);
+
+        const std::string index_cmd(unittest::wpkg_tool + " --create-index " + wpkg_util::make_safe_console_string(index.path_only())
+                + " --repository " + wpkg_util::make_safe_console_string(repository.path_only()) + " --index-diff");
+        printf("Create packages index: \"%s\"\n", index_cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system(index_cmd.c_str()) == 0);
+
+        server_process server(root, "");
+
+        // the target with the repository as its source
+        target_path.os_mkdir_p();
+        wpkg_filename::uri_filename core_ctrl_filename(root.append_child("core.ctrl"));
+        memfile::memory_file core_ctrl;
+        core_ctrl.create(memfile::memory_file::file_format_other);
+        core_ctrl.printf("Architecture: %s\n", debian_packages_architecture());
+        core_ctrl.printf("Maintainer: Alexis Wilke <alexis@m2osw.com>\n");
+        core_ctrl.write_file(core_ctrl_filename);
+        const std::string root_option(" --root " + wpkg_util::make_safe_console_string(target_path.path_only()));
+        std::string core_cmd(unittest::wpkg_tool + root_option + " --create-admindir " + wpkg_util::make_safe_console_string(core_ctrl_filename.path_only()));
+        printf("Create AdminDir Command: \"%s\"\n", core_cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system(core_cmd.c_str()) == 0);
+        std::stringstream source;
+        source << "wpkg http://127.0.0.1:" << server.get_port() << "/ repository";
+        CATCH_REQUIRE(system((unittest::wpkg_tool + root_option + " --add-sources '" + source.str() + "'").c_str()) == 0);
+
+        const std::string update_cmd(unittest::wpkg_tool + root_option + " --update");
+        const wpkg_filename::uri_filename core(target_path.append_child("var/lib/wpkg/core"));
+        const wpkg_filename::uri_filename local_index(core.append_child("indexes/update-1.index.gz"));
+        const std::string index_200("\"GET /repository/index.tar.gz HTTP/1.1\" 200 ");
+        const std::string index_304("\"GET /repository/index.tar.gz HTTP/1.1\" 304 ");
+        const std::string diff_200("\"GET /repository/index.diff.tar.gz HTTP/1.1\" 200 ");
+
+        // first update, the index gets downloaded
+        CATCH_REQUIRE(system(update_cmd.c_str()) == 0);
+        CATCH_REQUIRE(count_occurrences(server.log(), index_200) == 1);
+        CATCH_REQUIRE(memfile::memory_file::file_md5sum(local_index) == memfile::memory_file::file_md5sum(index));
+
+        // the update.index lines still have 4 fields so older versions
+        // of wpkg can read them, the validators are in their own file
+        {
+            memfile::memory_file update_index;
+            update_index.read_file(core.append_child("update.index"));
+            std::string line;
+            int64_t offset(0);
+            CATCH_REQUIRE(update_index.read_line(offset, line));
+            CATCH_REQUIRE(count_occurrences(line, " ") == 3);
+            wpkgar::wpkgar_repository::update_entry_t entry;
+            entry.from_string(line);
+
+            memfile::memory_file validators;
+            validators.read_file(core.append_child("update.validators"));
+            offset = 0;
+            CATCH_REQUIRE(validators.read_line(offset, line));
+            entry.validators_from_string(line);
+            CATCH_REQUIRE(entry.get_md5sum() == memfile::memory_file::file_md5sum(index));
+            CATCH_REQUIRE(entry.get_repository_md5sum() == entry.get_md5sum());
+            CATCH_REQUIRE(!entry.get_etag().empty());
+        }
+
+        // nothing changed, the conditional GET returns 304
+        CATCH_REQUIRE(system(update_cmd.c_str()) == 0);
+        CATCH_REQUIRE(count_occurrences(server.log(), index_200) == 1);
+        CATCH_REQUIRE(count_occurrences(server.log(), index_304) == 1);
+
+        // add t2 and replace t1 (which both sort before t3), and remove
+        // t4; the update applies the diff
+        std::shared_ptr<wpkg_control::control_file> ctrl_t2(get_new_control_file(__FUNCTION__));
+        ctrl_t2->set_field("Files", "conffiles\n"
+                "/usr/share/doc/t2/copyright 0123456789abcdef0123456789abcdef\n"
+                );
+        create_package("t2", ctrl_t2);
+        ctrl_t1->set_field("Description", "A new build of t1");
+        create_package("t1", ctrl_t1);
+        CATCH_REQUIRE(repository.append_child("t4_" + ctrl_t4->get_field("Version") + "_" + ctrl_t4->get_field("Architecture") + ".deb").os_unlink());
+        CATCH_REQUIRE(system(index_cmd.c_str()) == 0);
+        CATCH_REQUIRE(wpkgar::wpkgar_repository::index_diff_filename(index).exists());
+        CATCH_REQUIRE(system(update_cmd.c_str()) == 0);
+        CATCH_REQUIRE(count_occurrences(server.log(), diff_200) == 1);
+        CATCH_REQUIRE(count_occurrences(server.log(), index_200) == 1);
+
+        // the patched index has the same entries, in the same order, as
+        // the index of the repository; the validators describe our copy
+        const std::string entries(index_entries(index));
+        CATCH_REQUIRE(index_entries(local_index) == entries);
+        CATCH_REQUIRE(entries.find("t1_") < entries.find("t2_"));
+        CATCH_REQUIRE(entries.find("t2_") < entries.find("t3_"));
+        CATCH_REQUIRE(entries.find("t3_") != std::string::npos);
+        CATCH_REQUIRE(entries.find("t4_") == std::string::npos);
+        {
+            wpkgar::wpkgar_manager manager;
+            manager.set_root_path(target_path);
+            manager.set_database_path("var/lib/wpkg");
+            wpkgar::wpkgar_repository r(&manager);
+            const wpkgar::wpkgar_repository::update_entry_vector_t *update_entries(r.load_index_list());
+            CATCH_REQUIRE(update_entries != NULL);
+            CATCH_REQUIRE(update_entries->size() == 1);
+            const wpkgar::wpkgar_repository::update_entry_t& entry((*update_entries)[0]);
+            CATCH_REQUIRE(entry.get_md5sum() == memfile::memory_file::file_md5sum(local_index));
+            wpkg_filename::uri_filename::file_stat st;
+            CATCH_REQUIRE(local_index.os_stat(st) == 0);
+            CATCH_REQUIRE(entry.get_size() == st.get_size());
+            CATCH_REQUIRE(entry.get_repository_md5sum() == memfile::memory_file::file_md5sum(index));
+        }
+
+        // the diff says our index is current, the index is not requested
+        CATCH_REQUIRE(system(update_cmd.c_str()) == 0);
+        CATCH_REQUIRE(count_occurrences(server.log(), diff_200) == 2);
+        CATCH_REQUIRE(count_occurrences(server.log(), "GET /repository/index.tar.gz ") == 2);
+
+        // the index gets recreated without --index-diff, the diff which
+        // describes the previous index is removed and the new index gets
+        // downloaded
+        const std::string plain_index_cmd(index_cmd.substr(0, index_cmd.length() - std::string(" --index-diff").length()));
+        ctrl_t3->set_field("Description", "A new build of t3");
+        create_package("t3", ctrl_t3);
+        CATCH_REQUIRE(system(plain_index_cmd.c_str()) == 0);
+        CATCH_REQUIRE(!wpkgar::wpkgar_repository::index_diff_filename(index).exists());
+        CATCH_REQUIRE(system(update_cmd.c_str()) == 0);
+        CATCH_REQUIRE(count_occurrences(server.log(), index_200) == 2);
+        CATCH_REQUIRE(memfile::memory_file::file_md5sum(local_index) == memfile::memory_file::file_md5sum(index));
+
+        // a diff leading to our index left in the repository once the
+        // index changed again is ignored because its To: field is not
+        // the md5sum of the current index
+        ctrl_t2->set_field("Description", "A new build of t2");
+        create_package("t2", ctrl_t2);
+        CATCH_REQUIRE(system(index_cmd.c_str()) == 0);
+        CATCH_REQUIRE(system(update_cmd.c_str()) == 0);
+        CATCH_REQUIRE(count_occurrences(server.log(), diff_200) == 3);
+        CATCH_REQUIRE(count_occurrences(server.log(), index_200) == 2);
+        memfile::memory_file stale_diff;
+        stale_diff.read_file(wpkgar::wpkgar_repository::index_diff_filename(index));
+        ctrl_t1->set_field("Description", "Another build of t1");
+        create_package("t1", ctrl_t1);
+        CATCH_REQUIRE(system(plain_index_cmd.c_str()) == 0);
+        stale_diff.write_file(wpkgar::wpkgar_repository::index_diff_filename(index));
+        CATCH_REQUIRE(system(update_cmd.c_str()) == 0);
+        CATCH_REQUIRE(count_occurrences(server.log(), index_200) == 3);
+        CATCH_REQUIRE(memfile::memory_file::file_md5sum(local_index) == memfile::memory_file::file_md5sum(index));
+#endif
+    }
+
+    void concurrent_repositories()
+    {
+        // IMPORTANT: remember that all files are deleted between tests
 
-        // make sure that /usr/bin/t1 was removed
         wpkg_filename::uri_filename root(unittest::tmp_dir);
-        wpkg_filename::uri_filename target_path(root.append_child("target"));
-        CATCH_REQUIRE(!target_path.append_child("usr/bin/t1").exists());
+        wpkg_filename::uri_filename repository(root.append_child("repository"));
+        const int max_repositories(6);
 
-        root.append_child("t1").os_rename(root.append_child("t1-save"));
+        // each repository has its own package and a different version
+        // of the "shared" package; "ctop" depends on all of them
+        wpkg_filename::filename_list_t repositories;
+        std::string top_depends("shared (>= 1.1)");
+        for(int r(1); r <= max_repositories; ++r)
+        {
+            std::stringstream rep_name;
+            rep_name << "rep" << r;
+            const wpkg_filename::uri_filename rep(root.append_child(rep_name.str()));
+            rep.os_mkdir_p();
+            repositories.push_back(rep);
+
+            std::stringstream name;
+            name << "c" << r;
+            std::stringstream shared_version;
+            shared_version << "1." << r;
+            std::vector<std::pair<std::string, std::string> > packages;
+            packages.push_back(std::make_pair(name.str(), std::string("1.0")));
+            packages.push_back(std::make_pair(std::string("shared"), shared_version.str()));
+            if(r == max_repositories)
+            {
+                packages.push_back(std::make_pair(std::string("ctop"), std::string("1.0")));
+            }
+            top_depends += ", " + name.str();
+            for(std::vector<std::pair<std::string, std::string> >::const_iterator p(packages.begin()); p != packages.end(); ++p)
+            {
+                std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+                ctrl->set_field("Version", p->second);
+                ctrl->set_field("Files", "conffiles\n"
+                        "/usr/share/doc/" + p->first + "/copyright 0123456789abcdef0123456789abcdef\n"
+                        );
+                if(p->first == "ctop")
+                {
+                    ctrl->set_field("Depends", top_depends);
+                }
+                create_package(p->first, ctrl);
+                const std::string deb(p->first + "_" + ctrl->get_field("Version") + "_" + ctrl->get_field("Architecture") + ".deb");
+                repository.append_child(deb).os_rename(rep.append_child(deb));
+            }
 
-        // now test a downgrade
-        ctrl->set_field("Version", "0.9");
-        ctrl->set_field("Files", "conffiles\n"
-                "/usr/bin/t1 0123456789abcdef0123456789abcdef\n"
-                "/usr/share/doc/t1/copyright 0123456789abcdef0123456789abcdef\n"
-                "/usr/share/doc/t1/info..save 0123456789abcdef0123456789abcdef\n"
-                );
-        create_package("t1", ctrl);
+            // binary indexes and tar indexes
+            std::string cmd(unittest::wpkg_tool);
+            cmd += " --create-index " + wpkg_util::make_safe_console_string(rep.append_child("index.tar.gz").path_only()) + " --repository " + wpkg_util::make_safe_console_string(rep.path_only());
+            if(r <= max_repositories / 2)
+            {
+                cmd += " --binary-index";
+            }
+            printf("Create packages index: \"%s\"\n", cmd.c_str());
+            fflush(stdout);
+            CATCH_REQUIRE(system(cmd.c_str()) == 0);
+        }
 
-        install_package("t1", ctrl, 1);        // --install ("upgrade")
+        // an empty target
+        wpkg_filename::uri_filename target_path(root.append_child("target"));
+        target_path.os_mkdir_p();
+        wpkg_filename::uri_filename core_ctrl_filename(root.append_child("core.ctrl"));
+        memfile::memory_file core_ctrl;
+        core_ctrl.create(memfile::memory_file::file_format_other);
+        core_ctrl.printf("Architecture: %s\n", debian_packages_architecture());
+        core_ctrl.printf("Maintainer: Alexis Wilke <alexis@m2osw.com>\n");
+        core_ctrl.write_file(core_ctrl_filename);
+        std::string core_cmd(unittest::wpkg_tool + " --root " + wpkg_util::make_safe_console_string(target_path.path_only())
+                + " --create-admindir " + wpkg_util::make_safe_console_string(core_ctrl_filename.path_only()));
+        printf("Create AdminDir Command: \"%s\"\n", core_cmd.c_str());
+        fflush(stdout);
+        CATCH_REQUIRE(system(core_cmd.c_str()) == 0);
 
-        // restore the original t1 so we can verify that its files weren't modified
-        root.append_child("t1").os_unlink_rf();
-        root.append_child("t1-save").os_rename(root.append_child("t1"));
-        verify_installed_files("t1");
+        // compare the serial and the concurrent reads a few times
+        const wpkg_filename::uri_filename ctop(repositories.back().append_child("ctop_1.0_" + std::string(debian_packages_architecture()) + ".deb"));
+        const std::string serial(validate_install_list(ctop, repositories, 1));
+        printf("Serial install list:\n%s", serial.c_str());
+        CATCH_REQUIRE(serial.find("shared 1.6 ") != std::string::npos);
+        for(int i(0); i < 5; ++i)
+        {
+            CATCH_REQUIRE(validate_install_list(ctop, repositories, 1) == serial);
+            CATCH_REQUIRE(validate_install_list(ctop, repositories, max_repositories) == serial);
+            CATCH_REQUIRE(validate_install_list(ctop, repositories, 3) == serial);
+        }
     }
 
     void depends_with_simple_packages()
@@ -1566,13 +3489,58 @@ public:
         // if we let it do that we miss on the potential to test validation
         // against field only; however, we want to test the automatic
         // mechanism too once in a while so we randomize the use of that
+        // (with 2 the binary index gets created and used too)
         if(precreate_index)
         {
             std::string cmd(unittest::wpkg_tool);
             cmd += " --create-index " + wpkg_util::make_safe_console_string(repository.full_path()) + "/index.tar.gz --repository " + wpkg_util::make_safe_console_string(repository.full_path());
+            if(precreate_index == 2)
+            {
+                cmd += " --binary-index";
+            }
             printf("Create packages index: \"%s\"\n", cmd.c_str());
             fflush(stdout);
             CATCH_REQUIRE(system(cmd.c_str()) == 0);
+
+            if(precreate_index == 2)
+            {
+                // make sure the binary index matches the tar index and
+                // actually gets used by the installer
+                {
+                    wpkgar::wpkgar_binary_index index;
+                    index.open(repository.append_child("index.wpkgidx"));
+                    CATCH_REQUIRE(index.is_current(repository.append_child("index.tar.gz")));
+                }
+
+                wpkg_filename::uri_filename target_path(root.append_child("target"));
+                target_path.os_mkdir_p();
+                wpkg_filename::uri_filename core_ctrl_filename(repository.append_child("core.ctrl"));
+                memfile::memory_file core_ctrl;
+                core_ctrl.create(memfile::memory_file::file_format_other);
+                core_ctrl.printf("Architecture: %s\n", debian_packages_architecture());
+                core_ctrl.printf("Maintainer: Alexis Wilke <alexis@m2osw.com>\n");
+                core_ctrl.write_file(core_ctrl_filename);
+                std::string core_cmd(unittest::wpkg_tool + " --root " + wpkg_util::make_safe_console_string(target_path.path_only())
+                        + " --create-admindir " + wpkg_util::make_safe_console_string(core_ctrl_filename.path_only()));
+                printf("Create AdminDir Command: \"%s\"\n", core_cmd.c_str());
+                fflush(stdout);
+                CATCH_REQUIRE(system(core_cmd.c_str()) == 0);
+
+                // the repository only gets read to satisfy a dependency,
+                // the dependencies are random so search for a package
+                // with one
+                int validated(1);
+                for(; validated <= max_packages && !has_dependents[validated]; ++validated);
+                CATCH_REQUIRE(validated <= max_packages);
+                std::stringstream strname;
+                strname << "t" << validated;
+                std::shared_ptr<wpkg_control::control_file> ctrl(get_new_control_file(__FUNCTION__));
+                wpkg_filename::filename_list_t repositories;
+                repositories.push_back(repository);
+                std::string messages;
+                validate_install_list(repository.append_child(strname.str() + "_" + ctrl->get_field("Version") + "_" + ctrl->get_field("Architecture") + ".deb"), repositories, 1, &messages);
+                CATCH_REQUIRE(messages.find("Reading binary index file from repository") != std::string::npos);
+            }
         }
 
         // *** INSTALLATION ***
@@ -4348,6 +6316,69 @@ CATCH_TEST_CASE("PackageUnitTests::admindir_package_with_spaces","PackageUnitTes
     test.admindir_package();
 }
 
+CATCH_TEST_CASE("PackageUnitTests::install_roots","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.install_roots();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::install_roots_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.install_roots();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::extractor_output","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.extractor_output();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::extractor_output_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.extractor_output();
+}
+
+#if defined(MO_LINUX)
+// the payload store is only implemented under Linux
+CATCH_TEST_CASE("PackageUnitTests::payload_store","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.payload_store();
+}
+#endif
+
+#if !defined(MO_WINDOWS)
+// the postinst scripts of this test are Unix shell scripts
+CATCH_TEST_CASE("PackageUnitTests::configure_jobs","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.configure_jobs();
+}
+#endif
+
+CATCH_TEST_CASE("PackageUnitTests::verified_md5sums","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.verified_md5sums();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::corrupted_package","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.corrupted_package();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::corrupted_package_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.corrupted_package();
+}
+
 CATCH_TEST_CASE("PackageUnitTests::upgrade_package","PackageUnitTests")
 {
     PackageUnitTests test;
@@ -4361,6 +6392,214 @@ CATCH_TEST_CASE("PackageUnitTests::upgrade_package_with_spaces","PackageUnitTest
     test.upgrade_package();
 }
 
+CATCH_TEST_CASE("PackageUnitTests::upgrade_unchanged_files","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.upgrade_unchanged_files();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::upgrade_unchanged_files_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.upgrade_unchanged_files();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::backup_rollback","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.backup_rollback();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::backup_rollback_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.backup_rollback();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::read_package_once","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.read_package_once();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::read_package_once_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.read_package_once();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::status_transaction","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.status_transaction();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::status_transaction_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.status_transaction();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::tracking_journal","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.tracking_journal();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::tracking_journal_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.tracking_journal();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::prefetched_packages","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.prefetched_packages();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::prefetched_packages_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.prefetched_packages();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::read_package_head","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.read_package_head();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::read_package_head_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.read_package_head();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::files_field","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.files_field();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::files_field_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.files_field();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::legacy_files_field","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.legacy_files_field();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::legacy_files_field_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.legacy_files_field();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::contents_index","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.contents_index();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::contents_index_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.contents_index();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::binary_index_current","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.binary_index_current();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::binary_index_current_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.binary_index_current();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::serve_regenerate_index","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.serve_regenerate_index();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::serve_regenerate_index_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.serve_regenerate_index();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::index_jobs","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.index_jobs();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::index_jobs_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.index_jobs();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::incremental_index","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.incremental_index();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::incremental_index_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.incremental_index();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::update_index_diff","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.update_index_diff();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::update_index_diff_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.update_index_diff();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::concurrent_repositories","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.concurrent_repositories();
+}
+
+CATCH_TEST_CASE("PackageUnitTests::concurrent_repositories_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.concurrent_repositories();
+}
+
 CATCH_TEST_CASE("PackageUnitTests::depends_with_simple_packages","PackageUnitTests")
 {
     PackageUnitTests test;
@@ -4455,6 +6694,19 @@ CATCH_TEST_CASE("PackageUnitTests::sorted_packages_ready_index_with_spaces","Pac
     test.sorted_packages_run(true);
 }
 
+CATCH_TEST_CASE("PackageUnitTests::sorted_packages_binary_index","PackageUnitTests")
+{
+    PackageUnitTests test;
+    test.sorted_packages_run(2);
+}
+
+CATCH_TEST_CASE("PackageUnitTests::sorted_packages_binary_index_with_spaces","PackageUnitTests")
+{
+    PackageUnitTests test;
+    raii_tmp_dir_with_space add_spaces;
+    test.sorted_packages_run(2);
+}
+
 CATCH_TEST_CASE("PackageUnitTests::choices_packages","PackageUnitTests")
 {
     PackageUnitTests test;
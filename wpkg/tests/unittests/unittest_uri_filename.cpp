@@ -22,9 +22,15 @@
 #include "unittest_main.h"
 #include "libdebpackages/wpkg_filename.h"
 #include "libdebpackages/wpkg_util.h"
+#include "libdebpackages/memfile.h"
 
 #include <string.h>
 #include <time.h>
+#include <sstream>
+#include <thread>
+#if defined(MO_LINUX)
+#   include <unistd.h>
+#endif
 #include <catch.hpp>
 
 
@@ -1776,4 +1782,233 @@ CATCH_TEST_CASE("URIFilenameUnitTests::long_filename","URIFilenameUnitTests")
 }
 
 
+CATCH_TEST_CASE("URIFilenameUnitTests::stat_cache","URIFilenameUnitTests")
+{
+    // make sure that the temporary directory is not empty, may be relative
+    if(unittest::tmp_dir.empty())
+    {
+        fprintf(stderr, "\nerror:unittest_uri_filename: a temporary directory is required to run the stat_cache() unit test.\n");
+        throw std::runtime_error("--tmp <directory> missing");
+    }
+
+    wpkg_filename::uri_filename root(wpkg_filename::uri_filename(unittest::tmp_dir).append_child("stat_cache"));
+    root.os_unlink_rf();
+
+    CATCH_REQUIRE(!wpkg_filename::os_stat_cache::is_active());
+    {
+        wpkg_filename::os_stat_cache cache;
+        CATCH_REQUIRE(wpkg_filename::os_stat_cache::is_active());
+
+        // a missing file is remembered as missing...
+        const wpkg_filename::uri_filename dir(root.append_child("a/b"));
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(dir).exists());
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(dir).exists());
+
+        // ...until we create it
+        dir.os_mkdir_p();
+        CATCH_REQUIRE(wpkg_filename::uri_filename(dir).is_dir());
+        CATCH_REQUIRE(wpkg_filename::uri_filename(root.append_child("a")).is_dir());
+
+        // writing a file updates its size
+        const wpkg_filename::uri_filename file(dir.append_child("file.txt"));
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(file).exists());
+        memfile::memory_file data;
+        data.create(memfile::memory_file::file_format_other);
+        data.write("0123456789", 0, 10);
+        data.write_file(file);
+        wpkg_filename::uri_filename::file_stat s;
+        CATCH_REQUIRE(wpkg_filename::uri_filename(file).os_stat(s) == 0);
+        CATCH_REQUIRE(s.get_size() == 10);
+        data.write("0123456789", 10, 10);
+        data.write_file(file);
+        CATCH_REQUIRE(wpkg_filename::uri_filename(file).os_stat(s) == 0);
+        CATCH_REQUIRE(s.get_size() == 20);
+
+        // renaming a directory invalidates its children
+        const wpkg_filename::uri_filename moved(root.append_child("c"));
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(moved).exists());
+        root.append_child("a").os_rename(moved);
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(file).exists());
+        CATCH_REQUIRE(wpkg_filename::uri_filename(moved.append_child("b/file.txt")).is_reg());
+
+        // deleting a file is seen too
+        moved.append_child("b/file.txt").os_unlink();
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(moved.append_child("b/file.txt")).exists());
+        moved.os_unlink_rf();
+        CATCH_REQUIRE(!wpkg_filename::uri_filename(moved.append_child("b")).exists());
+    }
+    CATCH_REQUIRE(!wpkg_filename::os_stat_cache::is_active());
+
+    root.os_unlink_rf();
+}
+
+
+CATCH_TEST_CASE("URIFilenameUnitTests::stat_cache_threads","URIFilenameUnitTests")
+{
+    // make sure that the temporary directory is not empty, may be relative
+    if(unittest::tmp_dir.empty())
+    {
+        fprintf(stderr, "\nerror:unittest_uri_filename: a temporary directory is required to run the stat_cache_threads() unit test.\n");
+        throw std::runtime_error("--tmp <directory> missing");
+    }
+
+    wpkg_filename::uri_filename root(wpkg_filename::uri_filename(unittest::tmp_dir).append_child("stat_cache_threads"));
+    root.os_unlink_rf();
+
+    // each thread creates, checks, and deletes its own files while the
+    // others do the same in the same cache
+    const int thread_count(8);
+    const int file_count(200);
+    std::vector<int> errors(thread_count, 0);
+    {
+        wpkg_filename::os_stat_cache cache;
+        std::vector<std::thread> threads;
+        for(int t(0); t < thread_count; ++t)
+        {
+            threads.push_back(std::thread([&root, &errors, t, file_count]()
+                {
+                    std::stringstream name;
+                    name << "t" << t;
+                    const wpkg_filename::uri_filename dir(root.append_child(name.str()));
+                    dir.os_mkdir_p();
+                    for(int i(0); i < file_count; ++i)
+                    {
+                        std::stringstream filename;
+                        filename << "f" << i;
+                        const wpkg_filename::uri_filename file(dir.append_child(filename.str()));
+                        if(wpkg_filename::uri_filename(file).exists())
+                        {
+                            ++errors[t];
+                        }
+                        memfile::memory_file data;
+                        data.create(memfile::memory_file::file_format_other);
+                        data.write("0123456789", 0, 1 + i % 10);
+                        data.write_file(file);
+                        wpkg_filename::uri_filename::file_stat s;
+                        if(wpkg_filename::uri_filename(file).os_stat(s) != 0
+                        || s.get_size() != 1 + i % 10)
+                        {
+                            ++errors[t];
+                        }
+                        if(i % 2 == 0)
+                        {
+                            file.os_unlink();
+                            if(wpkg_filename::uri_filename(file).exists())
+                            {
+                                ++errors[t];
+                            }
+                        }
+                    }
+                    // the recursive invalidation walks the map while the
+                    // other threads modify it
+                    wpkg_filename::os_stat_cache::invalidate(dir, true);
+                    if(!wpkg_filename::uri_filename(dir.append_child("f1")).is_reg())
+                    {
+                        ++errors[t];
+                    }
+                }));
+        }
+        for(std::vector<std::thread>::iterator it(threads.begin()); it != threads.end(); ++it)
+        {
+            it->join();
+        }
+    }
+    for(int t(0); t < thread_count; ++t)
+    {
+        CATCH_REQUIRE(errors[t] == 0);
+    }
+
+    root.os_unlink_rf();
+}
+
+
+CATCH_TEST_CASE("URIFilenameUnitTests::stat_cache_prefetch","URIFilenameUnitTests")
+{
+    // make sure that the temporary directory is not empty, may be relative
+    if(unittest::tmp_dir.empty())
+    {
+        fprintf(stderr, "\nerror:unittest_uri_filename: a temporary directory is required to run the stat_cache_prefetch() unit test.\n");
+        throw std::runtime_error("--tmp <directory> missing");
+    }
+
+    wpkg_filename::uri_filename root(wpkg_filename::uri_filename(unittest::tmp_dir).append_child("stat_cache_prefetch"));
+    root.os_unlink_rf();
+
+    // enough directories for prefetch() to use several threads, plus
+    // missing files in existing and missing directories
+    std::vector<wpkg_filename::uri_filename> filenames;
+    for(int d(0); d < 40; ++d)
+    {
+        std::stringstream dirname;
+        dirname << "d" << d;
+        const wpkg_filename::uri_filename dir(root.append_child(dirname.str()));
+        if(d % 10 != 9)
+        {
+            dir.os_mkdir_p();
+        }
+        for(int f(0); f < 5; ++f)
+        {
+            std::stringstream filename;
+            filename << "f" << f;
+            const wpkg_filename::uri_filename file(dir.append_child(filename.str()));
+            if(d % 10 != 9 && f != 4)
+            {
+                memfile::memory_file data;
+                data.create(memfile::memory_file::file_format_other);
+                data.write("0123456789", 0, 1 + (d + f) % 10);
+                data.write_file(file);
+            }
+            filenames.push_back(file);
+        }
+        filenames.push_back(dir);
+    }
+
+    // the serial results, without the cache
+    CATCH_REQUIRE(!wpkg_filename::os_stat_cache::is_active());
+    std::vector<int> serial_results;
+    std::vector<wpkg_filename::uri_filename::file_stat> serial_stats;
+    for(std::vector<wpkg_filename::uri_filename>::const_iterator it(filenames.begin()); it != filenames.end(); ++it)
+    {
+        wpkg_filename::uri_filename::file_stat s;
+        serial_results.push_back(wpkg_filename::uri_filename(*it).os_stat(s));
+        serial_stats.push_back(s);
+    }
+
+    {
+        wpkg_filename::os_stat_cache cache;
+        wpkg_filename::os_stat_cache::prefetch(filenames);
+
+#if defined(MO_LINUX)
+        // prefetch() saved everything in the cache: the files are still
+        // seen after being deleted behind the cache back
+        for(std::vector<wpkg_filename::uri_filename>::const_iterator it(filenames.begin()); it != filenames.end(); ++it)
+        {
+            if(wpkg_filename::uri_filename(*it).is_reg())
+            {
+                unlink(it->os_filename().get_utf8().c_str());
+            }
+        }
+#endif
+
+        for(size_t i(0); i < filenames.size(); ++i)
+        {
+            wpkg_filename::uri_filename::file_stat s;
+            CATCH_REQUIRE(wpkg_filename::uri_filename(filenames[i]).os_stat(s) == serial_results[i]);
+            CATCH_REQUIRE(s.is_valid() == serial_stats[i].is_valid());
+            if(s.is_valid())
+            {
+                CATCH_REQUIRE(s.get_dev() == serial_stats[i].get_dev());
+                CATCH_REQUIRE(s.get_inode() == serial_stats[i].get_inode());
+                CATCH_REQUIRE(s.get_mode() == serial_stats[i].get_mode());
+                CATCH_REQUIRE(s.get_size() == serial_stats[i].get_size());
+                CATCH_REQUIRE(s.get_mtime() == serial_stats[i].get_mtime());
+                CATCH_REQUIRE(s.get_mtime_nano() == serial_stats[i].get_mtime_nano());
+            }
+        }
+    }
+
+    root.os_unlink_rf();
+}
+
+
 // vim: ts=4 sw=4 et
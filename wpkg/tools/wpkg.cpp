@@ -27,12 +27,16 @@
  * supported by wpkg. However, most of the implementation is found in the
  * libdebpackages library.
  */
+#include    "libdebpackages/wpkgar_binary_index.h"
+#include    "libdebpackages/wpkgar_contents_index.h"
 #include    "libdebpackages/wpkgar_build.h"
 #include    "libdebpackages/wpkgar_install.h"
 #include    "libdebpackages/wpkgar_remove.h"
 #include    "libdebpackages/wpkgar_repository.h"
 #include    "libdebpackages/wpkgar_tracker.h"
 #include    "libdebpackages/wpkg_util.h"
+#include    "libdebpackages/wpkg_http.h"
+#include    "libdebpackages/wpkg_extract.h"
 #include    "libdebpackages/wpkg_copyright.h"
 #include    "libdebpackages/wpkg_stream.h"
 #include    "libdebpackages/advgetopt.h"
@@ -48,13 +52,19 @@
 #include    <errno.h>
 #include    <signal.h>
 #include    <algorithm>
+#include    <atomic>
+#include    <chrono>
 #ifdef MO_WINDOWS
 #   include    <time.h>
 #else
+#   include    <dirent.h>
 #   include    <unistd.h>
+#   include    <sys/wait.h>
 #endif
 #include    <iostream>
+#include    <mutex>
 #include    <sstream>
+#include    <thread>
 
 #ifdef _MSC_VER
 // "unknown pragma"
@@ -304,6 +314,8 @@ public:
         command_canonicalize_version_misspelled,
         command_cflags,
         command_check_install,
+        command_collect_payload_store,
+        command_compact_database,
         command_compare_versions,
         command_compress,
         command_configure,
@@ -353,6 +365,8 @@ public:
         command_remove_sources,
         command_rollback,
         command_search,
+        command_search_index,
+        command_serve_repository,
         command_set_selection,
         command_show,
         command_package_status,
@@ -537,6 +551,22 @@ const advgetopt::getopt::option wpkg_options[] =
         "check that a set of packages can be installed",
         advgetopt::getopt::required_multiple_argument
     },
+    {
+        '\0',
+        0,
+        "collect-payload-store",
+        NULL,
+        "delete the files of a payload store (see --payload-store) which are not hard linked to any installed file anymore",
+        advgetopt::getopt::required_argument
+    },
+    {
+        '\0',
+        0,
+        "compact-database",
+        NULL,
+        "compress the data of the installed packages in the database in the seekable zstd format used by this version of wpkg to save the packages it installs; older versions of wpkg cannot read packages saved in that format",
+        advgetopt::getopt::no_argument
+    },
     {
         '\0',
         0,
@@ -977,6 +1007,22 @@ const advgetopt::getopt::option wpkg_options[] =
         "search installed packages for the specified file",
         advgetopt::getopt::required_argument
     },
+    {
+        '\0',
+        0,
+        "search-index",
+        NULL,
+        "search the contents index of the specified repositories for the packages including the specified files",
+        advgetopt::getopt::required_multiple_argument
+    },
+    {
+        '\0',
+        0,
+        "serve-repository",
+        NULL,
+        "serve the specified repository directory over HTTP",
+        advgetopt::getopt::required_argument
+    },
     {
         '\0',
         0,
@@ -1138,6 +1184,14 @@ const advgetopt::getopt::option wpkg_options[] =
         "define the administration directory (i.e. wpkg database folder), default is /var/lib/wpkg",
         advgetopt::getopt::required_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "binary-index",
+        NULL,
+        "with --create-index, also save a binary index (index.tar.gz becomes index.wpkgidx) which --install reads without parsing all the control files; the control files are compressed with zstd unless --compressor none is used",
+        advgetopt::getopt::no_argument
+    },
     {
         '\0',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1170,6 +1224,22 @@ const advgetopt::getopt::option wpkg_options[] =
         "type of compression to use (gzip, bzip2, lzma, xz, zstd, none); default is best available",
         advgetopt::getopt::required_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "configure-jobs",
+        NULL,
+        "with --install and --configure, run the postinst scripts of up to that many packages in parallel when they do not depend on each other; the output of the scripts is printed once each package is configured",
+        advgetopt::getopt::required_argument
+    },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "contents-index",
+        NULL,
+        "with --create-index, also create a contents index (index.contents.gz) listing the files of all the packages for --search-index",
+        advgetopt::getopt::no_argument
+    },
     {
         'D',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1218,6 +1288,14 @@ const advgetopt::getopt::option wpkg_options[] =
         "add one exception to the list of files not to add in a data.tar.gz file (i.e. \".svn\" or \"*.bak\")",
         advgetopt::getopt::required_multiple_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "fetch-jobs",
+        NULL,
+        "with --update or when installing from repositories, read that many repository indexes in parallel; the default is 4",
+        advgetopt::getopt::required_argument
+    },
     {
         'V',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1370,6 +1448,30 @@ const advgetopt::getopt::option wpkg_options[] =
         "silently exit with 0 status when there are no files to package in a build process",
         advgetopt::getopt::no_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "incremental",
+        NULL,
+        "with --create-index, reuse the entries of the existing index for the packages which size, modification time and inode did not change; the fingerprints are saved in <index>.fingerprints",
+        advgetopt::getopt::no_argument
+    },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "index-diff",
+        NULL,
+        "with --create-index, also save the differences with the previous index so clients can --update without downloading the whole index",
+        advgetopt::getopt::no_argument
+    },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "index-jobs",
+        NULL,
+        "with --create-index, read that many packages in parallel; the default is one per processor",
+        advgetopt::getopt::required_argument
+    },
     {
         '\0',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1394,6 +1496,14 @@ const advgetopt::getopt::option wpkg_options[] =
         "let wpkg know that it is interactive",
         advgetopt::getopt::required_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "listen",
+        NULL,
+        "with --serve-repository, the address and port to listen on (addr:port, addr, or port); the default is 0.0.0.0:8080; port 0 uses any free port",
+        advgetopt::getopt::required_argument
+    },
     {
         '\0',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1602,6 +1712,14 @@ const advgetopt::getopt::option wpkg_options[] =
         "make the output use a XML formatted message instead of a one line message",
         advgetopt::getopt::no_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "package-cache-size",
+        NULL,
+        "maximum size in Mb of the cache (core/cache in the administration directory) where packages from remote repositories are downloaded before an installation; the default is 1024, use 0 to disable the cache",
+        advgetopt::getopt::required_argument
+    },
     {
         '\0',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1610,6 +1728,14 @@ const advgetopt::getopt::option wpkg_options[] =
         "while building a package, warn about paths that are over this length (range 64 to 65536); to get an error instead of a warning use --enforce-path-length-limit instead",
         advgetopt::getopt::required_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "payload-store",
+        NULL,
+        "directory where the files being installed are saved by md5sum so other installations (any root on the same file system) can link to them instead of writing them again; implies --share-files hardlink unless --share-files is used; see also --collect-payload-store",
+        advgetopt::getopt::required_argument
+    },
     {
         'q',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1762,6 +1888,14 @@ const advgetopt::getopt::option wpkg_options[] =
         "prevent the action of the --force-vendor option",
         advgetopt::getopt::no_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "regenerate-index",
+        NULL,
+        "with --serve-repository, create the index of a directory again when it is requested and its packages changed",
+        advgetopt::getopt::no_argument
+    },
     {
         '\0',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1778,6 +1912,22 @@ const advgetopt::getopt::option wpkg_options[] =
         "define the root directory (i.e. where everything is installed), default is /",
         advgetopt::getopt::required_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "roots",
+        NULL,
+        "with --install, install the same packages in each one of these root directories; the dependencies are resolved once per distinct set of installed packages",
+        advgetopt::getopt::required_multiple_argument
+    },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "roots-jobs",
+        NULL,
+        "the maximum number of --roots installed in parallel; default is the number of processors",
+        advgetopt::getopt::required_argument
+    },
     {
         '\0',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1786,6 +1936,22 @@ const advgetopt::getopt::option wpkg_options[] =
         "run the unit tests of a package right after building a package from its source package and before creating its binary packages",
         advgetopt::getopt::no_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "serve-jobs",
+        NULL,
+        "with --serve-repository, serve up to that many connections simultaneously; the default is 16",
+        advgetopt::getopt::required_argument
+    },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "share-files",
+        NULL,
+        "with --roots, files that are identical in several roots are shared instead of being written again (hardlink or reflink); configuration files are never shared; WARNING: a file modified in place through a hard link is modified in all the roots",
+        advgetopt::getopt::required_argument
+    },
     {
         '\0',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -1810,6 +1976,14 @@ const advgetopt::getopt::option wpkg_options[] =
         "skip installing packages that are already installed (i.e. version is the same)",
         advgetopt::getopt::no_argument
     },
+    {
+        '\0',
+        advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
+        "skip-unchanged-files",
+        NULL,
+        "when upgrading, do not rewrite files which md5sum did not change between both versions of the package",
+        advgetopt::getopt::no_argument
+    },
     {
         '\0',
         advgetopt::getopt::GETOPT_FLAG_ENVIRONMENT_VARIABLE | advgetopt::getopt::GETOPT_FLAG_CONFIGURATION_FILE,
@@ -2413,6 +2587,14 @@ command_line::command_line(int argc, char *argv[], std::vector<std::string> conf
     {
         set_command(command_check_install);
     }
+    if(f_opt.is_defined("collect-payload-store"))
+    {
+        set_command(command_collect_payload_store);
+    }
+    if(f_opt.is_defined("compact-database"))
+    {
+        set_command(command_compact_database);
+    }
     if(f_opt.is_defined("compare-versions"))
     {
         set_command(command_compare_versions);
@@ -2609,6 +2791,14 @@ command_line::command_line(int argc, char *argv[], std::vector<std::string> conf
     {
         set_command(command_search);
     }
+    if(f_opt.is_defined("search-index"))
+    {
+        set_command(command_search_index);
+    }
+    if(f_opt.is_defined("serve-repository"))
+    {
+        set_command(command_serve_repository);
+    }
     if(f_opt.is_defined("set-selection"))
     {
         set_command(command_set_selection);
@@ -2954,7 +3144,24 @@ void define_wpkg_running_and_copy(const command_line& cl, wpkg_filename::uri_fil
     }
 }
 
-void init_manager(command_line& cl, wpkgar::wpkgar_manager& manager, const std::string& option)
+/** \brief One of the roots of an --install --roots command.
+ *
+ * When installing the same packages in several roots, the first root
+ * of each distinct state (i.e. same installed packages) gets validated
+ * as usual. The packages selected by that validation are saved in this
+ * structure so the other roots with the same state can be installed
+ * without searching the repositories again.
+ */
+struct root_install_t
+{
+    std::string                 f_root;
+    std::vector<std::string>    f_explicit;
+    std::vector<std::string>    f_implicit;
+    controlled_vars::fbool_t    f_resolved;
+};
+
+
+void init_manager(command_line& cl, wpkgar::wpkgar_manager& manager, const std::string& option, const root_install_t *root = NULL)
 {
     // add self so we can deal with the case when we're upgrading ourself
     //
@@ -2991,7 +3198,7 @@ void init_manager(command_line& cl, wpkgar::wpkgar_manager& manager, const std::
     manager.set_interrupt_handler(&interrupt);
 
     // all these directories have a default if not specified on the command line
-    manager.set_root_path(cl.opt().get_string("root"));
+    manager.set_root_path(root == NULL ? cl.opt().get_string("root") : root->f_root);
     manager.set_inst_path(cl.opt().get_string("instdir"));
     manager.set_database_path(cl.opt().get_string("admindir"));
 
@@ -3009,7 +3216,11 @@ void init_manager(command_line& cl, wpkgar::wpkgar_manager& manager, const std::
             .action("log");
     }
 
-    if(cl.opt().is_defined("repository"))
+    if(root != NULL && root->f_resolved)
+    {
+        // the packages were already selected, no repository needed
+    }
+    else if(cl.opt().is_defined("repository"))
     {
         std::string repositories("repositories ");
         int max_repository(cl.opt().size("repository"));
@@ -3034,15 +3245,47 @@ void init_manager(command_line& cl, wpkgar::wpkgar_manager& manager, const std::
 }
 
 
-void init_installer
+void init_file_sharing(command_line& cl)
+{
+    if(cl.opt().is_defined("share-files"))
+    {
+        const std::string share(cl.opt().get_string("share-files"));
+        if(share == "hardlink")
+        {
+            wpkg_extract::extractor::set_share_mode(wpkg_extract::extractor::share_mode_hardlink);
+        }
+        else if(share == "reflink")
+        {
+            wpkg_extract::extractor::set_share_mode(wpkg_extract::extractor::share_mode_reflink);
+        }
+        else
+        {
+            throw std::runtime_error("--share-files expects \"hardlink\" or \"reflink\"");
+        }
+    }
+    if(cl.opt().is_defined("payload-store"))
+    {
+        wpkg_extract::extractor::set_payload_store(cl.opt().get_string("payload-store"));
+        if(wpkg_extract::extractor::get_share_mode() == wpkg_extract::extractor::share_mode_none)
+        {
+            // the store is useless without sharing
+            wpkg_extract::extractor::set_share_mode(wpkg_extract::extractor::share_mode_hardlink);
+        }
+    }
+}
+
+
+bool init_installer
     ( command_line& cl
     , wpkgar::wpkgar_manager& manager
     , wpkgar::wpkgar_install& pkg_install
     , const std::string& option
     , const wpkg_filename::uri_filename& package_name = wpkg_filename::uri_filename()
+    , const root_install_t *root = NULL
     )
 {
-    init_manager(cl, manager, option);
+    init_manager(cl, manager, option, root);
+    init_file_sharing(cl);
 
     const int max(option == "upgrade" ? cl.size() : cl.opt().size(option));
     if(max == 0)
@@ -3131,7 +3374,20 @@ void init_installer
 
     // some additional parameters
     pkg_install.set_parameter(wpkgar::wpkgar_install::wpkgar_install_skip_same_version, cl.opt().is_defined("skip-same-version"));
+    pkg_install.set_parameter(wpkgar::wpkgar_install::wpkgar_install_skip_unchanged_files, cl.opt().is_defined("skip-unchanged-files"));
     pkg_install.set_parameter(wpkgar::wpkgar_install::wpkgar_install_recursive, cl.opt().is_defined("recursive"));
+    if(cl.opt().is_defined("configure-jobs"))
+    {
+        pkg_install.set_configure_jobs(cl.opt().get_long("configure-jobs", 0, 1, 1024));
+    }
+    if(cl.opt().is_defined("fetch-jobs"))
+    {
+        pkg_install.set_fetch_jobs(cl.opt().get_long("fetch-jobs", 0, 1, 1024));
+    }
+    if(cl.opt().is_defined("package-cache-size"))
+    {
+        pkg_install.set_package_cache_size(static_cast<int64_t>(cl.opt().get_long("package-cache-size", 0, 0, 1024 * 1024)) * 1024 * 1024);
+    }
 
     // add the list of verify-fields expressions if any
     if(cl.opt().is_defined("verify-fields"))
@@ -3146,7 +3402,19 @@ void init_installer
     try
     {
         // add the list of package names
-        if(package_name.empty())
+        if(root != NULL && root->f_resolved)
+        {
+            // another root with the same state was already validated
+            for(std::vector<std::string>::const_iterator it(root->f_explicit.begin()); it != root->f_explicit.end(); ++it)
+            {
+                pkg_install.add_package(*it, cl.opt().is_defined("force-reinstall"));
+            }
+            for(std::vector<std::string>::const_iterator it(root->f_implicit.begin()); it != root->f_implicit.end(); ++it)
+            {
+                pkg_install.add_implicit_package(*it);
+            }
+        }
+        else if(package_name.empty())
         {
             for(int i(0); i < max; ++i)
             {
@@ -3160,6 +3428,11 @@ void init_installer
                         .level(wpkg_output::level_warning)
                         .module(wpkg_output::module_configure_package)
                         .action("install-validation");
+                if(root != NULL)
+                {
+                    // other roots may still need to be installed
+                    return false;
+                }
                 exit(0);
             }
             //
@@ -3182,8 +3455,14 @@ void init_installer
                 .level(wpkg_output::level_fatal)
                 .module(wpkg_output::module_configure_package)
                 .action("install-validation");
+        if(root != NULL)
+        {
+            return false;
+        }
         exit(1);
     }
+
+    return true;
 }
 
 
@@ -3244,11 +3523,14 @@ void check_install(command_line& cl)
     exit(result ? 0 : 1);
 }
 
-void install(command_line& cl, const wpkg_filename::uri_filename package_name = wpkg_filename::uri_filename(), const std::string& option = "install")
+void install(command_line& cl, const wpkg_filename::uri_filename package_name = wpkg_filename::uri_filename(), const std::string& option = "install", root_install_t *root = NULL)
 {
     wpkgar::wpkgar_manager manager;
     wpkgar::wpkgar_install pkg_install(&manager);
-    init_installer(cl, manager, pkg_install, option, package_name);
+    if(!init_installer(cl, manager, pkg_install, option, package_name, root))
+    {
+        return;
+    }
     pkg_install.set_installing();
 
     if(cl.opt().is_defined("accept-special-windows-filename"))
@@ -3258,7 +3540,26 @@ void install(command_line& cl, const wpkg_filename::uri_filename package_name =
 
     wpkgar::wpkgar_lock lock_wpkg(&manager, "Installing");
 
-    if( pkg_install.validate() && !cl.dry_run())
+    const bool valid(pkg_install.validate());
+    if(valid && root != NULL && !root->f_resolved)
+    {
+        // save the selection for the other roots with the same state
+        wpkgar::wpkgar_install::install_info_list_t install_list = pkg_install.get_install_list();
+        for(wpkgar::wpkgar_install::install_info_list_t::const_iterator it(install_list.begin()); it != install_list.end(); ++it)
+        {
+            if(it->get_install_type() == wpkgar::wpkgar_install::install_info_t::install_type_explicit)
+            {
+                root->f_explicit.push_back(it->get_filename());
+            }
+            else
+            {
+                root->f_implicit.push_back(it->get_filename());
+            }
+        }
+        root->f_resolved = true;
+    }
+
+    if(valid && !cl.dry_run())
     {
         {
             wpkgar::wpkgar_install::install_info_list_t install_list = pkg_install.get_install_list();
@@ -3314,6 +3615,15 @@ void install(command_line& cl, const wpkg_filename::uri_filename package_name =
             }
         }
 
+        if(manager.is_self() && root != NULL)
+        {
+            wpkg_output::log("wpkg cannot upgrade itself while installing in several roots (--roots); upgrade wpkg first")
+                .level(wpkg_output::level_fatal)
+                .module(wpkg_output::module_validate_installation)
+                .package("wpkg")
+                .action("upgrade-initialization");
+            return;
+        }
         if(manager.is_self() && !cl.opt().is_defined("running-copy"))
         {
             // in this case we drop the lock; our copy will re-create a lock as required
@@ -3435,6 +3745,337 @@ void install(command_line& cl, const wpkg_filename::uri_filename package_name =
 }
 
 
+/** \brief Compute a signature of the state of a root.
+ *
+ * Two roots with the same installed packages (name, version, selection
+ * and status), the same architecture and the same sources get the same
+ * packages selected by the installation validation. This function
+ * returns an md5 sum representing that state.
+ *
+ * \param[in] cl  The command line.
+ * \param[in] root  The root to check.
+ *
+ * \return The md5 sum of the state of the root.
+ */
+std::string root_state(command_line& cl, const root_install_t& root)
+{
+    wpkgar::wpkgar_manager manager;
+    init_manager(cl, manager, "roots", &root);
+    wpkgar::wpkgar_lock lock_wpkg(&manager, "Listing");
+
+    std::stringstream state;
+    manager.load_package("core");
+    state << "Architecture:" << manager.get_field("core", "Architecture") << "\n";
+
+    wpkgar::wpkgar_manager::package_list_t list;
+    manager.list_installed_packages(list);
+    std::sort(list.begin(), list.end());
+    for(wpkgar::wpkgar_manager::package_list_t::const_iterator it(list.begin());
+            it != list.end(); ++it)
+    {
+        manager.load_package(*it);
+        state << *it
+              << " " << manager.get_field(*it, "Version")
+              << " " << static_cast<int>(manager.package_status(*it));
+        if(manager.field_is_defined(*it, wpkg_control::control_file::field_xselection_factory_t::canonicalized_name()))
+        {
+            state << " " << manager.get_field(*it, wpkg_control::control_file::field_xselection_factory_t::canonicalized_name());
+        }
+        state << "\n";
+    }
+
+    const wpkg_filename::filename_list_t& repositories(manager.get_repositories());
+    for(wpkg_filename::filename_list_t::const_iterator it(repositories.begin());
+            it != repositories.end(); ++it)
+    {
+        state << "Repository:" << it->full_path() << "\n";
+    }
+
+    const std::string str(state.str());
+    md5::md5sum sum;
+    sum.push_back(reinterpret_cast<const uint8_t *>(str.c_str()), str.length());
+    return sum.sum();
+}
+
+
+/** \brief Install one root of an --install --roots command.
+ *
+ * The errors are counted per root so one failure does not prevent the
+ * other roots from being installed.
+ *
+ * \param[in] cl  The command line.
+ * \param[in,out] root  The root to install.
+ *
+ * \return true if the installation succeeded.
+ */
+bool install_root(command_line& cl, root_install_t& root)
+{
+    try
+    {
+        install(cl, wpkg_filename::uri_filename(), "install", &root);
+    }
+    catch(const std::exception& e)
+    {
+        wpkg_output::log("%1")
+                .arg(e.what())
+            .level(wpkg_output::level_fatal)
+            .action("exception");
+    }
+    if(g_output.error_count() != 0)
+    {
+        g_output.reset_error_count();
+        return false;
+    }
+    return true;
+}
+
+
+#ifndef MO_WINDOWS
+/** \brief Check whether this process runs a single thread.
+ *
+ * Only the calling thread exists in the child of a fork(). If another
+ * thread held a lock at the time (i.e. the malloc() lock) the child
+ * would block forever on it, so the roots only get installed in child
+ * processes when no other thread runs.
+ *
+ * Under Linux the threads are listed in /proc/self/task. On other
+ * systems the function assumes that the threads started by the library
+ * were all joined, which is the case once install() returned.
+ *
+ * \return true if no other thread is running.
+ */
+bool single_threaded()
+{
+#if defined(MO_LINUX)
+    DIR *d(opendir("/proc/self/task"));
+    if(d == NULL)
+    {
+        return true;
+    }
+    int count(0);
+    for(struct dirent *e(readdir(d)); e != NULL; e = readdir(d))
+    {
+        if(e->d_name[0] != '.')
+        {
+            ++count;
+        }
+    }
+    closedir(d);
+    return count <= 1;
+#else
+    return true;
+#endif
+}
+#endif
+
+
+/** \brief Install the same packages in several roots.
+ *
+ * This function implements --install with --roots. The roots are
+ * grouped by state (see root_state()). The first root of each group
+ * is installed as usual. The packages selected for that root are then
+ * installed in the other roots of the group without any further search
+ * in the repositories. Those other roots are installed in parallel in
+ * child processes (up to --roots-jobs at a time.) The child processes
+ * are created once all the threads started while installing the first
+ * roots were joined; if a thread still runs, the other roots are
+ * installed one after another instead.
+ *
+ * The data.tar of each package is decompressed only once and shared
+ * between all the roots. With --share-files, files that are identical
+ * are hard linked or cloned instead of being written again.
+ *
+ * \param[in] cl  The command line.
+ */
+void install_roots(command_line& cl)
+{
+    if(cl.opt().is_defined("tracking-journal"))
+    {
+        throw std::runtime_error("--tracking-journal cannot be used with --roots");
+    }
+
+    init_file_sharing(cl);
+    wpkgar::wpkgar_manager::share_data_tar(true);
+
+    long jobs(0);
+    if(cl.opt().is_defined("roots-jobs"))
+    {
+        jobs = cl.opt().get_long("roots-jobs", 0, 1, 1024);
+    }
+    else
+    {
+        jobs = std::max(std::thread::hardware_concurrency(), 1U);
+    }
+
+    // group the roots by state, keeping the order of the command line
+    typedef std::vector<root_install_t> root_list_t;
+    typedef std::map<std::string, int> state_map_t;
+    root_list_t roots;
+    std::vector<int> leaders;
+    state_map_t states;
+    bool failed(false);
+    const int max(cl.opt().size("roots"));
+    for(int i(0); i < max; ++i)
+    {
+        root_install_t root;
+        root.f_root = cl.opt().get_string("roots", i);
+        std::string state;
+        try
+        {
+            state = root_state(cl, root);
+        }
+        catch(const std::exception& e)
+        {
+            wpkg_output::log("root %1 cannot be installed: %2")
+                    .quoted_arg(root.f_root)
+                    .arg(e.what())
+                .level(wpkg_output::level_error)
+                .action("install-validation");
+            failed = true;
+            continue;
+        }
+        roots.push_back(root);
+        state_map_t::const_iterator it(states.find(state));
+        if(it == states.end())
+        {
+            states[state] = static_cast<int>(roots.size() - 1);
+            leaders.push_back(static_cast<int>(roots.size() - 1));
+        }
+        else
+        {
+            // remember the leader of this state
+            leaders.push_back(it->second);
+        }
+    }
+
+    // install the first root of each state in this process; the errors
+    // are counted per root so one failure does not prevent the other
+    // roots from being installed
+    for(size_t i(0); i < roots.size(); ++i)
+    {
+        if(leaders[i] == static_cast<int>(i))
+        {
+            wpkg_output::log("installing in root %1")
+                    .quoted_arg(roots[i].f_root)
+                .level(wpkg_output::level_info)
+                .action("install-validation");
+            if(!install_root(cl, roots[i]))
+            {
+                failed = true;
+            }
+        }
+    }
+
+    // install the other roots reusing the selection of their leader
+    std::vector<size_t> followers;
+    for(size_t i(0); i < roots.size(); ++i)
+    {
+        if(leaders[i] != static_cast<int>(i))
+        {
+            const root_install_t& leader(roots[leaders[i]]);
+            roots[i].f_explicit = leader.f_explicit;
+            roots[i].f_implicit = leader.f_implicit;
+            roots[i].f_resolved = leader.f_resolved;
+            followers.push_back(i);
+        }
+    }
+
+#ifdef MO_WINDOWS
+    // no fork() under MS-Windows, install the roots one after another
+    static_cast<void>(jobs);
+    const bool sequential(true);
+#else
+    const bool sequential(!followers.empty() && !single_threaded());
+    if(sequential)
+    {
+        wpkg_output::log("a thread is still running, the other roots get installed one after another")
+            .level(wpkg_output::level_warning)
+            .action("install-validation");
+    }
+#endif
+    if(sequential)
+    {
+        for(std::vector<size_t>::const_iterator it(followers.begin()); it != followers.end(); ++it)
+        {
+            if(!install_root(cl, roots[*it]))
+            {
+                failed = true;
+            }
+        }
+        followers.clear();
+    }
+#ifndef MO_WINDOWS
+    long running(0);
+    for(std::vector<size_t>::const_iterator it(followers.begin()); it != followers.end() || running > 0;)
+    {
+        if(it != followers.end() && running < jobs)
+        {
+            // avoid duplicating buffered output in the child
+            fflush(NULL);
+            const pid_t pid(fork());
+            if(pid == 0)
+            {
+                // child: the temporary directory belongs to the parent
+                wpkg_filename::temporary_uri_filename::detach_tmpdir();
+                try
+                {
+                    install(cl, wpkg_filename::uri_filename(), "install", &roots[*it]);
+                }
+                catch(const std::exception& e)
+                {
+                    wpkg_output::log("%1")
+                            .arg(e.what())
+                        .level(wpkg_output::level_fatal)
+                        .action("exception");
+                }
+                fflush(NULL);
+                wpkg_output::set_output(NULL);
+                exit(g_output.exit_code());
+                /*NOTREACHED*/
+            }
+            if(pid < 0)
+            {
+                wpkg_output::log("could not create a process to install root %1")
+                        .quoted_arg(roots[*it].f_root)
+                    .level(wpkg_output::level_error)
+                    .action("install-validation");
+                failed = true;
+            }
+            else
+            {
+                ++running;
+            }
+            ++it;
+            continue;
+        }
+        int status(0);
+        if(waitpid(-1, &status, 0) <= 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        --running;
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            failed = true;
+        }
+    }
+#endif
+
+    // release the data.tar files shared by the roots
+    wpkgar::wpkgar_manager::share_data_tar(false);
+
+    if(failed)
+    {
+        wpkg_output::log("the installation failed in one or more of the roots")
+            .level(wpkg_output::level_error)
+            .action("install-validation");
+    }
+}
+
 void install_size(command_line& cl)
 {
     int max(cl.opt().size("install-size"));
@@ -3567,6 +4208,10 @@ void update(command_line& cl)
         wpkgar::wpkgar_manager manager;
         init_manager(cl, manager, "update");
         wpkgar::wpkgar_repository repository(&manager);
+        if(cl.opt().is_defined("fetch-jobs"))
+        {
+            repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_fetch_jobs, cl.opt().get_long("fetch-jobs", 0, 1, 1024));
+        }
 
         wpkgar::wpkgar_lock lock_wpkg(&manager, "Updating");
         repository.update();
@@ -3755,6 +4400,8 @@ void configure(command_line& cl)
                 break;
             }
         }
+        // with --configure-jobs the packages were only queued
+        pkg_install.finish_configure();
     }
 }
 
@@ -4135,6 +4782,11 @@ void audit(command_line& cl)
                         manager.get_control_file(md5sums_file, *it, md5filename, false);
                         wpkg_util::parse_md5sums(md5sums, md5sums_file);
                     }
+                    // when installed, the digests of the index were verified
+                    // against the md5sums file so we can use them directly;
+                    // that way files missing from md5sums get checked too
+                    const bool verified(manager.field_is_defined(*it, "X-Md5sums-Verified")
+                                     && manager.get_field_boolean(*it, "X-Md5sums-Verified"));
                     memfile::memory_file *wpkgar_file;
                     manager.get_wpkgar_file(*it, wpkgar_file);
                     wpkgar_file->set_package_path(package_path);
@@ -4158,10 +4810,11 @@ void audit(command_line& cl)
                                     const wpkg_filename::uri_filename fullname(package_path.append_child(filename));
                                     //printf("%s: %s\n", it->c_str(), fullname.c_str());
                                     filename.erase(0, 1);
-                                    if(md5sums.find(filename) != md5sums.end())
+                                    if(verified || md5sums.find(filename) != md5sums.end())
                                     {
-                                        std::string sum(data.md5sum());
-                                        if(md5sums[filename] != sum)
+                                        md5::raw_md5sum sum;
+                                        data.raw_md5sum(sum);
+                                        if(verified ? sum != info.get_raw_md5sum() : md5sums[filename] != md5::md5sum::sum(sum))
                                         {
                                             if(!manager.is_conffile(*it, filename))
                                             {
@@ -4177,7 +4830,7 @@ void audit(command_line& cl)
                                         }
                                         // remove the entry so we can err in case some
                                         // md5sums were not used up (why are they defined?)
-                                        md5sums.erase(md5sums.find(filename));
+                                        md5sums.erase(filename);
                                     }
                                     else
                                     {
@@ -4189,41 +4842,181 @@ void audit(command_line& cl)
                                 }
                                 break;
 
-                            default:
-                                // other types are not checked they don't have
-                                // an md5sum anyway
-                                break;
+                            default:
+                                // other types are not checked they don't have
+                                // an md5sum anyway
+                                break;
+
+                            }
+                        }
+                    }
+                    if(!md5sums.empty())
+                    {
+                        for(wpkg_util::md5sums_map_t::const_iterator m5(md5sums.begin());
+                                m5 != md5sums.end(); ++m5)
+                        {
+                            const wpkg_filename::uri_filename fullname(package_path.append_child(m5->first));
+                            printf("%s: package has file \"%s\" in its md5sums file but not in its wpkgar index\n",
+                                it->c_str(), fullname.original_filename().c_str());
+                            ++err;
+                        }
+                    }
+                }
+            }
+            catch(const std::exception&)
+            {
+                printf("%s: package could not be loaded\n", it->c_str());
+                ++err;
+            }
+        }
+    }
+    if(cl.verbose() && err > 0)
+    {
+        printf("%d error%s found while auditing\n", err, (err != 1 ? "s" : ""));
+    }
+
+    // exit with an error if anything failed while auditing
+    exit(err == 0 ? 0 : 1);
+}
+
+
+/** \brief Save a file so readers never see a partial file.
+ *
+ * The data is written in a temporary file which is then renamed. This
+ * matters when the file is being served by --serve-repository while
+ * it gets regenerated.
+ *
+ * \param[in] data  The data to save.
+ * \param[in] filename  The name of the file to replace.
+ */
+void replace_file(const memfile::memory_file& data, const wpkg_filename::uri_filename& filename)
+{
+    const wpkg_filename::uri_filename tmp(filename.original_filename() + ".tmp");
+    data.write_file(tmp);
+    if(!tmp.os_rename(filename))
+    {
+        // MS-Windows does not replace an existing file
+        filename.os_unlink();
+        if(!tmp.os_rename(filename))
+        {
+            throw std::runtime_error("could not rename \"" + tmp.original_filename() + "\" as \"" + filename.original_filename() + "\"");
+        }
+    }
+}
+
+
+/** \brief Create a repository index and its companion files.
+ *
+ * This function creates the index of the repositories attached to
+ * \p pkg_repository and saves it in \p archive, compressed as defined
+ * by its extension along with its md5sum. It optionally saves the binary
+ * index, the contents index, and the diff against the previous index.
+ * A diff left by a previous call is removed when no new diff gets
+ * created so a diff never describes an older index.
+ *
+ * \param[in] pkg_repository  The repository object, ready to create the index.
+ * \param[in] archive  The name of the index file (i.e. "index.tar.gz".)
+ * \param[in] index_diff  Whether to create the index diff file.
+ * \param[in] binary_index  Whether to create the binary index file.
+ * \param[in] compress_binary  Whether the binary index gets compressed.
+ * \param[in] contents_index  Whether to create the contents index file.
+ * \param[in] repositories  The repositories the index is created from.
+ *
+ * \return false if the index is empty, in which case nothing gets saved.
+ */
+bool write_index(wpkgar::wpkgar_repository& pkg_repository, const std::string& archive, bool index_diff, bool binary_index, bool compress_binary, bool contents_index, const wpkg_filename::filename_list_t& repositories)
+{
+    // keep a copy of the previous index to generate the diff
+    memfile::memory_file previous_index;
+    index_diff = index_diff && wpkg_filename::uri_filename(archive).exists();
+    if(index_diff)
+    {
+        previous_index.read_file(archive);
+    }
+
+    // create the output
+    memfile::memory_file index;
+    pkg_repository.create_index(index, &archive);
+
+    if(index.size() == 0)
+    {
+        return false;
+    }
+
+    // the diff of the previous index must not remain once the index
+    // changes; it gets created again below if requested
+    const wpkg_filename::uri_filename diff_filename(wpkgar::wpkgar_repository::index_diff_filename(archive));
+    if(diff_filename.exists() && !diff_filename.os_unlink())
+    {
+        throw std::runtime_error("could not delete the stale index diff \"" + diff_filename.original_filename() + "\"");
+    }
+
+    // check whether a compression is defined
+    std::string index_md5sum;
+    memfile::memory_file::file_format_t format(memfile::memory_file::filename_extension_to_format(archive));
+    switch(format)
+    {
+    case memfile::memory_file::file_format_gz:
+    case memfile::memory_file::file_format_bz2:
+    case memfile::memory_file::file_format_lzma:
+    case memfile::memory_file::file_format_xz:
+    case memfile::memory_file::file_format_zst:
+        {
+            memfile::memory_file compressed;
+            index.compress(compressed, format);
+            replace_file(compressed, archive);
+            index_md5sum = compressed.md5sum();
+        }
+        break;
+
+    default: // we don't prevent any extension here
+        replace_file(index, archive);
+        index_md5sum = index.md5sum();
+        break;
 
-                            }
-                        }
-                    }
-                    if(!md5sums.empty())
-                    {
-                        for(wpkg_util::md5sums_map_t::const_iterator m5(md5sums.begin());
-                                m5 != md5sums.end(); ++m5)
-                        {
-                            const wpkg_filename::uri_filename fullname(package_path.append_child(m5->first));
-                            printf("%s: package has file \"%s\" in its md5sums file but not in its wpkgar index\n",
-                                it->c_str(), fullname.original_filename().c_str());
-                            ++err;
-                        }
-                    }
-                }
-            }
-            catch(const std::exception&)
-            {
-                printf("%s: package could not be loaded\n", it->c_str());
-                ++err;
-            }
+    }
+
+    // clients only apply a diff which leads to this md5sum
+    {
+        memfile::memory_file md5sum;
+        md5sum.create(memfile::memory_file::file_format_other);
+        md5sum.printf("%s\n", index_md5sum.c_str());
+        replace_file(md5sum, wpkgar::wpkgar_repository::index_md5sum_filename(archive));
+    }
+
+    // the fingerprints must not be saved before the index they describe
+    pkg_repository.save_index_fingerprints(archive);
+
+    if(binary_index || contents_index)
+    {
+        wpkgar::wpkgar_repository::entry_vector_t entries;
+        pkg_repository.load_index(index, entries);
+        if(binary_index)
+        {
+            memfile::memory_file binary;
+            wpkgar::wpkgar_binary_index::create(entries, binary, compress_binary, archive);
+            replace_file(binary, wpkgar::wpkgar_binary_index::index_filename(archive));
+        }
+        if(contents_index)
+        {
+            memfile::memory_file contents;
+            wpkgar::wpkgar_contents_index::create(entries, repositories, contents);
+            replace_file(contents, wpkgar::wpkgar_contents_index::index_filename(archive));
         }
     }
-    if(cl.verbose() && err > 0)
+
+    if(index_diff)
     {
-        printf("%d error%s found while auditing\n", err, (err != 1 ? "s" : ""));
+        memfile::memory_file current_index;
+        current_index.read_file(archive);
+        memfile::memory_file diff;
+        wpkgar::wpkgar_repository::create_index_diff(previous_index, current_index, diff);
+        memfile::memory_file compressed;
+        diff.compress(compressed, memfile::memory_file::file_format_gz);
+        replace_file(compressed, wpkgar::wpkgar_repository::index_diff_filename(archive));
     }
 
-    // exit with an error if anything failed while auditing
-    exit(err == 0 ? 0 : 1);
+    return true;
 }
 
 
@@ -4240,6 +5033,12 @@ void create_index(command_line& cl)
         pkg_repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_recursive_depth, cl.opt().get_long("depth"));
     }
 
+    if(cl.opt().is_defined("index-jobs"))
+    {
+        pkg_repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_jobs, cl.opt().get_long("index-jobs", 0, 1, 1024));
+    }
+    pkg_repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_incremental, cl.opt().is_defined("incremental"));
+
     // check for a set of repository names
     if(manager.get_repositories().empty())
     {
@@ -4270,37 +5069,11 @@ void create_index(command_line& cl)
 
     }
 
-    // create the output
-    memfile::memory_file index;
-    pkg_repository.create_index(index, &archive);
-
-    if(index.size() == 0)
+    if(!write_index(pkg_repository, archive, cl.opt().is_defined("index-diff"), cl.opt().is_defined("binary-index"), cl.opt().get_string("compressor") != "none", cl.opt().is_defined("contents-index"), manager.get_repositories()))
     {
         cl.opt().usage(advgetopt::getopt::error, "the resulting index is empty; please specify the right repository(ies) and the --recursive option if necessary");
         /*NOTREACHED*/
     }
-
-    // check whether a compression is defined
-    memfile::memory_file::file_format_t format(memfile::memory_file::filename_extension_to_format(archive));
-    switch(format)
-    {
-    case memfile::memory_file::file_format_gz:
-    case memfile::memory_file::file_format_bz2:
-    case memfile::memory_file::file_format_lzma:
-    case memfile::memory_file::file_format_xz:
-    case memfile::memory_file::file_format_zst:
-        {
-            memfile::memory_file compressed;
-            index.compress(compressed, format);
-            compressed.write_file(archive);
-        }
-        break;
-
-    default: // we don't prevent any extension here
-        index.write_file(archive);
-        break;
-
-    }
 }
 
 
@@ -4586,6 +5359,63 @@ void canonicalize_version(command_line& cl, const std::string& optname)
     printf("%s\n", version);
 }
 
+void collect_payload_store(command_line& cl)
+{
+    if(cl.size() != 0)
+    {
+        printf("error:%s: --collect-payload-store does not take any extra parameters.\n",
+            cl.opt().get_program_name().c_str());
+        exit(1);
+    }
+
+    const wpkg_filename::uri_filename store(cl.opt().get_string("collect-payload-store"));
+    if(!store.is_dir())
+    {
+        throw std::runtime_error("--collect-payload-store expects the path to an existing payload store");
+    }
+    int64_t count(0);
+    int64_t size(0);
+    wpkg_extract::extractor::collect_payload_store(store, count, size);
+    if(cl.verbose())
+    {
+        printf("%ld file%s deleted, %ld bytes freed.\n", static_cast<long>(count), count == 1 ? "" : "s", static_cast<long>(size));
+    }
+}
+
+void compact_database(command_line& cl)
+{
+    if(cl.size() != 0)
+    {
+        printf("error:%s: --compact-database does not take any parameters.\n",
+            cl.opt().get_program_name().c_str());
+        exit(1);
+    }
+
+    wpkgar::wpkgar_manager manager;
+    init_manager(cl, manager, "compact-database");
+    // compacting rewrites the database files of the packages
+    wpkgar::wpkgar_lock lock_wpkg(&manager, "Compacting");
+    wpkgar::wpkgar_manager::package_list_t list;
+    manager.list_installed_packages(list);
+    int count(0);
+    for(wpkgar::wpkgar_manager::package_list_t::const_iterator it(list.begin());
+            it != list.end(); ++it)
+    {
+        if(manager.compact_package(*it))
+        {
+            ++count;
+            if(cl.verbose())
+            {
+                printf("%s: compacted\n", it->c_str());
+            }
+        }
+    }
+    if(cl.verbose())
+    {
+        printf("%d package%s compacted.\n", count, count == 1 ? "" : "s");
+    }
+}
+
 void compare_versions(command_line& cl)
 {
     if(cl.opt().size("compare-versions") != 3)
@@ -6793,6 +7623,279 @@ void search(command_line& cl)
     }
 }
 
+void search_index(command_line& cl)
+{
+    const int max(cl.opt().size("search-index"));
+    wpkgar::wpkgar_manager manager;
+    init_manager(cl, manager, "search-index");
+    const wpkg_filename::filename_list_t& repositories(manager.get_repositories());
+    if(repositories.empty())
+    {
+        cl.opt().usage(advgetopt::getopt::error, "--search-index requires at least one --repository name");
+        /*NOTREACHED*/
+    }
+
+    int count(0);
+    for(wpkg_filename::filename_list_t::const_iterator it(repositories.begin());
+            it != repositories.end(); ++it)
+    {
+        const wpkg_filename::uri_filename filename(wpkgar::wpkgar_contents_index::index_filename(it->append_child("index.tar.gz")));
+        if(filename.is_direct() && !filename.exists())
+        {
+            wpkg_output::log("repository %1 does not have a contents index; use --create-index with --contents-index to create it.")
+                    .quoted_arg(*it)
+                .level(wpkg_output::level_warning)
+                .action("search-index");
+            continue;
+        }
+        memfile::memory_file file;
+        file.read_file(filename);
+        wpkgar::wpkgar_contents_index contents;
+        contents.load(file);
+
+        for(int i(0); i < max; ++i)
+        {
+            wpkgar::wpkgar_contents_index::match_list_t matches;
+            contents.find(cl.opt().get_string("search-index", i), matches);
+            for(wpkgar::wpkgar_contents_index::match_list_t::const_iterator m(matches.begin());
+                    m != matches.end(); ++m)
+            {
+                printf("%s: %s\n", m->get_package().c_str(), m->get_path().c_str());
+                ++count;
+            }
+        }
+    }
+
+    if(cl.verbose())
+    {
+        printf("%d file%s found.\n", count, (count != 1 ? "s" : ""));
+    }
+}
+
+/** \brief The server used by --serve-repository.
+ *
+ * The server logs the requests it answers. With --regenerate-index it
+ * also creates the index of a directory again when one of the index
+ * files of that directory is requested and the packages changed since
+ * the index was last created by this server.
+ */
+class repository_server : public wpkg_http::server
+{
+public:
+    repository_server(command_line& cl, const wpkg_filename::uri_filename& root, const std::string& addr, int port)
+        : server(root, addr, port)
+        , f_regenerate_index(cl.opt().is_defined("regenerate-index"))
+        , f_recursive(cl.opt().is_defined("recursive"))
+        , f_depth(cl.opt().is_defined("depth") ? cl.opt().get_long("depth") : 0)
+        , f_index_jobs(cl.opt().is_defined("index-jobs") ? cl.opt().get_long("index-jobs", 0, 1, 1024) : 0)
+        , f_index_diff(cl.opt().is_defined("index-diff"))
+        , f_binary_index(cl.opt().is_defined("binary-index"))
+        , f_compress_binary(cl.opt().get_string("compressor") != "none")
+        , f_contents_index(cl.opt().is_defined("contents-index"))
+        //, f_mutex() -- auto-init
+        //, f_signatures() -- auto-init
+    {
+    }
+
+protected:
+    virtual void prepare_file(const wpkg_filename::uri_filename& filename)
+    {
+        if(!f_regenerate_index)
+        {
+            return;
+        }
+        const wpkg_filename::uri_filename dir(filename.dirname());
+        const wpkg_filename::uri_filename index(dir.append_child("index.tar.gz"));
+        if(filename != index
+        && filename != wpkgar::wpkgar_binary_index::index_filename(index)
+        && filename != wpkgar::wpkgar_contents_index::index_filename(index)
+        && filename != wpkgar::wpkgar_repository::index_diff_filename(index)
+        && filename != wpkgar::wpkgar_repository::index_md5sum_filename(index))
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(f_mutex);
+
+        // the signature changes whenever a package is added, replaced,
+        // or removed; we always regenerate the index the first time
+        // since it is incremental
+        std::stringstream signature;
+        memfile::memory_file r;
+        r.dir_rewind(dir, f_recursive, f_depth);
+        for(;;)
+        {
+            memfile::memory_file::file_info info;
+            if(!r.dir_next(info, NULL))
+            {
+                break;
+            }
+            if(info.get_file_type() == memfile::memory_file::file_info::regular_file
+            && wpkg_filename::uri_filename(info.get_filename()).extension() == "deb")
+            {
+                signature << info.get_filename() << " " << info.get_size() << " " << info.get_mtime() << "\n";
+            }
+        }
+        const std::string key(dir.full_path());
+        signature_map_t::const_iterator it(f_signatures.find(key));
+        if(it != f_signatures.end() && it->second == signature.str() && index.exists())
+        {
+            return;
+        }
+
+        wpkgar::wpkgar_manager manager;
+        manager.add_repository(dir);
+        wpkgar::wpkgar_repository pkg_repository(&manager);
+        pkg_repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_recursive, f_recursive);
+        pkg_repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_recursive_depth, f_depth);
+        if(f_index_jobs > 0)
+        {
+            pkg_repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_jobs, f_index_jobs);
+        }
+        pkg_repository.set_parameter(wpkgar::wpkgar_repository::wpkgar_repository_incremental, true);
+        const bool binary_index(f_binary_index || wpkgar::wpkgar_binary_index::index_filename(index).exists());
+        const bool contents_index(f_contents_index || wpkgar::wpkgar_contents_index::index_filename(index).exists());
+        if(write_index(pkg_repository, index.original_filename(), f_index_diff, binary_index, f_compress_binary, contents_index, manager.get_repositories()))
+        {
+            wpkg_output::log("regenerated index %1.")
+                    .quoted_arg(index)
+                .level(wpkg_output::level_info)
+                .action("serve-repository");
+        }
+        f_signatures[key] = signature.str();
+    }
+
+    virtual void log_request(const std::string& request_line, int status, int64_t size)
+    {
+        wpkg_output::log("%1 %2 %3")
+                .quoted_arg(request_line)
+                .arg(status)
+                .arg(static_cast<long>(size))
+            .level(wpkg_output::level_info)
+            .action("serve-repository");
+    }
+
+private:
+    typedef std::map<std::string, std::string>  signature_map_t;
+
+    const bool                  f_regenerate_index;
+    const bool                  f_recursive;
+    const long                  f_depth;
+    const long                  f_index_jobs;
+    const bool                  f_index_diff;
+    const bool                  f_binary_index;
+    const bool                  f_compress_binary;
+    const bool                  f_contents_index;
+    std::mutex                  f_mutex;
+    signature_map_t             f_signatures;
+};
+
+
+void listen_port(command_line& cl, const std::string& value, int& port)
+{
+    port = atoi(value.c_str());
+    if(value.empty() || value.find_first_not_of("0123456789") != std::string::npos || port < 0 || port > 65535)
+    {
+        cl.opt().usage(advgetopt::getopt::error, "--listen expects a port between 0 and 65535");
+        /*NOTREACHED*/
+    }
+}
+
+
+void serve_repository(command_line& cl)
+{
+    const wpkg_filename::uri_filename root(cl.get_string("serve-repository"));
+    if(!root.is_dir())
+    {
+        cl.opt().usage(advgetopt::getopt::error, "--serve-repository expects the name of an existing directory");
+        /*NOTREACHED*/
+    }
+
+    // the address and port to listen on: "addr:port", "addr", or "port"
+    std::string addr("0.0.0.0");
+    int port(8080);
+    if(cl.opt().is_defined("listen"))
+    {
+        const std::string listen(cl.opt().get_string("listen"));
+        std::string::size_type colon(std::string::npos);
+        if(!listen.empty() && listen[0] == '[')
+        {
+            // IPv6 address such as "[::1]:8080"
+            const std::string::size_type bracket(listen.find(']'));
+            if(bracket == std::string::npos
+            || (bracket + 1 < listen.length() && listen[bracket + 1] != ':'))
+            {
+                cl.opt().usage(advgetopt::getopt::error, "--listen expects an IPv6 address written as [addr]:port");
+                /*NOTREACHED*/
+            }
+            addr = listen.substr(1, bracket - 1);
+            if(bracket + 1 < listen.length())
+            {
+                colon = bracket + 1;
+            }
+        }
+        else if(listen.find_first_not_of("0123456789") == std::string::npos)
+        {
+            // just a port
+            listen_port(cl, listen, port);
+        }
+        else
+        {
+            colon = listen.find_last_of(':');
+            addr = listen.substr(0, colon);
+        }
+        if(colon != std::string::npos)
+        {
+            listen_port(cl, listen.substr(colon + 1), port);
+        }
+        if(addr.empty())
+        {
+            addr = "0.0.0.0";
+        }
+    }
+
+#if !defined(MO_WINDOWS)
+    // a client closing its connection must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    repository_server server(cl, root, addr, port);
+    if(cl.opt().is_defined("serve-jobs"))
+    {
+        server.set_threads(cl.opt().get_long("serve-jobs", 0, 1, 1024));
+    }
+    wpkg_output::log("serving repository %1 on %2:%3.")
+            .quoted_arg(root)
+            .arg(addr)
+            .arg(server.get_port())
+        .level(wpkg_output::level_info)
+        .action("serve-repository");
+
+    // Ctrl-C only sets g_interrupted and stop() cannot be called from
+    // the signal handler, so a thread watches that flag
+    std::atomic<bool> done(false);
+    std::thread watcher([&server, &done]()
+        {
+            while(!done && !g_interrupted)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            }
+            server.stop();
+        });
+    try
+    {
+        server.run();
+    }
+    catch(...)
+    {
+        done = true;
+        watcher.join();
+        throw;
+    }
+    done = true;
+    watcher.join();
+}
+
 void set_selection(command_line& cl)
 {
     int max(cl.size());
@@ -7222,6 +8325,14 @@ int main(int argc, char *argv[])
             check_install(cl);
             break;
 
+        case command_line::command_collect_payload_store:
+            collect_payload_store(cl);
+            break;
+
+        case command_line::command_compact_database:
+            compact_database(cl);
+            break;
+
         case command_line::command_compare_versions:
             compare_versions(cl);
             break;
@@ -7299,7 +8410,14 @@ int main(int argc, char *argv[])
             break;
 
         case command_line::command_install:
-            install(cl);
+            if(cl.opt().is_defined("roots"))
+            {
+                install_roots(cl);
+            }
+            else
+            {
+                install(cl);
+            }
             break;
 
         case command_line::command_install_size:
@@ -7410,6 +8528,14 @@ int main(int argc, char *argv[])
             search(cl);
             break;
 
+        case command_line::command_search_index:
+            search_index(cl);
+            break;
+
+        case command_line::command_serve_repository:
+            serve_repository(cl);
+            break;
+
         case command_line::command_set_selection:
             set_selection(cl);
             break;